@@ -57,6 +57,9 @@ android {
         jniLibs {
             // Keep debug symbols ONLY for our bridge, hoping it fixes the init issue
             keepDebugSymbols.add("**/libmedgemma_bridge.so")
+            // Extract .so files to disk: the isolated engine execs
+            // libmedgemma_daemon.so from the native library dir.
+            useLegacyPackaging = true
         }
     }
 }
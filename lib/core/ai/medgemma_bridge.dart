@@ -1,6 +1,7 @@
 import 'dart:ffi';
 import 'dart:io';
 import 'dart:async';
+import 'dart:convert';
 import 'dart:isolate';
 import 'package:ffi/ffi.dart';
 import 'package:flutter/foundation.dart';
@@ -11,6 +12,12 @@ import 'package:path_provider/path_provider.dart';
 typedef LoadMedGemmaC    = Pointer<Void> Function(Pointer<Utf8> modelDir);
 typedef LoadMedGemmaDart = Pointer<Void> Function(Pointer<Utf8> modelDir);
 
+// Engine in a child process (medgemma_daemon); null daemonPath = next to the lib.
+typedef LoadMedGemmaIsolatedC = Pointer<Void> Function(
+    Pointer<Utf8> modelDir, Pointer<Utf8> daemonPath);
+typedef LoadMedGemmaIsolatedDart = Pointer<Void> Function(
+    Pointer<Utf8> modelDir, Pointer<Utf8> daemonPath);
+
 typedef UnloadMedGemmaC    = Void Function(Pointer<Void> handle);
 typedef UnloadMedGemmaDart = void Function(Pointer<Void> handle);
 
@@ -21,6 +28,21 @@ typedef ResetInferenceStateDart = void Function(Pointer<Void> handle);
 typedef SetLogPathC    = Void Function(Pointer<Utf8> path);
 typedef SetLogPathDart = void Function(Pointer<Utf8> path);
 
+typedef SetTraceDirC    = Void Function(Pointer<Utf8> dir);
+typedef SetTraceDirDart = void Function(Pointer<Utf8> dir);
+
+typedef SetLogLevelC    = Void Function(Int32 level);
+typedef SetLogLevelDart = void Function(int level);
+
+typedef SetKvPrecisionC    = Void Function(Int32 precision);
+typedef SetKvPrecisionDart = void Function(int precision);
+
+typedef SetImagePoolingC    = Void Function(Int32 pooling);
+typedef SetImagePoolingDart = void Function(int pooling);
+
+typedef MedGemmaGetMemoryStatusC    = Int32 Function(Pointer<MedGemmaMemoryStatus> out);
+typedef MedGemmaGetMemoryStatusDart = int Function(Pointer<MedGemmaMemoryStatus> out);
+
 typedef MedGemmaTokenizeC = Int32 Function(
   Pointer<Void> handle,
   Pointer<Utf8> text,
@@ -34,6 +56,23 @@ typedef MedGemmaTokenizeDart = int Function(
   int maxTokens,
 );
 
+typedef MedGemmaTemplateDefineC    = Int32 Function(Pointer<Void> handle, Pointer<Utf8> source);
+typedef MedGemmaTemplateDefineDart = int Function(Pointer<Void> handle, Pointer<Utf8> source);
+
+typedef MedGemmaTemplateRenderC = Int32 Function(Pointer<Void> handle, Int32 id,
+    Pointer<Pointer<Utf8>> values, Int32 nValues, Pointer<Int64> outTokens, Int32 maxTokens);
+typedef MedGemmaTemplateRenderDart = int Function(Pointer<Void> handle, int id,
+    Pointer<Pointer<Utf8>> values, int nValues, Pointer<Int64> outTokens, int maxTokens);
+
+typedef MedGemmaPlanContextC = Int32 Function(Pointer<Void> handle,
+    Pointer<Pointer<Utf8>> segments, Pointer<Int32> fit, Int32 nSegments, Int32 images,
+    Int32 reserveTokens, Int32 maxPromptTokens, Pointer<Int32> keptBytes,
+    Pointer<Int32> segmentTokens, Pointer<MedGemmaContextPlan> out);
+typedef MedGemmaPlanContextDart = int Function(Pointer<Void> handle,
+    Pointer<Pointer<Utf8>> segments, Pointer<Int32> fit, int nSegments, int images,
+    int reserveTokens, int maxPromptTokens, Pointer<Int32> keptBytes,
+    Pointer<Int32> segmentTokens, Pointer<MedGemmaContextPlan> out);
+
 typedef RunMedGemmaInferenceC = Void Function(
   Pointer<Void> handle,
   Pointer<Uint8> imageBytes,
@@ -53,26 +92,430 @@ typedef RunMedGemmaInferenceDart = void Function(
 
 typedef TokenCallbackC = Void Function(Pointer<Utf8> textPiece);
 
-// --- HELPER CLASSES ---
-
-class _InferenceParams {
-  final int engineAddress;
-  final Uint8List? imageBytes;
-  final String promptString;
-  final SendPort sendPort;
-  final String libPath;
-  final String logFilePath; // passed into the isolate so it can re-init logging
-  final int maxTokens;
-
-  _InferenceParams({
-    required this.engineAddress,
-    this.imageBytes,
-    required this.promptString,
-    required this.sendPort,
-    required this.libPath,
-    required this.logFilePath,
-    required this.maxTokens,
-  });
+// Async job API: submit returns immediately, output is posted to a Dart port
+// (or drained from a native ring buffer), and cancel interrupts the ORT step
+// in flight.
+typedef MedGemmaInitDartApiC    = Void Function(Pointer<Void> postCObject);
+typedef MedGemmaInitDartApiDart = void Function(Pointer<Void> postCObject);
+
+typedef MedGemmaSubmitC = Int64 Function(
+  Pointer<Void> handle,
+  Pointer<Uint8> imageBytes,
+  Int32 imageLen,
+  Pointer<Utf8> prompt,
+  Pointer<MedGemmaJobParams> params,
+);
+typedef MedGemmaSubmitDart = int Function(
+  Pointer<Void> handle,
+  Pointer<Uint8> imageBytes,
+  int imageLen,
+  Pointer<Utf8> prompt,
+  Pointer<MedGemmaJobParams> params,
+);
+
+typedef MedGemmaSubmitTokensC = Int64 Function(
+  Pointer<Void> handle,
+  Pointer<Uint8> imageBytes,
+  Int32 imageLen,
+  Pointer<Int64> tokens,
+  Int32 nTokens,
+  Pointer<MedGemmaJobParams> params,
+);
+typedef MedGemmaSubmitTokensDart = int Function(
+  Pointer<Void> handle,
+  Pointer<Uint8> imageBytes,
+  int imageLen,
+  Pointer<Int64> tokens,
+  int nTokens,
+  Pointer<MedGemmaJobParams> params,
+);
+
+typedef MedGemmaSubmitClassifyC = Int64 Function(Pointer<Void> handle, Pointer<Uint8> imageBytes,
+    Int32 imageLen, Pointer<Utf8> prompt, Pointer<Pointer<Utf8>> labels, Int32 nLabels,
+    Pointer<MedGemmaJobParams> params);
+typedef MedGemmaSubmitClassifyDart = int Function(Pointer<Void> handle, Pointer<Uint8> imageBytes,
+    int imageLen, Pointer<Utf8> prompt, Pointer<Pointer<Utf8>> labels, int nLabels,
+    Pointer<MedGemmaJobParams> params);
+
+typedef MedGemmaGetClassificationC    = Int32 Function(Int64 jobId, Pointer<MedGemmaClassification> out);
+typedef MedGemmaGetClassificationDart = int Function(int jobId, Pointer<MedGemmaClassification> out);
+
+typedef MedGemmaPollC    = Int32 Function(Int64 jobId);
+typedef MedGemmaPollDart = int Function(int jobId);
+
+typedef MedGemmaReadC    = Int32 Function(Int64 jobId, Pointer<Uint8> out, Int32 outLen);
+typedef MedGemmaReadDart = int Function(int jobId, Pointer<Uint8> out, int outLen);
+
+typedef MedGemmaSetMaxBatchC    = Void Function(Pointer<Void> handle, Int32 maxBatch);
+typedef MedGemmaSetMaxBatchDart = void Function(Pointer<Void> handle, int maxBatch);
+
+typedef MedGemmaGetQueueStatsC    = Int32 Function(Pointer<Void> handle, Pointer<MedGemmaQueueStats> out);
+typedef MedGemmaGetQueueStatsDart = int Function(Pointer<Void> handle, Pointer<MedGemmaQueueStats> out);
+
+typedef MedGemmaGetLastMetricsC = Int32 Function(
+    Pointer<Void> handle, Pointer<MedGemmaJobTimings> last, Pointer<MedGemmaCounters> totals);
+typedef MedGemmaGetLastMetricsDart = int Function(
+    Pointer<Void> handle, Pointer<MedGemmaJobTimings> last, Pointer<MedGemmaCounters> totals);
+
+typedef MedGemmaCancelC    = Int32 Function(Int64 jobId);
+typedef MedGemmaCancelDart = int Function(int jobId);
+
+typedef MedGemmaReleaseC    = Void Function(Int64 jobId);
+typedef MedGemmaReleaseDart = void Function(int jobId);
+
+typedef MedGemmaSessionOpenC    = Int64 Function(Pointer<Void> handle, Int32 windowTokens, Int32 sinkTokens);
+typedef MedGemmaSessionOpenDart = int Function(Pointer<Void> handle, int windowTokens, int sinkTokens);
+
+typedef MedGemmaSessionCloseC    = Void Function(Pointer<Void> handle, Int64 session);
+typedef MedGemmaSessionCloseDart = void Function(Pointer<Void> handle, int session);
+
+typedef MedGemmaSessionSaveC    = Int32 Function(Pointer<Void> handle, Int64 session, Pointer<Utf8> path);
+typedef MedGemmaSessionSaveDart = int Function(Pointer<Void> handle, int session, Pointer<Utf8> path);
+
+typedef MedGemmaSessionLoadC    = Int64 Function(Pointer<Void> handle, Pointer<Utf8> path);
+typedef MedGemmaSessionLoadDart = int Function(Pointer<Void> handle, Pointer<Utf8> path);
+
+typedef MedGemmaSessionPushC    = Int32 Function(Pointer<Void> handle, Int64 session, Int32 index,
+    Pointer<Utf8> text, Pointer<Uint8> imageBytes, Int32 imageLen);
+typedef MedGemmaSessionPushDart = int Function(Pointer<Void> handle, int session, int index,
+    Pointer<Utf8> text, Pointer<Uint8> imageBytes, int imageLen);
+
+/// Mirrors `MedGemmaJobParams` in lib/cpp/medgemma_api.h — keep field order in sync.
+final class MedGemmaJobParams extends Struct {
+  @Int32()
+  external int maxTokens;
+
+  /// Wall-clock budget from submit in milliseconds; 0 = no deadline.
+  @Int32()
+  external int deadlineMs;
+
+  /// `SendPort.nativePort` that receives output pieces (String) and finally the
+  /// terminal status (int); 0 = buffer output for medgemma_read instead.
+  @Int64()
+  external int dartPort;
+
+  /// Encoded image file the engine memory-maps instead of receiving bytes.
+  external Pointer<Utf8> imagePath;
+
+  /// Open descriptor of the image file (e.g. from a content URI); wins over
+  /// [imagePath]. 0 = unused. The engine maps it during submit, so the caller
+  /// may close it as soon as submit returns.
+  @Int32()
+  external int imageFd;
+
+  /// [InferencePriority] index.
+  @Int32()
+  external int priority;
+
+  /// Sampling overrides; 0 = engine default.
+  @Float()
+  external double temperature;
+  @Float()
+  external double topP;
+  @Float()
+  external double repetitionPenalty;
+
+  /// [MedGemmaBridge.openSession] id whose cached conversation the prompt
+  /// continues; 0 = none.
+  @Int64()
+  external int session;
+
+  /// [MedGemmaBridge.classify] only: divides the labels' log-probabilities
+  /// before they are normalised; 0 = 1.
+  @Float()
+  external double labelTemperature;
+}
+
+/// A submit to a chat session the engine no longer has, or that is still
+/// answering; see [MedGemmaBridge.analyzeStream].
+class ChatSessionLost implements Exception {
+  final int session;
+  ChatSessionLost(this.session);
+  @override
+  String toString() => 'Chat session $session is no longer available';
+}
+
+/// A prompt whose fixed text the engine tokenizes only once: [source] with
+/// `{{name}}` slots that [values] fill in order (the names are for the
+/// reader). Only the values are tokenized per request, so anything that
+/// varies, down to an optional line, belongs in a value and the source stays
+/// the same for a locale. A slot takes the spaces before it.
+class PromptTemplate {
+  final String source;
+  final List<String> values;
+
+  const PromptTemplate(this.source, [this.values = const []]);
+
+  /// [text] as the only value: nothing fixed to cache, but it still goes in
+  /// as token IDs.
+  PromptTemplate.plain(String text) : this('{{text}}', [text]);
+
+  /// [parts] one after the other, each tokenized on its own: the way
+  /// [MedGemmaBridge.planContext] counts them.
+  PromptTemplate.pieces(List<String> parts) : this('{{part}}' * parts.length, parts);
+
+  /// [parts] one after the other.
+  PromptTemplate.join(List<PromptTemplate> parts)
+      : this(parts.map((p) => p.source).join(), [for (final p in parts) ...p.values]);
+
+  static final _slot = RegExp(r'\{\{[\s\S]*?\}\}');
+
+  /// The prompt as plain text, e.g. for drafts and logs.
+  String get text {
+    var i = 0;
+    return source.replaceAllMapped(_slot, (_) => i < values.length ? values[i++] : '');
+  }
+
+  PromptTemplate _wrap(String before, String after) =>
+      PromptTemplate('$before$source$after', values);
+}
+
+/// What [MedGemmaBridge.planContext] may do to a segment over the budget;
+/// indices match `MedGemmaSegmentFit` in lib/cpp/medgemma_api.h.
+enum SegmentFit {
+  keep,
+  /// Its end may be cut.
+  truncate,
+  /// It may be left out, earliest first.
+  drop,
+}
+
+/// A prompt measured against the model's context, in tokens.
+class ContextPlan {
+  /// The model's context length, 0 if unknown.
+  final int contextTokens;
+  /// The prompt as planned, chat turn and images included.
+  final int promptTokens;
+  /// Context left to generate in; -1 if unknown.
+  final int generationBudget;
+  /// Whether [promptTokens] is within the budget asked for.
+  final bool fits;
+  /// The segments as kept: whole, cut short, or empty if dropped.
+  final List<String> segments;
+
+  const ContextPlan(this.contextTokens, this.promptTokens, this.generationBudget,
+      this.fits, this.segments);
+}
+
+/// Request classes understood by the engine scheduler. A [high] request
+/// pauses [normal] work (keeping its KV cache) when the engine is full.
+enum InferencePriority { normal, high }
+
+/// Mirrors `MedGemmaQueueStats` in lib/cpp/medgemma_api.h — keep field order in sync.
+/// Per-class arrays are indexed by [InferencePriority]; times are ms from submit.
+final class MedGemmaQueueStats extends Struct {
+  @Int32()
+  external int queued;
+  @Int32()
+  external int paused;
+  @Int32()
+  external int running;
+  @Int32()
+  external int maxBatch;
+  @Int64()
+  external int submitted;
+  @Int64()
+  external int finished;
+  @Int64()
+  external int preemptions;
+  @Array(2)
+  external Array<Double> queueWaitAvgMs;
+  @Array(2)
+  external Array<Double> queueWaitMaxMs;
+  @Array(2)
+  external Array<Double> firstTokenAvgMs;
+}
+
+/// Mirrors `MedGemmaJobTimings` in lib/cpp/medgemma_api.h — keep field order in sync.
+/// Times are milliseconds; RSS is the engine process's, in KB.
+final class MedGemmaJobTimings extends Struct {
+  @Double()
+  external double queueMs;
+  @Double()
+  external double firstTokenMs;
+  @Double()
+  external double imageMs;
+  @Double()
+  external double visionMs;
+  @Double()
+  external double embedMs;
+  @Double()
+  external double prefillMs;
+  @Double()
+  external double decodeMs;
+  @Int32()
+  external int promptTokens;
+  @Int32()
+  external int imageTokens;
+  @Int32()
+  external int generatedTokens;
+  @Int32()
+  external int prefillChunks;
+  @Int32()
+  external int decodeSteps;
+  @Int32()
+  external int maxBatchSeen;
+  @Double()
+  external double imageDecodeMs;
+  @Double()
+  external double imageResizeMs;
+  @Double()
+  external double imageNormalizeMs;
+  @Double()
+  external double visionLoadMs;
+  @Double()
+  external double visionEncodeMs;
+  @Double()
+  external double visionProjectMs;
+  @Double()
+  external double tokenizeMs;
+  @Double()
+  external double prefillChunkMaxMs;
+  @Double()
+  external double decodeStepMaxMs;
+  @Double()
+  external double sampleMs;
+  @Double()
+  external double detokenizeMs;
+  @Double()
+  external double totalMs;
+  @Int32()
+  external int kvLen;
+  @Int32()
+  external int status;
+  @Int64()
+  external int rssStartKb;
+  @Int64()
+  external int rssPeakKb;
+  @Int64()
+  external int rssEndKb;
+  @Int64()
+  external int visionPeakKb;
+  @Int64()
+  external int prefillPeakKb;
+  @Int64()
+  external int decodePeakKb;
+  @Int32()
+  external int planPrefillChunk;
+  @Int32()
+  external int planMaxTokens;
+  @Int64()
+  external int planPeakKb;
+  @Int64()
+  external int planBudgetKb;
+  @Int32()
+  external int spills;
+  @Int32()
+  external int spillSteps;
+  @Int32()
+  external int cachedTokens;
+  @Int32()
+  external int evictedTokens;
+}
+
+/// Mirrors `MedGemmaCounters` in lib/cpp/medgemma_api.h — keep field order in sync.
+final class MedGemmaCounters extends Struct {
+  @Int64()
+  external int jobsDone;
+  @Int64()
+  external int jobsCancelled;
+  @Int64()
+  external int jobsTimedOut;
+  @Int64()
+  external int jobsFailed;
+  @Int64()
+  external int images;
+  @Int64()
+  external int promptTokens;
+  @Int64()
+  external int imageTokens;
+  @Int64()
+  external int generatedTokens;
+  @Double()
+  external double queueMs;
+  @Double()
+  external double imageMs;
+  @Double()
+  external double visionMs;
+  @Double()
+  external double embedMs;
+  @Double()
+  external double prefillMs;
+  @Double()
+  external double decodeMs;
+  @Double()
+  external double sampleMs;
+  @Double()
+  external double detokenizeMs;
+  @Int64()
+  external int rssPeakKb;
+  @Int64()
+  external int visionPeakKb;
+  @Int64()
+  external int prefillPeakKb;
+  @Int64()
+  external int decodePeakKb;
+}
+
+/// Mirrors `MedGemmaContextPlan` in lib/cpp/medgemma_api.h — keep field order in sync.
+final class MedGemmaContextPlan extends Struct {
+  @Int32()
+  external int contextTokens;
+  @Int32()
+  external int promptTokens;
+  @Int32()
+  external int imageTokens;
+  @Int32()
+  external int generationBudget;
+  @Int32()
+  external int fits;
+}
+
+/// Labels per [MedGemmaBridge.classify]; `MEDGEMMA_MAX_LABELS`.
+const int medGemmaMaxLabels = 8;
+
+/// Mirrors `MedGemmaClassification` in lib/cpp/medgemma_api.h — keep field order in sync.
+final class MedGemmaClassification extends Struct {
+  @Int32()
+  external int label;
+  @Int32()
+  external int nLabels;
+  @Array(medGemmaMaxLabels)
+  external Array<Float> probs;
+  @Float()
+  external double coverage;
+}
+
+/// The label the model would have answered with, from [MedGemmaBridge.classify].
+class Classification {
+  /// Index into the labels asked about.
+  final int label;
+  /// Per label, summing to 1.
+  final List<double> probs;
+  /// The model's own probability of answering with any of the labels, words
+  /// they all start with included; low means the prompt did not lead it to
+  /// one.
+  final double coverage;
+
+  const Classification(this.label, this.probs, this.coverage);
+}
+
+/// Mirrors `MedGemmaMemoryStatus` in lib/cpp/medgemma_api.h — keep field order in sync.
+final class MedGemmaMemoryStatus extends Struct {
+  @Int32()
+  external int level;
+  @Int64()
+  external int availableKb;
+  @Int64()
+  external int memAvailableKb;
+  @Int64()
+  external int cgroupLimitKb;
+  @Int64()
+  external int cgroupUsageKb;
+  @Double()
+  external double psiSomeAvg10;
+  @Double()
+  external double psiFullAvg10;
 }
 
 
@@ -81,12 +524,19 @@ class _InferenceParams {
 class MedGemmaBridge {
   final DynamicLibrary _lib;
   Pointer<Void>? _engineHandle;
-  bool _isInferenceRunning = false;
   final String _logFilePath;
 
-  /// True after an image inference — vision sessions were freed to save RAM.
-  /// resetInferenceState() is called automatically before the next image run.
-  bool _visionSessionsFreed = false;
+  late final MedGemmaSubmitDart _submitJob =
+      _lib.lookupFunction<MedGemmaSubmitC, MedGemmaSubmitDart>('medgemma_submit');
+  late final MedGemmaSubmitTokensDart _submitTokens =
+      _lib.lookupFunction<MedGemmaSubmitTokensC, MedGemmaSubmitTokensDart>(
+          'medgemma_submit_tokens');
+  // Template IDs by source; they last as long as the engine.
+  final Map<String, int> _templates = {};
+  late final MedGemmaCancelDart _cancelJob =
+      _lib.lookupFunction<MedGemmaCancelC, MedGemmaCancelDart>('medgemma_cancel');
+  late final MedGemmaReleaseDart _releaseJob =
+      _lib.lookupFunction<MedGemmaReleaseC, MedGemmaReleaseDart>('medgemma_release');
 
   MedGemmaBridge._(this._lib, this._engineHandle, this._logFilePath);
 
@@ -101,27 +551,64 @@ class MedGemmaBridge {
   }
 
   /// Factory method — loads the library, sets the log path, then loads the engine.
+  ///
+  /// With [isolated] the engine runs in a separate process that is restarted
+  /// if it crashes or is killed for memory, so the UI survives; a failed
+  /// request then ends with an error instead of taking the app down. Falls
+  /// back to the in-process engine if the daemon cannot be started.
+  ///
+  /// With [traceDir] (an existing directory) the engine profiles itself and
+  /// every ORT session, and [dispose] writes a `medgemma_trace_*.json` there
+  /// that chrome://tracing or ui.perfetto.dev opens. Slows inference; for
+  /// investigating slow devices only.
   static Future<MedGemmaBridge> create(
     String modelPath, {
     void Function(String)? onLog,
+    bool isolated = false,
+    String? traceDir,
   }) async {
     final String libPath = _resolveLibPath();
     final DynamicLibrary lib = _loadLibrary(libPath);
+    lib.lookupFunction<MedGemmaInitDartApiC, MedGemmaInitDartApiDart>(
+        'medgemma_init_dart_api')(NativeApi.postCObject.cast());
 
     // ── Set log file path so C++ can write to it ──────────────────────
     final logPath = await _resolveLogPath();
     _initLogPath(lib, logPath);
     onLog?.call('Log file: $logPath');
+    if (traceDir != null) {
+      final dirPtr = traceDir.toNativeUtf8();
+      lib.lookupFunction<SetTraceDirC, SetTraceDirDart>('set_trace_dir')(dirPtr);
+      calloc.free(dirPtr);
+      onLog?.call('Tracing to: $traceDir');
+    }
 
      // Load engine in background isolate to prevent ANR
-    final engineAddress = await Isolate.run(() {
-      final isoLib = _loadLibrary(libPath);
-      final loadFn = isoLib.lookupFunction<LoadMedGemmaC, LoadMedGemmaDart>('load_medgemma_4bit');
-      final modelPathPtr = modelPath.toNativeUtf8();
-      final ptr = loadFn(modelPathPtr);
-      calloc.free(modelPathPtr);
-      return ptr.address;
-    });
+    var engineAddress = 0;
+    if (isolated) {
+      engineAddress = await Isolate.run(() {
+        final isoLib = _loadLibrary(libPath);
+        final loadFn = isoLib.lookupFunction<LoadMedGemmaIsolatedC,
+            LoadMedGemmaIsolatedDart>('load_medgemma_isolated');
+        final modelPathPtr = modelPath.toNativeUtf8();
+        final ptr = loadFn(modelPathPtr, nullptr);
+        calloc.free(modelPathPtr);
+        return ptr.address;
+      });
+      if (engineAddress == 0) {
+        onLog?.call('Isolated engine unavailable, loading in-process');
+      }
+    }
+    if (engineAddress == 0) {
+      engineAddress = await Isolate.run(() {
+        final isoLib = _loadLibrary(libPath);
+        final loadFn = isoLib.lookupFunction<LoadMedGemmaC, LoadMedGemmaDart>('load_medgemma_4bit');
+        final modelPathPtr = modelPath.toNativeUtf8();
+        final ptr = loadFn(modelPathPtr);
+        calloc.free(modelPathPtr);
+        return ptr.address;
+      });
+    }
 
     if (engineAddress == 0) throw Exception("Failed to initialize MedGemma engine.");
 
@@ -197,13 +684,278 @@ class MedGemmaBridge {
           'unload_medgemma');
       unload(_engineHandle!);
       _engineHandle = null;
+      _templates.clear();
+    }
+  }
+
+  /// Upper bound on requests the engine decodes together (hub devices serving
+  /// several health workers). Each extra request costs one KV cache of RAM.
+  void setMaxBatch(int maxBatch) {
+    if (_engineHandle == null) return;
+    _lib.lookupFunction<MedGemmaSetMaxBatchC, MedGemmaSetMaxBatchDart>(
+        'medgemma_set_max_batch')(_engineHandle!, maxBatch);
+  }
+
+  /// Memory as the engine's monitor sees it, sampled now: `level` (0 ok,
+  /// 1 moderate, 2 high — no images, 3 critical — KV cache on flash), sizes
+  /// in KB (-1 if unknown) and PSI averages. Empty if nothing was readable.
+  Map<String, num> memoryStatus() {
+    final out = calloc<MedGemmaMemoryStatus>();
+    try {
+      final rc = _lib.lookupFunction<MedGemmaGetMemoryStatusC, MedGemmaGetMemoryStatusDart>(
+          'medgemma_get_memory_status')(out);
+      if (rc != 0) return {};
+      final s = out.ref;
+      return {
+        'level': s.level,
+        'availableKb': s.availableKb,
+        'memAvailableKb': s.memAvailableKb,
+        'cgroupLimitKb': s.cgroupLimitKb,
+        'cgroupUsageKb': s.cgroupUsageKb,
+        'psiSomeAvg10': s.psiSomeAvg10,
+        'psiFullAvg10': s.psiFullAvg10,
+      };
+    } finally {
+      calloc.free(out);
+    }
+  }
+
+  /// Lowest level the engine logs: 0 debug, 1 info (default), 2 errors only.
+  /// Also applies to an isolated engine's daemon.
+  void setLogLevel(int level) {
+    _lib.lookupFunction<SetLogLevelC, SetLogLevelDart>(
+        'medgemma_set_log_level')(level);
+  }
+
+  /// How engines loaded after this store their KV cache: 0 fp32 (default),
+  /// 1 fp16, 2 int8. Needs the matching decoder variant in the model
+  /// directory (lib/cpp/tools/kv_variant.py), else fp32 is used.
+  void setKvPrecision(int precision) {
+    _lib.lookupFunction<SetKvPrecisionC, SetKvPrecisionDart>(
+        'medgemma_set_kv_precision')(precision);
+  }
+
+  /// How many positions an image takes from the next request on: 0 all 256
+  /// (default), 1 pooled to 64, 2 pooled to 16. Fewer positions prefill
+  /// faster and leave more context; check the answers with
+  /// `medgemma_bench --image-pooling` first. Also applies to an isolated
+  /// engine's daemon.
+  void setImagePooling(int pooling) {
+    _lib.lookupFunction<SetImagePoolingC, SetImagePoolingDart>(
+        'medgemma_set_image_pooling')(pooling);
+  }
+
+  /// Opens a chat session: its KV cache outlives each request, so a follow-up
+  /// passed to [analyzeStream] with `session:` needs only the new message.
+  /// The engine keeps the most recent [windowTokens] positions (0 = 2048)
+  /// plus the first [sinkTokens] (0 = the first message, i.e. the patient
+  /// context). Returns 0 if the engine is not loaded or refuses.
+  int openSession({int windowTokens = 0, int sinkTokens = 0}) {
+    if (_engineHandle == null) return 0;
+    final id = _lib.lookupFunction<MedGemmaSessionOpenC, MedGemmaSessionOpenDart>(
+        'medgemma_session_open')(_engineHandle!, windowTokens, sinkTokens);
+    return id > 0 ? id : 0;
+  }
+
+  /// Frees a session's cache. Unknown ids are ignored.
+  void closeSession(int session) {
+    if (_engineHandle == null || session <= 0) return;
+    _lib.lookupFunction<MedGemmaSessionCloseC, MedGemmaSessionCloseDart>(
+        'medgemma_session_close')(_engineHandle!, session);
+  }
+
+  /// Writes [session]'s conversation to [path] (replacing it atomically) so
+  /// [loadSession] can continue it after an app restart: the KV cache in the
+  /// engine's precision (about 272 KB per token in fp32, 70 KB in int8),
+  /// stamped with the model's fingerprint.
+  /// The write (up to hundreds of MB, then an fsync) runs in a background
+  /// isolate; the session is busy until it completes, so await it before the
+  /// next submit. False if the session is busy, empty or gone, or the write
+  /// failed.
+  Future<bool> saveSession(int session, String path) {
+    if (_engineHandle == null || session <= 0) return Future.value(false);
+    return _saveSessionInBackground(
+        _resolveLibPath(), _engineHandle!.address, session, path);
+  }
+
+  static Future<bool> _saveSessionInBackground(
+      String libPath, int engineAddress, int session, String path) {
+    return Isolate.run(() {
+      final isoLib = _loadLibrary(libPath);
+      final saveFn = isoLib.lookupFunction<MedGemmaSessionSaveC,
+          MedGemmaSessionSaveDart>('medgemma_session_save');
+      final pathPtr = path.toNativeUtf8();
+      try {
+        return saveFn(Pointer<Void>.fromAddress(engineAddress), session,
+                pathPtr) ==
+            0;
+      } finally {
+        calloc.free(pathPtr);
+      }
+    });
+  }
+
+  /// Opens a session from a [saveSession] file; its first follow-up skips
+  /// the image and the conversation's prefill. The file is memory-mapped:
+  /// replace it only through [saveSession]. 0 if the file is missing,
+  /// damaged or was saved with another model.
+  int loadSession(String path) {
+    if (_engineHandle == null) return 0;
+    final pathPtr = path.toNativeUtf8();
+    try {
+      final id = _lib.lookupFunction<MedGemmaSessionLoadC, MedGemmaSessionLoadDart>(
+          'medgemma_session_load')(_engineHandle!, pathPtr);
+      return id > 0 ? id : 0;
+    } finally {
+      calloc.free(pathPtr);
+    }
+  }
+
+  /// Starts [session]'s next user turn ahead of its submit: [segments], then
+  /// [image] if any. While the engine is idle it prefills them into the
+  /// session's cache; calling again with a changed segment redrafts from
+  /// that one on, and unchanged ones cost nothing. Finish the turn with
+  /// [analyzeStream]'s `drafted:`. False if the session is busy or gone.
+  bool pushDraft(int session, List<String> segments, {Uint8List? image}) {
+    if (_engineHandle == null || session <= 0) return false;
+    final push = _lib.lookupFunction<MedGemmaSessionPushC, MedGemmaSessionPushDart>(
+        'medgemma_session_push');
+    final hasImage = image != null && image.isNotEmpty;
+    final texts = [...segments, if (hasImage) "<image>\n"];
+    if (texts.isNotEmpty) texts[0] = "<start_of_turn>user\n${texts[0]}";
+    for (var i = 0; i < texts.length; i++) {
+      final textPtr = texts[i].toNativeUtf8();
+      final imgLen = hasImage && i == segments.length ? image.length : 0;
+      final imgPtr = imgLen > 0 ? calloc<Uint8>(imgLen) : nullptr;
+      if (imgLen > 0) imgPtr.asTypedList(imgLen).setAll(0, image!);
+      try {
+        if (push(_engineHandle!, session, i, textPtr, imgPtr, imgLen) != 0) return false;
+      } finally {
+        calloc.free(textPtr);
+        if (imgPtr != nullptr) calloc.free(imgPtr);
+      }
+    }
+    // Drop what an earlier, longer draft had after these.
+    return push(_engineHandle!, session, texts.length, nullptr, nullptr, 0) == 0;
+  }
+
+  /// Queue depth, preemptions and per-priority latency of the engine, keyed
+  /// by field name (per-class values as `<name>.<priority>`). Empty if the
+  /// engine is not loaded.
+  Map<String, num> queueStats() {
+    if (_engineHandle == null) return {};
+    final out = calloc<MedGemmaQueueStats>();
+    try {
+      final rc = _lib.lookupFunction<MedGemmaGetQueueStatsC, MedGemmaGetQueueStatsDart>(
+          'medgemma_get_queue_stats')(_engineHandle!, out);
+      if (rc != 0) return {};
+      final s = out.ref;
+      return {
+        'queued': s.queued,
+        'paused': s.paused,
+        'running': s.running,
+        'maxBatch': s.maxBatch,
+        'submitted': s.submitted,
+        'finished': s.finished,
+        'preemptions': s.preemptions,
+        for (final p in InferencePriority.values) ...{
+          'queueWaitAvgMs.${p.name}': s.queueWaitAvgMs[p.index],
+          'queueWaitMaxMs.${p.name}': s.queueWaitMaxMs[p.index],
+          'firstTokenAvgMs.${p.name}': s.firstTokenAvgMs[p.index],
+        },
+      };
+    } finally {
+      calloc.free(out);
+    }
+  }
+
+  /// Stage times, token counts and RSS of the job that finished last (keys of
+  /// [MedGemmaJobTimings], under `last.`) and the engine's totals since load
+  /// (keys of [MedGemmaCounters], under `total.`). `last.*` is missing until
+  /// a job has finished; empty if the engine is not loaded.
+  Map<String, num> lastMetrics() {
+    if (_engineHandle == null) return {};
+    final last = calloc<MedGemmaJobTimings>();
+    final totals = calloc<MedGemmaCounters>();
+    try {
+      final rc = _lib.lookupFunction<MedGemmaGetLastMetricsC, MedGemmaGetLastMetricsDart>(
+          'medgemma_get_last_metrics')(_engineHandle!, last, totals);
+      if (rc < 0) return {};
+      final t = last.ref;
+      final c = totals.ref;
+      return {
+        if (rc == 0) ...{
+          'last.status': t.status,
+          'last.totalMs': t.totalMs,
+          'last.queueMs': t.queueMs,
+          'last.firstTokenMs': t.firstTokenMs,
+          'last.imageDecodeMs': t.imageDecodeMs,
+          'last.imageResizeMs': t.imageResizeMs,
+          'last.imageNormalizeMs': t.imageNormalizeMs,
+          'last.visionLoadMs': t.visionLoadMs,
+          'last.visionEncodeMs': t.visionEncodeMs,
+          'last.visionProjectMs': t.visionProjectMs,
+          'last.tokenizeMs': t.tokenizeMs,
+          'last.embedMs': t.embedMs,
+          'last.prefillMs': t.prefillMs,
+          'last.prefillChunks': t.prefillChunks,
+          'last.prefillChunkMaxMs': t.prefillChunkMaxMs,
+          'last.decodeMs': t.decodeMs,
+          'last.decodeSteps': t.decodeSteps,
+          'last.decodeStepMaxMs': t.decodeStepMaxMs,
+          'last.sampleMs': t.sampleMs,
+          'last.detokenizeMs': t.detokenizeMs,
+          'last.promptTokens': t.promptTokens,
+          'last.imageTokens': t.imageTokens,
+          'last.generatedTokens': t.generatedTokens,
+          'last.maxBatchSeen': t.maxBatchSeen,
+          'last.kvLen': t.kvLen,
+          'last.rssStartKb': t.rssStartKb,
+          'last.rssPeakKb': t.rssPeakKb,
+          'last.rssEndKb': t.rssEndKb,
+          'last.visionPeakKb': t.visionPeakKb,
+          'last.prefillPeakKb': t.prefillPeakKb,
+          'last.decodePeakKb': t.decodePeakKb,
+          'last.planPrefillChunk': t.planPrefillChunk,
+          'last.planMaxTokens': t.planMaxTokens,
+          'last.planPeakKb': t.planPeakKb,
+          'last.planBudgetKb': t.planBudgetKb,
+          'last.spills': t.spills,
+          'last.spillSteps': t.spillSteps,
+          'last.cachedTokens': t.cachedTokens,
+          'last.evictedTokens': t.evictedTokens,
+        },
+        'total.jobsDone': c.jobsDone,
+        'total.jobsCancelled': c.jobsCancelled,
+        'total.jobsTimedOut': c.jobsTimedOut,
+        'total.jobsFailed': c.jobsFailed,
+        'total.images': c.images,
+        'total.promptTokens': c.promptTokens,
+        'total.imageTokens': c.imageTokens,
+        'total.generatedTokens': c.generatedTokens,
+        'total.queueMs': c.queueMs,
+        'total.imageMs': c.imageMs,
+        'total.visionMs': c.visionMs,
+        'total.embedMs': c.embedMs,
+        'total.prefillMs': c.prefillMs,
+        'total.decodeMs': c.decodeMs,
+        'total.sampleMs': c.sampleMs,
+        'total.detokenizeMs': c.detokenizeMs,
+        'total.rssPeakKb': c.rssPeakKb,
+        'total.visionPeakKb': c.visionPeakKb,
+        'total.prefillPeakKb': c.prefillPeakKb,
+        'total.decodePeakKb': c.decodePeakKb,
+      };
+    } finally {
+      calloc.free(last);
+      calloc.free(totals);
     }
   }
 
   /// Reloads the vision encoder + projection sessions that were destroyed
   /// during the previous inference to free ~430 MB of working RAM.
-  /// Must be called between assessments so the next run can process images.
-  /// Safe to call even if sessions are still alive (C++ checks before reloading).
+  /// Optional: the engine also reloads them on demand for the next image, and
+  /// the reload happens on the engine thread, so this call never blocks.
   void resetInferenceState() {
     if (_engineHandle == null) return;
     try {
@@ -231,124 +983,316 @@ class MedGemmaBridge {
     }
   }
 
+  /// Measures [segments], sent as `PromptTemplate.pieces(segments)` with
+  /// [images], against the model's context with the engine's tokenizer,
+  /// leaving [reserveTokens] for the answer (and the prompt at most
+  /// [maxPromptTokens], if > 0). Over that, segments [fit] marks as
+  /// [SegmentFit.drop] are left out, then [SegmentFit.truncate] ones lose
+  /// their ends; the plan's segments are what is left. Null if the engine
+  /// cannot plan (not loaded, or a library from before this).
+  ContextPlan? planContext(List<String> segments, List<SegmentFit> fit,
+      {int images = 0, int reserveTokens = 0, int maxPromptTokens = 0}) {
+    if (_engineHandle == null) return null;
+    final MedGemmaPlanContextDart plan;
+    try {
+      plan = _lib.lookupFunction<MedGemmaPlanContextC, MedGemmaPlanContextDart>(
+          'medgemma_plan_context');
+    } on ArgumentError {
+      return null;
+    }
+    // analyzeStream's chat turn around them; an image's placeholder is
+    // counted with the image.
+    final all = ["<start_of_turn>user\n", for (var i = 0; i < images; i++) "\n",
+        ...segments, "<end_of_turn>\n<start_of_turn>model\n"];
+    final lead = 1 + images;
+    final n = all.length;
+    final texts = all.map((s) => s.toNativeUtf8()).toList();
+    final textsPtr = calloc<Pointer<Utf8>>(n);
+    final fitPtr = calloc<Int32>(n);
+    final keptPtr = calloc<Int32>(n);
+    final out = calloc<MedGemmaContextPlan>();
+    try {
+      for (var i = 0; i < n; i++) {
+        textsPtr[i] = texts[i];
+        final j = i - lead;
+        fitPtr[i] = j >= 0 && j < segments.length ? fit[j].index : SegmentFit.keep.index;
+      }
+      if (plan(_engineHandle!, textsPtr, fitPtr, n, images, reserveTokens, maxPromptTokens,
+              keptPtr, nullptr, out) != 0) {
+        return null;
+      }
+      final kept = [
+        for (var j = 0; j < segments.length; j++)
+          utf8.decode(utf8.encode(segments[j]).sublist(0, keptPtr[lead + j])),
+      ];
+      final r = out.ref;
+      return ContextPlan(r.contextTokens, r.promptTokens, r.generationBudget, r.fits != 0, kept);
+    } finally {
+      for (final t in texts) {
+        calloc.free(t);
+      }
+      calloc.free(textsPtr);
+      calloc.free(fitPtr);
+      calloc.free(keptPtr);
+      calloc.free(out);
+    }
+  }
+
+  /// [prompt] as token IDs: its source is tokenized the first time it is
+  /// seen, then only its values. Null if the engine cannot.
+  Int64List? renderTemplate(PromptTemplate prompt) {
+    if (_engineHandle == null) return null;
+    final MedGemmaTemplateRenderDart render;
+    var id = _templates[prompt.source];
+    try {
+      render = _lib.lookupFunction<MedGemmaTemplateRenderC, MedGemmaTemplateRenderDart>(
+          'medgemma_template_render');
+      if (id == null) {
+        final sourcePtr = prompt.source.toNativeUtf8();
+        try {
+          id = _lib.lookupFunction<MedGemmaTemplateDefineC, MedGemmaTemplateDefineDart>(
+              'medgemma_template_define')(_engineHandle!, sourcePtr);
+        } finally {
+          calloc.free(sourcePtr);
+        }
+        if (id <= 0) return null;
+        _templates[prompt.source] = id;
+      }
+    } on ArgumentError {
+      return null; // a library from before templates
+    }
+    final values = prompt.values.map((v) => v.toNativeUtf8()).toList();
+    final valuesPtr = calloc<Pointer<Utf8>>(values.isEmpty ? 1 : values.length);
+    for (var i = 0; i < values.length; i++) {
+      valuesPtr[i] = values[i];
+    }
+    var capacity = 4096;
+    try {
+      for (;;) {
+        final tokensPtr = calloc<Int64>(capacity);
+        try {
+          final n = render(_engineHandle!, id, valuesPtr, values.length, tokensPtr, capacity);
+          if (n <= 0) return null;
+          if (n <= capacity) return Int64List.fromList(tokensPtr.asTypedList(n));
+          capacity = n;
+        } finally {
+          calloc.free(tokensPtr);
+        }
+      }
+    } finally {
+      for (final v in values) {
+        calloc.free(v);
+      }
+      calloc.free(valuesPtr);
+    }
+  }
+
+  /// Streams the model's answer. Cancelling the subscription (e.g. the user
+  /// leaves the triage screen) cancels the native job, which stops the ORT step
+  /// in flight instead of generating up to [maxTokens]. An optional [deadline]
+  /// bounds the whole request; the stream then ends with a "[WARN] Deadline"
+  /// marker. Use [InferencePriority.high] for short interactive answers so
+  /// they overtake a running report instead of waiting behind it.
+  ///
+  /// Prefer [imagePath] (or [imageFd]) over [imageBytes] for photos on disk:
+  /// the engine maps the file and decodes straight from the mapping, so a
+  /// multi-megabyte JPEG is never copied through Dart.
+  ///
+  /// With a [session] from [openSession], [prompt] is only the new user
+  /// turn; the engine already holds the conversation. If the session is
+  /// gone (busy, closed, lost to a cancel or an engine restart) the stream
+  /// throws [ChatSessionLost]: open a new one and send the whole history.
+  /// With [drafted], [prompt] finishes the turn [pushDraft] started.
+  ///
+  /// The engine gets [prompt] in Gemma's chat wrapper as token IDs (see
+  /// [PromptTemplate]); the fixed text of both is tokenized once per engine.
   Stream<String> analyzeStream({
     Uint8List? imageBytes,
-    required String promptText,
+    String? imagePath,
+    int imageFd = 0,
+    required PromptTemplate prompt,
     int maxTokens = 512,
     double repetitionPenalty = 1.25,
+    Duration? deadline,
+    InferencePriority priority = InferencePriority.normal,
+    int session = 0,
+    bool drafted = false,
     void Function(String)? onLog,
   }) async* {
     if (_engineHandle == null) return;
-    if (_isInferenceRunning) throw Exception('Inference busy');
+    final hasImage = (imageBytes != null && imageBytes.isNotEmpty) ||
+        imageFd > 0 ||
+        (imagePath != null && imagePath.isNotEmpty);
 
     // Construct full prompt here
-    String fullPrompt = "";
-
-    fullPrompt += "<start_of_turn>user\n";
-    if (imageBytes != null && imageBytes.isNotEmpty) {
-      fullPrompt += "<image>\n";
-    }
-    fullPrompt += "$promptText<end_of_turn>\n<start_of_turn>model\n";
+    final fullPrompt = prompt._wrap(
+        "${drafted ? "" : "<start_of_turn>user\n"}${hasImage ? "<image>\n" : ""}",
+        "<end_of_turn>\n<start_of_turn>model\n");
 
-    // Auto-restore vision sessions if a previous image run freed them
-    if (imageBytes != null && imageBytes.isNotEmpty && _visionSessionsFreed) {
-      resetInferenceState();
-      _visionSessionsFreed = false;
+    // Concurrent calls are fine: the engine queues them and decodes up to its
+    // max batch together. Its scheduler thread posts each piece straight to
+    // this port, so tokens arrive as events without polling or an isolate.
+    final port = ReceivePort();
+    final jobId = _submit(imageBytes, imagePath, imageFd, fullPrompt, maxTokens, deadline,
+        priority, port.sendPort.nativePort, session);
+    if (jobId < 0) {
+      port.close();
+      if (session > 0) throw ChatSessionLost(session);
+      throw Exception('Failed to submit inference job');
     }
 
-    _isInferenceRunning = true;
-    final receivePort = ReceivePort();
-
-    final params = _InferenceParams(
-      engineAddress: _engineHandle!.address,
-      imageBytes: imageBytes,
-      promptString: fullPrompt.toString(),
-      sendPort: receivePort.sendPort,
-      libPath: _resolveLibPath(),
-      logFilePath: _logFilePath,
-      maxTokens: maxTokens,
-    );
-
+    bool finished = false;
     try {
-      await Isolate.spawn(_inferenceIsolate, params);
-      await for (final message in receivePort) {
-        if (message == null) break;
-        if (message is String) yield message;
+      await for (final msg in port) {
+        if (msg is String) {
+          yield msg;
+        } else {
+          // int JobStatus — always the last message of a job.
+          finished = true;
+          break;
+        }
       }
     } finally {
-      receivePort.close();
-      _isInferenceRunning = false;
-      // Vision encoder + projection sessions are freed inside C++ after each
-      // image inference to reclaim ~430 MB. Flag this so we know to reload them.
-      if (imageBytes != null && imageBytes.isNotEmpty) {
-        _visionSessionsFreed = true;
+      // Reached early when the listener cancels: free the CPU right away.
+      if (!finished) {
+        _cancelJob(jobId);
+        onLog?.call('Inference job $jobId cancelled');
       }
+      _releaseJob(jobId);
+      port.close();
     }
   }
-}
-
-// --- ISOLATE ---
-
-void _inferenceIsolate(_InferenceParams params) {
-  DynamicLibrary lib;
-  if (params.libPath.isEmpty || Platform.isIOS || Platform.isMacOS) {
-    lib = DynamicLibrary.process();
-  } else if (Platform.isWindows) {
-    // Isolates don't share loaded libraries from the main isolate, so we must
-    // pre-load the ONNX Runtime DLLs again before opening the bridge DLL.
-    final dir = File(params.libPath).parent.path;
-    DynamicLibrary.open('$dir\\onnxruntime.dll');
-    DynamicLibrary.open('$dir\\onnxruntime-genai.dll');
-    lib = DynamicLibrary.open(params.libPath);
-  } else {
-    lib = DynamicLibrary.open(params.libPath);
-  }
 
-  // Re-init log path in the isolate (isolates don't share globals with main)
-  if (params.logFilePath.isNotEmpty) {
+  /// Which of [labels] (at most [medGemmaMaxLabels], e.g. `[" RED",
+  /// " YELLOW", " GREEN"]`) the model would answer [prompt] with, from one
+  /// prefill and no generation: a fraction of a full answer's time. Words the
+  /// labels start with in common (e.g. `"[TRIAGE:"`) are read as part of the
+  /// prompt. [labelTemperature] > 1 flattens the probabilities, < 1 sharpens
+  /// them.
+  /// Null if the engine cannot (not loaded, a library from before this, or
+  /// the job failed, e.g. past [deadline]).
+  Future<Classification?> classify({
+    Uint8List? imageBytes,
+    String? imagePath,
+    required String prompt,
+    required List<String> labels,
+    double labelTemperature = 1,
+    Duration? deadline,
+    InferencePriority priority = InferencePriority.high,
+  }) async {
+    if (_engineHandle == null || labels.isEmpty || labels.length > medGemmaMaxLabels) {
+      return null;
+    }
+    final MedGemmaSubmitClassifyDart submit;
+    final MedGemmaGetClassificationDart result;
     try {
-      final setLogFn =
-          lib.lookupFunction<SetLogPathC, SetLogPathDart>('set_log_path');
-      final pathPtr = params.logFilePath.toNativeUtf8();
-      setLogFn(pathPtr);
-      calloc.free(pathPtr);
-    } catch (_) {}
-  }
+      submit = _lib.lookupFunction<MedGemmaSubmitClassifyC, MedGemmaSubmitClassifyDart>(
+          'medgemma_submit_classify');
+      result = _lib.lookupFunction<MedGemmaGetClassificationC, MedGemmaGetClassificationDart>(
+          'medgemma_get_classification');
+    } on ArgumentError {
+      return null;
+    }
+    final hasImage = (imageBytes != null && imageBytes.isNotEmpty) ||
+        (imagePath != null && imagePath.isNotEmpty);
+    final fullPrompt = "<start_of_turn>user\n${hasImage ? "<image>\n" : ""}$prompt"
+        "<end_of_turn>\n<start_of_turn>model\n";
 
-  Pointer<Uint8> imgPtr = nullptr;
-  int imgLen = 0;
+    final port = ReceivePort();
+    Pointer<Uint8> imgPtr = nullptr;
+    int imgLen = 0;
+    if (imageBytes != null && imageBytes.isNotEmpty) {
+      imgLen = imageBytes.length;
+      imgPtr = calloc<Uint8>(imgLen);
+      imgPtr.asTypedList(imgLen).setAll(0, imageBytes);
+    }
+    final pathPtr = (imgLen == 0 && imagePath != null && imagePath.isNotEmpty)
+        ? imagePath.toNativeUtf8()
+        : nullptr;
+    final promptPtr = fullPrompt.toNativeUtf8();
+    final labelPtrs = labels.map((l) => l.toNativeUtf8()).toList();
+    final labelsPtr = calloc<Pointer<Utf8>>(labels.length);
+    for (var i = 0; i < labels.length; i++) {
+      labelsPtr[i] = labelPtrs[i];
+    }
+    final params = calloc<MedGemmaJobParams>();
+    params.ref
+      ..deadlineMs = deadline?.inMilliseconds ?? 0
+      ..dartPort = port.sendPort.nativePort
+      ..imagePath = pathPtr
+      ..priority = priority.index
+      ..labelTemperature = labelTemperature;
+    final int jobId;
+    try {
+      jobId = submit(_engineHandle!, imgPtr, imgLen, promptPtr, labelsPtr, labels.length, params);
+    } finally {
+      if (imgPtr != nullptr) calloc.free(imgPtr);
+      if (pathPtr != nullptr) calloc.free(pathPtr);
+      calloc.free(promptPtr);
+      for (final l in labelPtrs) {
+        calloc.free(l);
+      }
+      calloc.free(labelsPtr);
+      calloc.free(params);
+    }
+    if (jobId < 0) {
+      port.close();
+      return null;
+    }
 
-  if (params.imageBytes != null && params.imageBytes!.isNotEmpty) {
-    imgLen = params.imageBytes!.length;
-    imgPtr = calloc<Uint8>(imgLen);
-    imgPtr.asTypedList(imgLen).setAll(0, params.imageBytes!);
+    final out = calloc<MedGemmaClassification>();
+    try {
+      // A classification posts no text, only its terminal status.
+      await port.firstWhere((msg) => msg is int);
+      if (result(jobId, out) != 0) return null;
+      final r = out.ref;
+      return Classification(
+          r.label, [for (var i = 0; i < r.nLabels; i++) r.probs[i]], r.coverage);
+    } finally {
+      calloc.free(out);
+      _releaseJob(jobId);
+      port.close();
+    }
   }
 
-  final promptPtr = params.promptString.toNativeUtf8();
-
-  final callback = NativeCallable<TokenCallbackC>.isolateLocal(
-    (Pointer<Utf8> textPtr) {
-      params.sendPort.send(textPtr.toDartString());
-    },
-  );
-
-  final maxTokensResult = params.maxTokens;
-  
-  try {
-    final runFn = lib.lookupFunction<RunMedGemmaInferenceC,
-        RunMedGemmaInferenceDart>('run_medgemma_inference');
-    runFn(
-      Pointer.fromAddress(params.engineAddress),
-      imgPtr,
-      imgLen,
-      promptPtr,
-      maxTokensResult,
-      callback.nativeFunction,
-    );
-  } finally {
-    if (imgPtr != nullptr) calloc.free(imgPtr);
-    calloc.free(promptPtr);
-    callback.close();
-    params.sendPort.send(null);
+  int _submit(Uint8List? imageBytes, String? imagePath, int imageFd, PromptTemplate prompt,
+      int maxTokens, Duration? deadline, InferencePriority priority, int dartPort,
+      int session) {
+    final tokens = renderTemplate(prompt);
+    Pointer<Uint8> imgPtr = nullptr;
+    int imgLen = 0;
+    if (imageBytes != null && imageBytes.isNotEmpty) {
+      imgLen = imageBytes.length;
+      imgPtr = calloc<Uint8>(imgLen);
+      imgPtr.asTypedList(imgLen).setAll(0, imageBytes);
+    }
+    final pathPtr = (imgLen == 0 && imagePath != null && imagePath.isNotEmpty)
+        ? imagePath.toNativeUtf8()
+        : nullptr;
+    final promptPtr = tokens == null ? prompt.text.toNativeUtf8() : nullptr;
+    final tokensPtr = tokens == null ? nullptr : calloc<Int64>(tokens.length);
+    if (tokens != null) tokensPtr.asTypedList(tokens.length).setAll(0, tokens);
+    final params = calloc<MedGemmaJobParams>();
+    params.ref
+      ..maxTokens = maxTokens
+      ..deadlineMs = deadline?.inMilliseconds ?? 0
+      ..dartPort = dartPort
+      ..imagePath = pathPtr
+      ..imageFd = imgLen == 0 ? imageFd : 0
+      ..priority = priority.index
+      ..session = session;
+    try {
+      // The engine copies image and prompt (or maps the image file), so
+      // everything is freed right away.
+      return tokens == null
+          ? _submitJob(_engineHandle!, imgPtr, imgLen, promptPtr, params)
+          : _submitTokens(_engineHandle!, imgPtr, imgLen, tokensPtr, tokens.length, params);
+    } finally {
+      if (imgPtr != nullptr) calloc.free(imgPtr);
+      if (pathPtr != nullptr) calloc.free(pathPtr);
+      if (promptPtr != nullptr) calloc.free(promptPtr);
+      if (tokensPtr != nullptr) calloc.free(tokensPtr);
+      calloc.free(params);
+    }
   }
-}
\ No newline at end of file
+}
@@ -510,6 +510,7 @@ class ModelManager {
     debugPrint("ModelManager: Explicitly disposing MedGemma engine.");
     _bridge?.dispose();
     _bridge = null;
+    _intakeDraft = 0; // its session went with the engine
     _isInitialized = false;  // Allow re-initialization before next inference
   }
 
@@ -595,9 +596,20 @@ class ModelManager {
     // before the native FFI call blocks the main thread.
     await Future.delayed(const Duration(milliseconds: 500));
 
+    // Opt-in engine timeline: build with --dart-define=MEDGEMMA_TRACE=true and
+    // pull <documents>/traces/medgemma_trace_*.json after the model unloads.
+    String? traceDir;
+    if (const bool.fromEnvironment('MEDGEMMA_TRACE')) {
+      final dir = Directory('${(await getApplicationDocumentsDirectory()).path}/traces');
+      await dir.create(recursive: true);
+      traceDir = dir.path;
+    }
+
+    // On Android the low-memory killer targets the engine process instead of
+    // the app, which keeps the clinician's session alive.
     _bridge = await MedGemmaBridge.create(modelDir, onLog: (msg) {
        log("[NATIVE] $msg");
-    });
+    }, isolated: Platform.isAndroid, traceDir: traceDir);
     _currentModelDir = modelDir;
     
     log("DEBUG: Bridge initialized and currentModelDir set.");
@@ -1285,7 +1297,13 @@ class ModelManager {
   /// 1. Preprocess clinical images (if any) — pass null for text-only.
   /// 2. Wrap prompt with Gemma-2 chat templates.
   /// 3. Stream tokens back to the UI in real-time.
-  Stream<String> inferenceStream(String prompt, {List<Uint8List>? images}) async* {
+  Stream<String> inferenceStream(
+    PromptTemplate prompt, {
+    List<Uint8List>? images,
+    InferencePriority priority = InferencePriority.normal,
+    int session = 0,
+    bool drafted = false,
+  }) async* {
     await _logMemoryInfo();
     
     try {
@@ -1333,10 +1351,14 @@ class ModelManager {
 
         final stopwatch = Stopwatch()..start();
         final stream = _bridge!.analyzeStream(
-          imageBytes: rawImageBytes,  // null = text-only, no vision
-          promptText: prompt, // Pass raw prompt; Bridge will wrap once.
+          // null = text-only, no vision; a draft already holds its image
+          imageBytes: drafted ? null : rawImageBytes,
+          prompt: prompt, // Pass raw prompt; Bridge will wrap once.
           maxTokens: maxTokens,
           repetitionPenalty: penalty,
+          priority: priority,
+          session: session,
+          drafted: drafted,
           onLog: (msg) => log("[NATIVE_INF] $msg"),
         );
 
@@ -1344,11 +1366,29 @@ class ModelManager {
            yield token;
         }
         log("INFERENCE COMPLETE: duration=${stopwatch.elapsed.inSeconds}s");
+        final m = _bridge!.lastMetrics();
+        if (m.containsKey('last.totalMs')) {
+          String ms(String k) => (m['last.$k'] ?? 0).toStringAsFixed(0);
+          String mb(String k) => ((m['last.$k'] ?? 0) / 1024).round().toString();
+          log("STAGES (ms): image=${ms('imageDecodeMs')}+${ms('imageResizeMs')}+${ms('imageNormalizeMs')} "
+              "vision=${ms('visionLoadMs')}+${ms('visionEncodeMs')}+${ms('visionProjectMs')} "
+              "embed=${ms('embedMs')} prefill=${ms('prefillMs')}/${m['last.prefillChunks']} chunks "
+              "decode=${ms('decodeMs')}/${m['last.decodeSteps']} steps "
+              "(sample=${ms('sampleMs')} detok=${ms('detokenizeMs')}) "
+              "kv=${m['last.kvLen']} rssPeak=${mb('rssPeakKb')}MB "
+              "tensors=${mb('visionPeakKb')}/${mb('prefillPeakKb')}/${mb('decodePeakKb')}MB "
+              "plan=chunk ${m['last.planPrefillChunk']}, ${m['last.planMaxTokens']} tokens, "
+              "${mb('planPeakKb')}/${mb('planBudgetKb')}MB "
+              "spilled=${m['last.spills']}x/${m['last.spillSteps']} steps "
+              "session=${m['last.cachedTokens']} cached/${m['last.evictedTokens']} evicted");
+        }
       } catch (e, stack) {
         log("INFERENCE LOOP ERROR: $e");
         log("STACK TRACE: $stack");
         rethrow;
       }
+    } on ChatSessionLost {
+      rethrow; // the caller resends the whole conversation
     } catch (e, stack) {
       log("INTERNAL INFERENCE ERROR (Triggering Scan): $e");
       log("STACK TRACE: $stack");
@@ -1401,6 +1441,138 @@ class ModelManager {
     }
   }
 
+  /// Streams the intake report. Its prompt is [segments], the last one being
+  /// the question, and the first image; everything before the question goes
+  /// into an engine session first, so whatever [draftIntake] prefilled while
+  /// the form was filled in is not prefilled again.
+  Stream<String> reportStream(List<PromptTemplate> segments, {List<Uint8List>? images}) async* {
+    final image = images != null && images.isNotEmpty ? images.first : null;
+    final drafts = [for (final s in segments.sublist(0, segments.length - 1)) s.text];
+    var session = _intakeDraft;
+    _intakeDraft = 0;
+    if (session == 0) session = _bridge?.openSession() ?? 0;
+    if (session == 0 || !_bridge!.pushDraft(session, drafts, image: image)) {
+      closeChatSession(session);
+      yield* inferenceStream(PromptTemplate.join(segments), images: images);
+      return;
+    }
+    try {
+      yield* inferenceStream(segments.last, images: images, session: session, drafted: true);
+    } on ChatSessionLost {
+      yield* inferenceStream(PromptTemplate.join(segments), images: images);
+    } finally {
+      closeChatSession(session);
+    }
+  }
+
+  // The session [draftIntake] fills, until [reportStream] takes it.
+  int _intakeDraft = 0;
+
+  /// Lets the engine prefill the report's prompt while the intake form is
+  /// still being filled in: [segments] are the ones already final, in
+  /// prompt order (see MedGemmaBridge.pushDraft). Only while the engine is
+  /// loaded; it is not loaded for this.
+  void draftIntake(List<PromptTemplate> segments, {Uint8List? image}) {
+    if (!_isInitialized || _bridge == null) return;
+    if (_intakeDraft == 0) _intakeDraft = _bridge!.openSession();
+    final texts = [for (final s in segments) s.text];
+    if (_intakeDraft != 0 && !_bridge!.pushDraft(_intakeDraft, texts, image: image)) {
+      discardIntakeDraft();
+    }
+  }
+
+  /// Frees the intake draft of a form that was left without a report.
+  void discardIntakeDraft() {
+    closeChatSession(_intakeDraft);
+    _intakeDraft = 0;
+  }
+
+  /// [segments] fitted to the model's context with room for an answer of
+  /// the configured length (see MedGemmaBridge.planContext); null when the
+  /// engine is not loaded, e.g. in mock mode.
+  ContextPlan? planContext(List<String> segments, List<SegmentFit> fit,
+      {int images = 0, int maxPromptTokens = 0}) {
+    if (!_isInitialized || _bridge == null) return null;
+    return _bridge!.planContext(segments, fit,
+        images: images,
+        reserveTokens: _ref.read(aiSettingsProvider).maxTokens,
+        maxPromptTokens: maxPromptTokens);
+  }
+
+  /// Engine chat session for follow-ups (see MedGemmaBridge.openSession);
+  /// 0 if the engine is not loaded.
+  int openChatSession() => _bridge?.openSession() ?? 0;
+
+  void closeChatSession(int session) => _bridge?.closeSession(session);
+
+  // Chat snapshots cost ~70 (int8) to ~272 (fp32) KB per token, up to
+  // ~560 MB for a full fp32 session. The most recent cases keep theirs
+  // while they add up to 512 MB; the latest is kept even if it alone is over.
+  static const int _chatSnapshotBudgetBytes = 512 << 20;
+
+  /// Where an assessment's follow-up chat seeded with [seed] is kept between
+  /// app runs. The name carries a hash of the seed, so a re-run assessment
+  /// (a new report) never resumes the old report's chat; the assessment's
+  /// other snapshots are deleted.
+  Future<String> chatSnapshotPath(String assessmentId, String seed) async {
+    final dir = Directory('${(await getApplicationDocumentsDirectory()).path}/chat_kv');
+    await dir.create(recursive: true);
+    var hash = 0x811c9dc5; // FNV-1a: stable across runs, unlike hashCode
+    for (final b in utf8.encode(seed)) {
+      hash = ((hash ^ b) * 0x01000193) & 0xffffffff;
+    }
+    final path = '${dir.path}/$assessmentId-${hash.toRadixString(16).padLeft(8, '0')}.kv';
+    await for (final f in dir.list()) {
+      final name = f.uri.pathSegments.last;
+      if (f is File && f.path != path && name.endsWith('.kv') &&
+          (name == '$assessmentId.kv' || name.startsWith('$assessmentId-'))) {
+        try {
+          await f.delete();
+        } catch (_) {}
+      }
+    }
+    return path;
+  }
+
+  /// Saves a chat session for [loadChatSession] (see MedGemmaBridge.saveSession),
+  /// off the UI isolate.
+  Future<bool> saveChatSession(int session, String path) async {
+    bool saved;
+    try {
+      saved = await _bridge?.saveSession(session, path) ?? false;
+    } catch (e) {
+      log("Chat snapshot $path not saved: $e");
+      saved = false;
+    }
+    if (saved) {
+      final snapshots = <File, FileStat>{};
+      await for (final f in File(path).parent.list()) {
+        if (f is File && f.path.endsWith('.kv')) snapshots[f] = await f.stat();
+      }
+      final newestFirst = snapshots.keys.toList()
+        ..sort((a, b) => snapshots[b]!.modified.compareTo(snapshots[a]!.modified));
+      var kept = 0;
+      for (final f in newestFirst) {
+        kept += snapshots[f]!.size;
+        if (f == newestFirst.first || kept <= _chatSnapshotBudgetBytes) continue;
+        try {
+          await f.delete();
+        } catch (_) {}
+      }
+    }
+    return saved;
+  }
+
+  /// Reopens a saved chat, loading the engine if needed; 0 if there is none
+  /// or it was saved with another model.
+  Future<int> loadChatSession(String path) async {
+    if (!File(path).existsSync()) return 0;
+    if (!_isInitialized) await init();
+    final session = _bridge?.loadSession(path) ?? 0;
+    log(session > 0 ? "Chat resumed from $path" : "Chat snapshot $path not usable");
+    return session;
+  }
+
   Future<void> createChat({List<Uint8List>? images}) async {
     // ONNX implementation doesn't use InferenceChat
   }
@@ -1415,7 +1587,7 @@ class ModelManager {
 
   Stream<String> sendMessageToChat(dynamic chat, String text, {Uint8List? image}) async* {
     // ONNX implementation uses manual history from triage_chat_controller
-    yield* inferenceStream(text, images: image != null ? [image] : null);
+    yield* inferenceStream(PromptTemplate.plain(text), images: image != null ? [image] : null);
   }
 
   String formatChatMessage(String text, bool isUser, bool isBinary, String language) {
@@ -0,0 +1,269 @@
+// ── medgemma_microbench ──────────────────────────────────────────────────────
+// Google Benchmark suite for the engine's host-side work: everything that
+// runs on the CPU around the ORT sessions, once per token or once per request.
+// End-to-end numbers are dominated by the model and hide these costs.
+//
+//   medgemma_microbench [--benchmark_filter=SampleTopP]
+//                       [--benchmark_out=base.json --benchmark_out_format=json]
+//
+// Compare two builds with Google Benchmark's tools/compare.py. Sizes are the
+// real ones (Gemma3 vocabulary, 896×896 vision input, 2560-wide embeddings).
+// The foreign-token mask is built from a real tokenizer, so that benchmark
+// only runs when MEDGEMMA_MODEL_DIR points at a model directory.
+//
+// The engine's internals are file-local, so this compiles
+// medgemma_inference.cpp in rather than linking libmedgemma_bridge.
+
+#include "../medgemma_inference.cpp"
+
+#include <benchmark/benchmark.h>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+namespace {
+
+const size_t kVocab = 262144; // Gemma3: 262,144 text tokens
+
+std::vector<float> random_logits(size_t n, unsigned seed = 7) {
+  std::mt19937 rng(seed);
+  std::normal_distribution<float> dist(0.0f, 3.0f);
+  std::vector<float> logits(n);
+  for (auto &x : logits)
+    x = dist(rng);
+  return logits;
+}
+
+// A vocabulary with the engine's real mix: mostly ASCII pieces, some Latin-1
+// accents, and the foreign scripts the language filter exists to block.
+std::vector<std::string> synthetic_vocab(size_t n) {
+  static const char *pieces[] = {
+      "▁the", "ing",  "▁patient", "▁fever", "▁é", "ñ",    "▁ü",
+      "дом",  "中文", "العربية", "▁",      "🙂", "▁BP", "▁mmHg",
+  };
+  std::vector<std::string> vocab(n);
+  for (size_t i = 0; i < n; ++i)
+    vocab[i] = pieces[(i * 7) % (sizeof(pieces) / sizeof(pieces[0]))] +
+               std::to_string(i % 97);
+  return vocab;
+}
+
+// Stand-in key for the foreign mask cache: lets sample_top_p take the
+// filtered path without an OGA tokenizer behind it.
+OgaTokenizer *fake_tokenizer() {
+  static int key;
+  OgaTokenizer *tok = reinterpret_cast<OgaTokenizer *>(&key);
+  std::lock_guard<std::mutex> lock(g_lang_cache_mutex);
+  auto &mask = g_foreign_token_cache[tok];
+  if (mask.empty()) {
+    std::vector<std::string> vocab = synthetic_vocab(kVocab);
+    mask.resize(kVocab);
+    for (size_t i = 0; i < kVocab; ++i)
+      mask[i] = !is_english_token(vocab[i].c_str());
+  }
+  return tok;
+}
+
+// Smooth gradient plus sensor-like noise, so the JPEG size and decode cost
+// are close to a phone photo's rather than to flat colour or pure noise.
+std::vector<uint8_t> make_jpeg(int megapixels) {
+  int w = (int)std::sqrt(megapixels * 1e6 * 4 / 3);
+  int h = w * 3 / 4;
+  cv::Mat img(h, w, CV_8UC3);
+  for (int y = 0; y < h; ++y) {
+    auto *row = img.ptr<uint8_t>(y);
+    for (int x = 0; x < w; ++x) {
+      row[3 * x] = (uint8_t)(x * 255 / w);
+      row[3 * x + 1] = (uint8_t)(y * 255 / h);
+      row[3 * x + 2] = (uint8_t)((x + y) * 128 / (w + h) + 64);
+    }
+  }
+  cv::Mat noise(h, w, CV_8UC3);
+  cv::randn(noise, cv::Scalar::all(0), cv::Scalar::all(6));
+  img += noise;
+  std::vector<uint8_t> jpeg;
+  cv::imencode(".jpg", img, jpeg, {cv::IMWRITE_JPEG_QUALITY, 90});
+  return jpeg;
+}
+
+} // namespace
+
+// ── Sampling (per generated token) ───────────────────────────────────────────
+
+enum SampleMode { GREEDY, NUCLEUS, PENALISED, FILTERED };
+
+static void BM_SampleTopP(benchmark::State &state) {
+  const SampleMode mode = static_cast<SampleMode>(state.range(0));
+  std::vector<float> logits = random_logits(kVocab);
+  std::vector<int64_t> recent(128);
+  for (size_t i = 0; i < recent.size(); ++i)
+    recent[i] = (int64_t)(i * 2039 % kVocab);
+  OgaTokenizer *tok = mode == FILTERED ? fake_tokenizer() : nullptr;
+  const float temp = mode == GREEDY ? 0.0f : 0.29f;
+  const std::vector<int64_t> *generated = mode >= PENALISED ? &recent : nullptr;
+  for (auto _ : state)
+    benchmark::DoNotOptimize(
+        sample_top_p(logits, 0.75f, temp, generated, 1.30f, tok));
+  static const char *labels[] = {"greedy", "top-p", "top-p+penalty",
+                                 "top-p+penalty+filter"};
+  state.SetLabel(labels[mode]);
+}
+BENCHMARK(BM_SampleTopP)
+    ->DenseRange(GREEDY, FILTERED)
+    ->Unit(benchmark::kMillisecond);
+
+// ── Language filter ──────────────────────────────────────────────────────────
+
+static void BM_IsEnglishToken(benchmark::State &state) {
+  std::vector<std::string> vocab = synthetic_vocab(kVocab);
+  for (auto _ : state) {
+    size_t blocked = 0;
+    for (const auto &piece : vocab)
+      blocked += !is_english_token(piece.c_str());
+    benchmark::DoNotOptimize(blocked);
+  }
+  state.SetItemsProcessed(state.iterations() * vocab.size());
+}
+BENCHMARK(BM_IsEnglishToken)->Unit(benchmark::kMillisecond);
+
+// Cold build: one tokenizer decode per vocabulary entry, paid on the first
+// request after load.
+static void BM_ForeignMaskBuild(benchmark::State &state) {
+  const char *dir = getenv("MEDGEMMA_MODEL_DIR");
+  if (!dir) {
+    state.SkipWithError("set MEDGEMMA_MODEL_DIR to a model directory");
+    return;
+  }
+  OgaConfig *config = nullptr;
+  OgaModel *model = nullptr;
+  OgaTokenizer *tok = nullptr;
+  if (OgaCreateConfig(dir, &config) != 0 ||
+      OgaCreateModelFromConfig(config, &model) != 0 ||
+      OgaCreateTokenizer(model, &tok) != 0) {
+    state.SkipWithError("could not load the tokenizer");
+    return;
+  }
+  for (auto _ : state) {
+    {
+      std::lock_guard<std::mutex> lock(g_lang_cache_mutex);
+      g_foreign_token_cache.erase(tok);
+    }
+    benchmark::DoNotOptimize(&get_foreign_mask(tok, kVocab));
+  }
+  state.SetItemsProcessed(state.iterations() * kVocab);
+  OgaDestroyTokenizer(tok);
+  OgaDestroyModel(model);
+  OgaDestroyConfig(config);
+}
+BENCHMARK(BM_ForeignMaskBuild)->Iterations(3)->Unit(benchmark::kMillisecond);
+
+// Warm path taken on every sampled token.
+static void BM_ForeignMaskLookup(benchmark::State &state) {
+  OgaTokenizer *tok = fake_tokenizer();
+  for (auto _ : state)
+    benchmark::DoNotOptimize(&get_foreign_mask(tok, kVocab));
+}
+BENCHMARK(BM_ForeignMaskLookup);
+
+// ── Image preprocessing (per image) ──────────────────────────────────────────
+
+static void BM_ProcessImageBytes(benchmark::State &state) {
+  std::vector<uint8_t> jpeg = make_jpeg((int)state.range(0));
+  std::string error;
+  for (auto _ : state) {
+    std::vector<float> pixels =
+        process_image_bytes(jpeg.data(), jpeg.size(), error);
+    benchmark::DoNotOptimize(pixels.data());
+  }
+  if (!error.empty())
+    state.SkipWithError(error.c_str());
+  state.SetBytesProcessed(state.iterations() * jpeg.size());
+  state.SetLabel(std::to_string(state.range(0)) + " MP, " +
+                 std::to_string(jpeg.size() / 1024) + " KB JPEG");
+}
+BENCHMARK(BM_ProcessImageBytes)
+    ->Arg(1)
+    ->Arg(3)
+    ->Arg(6)
+    ->Arg(12)
+    ->Unit(benchmark::kMillisecond);
+
+// The projector's 256 tokens down to 64 or 16, including the copy the engine
+// makes of the projector output.
+static void BM_PoolVisualTokens(benchmark::State &state) {
+  const std::vector<float> projected = random_logits(num_patches * embed_dim);
+  const int grid = (int)state.range(0);
+  for (auto _ : state) {
+    std::vector<float> embeds = projected;
+    pool_visual_tokens(embeds, grid);
+    benchmark::DoNotOptimize(embeds.data());
+  }
+  state.SetBytesProcessed(state.iterations() * projected.size() * 4);
+}
+BENCHMARK(BM_PoolVisualTokens)->Arg(8)->Arg(4)->Unit(benchmark::kMicrosecond);
+
+// ── Stop strings (per generated token) ───────────────────────────────────────
+
+static void BM_StopMatcherFeed(benchmark::State &state) {
+  // ~4-character pieces of a report that never hits a stop string.
+  const std::string report =
+      "**Triage Level:** YELLOW (Urgent). The patient presents with fever, "
+      "productive cough and mild tachypnoea. Differential diagnosis: "
+      "community-acquired pneumonia, acute bronchitis, malaria. Urgent "
+      "actions: check SpO2 and respiratory rate, start oral antibiotics per "
+      "protocol, refer if SpO2 falls below 92%. ";
+  std::vector<std::string> tokens;
+  for (size_t i = 0; tokens.size() < 512; i = (i + 4) % report.size())
+    tokens.push_back(report.substr(i, 4));
+  for (auto _ : state) {
+    StopMatcher stop;
+    for (const auto &t : tokens)
+      benchmark::DoNotOptimize(stop.feed(t.c_str()));
+  }
+  state.SetItemsProcessed(state.iterations() * tokens.size());
+}
+BENCHMARK(BM_StopMatcherFeed)->Unit(benchmark::kMicrosecond);
+
+// ── Prompt assembly and masks ────────────────────────────────────────────────
+
+// Image block + N text tokens, with the token embeddings already computed:
+// only the host-side copy into the prefill buffer is measured.
+static void BM_SplicePromptEmbeds(benchmark::State &state) {
+  const int64_t image_token = 262144;
+  const int text_tokens = (int)state.range(0);
+  std::vector<int64_t> tokens = {2};
+  for (int i = 0; i < text_tokens; ++i)
+    tokens.push_back(i == 4 ? image_token : 1000 + i);
+  std::vector<float> image_embeds = random_logits(num_patches * embed_dim);
+  std::vector<float> table = random_logits(64 * embed_dim, 11);
+  for (auto _ : state) {
+    std::vector<float> out;
+    int n = splice_prompt_embeds(
+        out, tokens, image_token, image_embeds,
+        [&](int64_t id) { return table.data() + (id % 64) * embed_dim; });
+    benchmark::DoNotOptimize(n);
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.SetBytesProcessed(state.iterations() *
+                          (tokens.size() + num_patches - 1) * embed_dim * 4);
+}
+BENCHMARK(BM_SplicePromptEmbeds)
+    ->Arg(64)
+    ->Arg(256)
+    ->Arg(1024)
+    ->Unit(benchmark::kMicrosecond);
+
+// One decode step's mask: B rows of the batch width, right-padded.
+static void BM_AttentionMask(benchmark::State &state) {
+  const int64_t batch = state.range(0), width = state.range(1);
+  std::vector<int64_t> valid(batch);
+  for (int64_t b = 0; b < batch; ++b)
+    valid[b] = width - b * 37;
+  std::vector<int64_t> mask;
+  for (auto _ : state) {
+    fill_attention_mask(mask, valid, width);
+    benchmark::DoNotOptimize(mask.data());
+  }
+}
+BENCHMARK(BM_AttentionMask)->ArgsProduct({{1, 4}, {512, 2048}});
+
+BENCHMARK_MAIN();
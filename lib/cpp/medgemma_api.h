@@ -0,0 +1,404 @@
+// ── MedGemma engine C API ────────────────────────────────────────────────────
+// Exported by libmedgemma_bridge. Consumed through dart:ffi by
+// lib/core/ai/medgemma_bridge.dart (whose Struct classes mirror the structs
+// below — keep field order in sync) and directly by the native tools
+// (medgemma_server). Everything here is plain C so both sides agree on layout.
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// ── Types ────────────────────────────────────────────────────────────────────
+
+typedef void (*TokenCallback)(const char *);
+
+// medgemma_poll() results. Anything >= JOB_DONE is terminal.
+enum JobStatus {
+  JOB_QUEUED = 0, // waiting for admission (or paused by a higher priority)
+  JOB_RUNNING = 1,
+  JOB_DONE = 2,
+  JOB_CANCELLED = 3,
+  JOB_TIMED_OUT = 4,
+  JOB_FAILED = 5,
+};
+
+// Request classes. A HIGH job (a chat follow-up) preempts NORMAL work (a full
+// report) when the engine is at max_batch.
+enum JobPriority {
+  PRIORITY_NORMAL = 0,
+  PRIORITY_HIGH = 1,
+  PRIORITY_COUNT
+};
+
+// medgemma_set_log_level() thresholds.
+enum MedGemmaLogLevel {
+  MEDGEMMA_LOG_DEBUG = 0, // per chunk / per step detail
+  MEDGEMMA_LOG_INFO = 1,  // default
+  MEDGEMMA_LOG_ERROR = 2,
+};
+
+// medgemma_set_kv_precision() modes: how the decoder's KV cache is stored.
+enum MedGemmaKvPrecision {
+  MEDGEMMA_KV_FP32 = 0, // model.onnx as exported
+  MEDGEMMA_KV_FP16 = 1, // model_kv16.onnx, half the cache memory
+  MEDGEMMA_KV_INT8 = 2, // model_kv8.onnx, int8 with a scale per head and
+                        // position: about a quarter
+};
+
+// medgemma_set_image_pooling() modes: visual tokens per image.
+enum MedGemmaImagePooling {
+  MEDGEMMA_IMAGE_POOL_NONE = 0, // the projector's 16×16 grid, 256 tokens
+  MEDGEMMA_IMAGE_POOL_8X8 = 1,  // 2×2 blocks averaged, 64 tokens
+  MEDGEMMA_IMAGE_POOL_4X4 = 2,  // 4×4 blocks averaged, 16 tokens
+};
+
+// medgemma_plan_context() segment flags: what may give way when the prompt
+// is over its target.
+enum MedGemmaSegmentFit {
+  MEDGEMMA_SEGMENT_KEEP = 0,     // always whole
+  MEDGEMMA_SEGMENT_TRUNCATE = 1, // its end may be cut
+  MEDGEMMA_SEGMENT_DROP = 2,     // may be left out whole
+};
+
+// Labels per medgemma_classify() request.
+enum { MEDGEMMA_MAX_LABELS = 8 };
+
+// Zero-initialise, then set what you need: every zero field means "default".
+typedef struct MedGemmaJobParams {
+  int32_t max_tokens;  // <= 0 → 512
+  int32_t deadline_ms; // wall-clock budget from submit, <= 0 → none
+  int64_t dart_port;   // SendPort.nativePort to post output to, 0 → ring
+  // Encoded image to map instead of passing bytes; image_fd > 0 wins over
+  // image_path. Ignored when image bytes are passed to medgemma_submit.
+  const char *image_path;
+  int32_t image_fd;
+  int32_t priority; // JobPriority, out of range → PRIORITY_NORMAL
+  // Sampling; <= 0 → engine default (0.29 / 0.75 / 1.30).
+  float temperature; // < 0.01 after defaulting → greedy
+  float top_p;
+  float repetition_penalty;
+  // medgemma_session_open() id, 0 → none. The prompt is then only this turn:
+  // it continues the session's cached conversation.
+  int64_t session;
+  // medgemma_submit_classify only: divides the labels' log-probabilities
+  // before they are normalised (calibration: fit it on labelled cases).
+  // <= 0 → 1.
+  float label_temperature;
+} MedGemmaJobParams;
+
+// Per-class arrays are indexed by JobPriority; times are milliseconds from
+// submit.
+typedef struct MedGemmaQueueStats {
+  int32_t queued;  // never admitted yet
+  int32_t paused;  // preempted, KV cache kept, waiting to resume
+  int32_t running; // admitted (prefill or decode)
+  int32_t max_batch;
+  int64_t submitted;
+  int64_t finished;
+  int64_t preemptions;
+  double queue_wait_avg_ms[PRIORITY_COUNT]; // submit → first admission
+  double queue_wait_max_ms[PRIORITY_COUNT];
+  double first_token_avg_ms[PRIORITY_COUNT]; // submit → first token
+} MedGemmaQueueStats;
+
+// Where one job's time went, in milliseconds from its own clock. Stage times
+// sum this job's share of the work; a decode step shared by a batch counts in
+// full for every member.
+typedef struct MedGemmaJobTimings {
+  double queue_ms;       // submit → first admission
+  double first_token_ms; // submit → first token
+  double image_ms;       // image decode + resize + normalize
+  double vision_ms;      // vision encoder + projection
+  double embed_ms;       // tokenize + prompt embeddings
+  double prefill_ms;     // all prefill chunks
+  double decode_ms;      // decode steps after the first token
+  int32_t prompt_tokens; // prefill positions, image patches included
+  int32_t image_tokens;
+  int32_t generated_tokens;
+  int32_t prefill_chunks;
+  int32_t decode_steps;
+  int32_t max_batch_seen; // widest decode batch this job was part of
+  // Finer split of the stages above. Fields up to here keep their offsets.
+  double image_decode_ms;    // stb decode of the encoded file
+  double image_resize_ms;    // → 896×896
+  double image_normalize_ms; // HWC uint8 → CHW float
+  double vision_load_ms;     // reloading the vision sessions, if dropped
+  double vision_encode_ms;
+  double vision_project_ms;
+  double tokenize_ms;          // part of embed_ms
+  double prefill_chunk_max_ms; // slowest single prefill chunk
+  double decode_step_max_ms;   // slowest single decode step
+  double sample_ms;            // sampling, summed over every token
+  double detokenize_ms;        // token → text, summed over every token
+  double total_ms;             // submit → terminal status
+  int32_t kv_len;              // cache positions when the job ended
+  int32_t status;              // terminal JobStatus
+  int64_t rss_start_kb;        // engine process RSS when preparation began
+  int64_t rss_peak_kb;         // highest RSS sampled between stages
+  int64_t rss_end_kb;
+  // Tensor memory held by the engine's allocator (live tensors plus its
+  // reuse pool) at its highest during each stage; 0 if the job skipped it.
+  int64_t vision_peak_kb;
+  int64_t prefill_peak_kb; // prompt embeddings and prefill chunks
+  int64_t decode_peak_kb;
+  // What the memory planner chose before the job did any work.
+  int32_t plan_prefill_chunk;
+  int32_t plan_max_tokens; // the request's, or fewer to fit memory or the
+                           // context
+  int64_t plan_peak_kb;    // its estimate of the job's peak
+  int64_t plan_budget_kb;  // available minus headroom; -1 if unknown
+  int32_t spills;          // times its KV cache was moved to flash
+  int32_t spill_steps;     // prefill chunks and decode steps run from there
+  int32_t cached_tokens;   // session positions reused instead of prefilled
+  int32_t evicted_tokens;  // session positions dropped to stay in its window
+} MedGemmaJobTimings;
+
+// Running totals over every job the engine has finished since load (for an
+// isolated engine: since load_medgemma_isolated, across daemon restarts).
+typedef struct MedGemmaCounters {
+  int64_t jobs_done;
+  int64_t jobs_cancelled;
+  int64_t jobs_timed_out;
+  int64_t jobs_failed;
+  int64_t images;
+  int64_t prompt_tokens;
+  int64_t image_tokens;
+  int64_t generated_tokens;
+  double queue_ms; // stage times summed over jobs (see MedGemmaJobTimings)
+  double image_ms;
+  double vision_ms;
+  double embed_ms;
+  double prefill_ms;
+  double decode_ms;
+  double sample_ms;
+  double detokenize_ms;
+  int64_t rss_peak_kb; // highest rss_peak_kb of any job
+  int64_t vision_peak_kb; // likewise for the *_peak_kb stage peaks
+  int64_t prefill_peak_kb;
+  int64_t decode_peak_kb;
+} MedGemmaCounters;
+
+// How tight memory is, as the engine sees it (see medgemma_get_memory_status).
+enum MedGemmaMemoryLevel {
+  MEDGEMMA_MEM_OK = 0,
+  MEDGEMMA_MEM_MODERATE = 1, // caches dropped
+  MEDGEMMA_MEM_HIGH = 2,     // no images, small prefill chunks, one job
+  MEDGEMMA_MEM_CRITICAL = 3, // KV caches spilled to flash, generation paused
+                             // and then continued from there
+};
+
+// Sizes in KB; -1 where the source is missing (no PSI, no cgroup limit).
+typedef struct MedGemmaMemoryStatus {
+  int32_t level;            // MedGemmaMemoryLevel
+  int64_t available_kb;     // min(MemAvailable, cgroup limit - usage)
+  int64_t mem_available_kb; // /proc/meminfo
+  int64_t cgroup_limit_kb;
+  int64_t cgroup_usage_kb;
+  double psi_some_avg10; // /proc/pressure/memory, % of the last 10 s
+  double psi_full_avg10;
+} MedGemmaMemoryStatus;
+
+// A prompt measured against the model's context (medgemma_plan_context).
+typedef struct MedGemmaContextPlan {
+  int32_t context_tokens;    // the model's context length, 0 if unknown
+  int32_t prompt_tokens;     // BOS, the segments as kept and the images
+  int32_t image_tokens;      // 256 per image, fewer when pooled
+  int32_t generation_budget; // context left after the prompt, -1 if unknown
+  int32_t fits;              // 1 if prompt_tokens is within the target
+} MedGemmaContextPlan;
+
+// The answer of a classification job (medgemma_classify).
+typedef struct MedGemmaClassification {
+  int32_t label;    // index of the most likely label, -1 if none (failed)
+  int32_t n_labels;
+  float probs[MEDGEMMA_MAX_LABELS]; // per label, summing to 1
+  // The model's own probability of answering with one of the labels at all,
+  // words they all start with included; low means the prompt did not lead it
+  // to a label.
+  float coverage;
+} MedGemmaClassification;
+
+// ── Engine lifetime ──────────────────────────────────────────────────────────
+
+void set_log_path(const char *path);
+// Lines below `level` (MedGemmaLogLevel) are skipped without being formatted;
+// applies to isolated engines' children too.
+void medgemma_set_log_level(int32_t level);
+// Chrome trace (engine spans + ORT operator profiles) of every engine loaded
+// after this call, written to `dir` by unload_medgemma. null or "" → off.
+void set_trace_dir(const char *dir);
+// Where the memory monitor reads /proc/meminfo, /proc/pressure/memory and the
+// cgroup directory (memory.max etc.); null or "" restores the default (for
+// the cgroup: the process's own). Takes effect at the next sample, also for
+// engines already loaded; isolated engines spawned later inherit it.
+void medgemma_set_memory_paths(const char *meminfo, const char *psi,
+                               const char *cgroup_dir);
+// Samples every source now. Returns 0, or -1 if none could be read.
+int32_t medgemma_get_memory_status(MedGemmaMemoryStatus *out);
+// Directory for KV spill files under critical memory pressure; it should be
+// on local flash with room for twice the largest cache. null or "" → the
+// model directory. Isolated engines spawned later inherit it.
+void medgemma_set_spill_dir(const char *dir);
+// KV cache precision (MedGemmaKvPrecision) of engines loaded after this call,
+// isolated ones included. The fp16/int8 modes need the decoder variant that
+// lib/cpp/tools/kv_variant.py writes next to model.onnx; without it the
+// engine logs an error and keeps fp32. Lower precision costs some accuracy.
+void medgemma_set_kv_precision(int32_t precision);
+// Visual tokens per image (MedGemmaImagePooling) of requests submitted from
+// now on, in every engine; out of range → NONE. Fewer tokens prefill faster
+// and lose detail; medgemma_bench --image-pooling measures both. A chat
+// session's cache keeps its images as they were pooled.
+void medgemma_set_image_pooling(int32_t pooling);
+void *load_medgemma_4bit(const char *model_dir);
+// Runs the engine in a medgemma_daemon child process that is restarted if it
+// dies. daemon_path may be null (looked up next to the library).
+void *load_medgemma_isolated(const char *model_dir, const char *daemon_path);
+void unload_medgemma(void *handle);
+void reset_inference_state(void *handle);
+void medgemma_set_max_batch(void *handle, int32_t max_batch);
+int32_t medgemma_get_queue_stats(void *handle, MedGemmaQueueStats *out);
+// Timings of the job that most recently reached a terminal status, and the
+// engine's running totals. Either pointer may be null. Returns 0, 1 if no job
+// has finished yet (`last` untouched) or -1 for a null handle.
+int32_t medgemma_get_last_metrics(void *handle, MedGemmaJobTimings *last,
+                                  MedGemmaCounters *totals);
+int medgemma_tokenize(void *handle, const char *text, int64_t *out_tokens,
+                      int max_tokens);
+
+// ── Prompt templates ─────────────────────────────────────────────────────────
+
+// A prompt whose fixed text is tokenized once: `source` is text with "{{…}}"
+// slots (the names inside are for the reader; values go in in order).
+// Returns an ID > 0 for the engine's lifetime, the same one for the same
+// source, or -1 (at most 256 sources per engine).
+int32_t medgemma_template_define(void *handle, const char *source);
+// Writes template `id` with `values` (n_values = its slots, null → empty) as
+// token IDs for medgemma_submit_tokens, tokenizing only the values. A slot
+// takes the spaces before it, so "Age: {{age}}" reads like "Age: 42".
+// Returns the number of tokens, which may exceed `max_tokens` (only that many
+// are written), or -1 for an unknown id or the wrong number of values.
+int32_t medgemma_template_render(void *handle, int32_t id,
+                                 const char *const *values, int32_t n_values,
+                                 int64_t *out_tokens, int32_t max_tokens);
+
+// ── Context planning ─────────────────────────────────────────────────────────
+
+// Measures a prompt made of `n_segments` UTF-8 segments, in order, and
+// `images` images (256 positions each, fewer when pooled; placeholders not in
+// the segments) as a prompt that opens a conversation. Its target is the
+// context less `reserve_tokens` (room for the answer), or `max_prompt_tokens`
+// if that is > 0 and lower. Over it, segments whose `fit`
+// (MedGemmaSegmentFit; null → all KEEP) is DROP are left out, earliest
+// first, then TRUNCATE ones lose their ends, earliest first, at the last
+// character that keeps within it.
+// Fills `kept_bytes` (how much of each segment to keep, 0 if dropped) and
+// `segment_tokens` (its tokens as kept), either may be null. Each segment is
+// tokenized on its own, like template values, so the counts are exact for a
+// prompt sent that way; joined into one text, a seam may tokenize a token
+// differently. Returns 0 (out->fits tells whether the target was met) or -1.
+int32_t medgemma_plan_context(void *handle, const char *const *segments,
+                              const int32_t *fit, int32_t n_segments,
+                              int32_t images, int32_t reserve_tokens,
+                              int32_t max_prompt_tokens, int32_t *kept_bytes,
+                              int32_t *segment_tokens,
+                              MedGemmaContextPlan *out);
+
+// ── Jobs ─────────────────────────────────────────────────────────────────────
+
+void medgemma_init_dart_api(void *post_cobject);
+int64_t medgemma_submit(void *handle, const uint8_t *image_bytes,
+                        int image_len, const char *prompt,
+                        const MedGemmaJobParams *params);
+// medgemma_submit with the prompt as token IDs, e.g. from
+// medgemma_template_render; a leading BOS is dropped (the engine adds its
+// own). -1 if there are none or one is not in the vocabulary.
+int64_t medgemma_submit_tokens(void *handle, const uint8_t *image_bytes,
+                               int image_len, const int64_t *tokens,
+                               int32_t n_tokens,
+                               const MedGemmaJobParams *params);
+int32_t medgemma_poll(int64_t job_id);
+int32_t medgemma_read(int64_t job_id, char *out, int32_t out_len);
+int32_t medgemma_cancel(int64_t job_id);
+// Fills `out` once the job is terminal (until it is released); -1 before.
+int32_t medgemma_get_job_timings(int64_t job_id, MedGemmaJobTimings *out);
+void medgemma_release(int64_t job_id);
+
+// A chat whose KV cache outlives its jobs: each job submitted with the
+// session's id sends only its new turn, and the engine closes the previous
+// model turn itself. The cache holds at most `window_tokens` positions
+// (<= 0 → 2048); when full, the oldest positions after the first
+// `sink_tokens` are dropped (0 → the first prompt's, up to half the window).
+// The window never exceeds the model's context length.
+// Returns the id, or -1. One job at a time per session: medgemma_submit
+// returns -1 while one is running, for an unknown id, or once the session is
+// lost (a job that continued it stopped inside its prompt); then open a new
+// one and send the whole conversation.
+int64_t medgemma_session_open(void *handle, int32_t window_tokens,
+                              int32_t sink_tokens);
+void medgemma_session_close(void *handle, int64_t session);
+// Writes the session's conversation to `path` (replacing it atomically): its
+// KV cache in the engine's KV precision, and a fingerprint of the weights.
+// Returns 0, or -1 if the session is unknown, busy, lost or empty, or the
+// file cannot be written.
+int32_t medgemma_session_save(void *handle, int64_t session, const char *path);
+// Opens a session that continues a saved conversation, on any KV precision
+// of the same weights: its first job prefills only its own turn. The file is
+// mapped, so it must not be truncated or rewritten in place while the
+// session is open (a save to the same path replaces it, which is fine).
+// Returns the session ID, or -1 if the file is missing, damaged or was saved
+// with other weights.
+int64_t medgemma_session_load(void *handle, const char *path);
+// Sets segment `index` of the session's next prompt ahead of its submit,
+// e.g. as an intake form is filled in. While the engine has no job, it
+// prefills the segments into the session's cache in the background; the next
+// job submitted to the session then starts with the segments (with the last
+// image among them unless it brings its own) and only prefills what is left.
+// Changing a segment drops the ones after it and the cache built on them; a
+// null `text` drops segment `index` on. Segments join as they are, best at
+// line breaks. Returns 0, or -1 if the session is unknown, busy or lost, or
+// `index` is past the segments pushed so far.
+int32_t medgemma_session_push(void *handle, int64_t session, int32_t index,
+                              const char *text, const uint8_t *image_bytes,
+                              int32_t image_len);
+
+// ── Classification ───────────────────────────────────────────────────────────
+
+// Picks one of `labels` (1..MEDGEMMA_MAX_LABELS UTF-8 strings, e.g. " RED",
+// " YELLOW", " GREEN") as the prompt's continuation without generating: the
+// job prefills the prompt and scores each label from the logits at its end.
+// Tokens all labels start with (the "[TRIAGE:" of "[TRIAGE:RED]" and
+// "[TRIAGE:GREEN]") are prefilled with the prompt; a label that goes on past
+// its next token costs one more decoder Run over the rest. Labels are
+// tokenized on their own, so put in the space the model would write before
+// them. `params` works as for
+// medgemma_submit except that max_tokens, session and the sampling fields are
+// ignored, and label_temperature applies. Returns a job ID; the job writes no
+// text, its result is read with medgemma_get_classification.
+int64_t medgemma_submit_classify(void *handle, const uint8_t *image_bytes,
+                                 int image_len, const char *prompt,
+                                 const char *const *labels, int32_t n_labels,
+                                 const MedGemmaJobParams *params);
+// Fills `out` once the classification job is done (until it is released).
+// Returns 0, or -1 while it runs, if it did not finish or is no
+// classification.
+int32_t medgemma_get_classification(int64_t job_id,
+                                    MedGemmaClassification *out);
+// medgemma_submit_classify, waiting for the result. Returns the index of the
+// most likely label (also out->label), or -1.
+int32_t medgemma_classify(void *handle, const uint8_t *image_bytes,
+                          int image_len, const char *prompt,
+                          const char *const *labels, int32_t n_labels,
+                          const MedGemmaJobParams *params,
+                          MedGemmaClassification *out);
+
+// Blocking, pre-job entry point kept for older callers.
+void run_medgemma_inference(void *handle, uint8_t *image_bytes, int image_len,
+                            const char *prompt, int max_tokens,
+                            TokenCallback callback);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
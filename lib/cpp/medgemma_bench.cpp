@@ -0,0 +1,608 @@
+// ── medgemma_bench ───────────────────────────────────────────────────────────
+// Headless benchmark of the C++ engine (the same code path the app uses, not
+// the Python one in bridge.py). Replays a JSONL corpus of triage requests and
+// writes one JSON document with per-request numbers and a summary, so two
+// builds can be compared on the same Linux box:
+//
+//   medgemma_bench --model DIR --corpus bench/triage_corpus.jsonl
+//                  [--runs 3] [--warmup 1] [--concurrency 1] [--max-batch N]
+//                  [--max-tokens N] [--out results.json] [--log FILE]
+//                  [--trace DIR] [--image-pooling 0,1,2 [--min-agreement F]]
+//
+// Corpus lines: {"id": "...", "prompt": "...", "image": "rel/or/abs.jpg",
+// "max_tokens": 256}. Only "prompt" is required; images are resolved against
+// the corpus file's directory and submitted by path, like the app does. The
+// prompt gets the app's Gemma chat wrapping unless it already has turns.
+//
+// Reported: load time, RSS after load and peak RSS, and per request TTFT,
+// total time, prefill and decode tok/s and the engine's stage times
+// (medgemma_get_job_timings); the summary has mean/p50/p90/p99 of each. The
+// exit status is 1 if any request did not finish cleanly. --trace writes a
+// Chrome trace of the whole run (engine spans + ORT operator profiles) into
+// DIR on exit; profiling slows the engine, so don't compare traced numbers.
+//
+// --image-pooling replays the corpus once per MedGemmaImagePooling mode listed
+// (the image entries only after the first) and adds a "pooling" section: per
+// mode the image tokens, TTFT and prefill time, and how the answers agree with
+// the first mode's for the same request: identical, the shared prefix, and
+// the triage level (the first RED, YELLOW or GREEN) where the first mode's
+// answer names one. --min-agreement makes the exit status 1 if a mode's level
+// agreement (the prefix, if no answer names a level) falls below it; run it
+// with greedy decoding, which is the default.
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "medgemma_api.h"
+#include "medgemma_json.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static double ms_between(Clock::time_point a, Clock::time_point b) {
+  return std::chrono::duration<double, std::milli>(b - a).count();
+}
+
+struct CorpusEntry {
+  std::string id;
+  std::string prompt;
+  std::string image_path;
+  int max_tokens = 0;
+};
+
+struct Result {
+  std::string id;
+  int run = 0;
+  int status = -1;
+  double ttft_ms = 0; // submit → first output byte, as the caller sees it
+  double total_ms = 0;
+  double max_gap_ms = 0; // longest stall between two output chunks
+  size_t output_bytes = 0;
+  int pooling = -1; // MedGemmaImagePooling, -1 → left as the engine had it
+  std::string text;
+  MedGemmaJobTimings t = {};
+};
+
+static double rss_mb() {
+  long pages = 0, resident = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f) {
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+      resident = 0;
+    fclose(f);
+  }
+  return resident * (double)sysconf(_SC_PAGESIZE) / (1024.0 * 1024.0);
+}
+
+static double peak_rss_mb() {
+  rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_maxrss / 1024.0; // KB on Linux
+}
+
+// Same wrapping as MedGemmaBridge.analyzeStream.
+static std::string wrap_prompt(const std::string &text, bool has_image) {
+  if (text.find("<start_of_turn>") != std::string::npos)
+    return text;
+  return std::string("<start_of_turn>user\n") + (has_image ? "<image>\n" : "") +
+         text + "<end_of_turn>\n<start_of_turn>model\n";
+}
+
+static bool load_corpus(const std::string &path,
+                        std::vector<CorpusEntry> &out) {
+  std::ifstream in(path);
+  if (!in)
+    return false;
+  size_t slash = path.rfind('/');
+  std::string dir = slash == std::string::npos ? "." : path.substr(0, slash);
+  std::string line;
+  for (int n = 1; std::getline(in, line); ++n) {
+    if (line.find_first_not_of(" \t\r") == std::string::npos)
+      continue;
+    Json j;
+    if (!JsonParser(line).parse(j) || !j.get("prompt")) {
+      fprintf(stderr, "medgemma_bench: %s:%d: not a {\"prompt\": ...} line\n",
+              path.c_str(), n);
+      return false;
+    }
+    CorpusEntry e;
+    e.id = j.string_or("id", "line" + std::to_string(n));
+    e.image_path = j.string_or("image", "");
+    if (!e.image_path.empty() && e.image_path[0] != '/')
+      e.image_path = dir + "/" + e.image_path;
+    e.prompt = wrap_prompt(j.string_or("prompt", ""), !e.image_path.empty());
+    e.max_tokens = (int)j.number_or("max_tokens", 0);
+    out.push_back(e);
+  }
+  return !out.empty();
+}
+
+// ── Statistics ───────────────────────────────────────────────────────────────
+
+static double percentile(std::vector<double> v, double p) {
+  if (v.empty())
+    return 0;
+  std::sort(v.begin(), v.end());
+  double rank = p / 100.0 * (v.size() - 1);
+  size_t lo = (size_t)rank;
+  size_t hi = std::min(lo + 1, v.size() - 1);
+  return v[lo] + (v[hi] - v[lo]) * (rank - lo);
+}
+
+static std::string stats_json(const std::vector<double> &v) {
+  double sum = 0;
+  for (double x : v)
+    sum += x;
+  char buf[256];
+  snprintf(buf, sizeof(buf),
+           "{\"n\":%zu,\"mean\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,"
+           "\"min\":%.3f,\"max\":%.3f}",
+           v.size(), v.empty() ? 0 : sum / v.size(), percentile(v, 50),
+           percentile(v, 90), percentile(v, 99),
+           v.empty() ? 0 : *std::min_element(v.begin(), v.end()),
+           v.empty() ? 0 : *std::max_element(v.begin(), v.end()));
+  return buf;
+}
+
+static double per_second(double count, double ms) {
+  return ms > 0 ? count * 1000.0 / ms : 0;
+}
+
+static double prefill_tok_s(const Result &r) {
+  return per_second(r.t.prompt_tokens, r.t.prefill_ms);
+}
+
+static double decode_tok_s(const Result &r) {
+  return per_second(r.t.decode_steps, r.t.decode_ms);
+}
+
+// ── Runner ───────────────────────────────────────────────────────────────────
+
+struct InFlight {
+  int64_t job;
+  Result result;
+  Clock::time_point submitted, last_output;
+  bool got_output = false;
+};
+
+// Keeps `concurrency` jobs in flight until every queued entry has finished,
+// draining each job's ring the way run_medgemma_inference does.
+static std::vector<Result> run_all(void *engine,
+                                   const std::vector<const CorpusEntry *> &q,
+                                   const std::vector<int> &runs,
+                                   int concurrency, int max_tokens) {
+  std::vector<Result> done;
+  std::vector<InFlight> flying;
+  size_t next = 0;
+  char buf[8192];
+  while (next < q.size() || !flying.empty()) {
+    while ((int)flying.size() < concurrency && next < q.size()) {
+      const CorpusEntry &e = *q[next];
+      MedGemmaJobParams p = {};
+      p.max_tokens = max_tokens > 0 ? max_tokens : e.max_tokens;
+      p.image_path = e.image_path.empty() ? nullptr : e.image_path.c_str();
+      InFlight f;
+      f.result.id = e.id;
+      f.result.run = runs[next];
+      f.submitted = Clock::now();
+      f.job = medgemma_submit(engine, nullptr, 0, e.prompt.c_str(), &p);
+      ++next;
+      if (f.job < 0) {
+        fprintf(stderr, "medgemma_bench: %s rejected\n", e.id.c_str());
+        done.push_back(f.result);
+        continue;
+      }
+      flying.push_back(f);
+    }
+
+    bool moved = false;
+    for (size_t i = 0; i < flying.size();) {
+      InFlight &f = flying[i];
+      int32_t status = medgemma_poll(f.job);
+      int32_t n = medgemma_read(f.job, buf, sizeof(buf));
+      auto now = Clock::now();
+      if (n > 0) {
+        if (!f.got_output)
+          f.result.ttft_ms = ms_between(f.submitted, now);
+        else
+          f.result.max_gap_ms =
+              std::max(f.result.max_gap_ms, ms_between(f.last_output, now));
+        f.got_output = true;
+        f.last_output = now;
+        f.result.output_bytes += n;
+        f.result.text.append(buf, n);
+        moved = true;
+        ++i;
+        continue;
+      }
+      if (status >= 0 && status < JOB_DONE) {
+        ++i;
+        continue;
+      }
+      f.result.status = status;
+      f.result.total_ms = ms_between(f.submitted, now);
+      medgemma_get_job_timings(f.job, &f.result.t);
+      medgemma_release(f.job);
+      const Result &r = f.result;
+      fprintf(stderr,
+              "  %-24s run %d  status %d  ttft %7.0f ms  total %7.0f ms  "
+              "prefill %6.1f tok/s  decode %5.2f tok/s  (%d tok)\n",
+              r.id.c_str(), r.run, r.status, r.ttft_ms, r.total_ms,
+              prefill_tok_s(r), decode_tok_s(r), r.t.generated_tokens);
+      done.push_back(r);
+      flying.erase(flying.begin() + i);
+      moved = true;
+    }
+    if (!moved)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return done;
+}
+
+// ── Pooling agreement ────────────────────────────────────────────────────────
+
+// The first triage level `text` names as a word (red, yellow or green, any
+// case), or "".
+static std::string triage_label(const std::string &text) {
+  std::string lower = text;
+  for (char &c : lower)
+    c = (char)tolower((unsigned char)c);
+  auto word = [&](size_t at, size_t n) {
+    return (at == 0 || !isalpha((unsigned char)lower[at - 1])) &&
+           (at + n == lower.size() || !isalpha((unsigned char)lower[at + n]));
+  };
+  size_t best = std::string::npos;
+  std::string label;
+  for (const char *l : {"red", "yellow", "green"}) {
+    const size_t n = strlen(l);
+    for (size_t at = lower.find(l); at != std::string::npos;
+         at = lower.find(l, at + 1))
+      if (word(at, n)) {
+        if (at < best) {
+          best = at;
+          label = l;
+        }
+        break;
+      }
+  }
+  return label;
+}
+
+// Share of the longer text the two have in common from the start.
+static double prefix_agreement(const std::string &a, const std::string &b) {
+  const size_t longer = std::max(a.size(), b.size());
+  if (longer == 0)
+    return 1;
+  size_t n = 0;
+  while (n < a.size() && n < b.size() && a[n] == b[n])
+    ++n;
+  return (double)n / longer;
+}
+
+struct PoolingSummary {
+  int mode = -1;
+  std::string json;
+  double agreement = 1; // label agreement, or the prefix without labels
+};
+
+// Each mode's image requests against the same request (id and run) under the
+// first mode.
+static std::vector<PoolingSummary>
+pooling_summaries(const std::vector<int> &modes,
+                  const std::vector<Result> &results) {
+  std::vector<PoolingSummary> out;
+  for (int mode : modes) {
+    std::vector<double> ttft, prefill, tokens;
+    int n = 0, exact = 0, labelled = 0, same_label = 0;
+    double prefix = 0;
+    for (const Result &r : results) {
+      if (r.pooling != mode || r.status != JOB_DONE || r.t.image_tokens == 0)
+        continue;
+      const Result *ref = nullptr;
+      for (const Result &o : results)
+        if (o.pooling == modes[0] && o.id == r.id && o.run == r.run &&
+            o.status == JOB_DONE)
+          ref = &o;
+      if (!ref)
+        continue;
+      ++n;
+      ttft.push_back(r.ttft_ms);
+      prefill.push_back(r.t.prefill_ms);
+      tokens.push_back(r.t.image_tokens);
+      exact += r.text == ref->text;
+      prefix += prefix_agreement(ref->text, r.text);
+      const std::string label = triage_label(ref->text);
+      if (!label.empty()) {
+        ++labelled;
+        same_label += triage_label(r.text) == label;
+      }
+    }
+    PoolingSummary s;
+    s.mode = mode;
+    const double prefix_mean = n ? prefix / n : 0;
+    const double label_mean = labelled ? (double)same_label / labelled : 0;
+    s.agreement = labelled ? label_mean : prefix_mean;
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+             "{\"mode\":%d,\"requests\":%d,\"exact\":%.3f,\"prefix\":%.3f,"
+             "\"labelled\":%d,\"label\":%.3f,",
+             mode, n, n ? (double)exact / n : 0, prefix_mean, labelled,
+             label_mean);
+    s.json = std::string(buf) + "\"image_tokens\":" + stats_json(tokens) +
+             ",\"ttft_ms\":" + stats_json(ttft) +
+             ",\"prefill_ms\":" + stats_json(prefill) + "}";
+    out.push_back(s);
+  }
+  return out;
+}
+
+// ── Report ───────────────────────────────────────────────────────────────────
+
+static std::string report_json(const std::string &model,
+                               const std::string &corpus, int runs,
+                               int concurrency, double load_ms,
+                               double rss_after_load, double wall_ms,
+                               const std::vector<Result> &results,
+                               const std::vector<PoolingSummary> &pooling) {
+  std::string out = "{\"tool\":\"medgemma_bench\",\"model\":\"" +
+                    json_escape(model) + "\",\"corpus\":\"" +
+                    json_escape(corpus) + "\"";
+  char buf[512];
+  long generated = 0;
+  for (auto &r : results)
+    generated += r.t.generated_tokens;
+  snprintf(buf, sizeof(buf),
+           ",\"runs\":%d,\"concurrency\":%d,\"load_ms\":%.1f,"
+           "\"rss_after_load_mb\":%.1f,\"peak_rss_mb\":%.1f,"
+           "\"wall_ms\":%.1f,\"generated_tokens\":%ld,"
+           "\"throughput_tok_s\":%.3f",
+           runs, concurrency, load_ms, rss_after_load, peak_rss_mb(), wall_ms,
+           generated, per_second(generated, wall_ms));
+  out += buf;
+
+  out += ",\"requests\":[";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Result &r = results[i];
+    const MedGemmaJobTimings &t = r.t;
+    snprintf(buf, sizeof(buf),
+             "%s{\"id\":\"%s\",\"run\":%d,\"status\":%d,\"ttft_ms\":%.2f,"
+             "\"total_ms\":%.2f,\"max_gap_ms\":%.2f,\"output_bytes\":%zu,"
+             "\"prompt_tokens\":%d,\"image_tokens\":%d,"
+             "\"generated_tokens\":%d,\"image_pooling\":%d,",
+             i ? "," : "", json_escape(r.id).c_str(), r.run, r.status,
+             r.ttft_ms, r.total_ms, r.max_gap_ms, r.output_bytes,
+             t.prompt_tokens, t.image_tokens, t.generated_tokens, r.pooling);
+    out += buf;
+    snprintf(buf, sizeof(buf),
+             "\"prefill_tok_s\":%.3f,\"decode_tok_s\":%.3f,"
+             "\"queue_ms\":%.2f,\"image_ms\":%.2f,\"vision_ms\":%.2f,"
+             "\"embed_ms\":%.2f,\"prefill_ms\":%.2f,\"decode_ms\":%.2f,"
+             "\"prefill_chunks\":%d,\"decode_steps\":%d,"
+             "\"max_batch_seen\":%d,\"vision_peak_mb\":%.1f,"
+             "\"prefill_peak_mb\":%.1f,\"decode_peak_mb\":%.1f,"
+             "\"plan_prefill_chunk\":%d,\"plan_max_tokens\":%d,"
+             "\"plan_peak_mb\":%.1f}",
+             prefill_tok_s(r), decode_tok_s(r), t.queue_ms, t.image_ms,
+             t.vision_ms, t.embed_ms, t.prefill_ms, t.decode_ms,
+             t.prefill_chunks, t.decode_steps, t.max_batch_seen,
+             t.vision_peak_kb / 1024.0, t.prefill_peak_kb / 1024.0,
+             t.decode_peak_kb / 1024.0, t.plan_prefill_chunk,
+             t.plan_max_tokens, t.plan_peak_kb / 1024.0);
+    out += buf;
+  }
+  out += "]";
+
+  // Stage distributions over requests that actually ran the stage.
+  struct Metric {
+    const char *name;
+    double (*get)(const Result &);
+  };
+  static const Metric metrics[] = {
+      {"ttft_ms", [](const Result &r) { return r.ttft_ms; }},
+      {"total_ms", [](const Result &r) { return r.total_ms; }},
+      {"max_gap_ms", [](const Result &r) { return r.max_gap_ms; }},
+      {"prefill_tok_s", prefill_tok_s},
+      {"decode_tok_s", decode_tok_s},
+      {"decode_ms_per_token",
+       [](const Result &r) {
+         return r.t.decode_steps ? r.t.decode_ms / r.t.decode_steps : 0;
+       }},
+      {"queue_ms", [](const Result &r) { return r.t.queue_ms; }},
+      {"image_ms", [](const Result &r) { return r.t.image_ms; }},
+      {"vision_ms", [](const Result &r) { return r.t.vision_ms; }},
+      {"embed_ms", [](const Result &r) { return r.t.embed_ms; }},
+      {"prefill_ms", [](const Result &r) { return r.t.prefill_ms; }},
+      {"decode_ms", [](const Result &r) { return r.t.decode_ms; }},
+  };
+  out += ",\"summary\":{";
+  bool first = true;
+  for (const Metric &m : metrics) {
+    std::vector<double> v;
+    bool image_stage = !strcmp(m.name, "image_ms") ||
+                       !strcmp(m.name, "vision_ms");
+    for (auto &r : results)
+      if (r.status == JOB_DONE && r.pooling == results[0].pooling &&
+          (!image_stage || r.t.image_tokens > 0))
+        v.push_back(m.get(r));
+    out += std::string(first ? "" : ",") + "\"" + m.name +
+           "\":" + stats_json(v);
+    first = false;
+  }
+  out += "}";
+  if (!pooling.empty()) {
+    out += ",\"pooling\":[";
+    for (size_t i = 0; i < pooling.size(); ++i)
+      out += (i ? "," : "") + pooling[i].json;
+    out += "]";
+  }
+  out += "}\n";
+  return out;
+}
+
+static void usage() {
+  fprintf(stderr,
+          "usage: medgemma_bench --model DIR --corpus FILE.jsonl [--runs N]\n"
+          "                      [--warmup N] [--concurrency N]\n"
+          "                      [--max-batch N] [--max-tokens N]\n"
+          "                      [--out FILE] [--log FILE] [--trace DIR]\n"
+          "                      [--image-pooling 0,1,2]"
+          " [--min-agreement F]\n");
+}
+
+int main(int argc, char **argv) {
+  std::string model_dir, corpus_path, out_path, log_path, trace_dir;
+  int runs = 1, warmup = 1, concurrency = 1, max_batch = 0, max_tokens = 0;
+  std::vector<int> poolings = {-1};
+  double min_agreement = 0;
+  for (int i = 1; i < argc; ++i) {
+    std::string a = argv[i];
+    bool has_value = i + 1 < argc;
+    if (a == "--model" && has_value)
+      model_dir = argv[++i];
+    else if (a == "--corpus" && has_value)
+      corpus_path = argv[++i];
+    else if (a == "--runs" && has_value)
+      runs = std::max(1, atoi(argv[++i]));
+    else if (a == "--warmup" && has_value)
+      warmup = std::max(0, atoi(argv[++i]));
+    else if (a == "--concurrency" && has_value)
+      concurrency = std::max(1, atoi(argv[++i]));
+    else if (a == "--max-batch" && has_value)
+      max_batch = atoi(argv[++i]);
+    else if (a == "--max-tokens" && has_value)
+      max_tokens = atoi(argv[++i]);
+    else if (a == "--out" && has_value)
+      out_path = argv[++i];
+    else if (a == "--log" && has_value)
+      log_path = argv[++i];
+    else if (a == "--trace" && has_value)
+      trace_dir = argv[++i];
+    else if (a == "--image-pooling" && has_value) {
+      poolings.clear();
+      for (const char *p = argv[++i]; *p;) {
+        char *end = nullptr;
+        poolings.push_back((int)strtol(p, &end, 10));
+        if (end == p)
+          return usage(), 2;
+        p = *end == ',' ? end + 1 : end;
+      }
+    } else if (a == "--min-agreement" && has_value)
+      min_agreement = atof(argv[++i]);
+    else
+      return usage(), 2;
+  }
+  if (model_dir.empty() || corpus_path.empty())
+    return usage(), 2;
+
+  std::vector<CorpusEntry> corpus;
+  if (!load_corpus(corpus_path, corpus)) {
+    fprintf(stderr, "medgemma_bench: cannot read corpus %s\n",
+            corpus_path.c_str());
+    return 2;
+  }
+  // The engine logs to stderr (and to --log if given); stdout stays JSON.
+  set_log_path(log_path.empty() ? nullptr : log_path.c_str());
+  set_trace_dir(trace_dir.empty() ? nullptr : trace_dir.c_str());
+
+  auto t0 = Clock::now();
+  void *engine = load_medgemma_4bit(model_dir.c_str());
+  double load_ms = ms_between(t0, Clock::now());
+  if (!engine) {
+    fprintf(stderr, "medgemma_bench: failed to load %s\n", model_dir.c_str());
+    return 1;
+  }
+  double rss_after_load = rss_mb();
+  if (max_batch > 0)
+    medgemma_set_max_batch(engine, max_batch);
+  concurrency = std::min(concurrency, 16);
+  fprintf(stderr, "medgemma_bench: loaded in %.0f ms, RSS %.0f MB, %zu "
+                  "corpus entries\n",
+          load_ms, rss_after_load, corpus.size());
+
+  // Warm-up: first requests pay for page faults on the mmap'd weights and
+  // the vision session reload; they are run but not reported.
+  std::vector<const CorpusEntry *> queue;
+  std::vector<int> run_of;
+  for (int i = 0; i < warmup && i < (int)corpus.size(); ++i) {
+    queue.push_back(&corpus[i]);
+    run_of.push_back(0);
+  }
+  if (!queue.empty()) {
+    fprintf(stderr, "warm-up:\n");
+    run_all(engine, queue, run_of, 1, max_tokens);
+  }
+
+  std::vector<Result> results;
+  double wall_ms = 0;
+  for (size_t k = 0; k < poolings.size(); ++k) {
+    queue.clear();
+    run_of.clear();
+    for (int r = 1; r <= runs; ++r)
+      for (auto &e : corpus)
+        if (k == 0 || !e.image_path.empty()) { // pooling only touches images
+          queue.push_back(&e);
+          run_of.push_back(r);
+        }
+    if (poolings[k] >= 0)
+      medgemma_set_image_pooling(poolings[k]);
+    fprintf(stderr, "measured (%d run%s, concurrency %d", runs,
+            runs > 1 ? "s" : "", concurrency);
+    if (poolings[k] >= 0)
+      fprintf(stderr, ", image pooling %d", poolings[k]);
+    fprintf(stderr, "):\n");
+    t0 = Clock::now();
+    for (Result &r : run_all(engine, queue, run_of, concurrency, max_tokens)) {
+      r.pooling = poolings[k];
+      results.push_back(std::move(r));
+    }
+    wall_ms += ms_between(t0, Clock::now());
+  }
+  unload_medgemma(engine);
+
+  std::vector<PoolingSummary> pooling;
+  if (poolings.size() > 1)
+    pooling = pooling_summaries(poolings, results);
+  std::string report =
+      report_json(model_dir, corpus_path, runs, concurrency, load_ms,
+                  rss_after_load, wall_ms, results, pooling);
+  if (out_path.empty()) {
+    fputs(report.c_str(), stdout);
+  } else {
+    FILE *f = fopen(out_path.c_str(), "w");
+    if (!f) {
+      fprintf(stderr, "medgemma_bench: cannot write %s\n", out_path.c_str());
+      return 2;
+    }
+    fputs(report.c_str(), f);
+    fclose(f);
+    fprintf(stderr, "medgemma_bench: results in %s\n", out_path.c_str());
+  }
+  fprintf(stderr, "peak RSS %.0f MB, %.2f tok/s overall\n", peak_rss_mb(),
+          per_second([&] {
+            long n = 0;
+            for (auto &r : results)
+              n += r.t.generated_tokens;
+            return (double)n;
+          }(), wall_ms));
+
+  for (auto &r : results)
+    if (r.status != JOB_DONE)
+      return 1;
+  for (const PoolingSummary &s : pooling) {
+    fprintf(stderr, "image pooling %d: agreement %.3f\n", s.mode,
+            s.agreement);
+    if (s.agreement < min_agreement)
+      return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,518 @@
+// ── medgemma_daemon ──────────────────────────────────────────────────────────
+// Engine host process behind load_medgemma_isolated(). Started by the bridge
+// library with an inherited shared-memory block and socket (medgemma_ipc.h);
+// never run by hand:
+//
+//   medgemma_daemon --model DIR --shm-fd N --sock-fd M [--log FILE]
+//                   [--log-level N] [--kv N] [--trace DIR]
+//                   [--meminfo FILE] [--psi FILE] [--cgroup DIR]
+//                   [--spill DIR]
+//
+// It loads the engine in-process through the regular C API and relays:
+// requests from the app become medgemma_submit()/cancel()/... calls, and a
+// pump thread forwards each job's output and status back as events. When the
+// app closes its end of the socket (unload, or the app itself died) the
+// engine is unloaded and the process exits.
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#include "medgemma_api.h"
+#include "medgemma_ipc.h"
+
+static void *g_engine = nullptr;
+static ipc::Block *g_block = nullptr;
+static int g_sock = -1;
+
+static std::mutex g_event_mutex; // the command and pump threads both write
+static std::atomic<bool> g_app_gone{false};
+
+static std::mutex g_jobs_mutex;
+static std::unordered_map<int64_t, int64_t> g_jobs; // app job ID → engine ID
+// App session ID → engine ID; only the command thread touches it.
+static std::unordered_map<int64_t, int64_t> g_sessions;
+
+static void send_event(uint32_t type, int64_t id, const void *data,
+                       uint32_t len) {
+  // Never fits, however long we wait: callers cap their replies, so this is
+  // a bug, not back-pressure.
+  if (sizeof(ipc::MsgHeader) + len > ipc::EVENT_RING_BYTES) {
+    fprintf(stderr, "medgemma_daemon: event %u of %u bytes dropped\n", type,
+            len);
+    return;
+  }
+  std::lock_guard<std::mutex> lock(g_event_mutex);
+  // A full ring means the app is busy (or stuck in a debugger): wait for it.
+  while (!g_app_gone && !g_block->events.push(type, id, data, len))
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  char b = 1;
+  (void)!send(g_sock, &b, 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+static void send_int(uint32_t type, int64_t id, int32_t value) {
+  send_event(type, id, &value, sizeof(value));
+}
+
+// Makes the kernel / lmkd pick this process before the app under memory
+// pressure: losing the engine is recoverable, losing the UI is not.
+static void prefer_oom_kill() {
+  FILE *f = fopen("/proc/self/oom_score_adj", "r+");
+  if (!f)
+    return;
+  int adj = 0;
+  if (fscanf(f, "%d", &adj) == 1) {
+    rewind(f);
+    fprintf(f, "%d", adj + 300 > 1000 ? 1000 : adj + 300);
+  }
+  fclose(f);
+}
+
+// ── Requests ─────────────────────────────────────────────────────────────────
+
+static void handle_submit(int64_t app_id, const std::vector<uint8_t> &p) {
+  ipc::SubmitMsg msg;
+  if (p.size() < sizeof(msg)) {
+    send_int(ipc::MSG_SUBMITTED, app_id, 0);
+    return;
+  }
+  memcpy(&msg, p.data(), sizeof(msg));
+  const char *strings = reinterpret_cast<const char *>(p.data()) + sizeof(msg);
+  uint64_t at = sizeof(msg) + msg.prompt_len + msg.path_len +
+                uint64_t(msg.token_count) * sizeof(int64_t);
+  std::vector<std::string> labels;
+  for (uint32_t i = 0; i < msg.label_count && at + 4 <= p.size(); ++i) {
+    uint32_t len = 0;
+    memcpy(&len, p.data() + at, sizeof(len));
+    at += sizeof(len);
+    if (at + len > p.size())
+      break;
+    labels.emplace_back(p.begin() + at, p.begin() + at + len);
+    at += len;
+  }
+  if (at != p.size() || labels.size() != msg.label_count ||
+      msg.image_len > ipc::IMAGE_SLAB_BYTES) {
+    send_int(ipc::MSG_SUBMITTED, app_id, 0);
+    return;
+  }
+  std::string prompt(strings, msg.prompt_len);
+  std::string path(strings + msg.prompt_len, msg.path_len);
+  std::vector<int64_t> tokens(msg.token_count);
+  memcpy(tokens.data(), strings + msg.prompt_len + msg.path_len,
+         tokens.size() * sizeof(int64_t));
+  std::vector<const char *> label_ptrs;
+  for (auto &l : labels)
+    label_ptrs.push_back(l.c_str());
+  msg.params.image_path = path.empty() ? nullptr : path.c_str();
+  if (msg.params.session) {
+    // Unknown after a restart too: the app then opens a new one.
+    auto it = g_sessions.find(msg.params.session);
+    if (it == g_sessions.end()) {
+      send_int(ipc::MSG_SUBMITTED, app_id, 0);
+      return;
+    }
+    msg.params.session = it->second;
+  }
+
+  // The engine copies the slab before returning, so the app may reuse it as
+  // soon as MSG_SUBMITTED arrives.
+  const uint8_t *image = msg.image_len ? g_block->image_slab : nullptr;
+  const int image_len = static_cast<int>(msg.image_len);
+  int64_t id;
+  if (!labels.empty())
+    id = medgemma_submit_classify(g_engine, image, image_len, prompt.c_str(),
+                                  label_ptrs.data(),
+                                  static_cast<int32_t>(labels.size()),
+                                  &msg.params);
+  else if (tokens.empty())
+    id = medgemma_submit(g_engine, image, image_len, prompt.c_str(),
+                         &msg.params);
+  else
+    id = medgemma_submit_tokens(g_engine, image, image_len, tokens.data(),
+                                static_cast<int32_t>(tokens.size()),
+                                &msg.params);
+  if (id > 0) {
+    std::lock_guard<std::mutex> lock(g_jobs_mutex);
+    g_jobs[app_id] = id;
+  }
+  send_int(ipc::MSG_SUBMITTED, app_id, id > 0 ? 1 : 0);
+}
+
+// Defines the template the first time its source comes (again after a
+// restart: the app keeps the sources).
+static void handle_template_render(int64_t tag, const std::vector<uint8_t> &p) {
+  ipc::TemplateRenderMsg msg = {};
+  std::vector<std::string> values;
+  bool valid = p.size() >= sizeof(msg);
+  if (valid)
+    memcpy(&msg, p.data(), sizeof(msg));
+  size_t at = sizeof(msg) + msg.source_len;
+  valid = valid && msg.n_values >= 0 && at <= p.size();
+  for (int32_t i = 0; valid && i < msg.n_values; ++i) {
+    uint32_t len = 0;
+    valid = at + sizeof(len) <= p.size();
+    if (valid)
+      memcpy(&len, p.data() + at, sizeof(len));
+    at += sizeof(len);
+    valid = valid && at + len <= p.size();
+    if (valid)
+      values.emplace_back(p.begin() + at, p.begin() + at + len);
+    at += len;
+  }
+  std::vector<int64_t> reply(1, -1); // count, then the IDs
+  if (valid && at == p.size()) {
+    std::string source(p.begin() + sizeof(msg),
+                       p.begin() + sizeof(msg) + msg.source_len);
+    std::vector<const char *> ptrs;
+    for (auto &v : values)
+      ptrs.push_back(v.c_str());
+    // The reply has to fit the event ring; the count still tells the
+    // whole length.
+    const int32_t max = std::min<int32_t>(
+        std::max(msg.max_tokens, 0),
+        ipc::EVENT_RING_BYTES / 4 / sizeof(int64_t));
+    int32_t id = medgemma_template_define(g_engine, source.c_str());
+    reply.resize(1 + max);
+    reply[0] = id < 0 ? -1
+                      : medgemma_template_render(g_engine, id, ptrs.data(),
+                                                 msg.n_values,
+                                                 reply.data() + 1, max);
+    reply.resize(1 + std::max<int64_t>(0, std::min<int64_t>(reply[0], max)));
+  }
+  send_event(ipc::MSG_TOKENS, tag, reply.data(),
+             static_cast<uint32_t>(reply.size() * sizeof(int64_t)));
+}
+
+static void handle_plan_context(int64_t tag, const std::vector<uint8_t> &p) {
+  ipc::PlanContextMsg msg = {};
+  bool valid = p.size() >= sizeof(msg);
+  if (valid)
+    memcpy(&msg, p.data(), sizeof(msg));
+  valid = valid && msg.n_segments >= 0;
+  std::vector<std::string> segments;
+  std::vector<int32_t> fit;
+  size_t at = sizeof(msg);
+  for (int32_t i = 0; valid && i < msg.n_segments; ++i) {
+    int32_t f = 0;
+    uint32_t len = 0;
+    valid = at + sizeof(f) + sizeof(len) <= p.size();
+    if (!valid)
+      break;
+    memcpy(&f, p.data() + at, sizeof(f));
+    memcpy(&len, p.data() + at + sizeof(f), sizeof(len));
+    at += sizeof(f) + sizeof(len);
+    valid = at + len <= p.size();
+    if (valid)
+      segments.emplace_back(p.begin() + at, p.begin() + at + len);
+    fit.push_back(f);
+    at += len;
+  }
+  std::vector<uint8_t> reply;
+  if (valid && at == p.size()) {
+    std::vector<const char *> ptrs;
+    for (auto &s : segments)
+      ptrs.push_back(s.c_str());
+    MedGemmaContextPlan plan = {};
+    std::vector<int32_t> kept(segments.size()), tokens(segments.size());
+    if (medgemma_plan_context(g_engine, ptrs.data(), fit.data(),
+                              msg.n_segments, msg.images, msg.reserve_tokens,
+                              msg.max_prompt_tokens, kept.data(),
+                              tokens.data(), &plan) == 0) {
+      auto put = [&](const void *data, size_t n) {
+        auto bytes = static_cast<const uint8_t *>(data);
+        reply.insert(reply.end(), bytes, bytes + n);
+      };
+      put(&plan, sizeof(plan));
+      put(kept.data(), kept.size() * sizeof(int32_t));
+      put(tokens.data(), tokens.size() * sizeof(int32_t));
+    }
+  }
+  send_event(ipc::MSG_CONTEXT_PLAN, tag, reply.data(),
+             static_cast<uint32_t>(reply.size()));
+}
+
+static void handle_request(const ipc::MsgHeader &h,
+                           const std::vector<uint8_t> &p) {
+  int32_t value = 0;
+  if (p.size() >= sizeof(value))
+    memcpy(&value, p.data(), sizeof(value));
+  switch (h.type) {
+  case ipc::MSG_SUBMIT:
+    handle_submit(h.id, p);
+    break;
+  case ipc::MSG_CANCEL: {
+    std::lock_guard<std::mutex> lock(g_jobs_mutex);
+    auto it = g_jobs.find(h.id);
+    if (it != g_jobs.end())
+      medgemma_cancel(it->second);
+    break;
+  }
+  case ipc::MSG_SET_MAX_BATCH:
+    medgemma_set_max_batch(g_engine, value);
+    break;
+  case ipc::MSG_RESET_VISION:
+    reset_inference_state(g_engine);
+    break;
+  case ipc::MSG_SET_LOG_LEVEL:
+    medgemma_set_log_level(value);
+    break;
+  case ipc::MSG_SET_IMAGE_POOLING:
+    medgemma_set_image_pooling(value);
+    break;
+  case ipc::MSG_SESSION_OPEN: {
+    int32_t sink = 0;
+    if (p.size() >= 2 * sizeof(int32_t))
+      memcpy(&sink, p.data() + sizeof(value), sizeof(sink));
+    int64_t id = medgemma_session_open(g_engine, value, sink);
+    if (id > 0)
+      g_sessions[h.id] = id;
+    break;
+  }
+  case ipc::MSG_SESSION_CLOSE: {
+    auto it = g_sessions.find(h.id);
+    if (it != g_sessions.end()) {
+      medgemma_session_close(g_engine, it->second);
+      g_sessions.erase(it);
+    }
+    break;
+  }
+  case ipc::MSG_SESSION_SAVE:
+  case ipc::MSG_SESSION_LOAD: {
+    int64_t app_session = 0;
+    if (p.size() >= sizeof(app_session))
+      memcpy(&app_session, p.data(), sizeof(app_session));
+    std::string path(p.begin() + std::min(p.size(), sizeof(app_session)),
+                     p.end());
+    int32_t result = -1;
+    if (h.type == ipc::MSG_SESSION_LOAD) {
+      int64_t id = medgemma_session_load(g_engine, path.c_str());
+      if (id > 0) {
+        g_sessions[app_session] = id;
+        result = 0;
+      }
+    } else {
+      auto it = g_sessions.find(app_session);
+      if (it != g_sessions.end())
+        result = medgemma_session_save(g_engine, it->second, path.c_str());
+    }
+    send_int(ipc::MSG_RESULT, h.id, result);
+    break;
+  }
+  case ipc::MSG_SESSION_PUSH: {
+    ipc::SessionPushMsg msg = {};
+    int32_t result = -1;
+    if (p.size() >= sizeof(msg))
+      memcpy(&msg, p.data(), sizeof(msg));
+    auto it = g_sessions.find(msg.session);
+    if (p.size() == sizeof(msg) + msg.text_len &&
+        msg.image_len <= ipc::IMAGE_SLAB_BYTES && it != g_sessions.end()) {
+      std::string text(p.begin() + sizeof(msg), p.end());
+      result = medgemma_session_push(
+          g_engine, it->second, msg.index,
+          msg.has_text ? text.c_str() : nullptr,
+          msg.image_len ? g_block->image_slab : nullptr,
+          static_cast<int32_t>(msg.image_len));
+    }
+    send_int(ipc::MSG_RESULT, h.id, result);
+    break;
+  }
+  case ipc::MSG_TEMPLATE_RENDER:
+    handle_template_render(h.id, p);
+    break;
+  case ipc::MSG_PLAN_CONTEXT:
+    handle_plan_context(h.id, p);
+    break;
+  case ipc::MSG_GET_STATS: {
+    MedGemmaQueueStats stats = {};
+    medgemma_get_queue_stats(g_engine, &stats);
+    send_event(ipc::MSG_STATS, h.id, &stats, sizeof(stats));
+    break;
+  }
+  case ipc::MSG_TOKENIZE: {
+    // Count first, then as many IDs as were asked for and fit the ring.
+    std::vector<int64_t> reply(1, 0);
+    if (p.size() >= sizeof(value) && value > 0) {
+      std::string text(p.begin() + sizeof(value), p.end());
+      // No token is shorter than a byte; room for BOS and EOS besides.
+      std::vector<int64_t> tokens(text.size() + 2);
+      int n = medgemma_tokenize(g_engine, text.c_str(), tokens.data(),
+                                static_cast<int>(tokens.size()));
+      const int32_t max = std::min<int32_t>(
+          value, ipc::EVENT_RING_BYTES / 4 / sizeof(int64_t));
+      reply[0] = n;
+      reply.insert(reply.end(), tokens.begin(),
+                   tokens.begin() + std::min<int>(n, max));
+    }
+    send_event(ipc::MSG_TOKENS, h.id, reply.data(),
+               static_cast<uint32_t>(reply.size() * sizeof(int64_t)));
+    break;
+  }
+  default:
+    fprintf(stderr, "medgemma_daemon: unknown request %u\n", h.type);
+  }
+}
+
+// ── Output pump ──────────────────────────────────────────────────────────────
+// Drains every job's ring like run_medgemma_inference does, forwarding text as
+// it comes and the terminal status once the ring is empty.
+
+static void pump_loop(const std::atomic<bool> *stop) {
+  std::unordered_map<int64_t, int32_t> last_status;
+  char buf[4096];
+  while (!*stop) {
+    std::vector<std::pair<int64_t, int64_t>> jobs;
+    {
+      std::lock_guard<std::mutex> lock(g_jobs_mutex);
+      jobs.assign(g_jobs.begin(), g_jobs.end());
+    }
+    bool moved = false;
+    for (auto &job : jobs) {
+      int64_t app_id = job.first, id = job.second;
+      // Poll before reading: after a terminal status an empty read means done.
+      int32_t status = medgemma_poll(id);
+      int32_t n = medgemma_read(id, buf, sizeof(buf));
+      if (n > 0) {
+        send_event(ipc::MSG_TEXT, app_id, buf, static_cast<uint32_t>(n));
+        moved = true;
+        continue;
+      }
+      if (status < 0 || status >= JOB_DONE) {
+        ipc::StatusMsg done = {};
+        done.status = status < 0 ? JOB_FAILED : status;
+        medgemma_get_job_timings(id, &done.timings);
+        done.classification.label = -1;
+        medgemma_get_classification(id, &done.classification);
+        send_event(ipc::MSG_STATUS, app_id, &done, sizeof(done));
+        medgemma_release(id);
+        last_status.erase(app_id);
+        std::lock_guard<std::mutex> lock(g_jobs_mutex);
+        g_jobs.erase(app_id);
+        moved = true;
+      } else if (last_status[app_id] != status) {
+        last_status[app_id] = status;
+        send_int(ipc::MSG_STATUS, app_id, status);
+      }
+    }
+    if (!moved)
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  }
+}
+
+// ── Main ─────────────────────────────────────────────────────────────────────
+
+int main(int argc, char **argv) {
+  std::string model_dir, log_path, trace_dir, meminfo, psi, cgroup;
+  int shm_fd = -1;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string a = argv[i];
+    if (a == "--model")
+      model_dir = argv[i + 1];
+    else if (a == "--shm-fd")
+      shm_fd = atoi(argv[i + 1]);
+    else if (a == "--sock-fd")
+      g_sock = atoi(argv[i + 1]);
+    else if (a == "--log")
+      log_path = argv[i + 1];
+    else if (a == "--log-level")
+      medgemma_set_log_level(atoi(argv[i + 1]));
+    else if (a == "--kv")
+      medgemma_set_kv_precision(atoi(argv[i + 1]));
+    else if (a == "--image-pooling")
+      medgemma_set_image_pooling(atoi(argv[i + 1]));
+    else if (a == "--trace")
+      trace_dir = argv[i + 1];
+    else if (a == "--meminfo")
+      meminfo = argv[i + 1];
+    else if (a == "--psi")
+      psi = argv[i + 1];
+    else if (a == "--cgroup")
+      cgroup = argv[i + 1];
+    else if (a == "--spill")
+      medgemma_set_spill_dir(argv[i + 1]);
+  }
+  if (model_dir.empty() || shm_fd < 0 || g_sock < 0) {
+    fprintf(stderr, "medgemma_daemon: started by libmedgemma_bridge only\n");
+    return 2;
+  }
+#ifdef __linux__
+  prctl(PR_SET_PDEATHSIG, SIGKILL); // never outlive the app
+#endif
+  void *base = mmap(nullptr, ipc::block_size(), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, shm_fd, 0);
+  if (base == MAP_FAILED) {
+    perror("medgemma_daemon: mmap");
+    return 2;
+  }
+  close(shm_fd);
+  ipc::Block block(base);
+  if (!block.valid()) {
+    fprintf(stderr, "medgemma_daemon: bad shared memory block\n");
+    return 2;
+  }
+  g_block = &block;
+  fcntl(g_sock, F_SETFD, FD_CLOEXEC);
+  fcntl(g_sock, F_SETFL, fcntl(g_sock, F_GETFL) | O_NONBLOCK);
+  prefer_oom_kill();
+
+  if (!log_path.empty())
+    set_log_path(log_path.c_str());
+  if (!trace_dir.empty())
+    set_trace_dir(trace_dir.c_str());
+  medgemma_set_memory_paths(meminfo.c_str(), psi.c_str(), cgroup.c_str());
+  g_engine = load_medgemma_4bit(model_dir.c_str());
+  if (!g_engine)
+    return 3;
+  send_int(ipc::MSG_READY, 0, static_cast<int32_t>(getpid()));
+
+  std::atomic<bool> stop{false};
+  std::thread pump(pump_loop, &stop);
+  std::vector<uint8_t> payload;
+  ipc::MsgHeader h;
+  for (bool open = true; open;) {
+    pollfd pfd = {g_sock, POLLIN, 0};
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+      break;
+    char drain[256];
+    for (;;) {
+      ssize_t n = recv(g_sock, drain, sizeof(drain), 0);
+      if (n > 0)
+        continue;
+      if (n == 0 || (errno != EAGAIN && errno != EINTR))
+        open = false;
+      break;
+    }
+    ipc::PopResult got = ipc::POP_EMPTY;
+    while (open && (got = block.requests.pop(h, payload)) == ipc::POP_OK)
+      handle_request(h, payload);
+    if (got == ipc::POP_CORRUPT) {
+      fprintf(stderr, "medgemma_daemon: corrupt request ring, exiting\n");
+      open = false;
+    }
+  }
+
+  // The app is gone or unloading: cancel everything, then exit.
+  g_app_gone = true;
+  unload_medgemma(g_engine);
+  stop = true;
+  pump.join();
+  return 0;
+}
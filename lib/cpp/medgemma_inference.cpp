@@ -3,12 +3,18 @@
  */
 
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <chrono>
 #include <cmath>
+#include <condition_variable>
 #include <cstdarg>
 #include <cstdio>
 #include <cstring>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <numeric>
@@ -20,6 +26,10 @@
 
 #include <onnxruntime_cxx_api.h>
 
+#include "medgemma_api.h"
+#include "medgemma_ipc.h"
+#include "medgemma_json.h"
+
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_RESIZE_IMPLEMENTATION
 #include "stb_image.h"
@@ -27,6 +37,24 @@
 
 #include <ort_genai.h>
 
+#ifdef _WIN32
+#include <io.h>      // _get_osfhandle
+#include <process.h> // _getpid
+#include <windows.h>
+#else
+#include <dlfcn.h> // dladdr (locating medgemma_daemon)
+#include <fcntl.h>
+#include <malloc.h> // malloc_trim
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
 #ifdef ANDROID
 #include <android/log.h>
 #include <sched.h>        // sched_setscheduler
@@ -38,54 +66,203 @@
 // platform sink (logcat / stderr) AND a file on disk so you can read them from
 // Flutter without adb. Call set_log_path() from Dart right after loading the
 // library.
+//
+// Logging never blocks the caller: a line is formatted straight into a slot
+// of a lock-free ring and a background thread writes the batch to both sinks
+// with one fflush, so a decode step never waits on flash (cheap eMMC stalls
+// for tens of ms). Lines below the level set with medgemma_set_log_level are
+// skipped before their arguments are even evaluated, and building with
+// MEDGEMMA_NO_DEBUG_LOG compiles LOGD out entirely. If the ring is full the
+// line is dropped and counted rather than waited for. Errors wake the writer
+// at once; everything else reaches the file within LOG_FLUSH_MS.
 
 static FILE *g_log_file = nullptr;
-static std::mutex g_log_mutex;
+static std::string g_log_path; // handed to medgemma_daemon
+static std::mutex g_log_mutex; // sinks and paths; never taken by a producer
+static std::atomic<int> g_log_level{MEDGEMMA_LOG_INFO};
 
-static void write_log(const char *level, const char *fmt, va_list args) {
-  std::lock_guard<std::mutex> lock(g_log_mutex);
+const int LOG_FLUSH_MS = 50;
 
-  char buf[1024];
-  vsnprintf(buf, sizeof(buf), fmt, args);
+// Bounded multi-producer / single-consumer ring (Vyukov): each slot's
+// sequence number says whether it is free for the producer at `pos` or holds
+// a line for the consumer at `pos`.
+class LogRing {
+public:
+  static const size_t SLOTS = 512; // × 1 KB, about half a MB
+  static const size_t TEXT = 1024;  // the line limit before the ring
 
-  // Write to file if path was set
-  if (g_log_file) {
-    fprintf(g_log_file, "[%s] %s\n", level, buf);
-    fflush(g_log_file);
+  struct Slot {
+    std::atomic<size_t> seq;
+    int level;
+    char text[TEXT];
+  };
+
+  LogRing() {
+    for (size_t i = 0; i < SLOTS; ++i)
+      slots_[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  // False if the ring is full.
+  bool push(int level, const char *fmt, va_list args) {
+    size_t pos = head_.load(std::memory_order_relaxed);
+    Slot *slot;
+    for (;;) {
+      slot = &slots_[pos % SLOTS];
+      size_t seq = slot->seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0 && head_.compare_exchange_weak(pos, pos + 1,
+                                                   std::memory_order_relaxed))
+        break;
+      if (diff < 0)
+        return false;
+      if (diff > 0)
+        pos = head_.load(std::memory_order_relaxed);
+    }
+    slot->level = level;
+    vsnprintf(slot->text, TEXT, fmt, args);
+    slot->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side (caller holds g_log_mutex). Null when empty; call done()
+  // once the slot has been written out.
+  Slot *front() {
+    Slot *slot = &slots_[tail_ % SLOTS];
+    return slot->seq.load(std::memory_order_acquire) == tail_ + 1 ? slot
+                                                                  : nullptr;
+  }
+  void done(Slot *slot) {
+    slot->seq.store(tail_ + SLOTS, std::memory_order_release);
+    ++tail_;
   }
 
+  std::atomic<uint64_t> dropped{0};
+
+private:
+  Slot slots_[SLOTS];
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) size_t tail_ = 0;
+};
+
+static const char *level_name(int level) {
+  return level >= MEDGEMMA_LOG_ERROR  ? "ERROR"
+         : level == MEDGEMMA_LOG_INFO ? "INFO"
+                                      : "DEBUG";
+}
+
+static void emit_line(int level, const char *text) {
+  if (g_log_file)
+    fprintf(g_log_file, "[%s] %s\n", level_name(level), text);
 #ifdef ANDROID
-  int prio = (level[0] == 'E')   ? ANDROID_LOG_ERROR
-             : (level[0] == 'D') ? ANDROID_LOG_DEBUG
-                                 : ANDROID_LOG_INFO;
-  __android_log_print(prio, "MedGemma", "%s", buf);
+  int prio = level >= MEDGEMMA_LOG_ERROR  ? ANDROID_LOG_ERROR
+             : level == MEDGEMMA_LOG_INFO ? ANDROID_LOG_INFO
+                                          : ANDROID_LOG_DEBUG;
+  __android_log_print(prio, "MedGemma", "%s", text);
 #else
-  fprintf(stderr, "[%s] %s\n", level, buf);
+  fprintf(stderr, "[%s] %s\n", level_name(level), text);
 #endif
 }
 
+// The ring and its writer thread. Heap-allocated and never freed, like the
+// deadline watchdog; an atexit hook drains what is left.
+struct AsyncLog {
+  LogRing ring;
+  std::mutex wake_mutex;
+  std::condition_variable wake;
+
+  // Writes out everything queued. Caller holds g_log_mutex.
+  void drain_locked() {
+    bool wrote = false;
+    while (LogRing::Slot *slot = ring.front()) {
+      emit_line(slot->level, slot->text);
+      ring.done(slot);
+      wrote = true;
+    }
+    if (uint64_t n = ring.dropped.exchange(0)) {
+      char note[64];
+      snprintf(note, sizeof(note), "%llu log lines dropped (ring full)",
+               (unsigned long long)n);
+      emit_line(MEDGEMMA_LOG_ERROR, note);
+      wrote = true;
+    }
+    if (wrote && g_log_file)
+      fflush(g_log_file);
+  }
+
+  void drain() {
+    std::lock_guard<std::mutex> lock(g_log_mutex);
+    drain_locked();
+  }
+
+  void loop() {
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(wake_mutex);
+        wake.wait_for(lock, std::chrono::milliseconds(LOG_FLUSH_MS));
+      }
+      drain();
+    }
+  }
+};
+
+static AsyncLog &async_log() {
+  static AsyncLog *log = [] {
+    auto *l = new AsyncLog;
+    std::thread([l] { l->loop(); }).detach();
+    atexit([] { async_log().drain(); });
+    return l;
+  }();
+  return *log;
+}
+
+static bool log_enabled(int level) {
+  return level >= g_log_level.load(std::memory_order_relaxed);
+}
+
+static void write_log(int level, const char *fmt, va_list args) {
+  AsyncLog &log = async_log();
+  if (!log.ring.push(level, fmt, args))
+    log.ring.dropped++;
+  else if (level >= MEDGEMMA_LOG_ERROR)
+    log.wake.notify_one();
+}
+
 static void log_i(const char *fmt, ...) {
   va_list a;
   va_start(a, fmt);
-  write_log("INFO", fmt, a);
+  write_log(MEDGEMMA_LOG_INFO, fmt, a);
   va_end(a);
 }
 static void log_e(const char *fmt, ...) {
   va_list a;
   va_start(a, fmt);
-  write_log("ERROR", fmt, a);
+  write_log(MEDGEMMA_LOG_ERROR, fmt, a);
   va_end(a);
 }
 static void log_d(const char *fmt, ...) {
   va_list a;
   va_start(a, fmt);
-  write_log("DEBUG", fmt, a);
+  write_log(MEDGEMMA_LOG_DEBUG, fmt, a);
   va_end(a);
 }
 
-#define LOGI(...) log_i(__VA_ARGS__)
-#define LOGE(...) log_e(__VA_ARGS__)
-#define LOGD(...) log_d(__VA_ARGS__)
+#define LOG_AT(level, fn, ...)                                                 \
+  do {                                                                         \
+    if (log_enabled(level))                                                    \
+      fn(__VA_ARGS__);                                                         \
+  } while (0)
+#define LOGI(...) LOG_AT(MEDGEMMA_LOG_INFO, log_i, __VA_ARGS__)
+#define LOGE(...) LOG_AT(MEDGEMMA_LOG_ERROR, log_e, __VA_ARGS__)
+#ifdef MEDGEMMA_NO_DEBUG_LOG
+// Still type-checks the arguments, but the call is dead code.
+#define LOGD(...)                                                              \
+  do {                                                                         \
+    if (false)                                                                 \
+      log_d(__VA_ARGS__);                                                      \
+  } while (0)
+#else
+#define LOGD(...) LOG_AT(MEDGEMMA_LOG_DEBUG, log_d, __VA_ARGS__)
+#endif
 // ─────────────────────────────────────────────────────────────────────────────
 
 #ifdef _WIN32
@@ -94,14 +271,42 @@ static void log_d(const char *fmt, ...) {
 #define EXPORT __attribute__((visibility("default"))) __attribute__((used))
 #endif
 
-typedef void (*TokenCallback)(const char *);
-
 const std::vector<int64_t> EOS_IDS = {1, 106};
 // IMG_TOKEN_ID removed — now discovered dynamically per model (see
 // MedGemmaState::image_token_id)
 const int num_patches = 256;
 const int embed_dim = 2560;
 
+// Decoder geometry of the Gemma3 4B text stack (see model.onnx inputs).
+const int num_layers = 34;
+const int kv_heads = 4;
+const int head_dim = 256;
+const int64_t vocab_size = 262144; // logits width
+
+// Rotary position embeddings: five sliding-window layers with base 10k, then
+// one global layer with base 1M and positions scaled down 8×. The cache holds
+// keys already rotated for their position (see kv_evict).
+const int rope_global_every = 6; // layers 5, 11, 17, …
+const double rope_local_base = 10000.0;
+const double rope_global_base = 1000000.0;
+const double rope_global_scale = 8.0;
+
+// Problem: sending all 174 prompt tokens at once produces logits
+// {1,174,262144} = 182 MB on Android. Solution: chunk prefill, each chunk
+// producing only {1,CHUNK,262144} logits; all but the last chunk's final
+// token logits are discarded. The chunk is chosen per request by the memory
+// planner (plan_request); PREFILL_CHUNK is its default where memory is
+// unknown.
+const int PREFILL_CHUNK = 16; // 16 tokens × 262144 × 4 = 16.8 MB per chunk
+
+// Concurrent requests per engine (medgemma_set_max_batch). Phones keep the
+// single-request RAM profile; desktops serving a clinic batch a few users.
+#ifdef ANDROID
+const int DEFAULT_MAX_BATCH = 1;
+#else
+const int DEFAULT_MAX_BATCH = 4;
+#endif
+
 Ort::Value create_tensor(const std::vector<int64_t> &data,
                          const std::vector<int64_t> &shape,
                          const Ort::MemoryInfo &mem) {
@@ -248,212 +453,5045 @@ struct OgaTokenizerDeleter {
   }
 };
 
-class MedGemmaState {
-public:
-  std::string model_dir;
-  std::unique_ptr<Ort::Env> env;
-  std::unique_ptr<Ort::SessionOptions> session_options;
-  std::unique_ptr<Ort::SessionOptions>
-      vision_session_options; // lower RAM for vision encoder
-  std::unique_ptr<Ort::Session> v_sess, p_sess, e_sess, m_sess;
-  std::unique_ptr<OgaTokenizer, OgaTokenizerDeleter> tokenizer;
-  Ort::MemoryInfo memory_info;
-  int64_t image_token_id =
-      -1; // discovered at load time by tokenizing "<image>"
+// ── Clocks ───────────────────────────────────────────────────────────────────
 
-  MedGemmaState(const char *path)
-      : model_dir(path), memory_info(Ort::MemoryInfo::CreateCpu(
-                             OrtArenaAllocator, OrtMemTypeDefault)) {
-    LOGI("Loading MedGemma from: %s", path);
-    env = std::make_unique<Ort::Env>(ORT_LOGGING_LEVEL_WARNING, "MedGemma");
-    session_options = std::make_unique<Ort::SessionOptions>();
+static double ms_since(std::chrono::steady_clock::time_point t) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - t)
+      .count();
+}
 
-    // ── LLM session: prioritize low peak RAM over speed ──────────────
-    // int4 Gemma-2 dequantizes weights to fp32 during compute. With parallel
-    // threads, multiple layers dequantize simultaneously = ~480 MB spike.
-    // Single-threaded sequential execution cuts peak by ~60-70%.
-    session_options->SetIntraOpNumThreads(1);
-    session_options->SetInterOpNumThreads(1);
-    session_options->SetExecutionMode(ExecutionMode::ORT_SEQUENTIAL);
-    session_options->SetGraphOptimizationLevel(
-        GraphOptimizationLevel::ORT_ENABLE_BASIC);
-    session_options->AddConfigEntry("session.use_mmap", "1");
-    session_options->DisableMemPattern();
-    session_options->DisableCpuMemArena(); // free buffers immediately, don't
-                                           // cache in arena
+// Resident set of this process in KB (0 where /proc is unavailable). Cheap
+// enough to sample between stages: one small read from procfs.
+static int64_t rss_kb() {
+#ifdef _WIN32
+  return 0;
+#else
+  long pages = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (!f)
+    return 0;
+  if (fscanf(f, "%*s %ld", &pages) != 1)
+    pages = 0;
+  fclose(f);
+  return (int64_t)pages * (sysconf(_SC_PAGESIZE) / 1024);
+#endif
+}
 
-    // ── Vision-specific session options (lower RAM footprint) ───────────
-    vision_session_options = std::make_unique<Ort::SessionOptions>();
-    vision_session_options->SetIntraOpNumThreads(
-        2); // fewer threads = less parallel RAM
-    vision_session_options->SetGraphOptimizationLevel(
-        GraphOptimizationLevel::ORT_ENABLE_BASIC);
-    vision_session_options->AddConfigEntry("session.use_mmap", "1");
-    vision_session_options
-        ->DisableMemPattern(); // don't pre-allocate memory pattern
-    vision_session_options
-        ->DisableCpuMemArena(); // release memory immediately after use
-    vision_session_options->SetExecutionMode(
-        ExecutionMode::ORT_SEQUENTIAL); // sequential = less peak RAM
+static void note_rss(MedGemmaJobTimings &t) {
+  t.rss_end_kb = rss_kb();
+  t.rss_peak_kb = std::max(t.rss_peak_kb, t.rss_end_kb);
+}
 
-    OgaConfig *config = nullptr;
-    if (OgaCreateConfig(path, &config) == 0) {
-      OgaModel *temp_model = nullptr;
-      if (OgaCreateModelFromConfig(config, &temp_model) == 0) {
-        OgaTokenizer *tok = nullptr;
-        if (OgaCreateTokenizer(temp_model, &tok) == 0) {
-          tokenizer.reset(tok);
-          LOGI("Tokenizer loaded OK");
+// ── Tracing ──────────────────────────────────────────────────────────────────
+// Opt-in timeline of where a request's time goes (set_trace_dir before load).
+// The scheduler records the engine's own spans — image preprocessing, every
+// session Run, sampling, detokenizing and output callbacks — on one track per
+// job, and every ORT session profiles its operators. unload_medgemma merges
+// both into one Chrome trace JSON that chrome://tracing and ui.perfetto.dev
+// open directly, so the int4 decoder's ops and the host gaps between steps sit
+// on the same clock. With tracing off a span costs a thread-local load.
+static std::string g_trace_dir; // guarded by g_log_mutex, like g_log_path
 
-          // ── Discover the image token ID ──────────────────────────────
-          // Do NOT hardcode — the actual ID depends on the tokenizer vocab.
-          // We tokenize the literal string "<image>" and take the first token
-          // that isn't BOS (token 2) as the image placeholder token.
-          const char *img_probe = "<image>";
-          OgaSequences *img_seq = nullptr;
-          OgaCreateSequences(&img_seq);
-          if (OgaTokenizerEncode(tok, img_probe, img_seq) == 0) {
-            size_t img_count = OgaSequencesGetSequenceCount(img_seq, 0);
-            const int32_t *img_data = OgaSequencesGetSequenceData(img_seq, 0);
-            LOGI("<image> tokenizes to %zu token(s):", img_count);
-            for (size_t ti = 0; ti < img_count; ++ti)
-              LOGI("  [%zu] = %d", ti, img_data[ti]);
-            // Take first non-BOS token as the image placeholder
-            for (size_t ti = 0; ti < img_count; ++ti) {
-              if (img_data[ti] != 2) { // 2 = BOS in Gemma vocab
-                image_token_id = static_cast<int64_t>(img_data[ti]);
-                break;
-              }
-            }
-          }
-          OgaDestroySequences(img_seq);
-          if (image_token_id < 0) {
-            // Fallback to known MedGemma value if probe failed
-            image_token_id = 255999;
-            LOGE("<image> token discovery failed — using fallback id=255999");
-          }
-          LOGI("Image token ID: %lld", image_token_id);
-        } else {
-          LOGE("OgaCreateTokenizer FAILED");
-        }
-        OgaDestroyModel(temp_model);
-      } else {
-        LOGE("OgaCreateModelFromConfig FAILED");
-      }
-      OgaDestroyConfig(config);
-    } else {
-      LOGE("OgaCreateConfig FAILED: %s", path);
-    }
+using TraceClock = std::chrono::high_resolution_clock; // ORT's profiler clock
 
-    auto load = [&](const std::string &p, Ort::SessionOptions &opts) {
-      LOGI("Loading session: %s", p.c_str());
-      return std::make_unique<Ort::Session>(*env, p.c_str(), opts);
-    };
-    // Vision encoder + projection use memory-conservative options
-    v_sess = load(model_dir + "/vision_encoder.ort", *vision_session_options);
-    p_sess =
-        load(model_dir + "/vision_projection.ort", *vision_session_options);
-    // Text sessions use standard options
-    e_sess = load(model_dir + "/embeddings.ort", *session_options);
-    m_sess = load(model_dir + "/model.onnx", *session_options);
-    LOGI("All sessions loaded OK");
-  }
-};
+static int64_t trace_us(TraceClock::time_point t) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             t.time_since_epoch())
+      .count();
+}
 
-// ── Image processing
-// ────────────────────────────────────────────────────────── Memory layout
-// during this call (all freed before returning):
-//   raw JPEG buffer  : owned by caller, not freed here
-//   stb decoded img  : ~w*h*3 bytes  → freed with stbi_image_free()
-//   resized buffer   : 896*896*3 = 2.35 MB (vector, freed at end of scope)
-//   pixel_values     : 896*896*3*4 = 9.2 MB float (returned, freed by caller)
-// Peak usage while both resized + pixel_values exist: ~11.6 MB
-// After return only pixel_values remains until vision encoder runs.
-std::vector<float> process_image_bytes(const uint8_t *data, size_t len,
-                                       std::string &error_out) {
-  error_out.clear();
-  LOGD("process_image_bytes: %zu bytes input", len);
+// Spans are recorded on the scheduler thread only; profiles are collected
+// there too (vision sessions dropped mid-run) and by unload after the join.
+class Tracer {
+public:
+  explicit Tracer(std::string dir)
+      : dir_(std::move(dir)), origin_us_(trace_us(TraceClock::now())) {}
 
-  if (!data || len == 0) {
-    error_out = "[IMG_ERR] Input is null or empty";
-    LOGE("%s", error_out.c_str());
-    return {};
-  }
+  const std::string &dir() const { return dir_; }
 
-  // ── Decode ────────────────────────────────────────────────────────
-  int w = 0, h = 0, c = 0;
-  uint8_t *img = stbi_load_from_memory(reinterpret_cast<const stbi_uc *>(data),
-                                       static_cast<int>(len), &w, &h, &c, 3);
+  // `args` is the body of a JSON object ("\"k\":1"), may be empty.
+  void span(const char *name, int64_t track, TraceClock::time_point start,
+            std::string args = "") {
+    int64_t ts = trace_us(start);
+    events_.push_back({name, track, ts - origin_us_,
+                       trace_us(TraceClock::now()) - ts, std::move(args)});
+  }
 
-  if (!img) {
-    const char *reason = stbi_failure_reason();
-    error_out = std::string("[IMG_ERR] Decode failed: ") +
-                (reason ? reason : "unknown");
-    LOGE("%s", error_out.c_str());
-    return {};
+  // Ends the session's operator profile; call before destroying it.
+  void end_session(Ort::Session &sess, const char *label) {
+    try {
+      int64_t start_us = (int64_t)(sess.GetProfilingStartTimeNs() / 1000);
+      Ort::AllocatorWithDefaultOptions alloc;
+      auto path = sess.EndProfilingAllocated(alloc);
+      profiles_.push_back({label, path.get(), start_us - origin_us_});
+    } catch (const std::exception &e) {
+      LOGE("trace: no ORT profile for %s: %s", label, e.what());
+    }
   }
-  LOGD("Decoded OK: %dx%d ch=%d (%.1f KB)", w, h, c, (w * h * 3) / 1024.0f);
 
-  // ── Resize to 896x896 ─────────────────────────────────────────────
-  const int TARGET = 896;
-  std::vector<float> pixel_values; // declared here so we can return it
+  // Writes the merged trace and deletes ORT's per-session files. Returns the
+  // trace path, "" on failure.
+  std::string write() {
+    char name[96];
+#ifdef _WIN32
+    int pid = _getpid();
+#else
+    int pid = getpid();
+#endif
+    snprintf(name, sizeof(name), "/medgemma_trace_%d_%lld.json", pid,
+             (long long)(origin_us_ / 1000000));
+    std::string path = dir_ + name;
+    FILE *out = fopen(path.c_str(), "w");
+    if (!out) {
+      LOGE("trace: cannot write %s: %s", path.c_str(), strerror(errno));
+      return "";
+    }
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", out);
+    fputs("{\"ph\":\"M\",\"pid\":1,\"name\":\"process_name\","
+          "\"args\":{\"name\":\"MedGemma engine\"}}",
+          out);
+    std::vector<int64_t> tracks;
+    for (const Event &e : events_)
+      if (std::find(tracks.begin(), tracks.end(), e.track) == tracks.end())
+        tracks.push_back(e.track);
+    for (int64_t t : tracks)
+      fprintf(out,
+              ",\n{\"ph\":\"M\",\"pid\":1,\"tid\":%lld,"
+              "\"name\":\"thread_name\",\"args\":{\"name\":\"%s\"}}",
+              (long long)t,
+              t ? ("job " + std::to_string(t)).c_str() : "scheduler");
+    for (const Event &e : events_)
+      fprintf(out,
+              ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%lld,\"name\":\"%s\","
+              "\"ts\":%lld,\"dur\":%lld,\"args\":{%s}}",
+              (long long)e.track, e.name, (long long)e.ts_us,
+              (long long)e.dur_us, e.args.c_str());
+    size_t ort_events = 0;
+    std::vector<std::string> labels;
+    for (const Profile &p : profiles_) {
+      auto it = std::find(labels.begin(), labels.end(), p.label);
+      int pid = 2 + (int)(it - labels.begin());
+      if (it == labels.end()) {
+        labels.push_back(p.label);
+        fprintf(out,
+                ",\n{\"ph\":\"M\",\"pid\":%d,\"name\":\"process_name\","
+                "\"args\":{\"name\":\"onnxruntime %s\"}}",
+                pid, p.label.c_str());
+      }
+      ort_events += copy_profile(p, pid, out);
+    }
+    fputs("\n]}\n", out);
+    bool ok = !ferror(out);
+    fclose(out);
+    if (!ok)
+      return "";
+    LOGI("trace: %zu engine spans + %zu ORT events → %s", events_.size(),
+         ort_events, path.c_str());
+    return path;
+  }
 
-  {
-    // Inner scope: resized buffer lives here and is freed when scope exits,
-    // BEFORE pixel_values is fully populated — keeps peak RAM lower.
-    std::vector<uint8_t> resized(static_cast<size_t>(TARGET * TARGET * 3));
+private:
+  struct Event {
+    const char *name; // string literal
+    int64_t track;    // job ID, 0 = scheduler
+    int64_t ts_us, dur_us;
+    std::string args;
+  };
+  struct Profile {
+    std::string label, path;
+    int64_t start_us; // ORT's ts origin on the trace clock
+  };
 
-    // stbir_resize_uint8_linear returns uint8_t* NOT int — must store as
-    // pointer
-    uint8_t *ok = stbir_resize_uint8_linear(img, w, h, 0, resized.data(),
-                                            TARGET, TARGET, 0, STBIR_RGB);
+  // ORT writes one event per line ("[", "{...},", ..., "]"), so even a long
+  // run's profile is streamed rather than parsed whole. Events move to `pid`
+  // and onto the trace clock; everything else is kept.
+  size_t copy_profile(const Profile &p, int pid, FILE *out) {
+    FILE *in = fopen(p.path.c_str(), "r");
+    if (!in)
+      return 0;
+    size_t n = 0;
+    std::string line, buf;
+    char chunk[4096];
+    while (fgets(chunk, sizeof(chunk), in)) {
+      line += chunk;
+      if (line.back() != '\n' && !feof(in))
+        continue; // longer than the chunk
+      while (!line.empty() && strchr(",\r\n ", line.back()))
+        line.pop_back();
+      Json ev;
+      if (!line.empty() && line[0] == '{' && JsonParser(line).parse(ev) &&
+          ev.type == Json::OBJ) {
+        ev.obj["pid"].num = pid;
+        ev.obj["ts"].num = ev.number_or("ts", 0) + (double)p.start_us;
+        buf.clear();
+        json_dump(ev, buf);
+        fprintf(out, ",\n%s", buf.c_str());
+        ++n;
+      }
+      line.clear();
+    }
+    fclose(in);
+    remove(p.path.c_str());
+    return n;
+  }
 
-    stbi_image_free(img); // free decoded image immediately after resize
-    img = nullptr;
+  std::string dir_;
+  int64_t origin_us_;
+  std::vector<Event> events_;
+  std::vector<Profile> profiles_;
+};
 
-    if (ok == nullptr) {
-      error_out = "[IMG_ERR] Resize failed (stbir returned null)";
-      LOGE("%s", error_out.c_str());
-      return {};
-    }
-    LOGD("Resized to %dx%d (%.1f KB)", TARGET, TARGET,
-         (TARGET * TARGET * 3) / 1024.0f);
+// The calling thread's tracer (its engine's, set by scheduler_loop) and the
+// track new spans go to: the job whose unit is running, 0 for shared steps.
+static thread_local Tracer *t_tracer = nullptr;
+static thread_local int64_t t_trace_track = 0;
 
-    // ── HWC uint8 → CHW float32, SigLIP normalization ────────────────
-    // SigLIP (MedGemma's vision encoder) expects (value/255 - mean) / std
-    // with mean=[0.5,0.5,0.5] and std=[0.5,0.5,0.5] per channel.
-    // This is mathematically identical to (value/127.5 - 1.0) but written
-    // explicitly so the values are easy to update if the model changes.
-    // stb_image already outputs RGB order — do NOT swap to BGR.
-    constexpr float MEAN = 0.5f;
-    constexpr float STD = 0.5f;
-    pixel_values.resize(static_cast<size_t>(3 * TARGET * TARGET));
-    const int area = TARGET * TARGET;
-    for (int i = 0; i < area; ++i)
-      for (int ch = 0; ch < 3; ++ch)
-        pixel_values[ch * area + i] =
-            ((resized[i * 3 + ch] / 255.0f) - MEAN) / STD;
+// Records [construction, destruction) on the current track when tracing.
+struct TraceSpan {
+  const char *name;
+  int64_t track = t_trace_track;
+  TraceClock::time_point start;
+  std::string args; // set before the span ends, see Tracer::span
 
-    // resized vector is freed here when scope exits (~2.35 MB freed)
+  explicit TraceSpan(const char *n) : name(n) {
+    if (t_tracer)
+      start = TraceClock::now();
+  }
+  ~TraceSpan() {
+    if (t_tracer)
+      t_tracer->span(name, track, start, std::move(args));
+  }
+  // Ends this span and starts `n` where it stopped (back-to-back phases).
+  void next(const char *n) {
+    if (t_tracer) {
+      t_tracer->span(name, track, start, std::move(args));
+      args.clear();
+      start = TraceClock::now();
+    }
+    name = n;
   }
+};
 
-  LOGD("process_image_bytes OK: %zu floats (%.1f MB)", pixel_values.size(),
-       pixel_values.size() * 4 / (1024.0f * 1024.0f));
-  return pixel_values;
+// Every session is created through here, so each gets its own profile file
+// when tracing.
+static std::unique_ptr<Ort::Session>
+open_session(Ort::Env &env, const std::string &path, Ort::SessionOptions &opts,
+             Tracer *tracer) {
+  if (!tracer)
+    return std::make_unique<Ort::Session>(env, path.c_str(), opts);
+  Ort::SessionOptions traced = opts.Clone();
+  std::string stem = path.substr(path.rfind('/') + 1);
+  std::string prefix =
+      tracer->dir() + "/ort_" + stem.substr(0, stem.find('.'));
+#ifdef _WIN32
+  traced.EnableProfiling(std::wstring(prefix.begin(), prefix.end()).c_str());
+#else
+  traced.EnableProfiling(prefix.c_str());
+#endif
+  return std::make_unique<Ort::Session>(env, path.c_str(), traced);
 }
-// ─────────────────────────────────────────────────────────────────────────────
 
-extern "C" {
+// ── Tensor allocator ─────────────────────────────────────────────────────────
+// Every ORT session allocates its CPU tensors here (registered with the env,
+// picked up through session.use_env_allocators) instead of in ORT's arena,
+// which is disabled to keep the peak down. Blocks of POOL_MIN_BYTES and up
+// are mmap'd, so they never fragment the heap, and a freed one is kept in a
+// pool keyed by size class: the next decode step's present KV and logits
+// reuse the previous step's buffers instead of faulting in fresh pages. The
+// pool never holds more than the tensors currently live, so it at most
+// doubles what a step needs anyway (past + present KV). release() unmaps the
+// pool and trims the heap; the scheduler calls it after the vision stage and
+// whenever it goes idle.
+//
+// Each allocation is tagged with the stage the scheduler is in (AllocScope),
+// and the bytes held — live tensors plus the pool — are tracked at their
+// highest per stage, for MedGemmaJobTimings::*_peak_kb. One allocator serves
+// the process: ORT keeps one shared allocator per device in its global env.
+enum AllocStageId { ALLOC_LOAD, ALLOC_VISION, ALLOC_PREFILL, ALLOC_DECODE };
+static const int ALLOC_STAGES = 4;
+static const size_t POOL_MIN_BYTES = 256 * 1024;
+static const size_t BLOCK_HEADER = 64; // keeps ORT's 64-byte alignment
 
-// ── Call this from Dart immediately after loading the library
-// ───────────────── path should be something like:
-// getApplicationDocumentsDirectory() + "/medgemma_log.txt"
+class StageAllocator : public OrtAllocator {
+public:
+  StageAllocator() : OrtAllocator{} {
+    version = ORT_API_VERSION;
+    OrtAllocator::Alloc = [](OrtAllocator *self, size_t n) {
+      return static_cast<StageAllocator *>(self)->alloc(n);
+    };
+    OrtAllocator::Free = [](OrtAllocator *self, void *p) {
+      static_cast<StageAllocator *>(self)->free(p);
+    };
+    OrtAllocator::Info = [](const OrtAllocator *self) {
+      return (const OrtMemoryInfo *)static_cast<const StageAllocator *>(self)
+          ->info_;
+    };
+    // Session initialisation (pre-packed weights, constant folding) goes
+    // through Reserve; those blocks live as long as the session.
+    OrtAllocator::Reserve = [](OrtAllocator *self, size_t n) {
+      return static_cast<StageAllocator *>(self)->alloc(n, ALLOC_LOAD);
+    };
+  }
+
+  void *alloc(size_t n) { return alloc(n, stage_.load()); }
+
+  void *alloc(size_t n, int stage) {
+    if (n == 0)
+      return nullptr;
+    size_t cap = n + BLOCK_HEADER;
+    char *block = nullptr;
+    bool mapped = cap >= POOL_MIN_BYTES;
+    if (mapped) {
+      cap = size_class(cap);
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = pool_.find(cap);
+      if (it != pool_.end() && !it->second.empty()) {
+        block = it->second.back();
+        it->second.pop_back();
+        idle_ -= cap;
+      } else {
+        // A miss usually means the KV outgrew its class: the blocks one
+        // class down will not be asked for again this request. Grow one of
+        // them in place, keeping its pages, rather than faulting in new ones.
+        auto below = pool_.lower_bound(cap);
+        if (below != pool_.begin()) {
+          --below;
+          block = grow_block(below->second.back(), below->first, cap);
+          idle_ -= below->first;
+          below->second.pop_back();
+          if (below->second.empty())
+            pool_.erase(below);
+        }
+      }
+    }
+    if (!block)
+      block = static_cast<char *>(mapped ? map_block(cap) : heap_block(cap));
+    if (!block)
+      return nullptr;
+    auto *h = reinterpret_cast<Header *>(block);
+    h->cap = cap;
+    h->stage = stage;
+    h->mapped = mapped;
+    account((int64_t)cap);
+    return block + BLOCK_HEADER;
+  }
+
+  void free(void *p) {
+    if (!p)
+      return;
+    char *block = static_cast<char *>(p) - BLOCK_HEADER;
+    auto *h = reinterpret_cast<Header *>(block);
+    const size_t cap = h->cap;
+    account(-(int64_t)cap);
+    if (!h->mapped) {
+      heap_free(block);
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (idle_ + cap <= (size_t)live_.load()) {
+        pool_[cap].push_back(block);
+        idle_ += cap;
+        held_ = live_.load() + (int64_t)idle_;
+        return;
+      }
+    }
+    unmap_block(block, cap);
+  }
+
+  // Unmaps the pool and hands the heap's free pages back to the OS.
+  void release() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      while (!pool_.empty())
+        drop_locked(pool_.begin());
+      held_ = live_.load();
+    }
+    trim_heap();
+  }
+
+  int enter(int stage) {
+    int prev = stage_.exchange(stage);
+    peak_[stage] = held_.load();
+    return prev;
+  }
+  void leave(int prev) { stage_ = prev; }
+  int64_t peak_kb(int stage) const { return peak_[stage].load() / 1024; }
+
+  static void trim_heap() {
+#if defined(__GLIBC__)
+    malloc_trim(0);
+#elif defined(ANDROID) && __ANDROID_API__ >= 28
+    mallopt(M_PURGE, 0);
+#endif
+  }
+
+private:
+  struct Header {
+    size_t cap; // block size, header included
+    int32_t stage;
+    int32_t mapped;
+  };
+  static_assert(sizeof(Header) <= BLOCK_HEADER, "header overflows");
+
+  // Four classes per power of two (≤ 19% slack), whole pages.
+  static size_t size_class(size_t n) {
+    size_t top = 1;
+    while (top < n)
+      top <<= 1;
+    size_t step = std::max<size_t>(top / 8, 4096);
+    return (n + step - 1) / step * step;
+  }
+
+  void account(int64_t delta) {
+    int64_t held = (live_ += delta) + (int64_t)idle_.load();
+    held_ = held;
+    std::atomic<int64_t> &peak = peak_[stage_.load()];
+    int64_t seen = peak.load();
+    while (held > seen && !peak.compare_exchange_weak(seen, held)) {
+    }
+  }
+
+  void drop_locked(std::map<size_t, std::vector<char *>>::iterator it) {
+    for (char *block : it->second)
+      unmap_block(block, it->first);
+    idle_ -= it->first * it->second.size();
+    pool_.erase(it);
+  }
+
+  static void *heap_block(size_t n) {
+#ifdef _WIN32
+    return _aligned_malloc(n, BLOCK_HEADER);
+#else
+    void *p = nullptr;
+    return posix_memalign(&p, BLOCK_HEADER, n) == 0 ? p : nullptr;
+#endif
+  }
+  static void heap_free(void *p) {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    ::free(p);
+#endif
+  }
+  static void *map_block(size_t n) {
+#ifdef _WIN32
+    return VirtualAlloc(nullptr, n, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    void *p = mmap(nullptr, n, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? nullptr : p;
+#endif
+  }
+  // Returns a block of `to` bytes holding `p`'s pages; `p` is gone either way.
+  static char *grow_block(char *p, size_t from, size_t to) {
+#ifdef __linux__
+    void *q = mremap(p, from, to, MREMAP_MAYMOVE);
+    if (q != MAP_FAILED)
+      return static_cast<char *>(q);
+#endif
+    unmap_block(p, from);
+    return static_cast<char *>(map_block(to));
+  }
+  static void unmap_block(void *p, size_t n) {
+#ifdef _WIN32
+    (void)n;
+    VirtualFree(p, 0, MEM_RELEASE);
+#else
+    munmap(p, n);
+#endif
+  }
+
+  Ort::MemoryInfo info_ =
+      Ort::MemoryInfo::CreateCpu(OrtDeviceAllocator, OrtMemTypeDefault);
+  std::atomic<int> stage_{ALLOC_LOAD};
+  std::atomic<int64_t> live_{0};  // bytes handed to ORT and not yet freed
+  std::atomic<size_t> idle_{0};   // bytes parked in pool_ (under mutex_)
+  std::atomic<int64_t> held_{0};  // live_ + idle_
+  std::atomic<int64_t> peak_[ALLOC_STAGES] = {};
+  std::mutex mutex_; // guards pool_
+  std::map<size_t, std::vector<char *>> pool_;
+};
+
+// Never destroyed: ORT's env may outlive every engine (OGA holds it too).
+static StageAllocator &stage_allocator() {
+  static StageAllocator *alloc = new StageAllocator();
+  return *alloc;
+}
+
+// Tags the allocations of one scheduler unit with `stage` and restarts that
+// stage's high-water mark.
+struct AllocScope {
+  int stage, prev;
+  explicit AllocScope(int s) : stage(s), prev(stage_allocator().enter(s)) {}
+  ~AllocScope() { stage_allocator().leave(prev); }
+  int64_t peak_kb() const { return stage_allocator().peak_kb(stage); }
+};
+
+// ── Memory pressure ──────────────────────────────────────────────────────────
+// A monitor thread per engine samples, every MEM_SAMPLE_MS:
+//   - MemAvailable from /proc/meminfo;
+//   - the PSI averages in /proc/pressure/memory (kernel ≥ 4.20);
+//   - the cgroup's limit and usage. v2 uses memory.max/current, v1 uses
+//     memory.limit_in_bytes/usage_in_bytes. The cgroup directory is found
+//     through /proc/self/cgroup.
+// Any source that is missing is skipped. Available memory is the smaller of
+// MemAvailable and the cgroup's headroom. The sample is reduced to one
+// MedGemmaMemoryLevel that the scheduler reacts to:
+//   - moderate: drop the tensor pool, don't keep vision sessions;
+//   - high: no images, the smallest prefill chunks, one job at a time;
+//   - critical: spill the KV caches to flash and pause, then go on from
+//     there (see KvSpill).
+// medgemma_set_memory_paths points every source somewhere else, e.g. at
+// fake files in tests.
+const int MEM_SAMPLE_MS = 250;
+const int MEM_PAUSE_MS = 3000; // critical: wait this long, then use flash
+const int64_t MEM_MODERATE_KB = 1024 * 1024;
+const int64_t MEM_HIGH_KB = 600 * 1024;    // vision encoder working set
+const int64_t MEM_CRITICAL_KB = 200 * 1024; // decoder step + logits
+
+struct MemoryPaths {
+  std::string meminfo = "/proc/meminfo";
+  std::string psi = "/proc/pressure/memory";
+  std::string cgroup; // "" → the process's own, from /proc/self/cgroup
+};
+static MemoryPaths g_memory_paths; // guarded by g_log_mutex
+
+static int64_t read_kb_field(const std::string &path, const char *key) {
+  FILE *f = fopen(path.c_str(), "r");
+  if (!f)
+    return -1;
+  int64_t kb = -1;
+  char line[256];
+  size_t n = strlen(key);
+  while (fgets(line, sizeof(line), f))
+    if (!strncmp(line, key, n) && line[n] == ':') {
+      long long v = 0;
+      if (sscanf(line + n + 1, " %lld", &v) == 1)
+        kb = v;
+      break;
+    }
+  fclose(f);
+  return kb;
+}
+
+// A cgroup file holding one byte count, in KB; "max" (v2) or a v1 limit
+// near 2^63 reads as -1 (no limit), as does a missing file.
+static int64_t read_cgroup_kb(const std::string &path) {
+  FILE *f = fopen(path.c_str(), "r");
+  if (!f)
+    return -1;
+  unsigned long long v = 0;
+  int ok = fscanf(f, "%llu", &v);
+  fclose(f);
+  if (ok != 1 || v >= (1ULL << 62))
+    return -1;
+  return (int64_t)(v / 1024);
+}
+
+static std::string own_cgroup_dir() {
+  FILE *f = fopen("/proc/self/cgroup", "r");
+  if (!f)
+    return "";
+  std::string v1, v2;
+  char line[512];
+  while (fgets(line, sizeof(line), f)) {
+    line[strcspn(line, "\n")] = 0;
+    if (!strncmp(line, "0::", 3))
+      v2 = std::string("/sys/fs/cgroup") + (line + 3);
+    else if (const char *m = strstr(line, ":memory:"))
+      v1 = std::string("/sys/fs/cgroup/memory") + (m + 8);
+  }
+  fclose(f);
+  return v1.empty() ? v2 : v1;
+}
+
+static int memory_level(const MedGemmaMemoryStatus &s) {
+  const int64_t avail = s.available_kb;
+  const double some = s.psi_some_avg10, full = s.psi_full_avg10;
+  if ((avail >= 0 && avail < MEM_CRITICAL_KB) || full >= 20)
+    return MEDGEMMA_MEM_CRITICAL;
+  if ((avail >= 0 && avail < MEM_HIGH_KB) || some >= 30 || full >= 5)
+    return MEDGEMMA_MEM_HIGH;
+  if ((avail >= 0 && avail < MEM_MODERATE_KB) || some >= 10)
+    return MEDGEMMA_MEM_MODERATE;
+  return MEDGEMMA_MEM_OK;
+}
+
+// One reading of every source. Returns false if none could be read.
+static bool sample_memory(MedGemmaMemoryStatus &s) {
+  MemoryPaths paths;
+  {
+    std::lock_guard<std::mutex> lock(g_log_mutex);
+    paths = g_memory_paths;
+  }
+  s = {};
+  s.mem_available_kb = read_kb_field(paths.meminfo, "MemAvailable");
+  s.psi_some_avg10 = s.psi_full_avg10 = -1;
+  if (FILE *f = fopen(paths.psi.c_str(), "r")) {
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+      double avg10 = 0;
+      if (sscanf(line, "some avg10=%lf", &avg10) == 1)
+        s.psi_some_avg10 = avg10;
+      else if (sscanf(line, "full avg10=%lf", &avg10) == 1)
+        s.psi_full_avg10 = avg10;
+    }
+    fclose(f);
+  }
+  std::string cg = paths.cgroup.empty() ? own_cgroup_dir() : paths.cgroup;
+  s.cgroup_limit_kb = s.cgroup_usage_kb = -1;
+  if (!cg.empty()) {
+    s.cgroup_limit_kb = read_cgroup_kb(cg + "/memory.max");
+    s.cgroup_usage_kb = read_cgroup_kb(cg + "/memory.current");
+    if (s.cgroup_usage_kb < 0) {
+      s.cgroup_limit_kb = read_cgroup_kb(cg + "/memory.limit_in_bytes");
+      s.cgroup_usage_kb = read_cgroup_kb(cg + "/memory.usage_in_bytes");
+    }
+  }
+  s.available_kb = s.mem_available_kb;
+  if (s.cgroup_limit_kb >= 0 && s.cgroup_usage_kb >= 0) {
+    int64_t headroom =
+        std::max<int64_t>(0, s.cgroup_limit_kb - s.cgroup_usage_kb);
+    if (s.available_kb < 0 || headroom < s.available_kb)
+      s.available_kb = headroom;
+  }
+  s.level = memory_level(s);
+  return s.available_kb >= 0 || s.psi_some_avg10 >= 0;
+}
+
+static const char *memory_level_name(int level) {
+  static const char *names[] = {"ok", "moderate", "high", "critical"};
+  return names[level];
+}
+
+class MemoryMonitor {
+public:
+  MemoryMonitor() : thread_([this]() { loop(); }) {}
+  ~MemoryMonitor() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+  }
+
+  int level() const { return level_.load(); }
+  MedGemmaMemoryStatus last() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return last_;
+  }
+
+  // Blocks until the level drops below `level`, `ms` pass or `give_up()`
+  // returns true (checked every sample). True if the level dropped.
+  bool wait_below(int level, int ms, const std::function<bool()> &give_up) {
+    auto until =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (level_.load() >= level) {
+      if (stopping_ || give_up() ||
+          cv_.wait_until(lock, until) == std::cv_status::timeout)
+        return level_.load() < level;
+    }
+    return true;
+  }
+
+private:
+  void loop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+      lock.unlock();
+      MedGemmaMemoryStatus s;
+      bool ok = sample_memory(s);
+      lock.lock();
+      last_ = s;
+      int prev = level_.exchange(ok ? s.level : MEDGEMMA_MEM_OK);
+      if (level_.load() != prev)
+        LOGI("Memory pressure %s → %s (%lld MB available, PSI some %.1f "
+             "full %.1f)",
+             memory_level_name(prev), memory_level_name(level_.load()),
+             (long long)(s.available_kb / 1024), s.psi_some_avg10,
+             s.psi_full_avg10);
+      cv_.notify_all();
+      cv_.wait_for(lock, std::chrono::milliseconds(MEM_SAMPLE_MS),
+                   [this]() { return stopping_; });
+    }
+  }
+
+  std::mutex mutex_; // guards last_ and stopping_
+  std::condition_variable cv_;
+  MedGemmaMemoryStatus last_ = {};
+  std::atomic<int> level_{MEDGEMMA_MEM_OK};
+  bool stopping_ = false;
+  std::thread thread_; // last: starts once the fields above exist
+};
+
+// ── Memory planner ───────────────────────────────────────────────────────────
+// Before a request does any work, plan_request() estimates its peak from the
+// prompt length, the image, the cache it will grow to, the prefill chunk and
+// whether the vision sessions have to be loaded, then picks the fastest
+// configuration that fits what the monitor says is available. With RAM to
+// spare that means large prefill chunks. As the budget tightens it gives up,
+// in order: chunk size, vision sessions kept for the next image, generation
+// length (down to PLAN_MIN_TOKENS) and finally the image. A tight device
+// thus writes a shorter or text-only report instead of being stopped halfway
+// through one.
+//
+// Fixed costs come from the model geometry. The working sets of the vision
+// encoder and of one decoder Run beyond its KV and logits are the largest the
+// allocator has measured so far (guesses until the first request). They
+// include whatever other jobs held at the time, so they err on the high side.
+const int PREFILL_CHUNK_MIN = 4;
+const int PREFILL_CHUNK_MAX = 64;
+const int PLAN_MIN_TOKENS = 64;             // shortest report worth starting
+const int64_t PLAN_RESERVE_KB = 150 * 1024; // headroom for the app and OS
+
+struct MemoryEstimates { // KB
+  std::atomic<int64_t> vision_weights_kb{0}; // .ort sizes, set at load
+  std::atomic<int64_t> kv_position_bytes{    // DecoderIO::position_bytes
+      2 * num_layers * kv_heads * head_dim * (int64_t)sizeof(float)};
+  std::atomic<int64_t> vision_work_kb{400 * 1024};
+  std::atomic<int64_t> decoder_work_kb{64 * 1024};
+  std::atomic<bool> vision_measured{false}, decoder_measured{false};
+
+  // The first measurement replaces the guess, later ones only raise it.
+  static void calibrate(std::atomic<int64_t> &est, std::atomic<bool> &measured,
+                        int64_t kb) {
+    if (kb <= 0)
+      return;
+    if (!measured.exchange(true))
+      est = kb;
+    else if (kb > est)
+      est = kb;
+  }
+};
+
+struct PlanInput {
+  int prompt_tokens = 0; // tokenized text, image placeholders included
+  int image_slots = 0;   // placeholders that become image_positions each
+  int image_positions = num_patches; // per image, after pooling
+  int max_tokens = 0;
+  int cached_tokens = 0; // chat session cache the prompt continues
+  int window = 0;        // that session's cache cap, 0 → none
+  int context = 0;       // the model's context length, 0 → unknown
+  bool vision_resident = false; // sessions still loaded from a previous image
+  bool keep_vision = false;     // another image request is waiting
+  int pressure = MEDGEMMA_MEM_OK;
+  int64_t others_kb = 0; // growth still ahead of the jobs already running
+};
+
+struct RequestPlan {
+  bool image = false;
+  bool keep_vision = false;
+  int prefill_chunk = PREFILL_CHUNK;
+  int max_tokens = 0;
+  int64_t peak_kb = 0;
+  int64_t budget_kb = -1; // -1: available memory unknown, nothing limited
+};
+
+// The whole cache for `positions`, at the loaded decoder's precision.
+static int64_t kv_kb(const MemoryEstimates &est, int64_t positions) {
+  return positions * est.kv_position_bytes / 1024;
+}
+
+static int64_t logits_kb(int64_t rows) {
+  return rows * vocab_size * (int64_t)sizeof(float) / 1024;
+}
+
+// The largest of the request's vision stage, its last prefill chunk and its
+// last decode step. A decoder Run holds the past and the present cache.
+static int64_t plan_peak_kb(const PlanInput &in, const RequestPlan &plan,
+                            const MemoryEstimates &est) {
+  const int64_t positions =
+      in.prompt_tokens +
+      (plan.image ? in.image_slots * (in.image_positions - 1) : 0);
+  const int64_t embeds_kb = positions * embed_dim * sizeof(float) / 1024;
+  const int64_t weights_kb = est.vision_weights_kb;
+  int64_t vision = 0;
+  if (plan.image)
+    vision = (in.vision_resident ? 0 : weights_kb) + est.vision_work_kb;
+  const bool resident =
+      plan.image ? plan.keep_vision : in.vision_resident;
+  const int64_t held = embeds_kb + (resident ? weights_kb : 0);
+  auto cache_kb = [&](int64_t n) {
+    n += in.cached_tokens;
+    return kv_kb(est, in.window > 0 ? std::min<int64_t>(n, in.window) : n);
+  };
+  const int64_t prefill =
+      held + 2 * cache_kb(positions) + logits_kb(plan.prefill_chunk);
+  const int64_t decode = (resident ? weights_kb : 0) +
+                         2 * cache_kb(positions + plan.max_tokens) +
+                         logits_kb(1);
+  return in.others_kb + est.decoder_work_kb +
+         std::max(vision, std::max(prefill, decode));
+}
+
+// max_tokens, less what would run past the model's context. A session's
+// window makes its own room (see seq_make_room).
+static int context_room(const PlanInput &in, bool image) {
+  if (in.context <= 0 || in.window > 0)
+    return in.max_tokens;
+  const int positions = in.cached_tokens + in.prompt_tokens +
+                        (image ? in.image_slots * (in.image_positions - 1)
+                               : 0);
+  return std::max(0, std::min(in.max_tokens, in.context - positions));
+}
+
+static RequestPlan plan_request(const PlanInput &in, int64_t available_kb,
+                                const MemoryEstimates &est) {
+  RequestPlan plan;
+  plan.image = in.image_slots > 0 && in.pressure < MEDGEMMA_MEM_HIGH;
+  plan.keep_vision =
+      plan.image && in.keep_vision && in.pressure < MEDGEMMA_MEM_MODERATE;
+  plan.max_tokens = context_room(in, plan.image);
+  if (available_kb < 0) {
+    plan.peak_kb = plan_peak_kb(in, plan, est);
+    return plan;
+  }
+  plan.prefill_chunk = in.pressure >= MEDGEMMA_MEM_HIGH ? PREFILL_CHUNK_MIN
+                                                        : PREFILL_CHUNK_MAX;
+  plan.budget_kb = available_kb - PLAN_RESERVE_KB;
+  auto fits = [&]() {
+    plan.peak_kb = plan_peak_kb(in, plan, est);
+    return plan.peak_kb <= plan.budget_kb;
+  };
+  auto shorten = [&]() {
+    while (!fits() && plan.max_tokens > PLAN_MIN_TOKENS)
+      plan.max_tokens = std::max(PLAN_MIN_TOKENS, plan.max_tokens * 3 / 4);
+  };
+  while (!fits() && plan.prefill_chunk > PREFILL_CHUNK_MIN)
+    plan.prefill_chunk /= 2;
+  if (!fits())
+    plan.keep_vision = false;
+  shorten();
+  if (!fits() && plan.image) {
+    plan.image = false; // text-only gets the full length back if it fits
+    plan.max_tokens = context_room(in, false);
+    shorten();
+  }
+  // A shorter report may have freed enough for larger chunks again.
+  while (plan.prefill_chunk < PREFILL_CHUNK_MAX && fits()) {
+    plan.prefill_chunk *= 2;
+    if (!fits()) {
+      plan.prefill_chunk /= 2;
+      break;
+    }
+  }
+  fits(); // peak_kb of the final choice; over budget is left to the monitor
+  return plan;
+}
+
+// fseek/ftell with 64-bit offsets: `long` is 32 bits on Windows, and model
+// files and snapshots pass 2 GB. False / -1 for an offset the platform's
+// off_t cannot hold rather than a wrapped one.
+static bool file_seek(FILE *f, int64_t at, int whence) {
+#ifdef _WIN32
+  return _fseeki64(f, at, whence) == 0;
+#else
+  return at == (int64_t)(off_t)at && fseeko(f, (off_t)at, whence) == 0;
+#endif
+}
+
+static int64_t file_tell(FILE *f) {
+#ifdef _WIN32
+  return _ftelli64(f);
+#else
+  return ftello(f);
+#endif
+}
+
+// Size of a model file, 0 if it is missing.
+static int64_t file_kb(const std::string &path) {
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f)
+    return 0;
+  int64_t size = file_seek(f, 0, SEEK_END) ? file_tell(f) : 0;
+  fclose(f);
+  return size > 0 ? size / 1024 : 0;
+}
+
+// ── Decoder I/O ──────────────────────────────────────────────────────────────
+// Input/output names of the decoder and the layout of its KV cache, read from
+// the session at load. Every input after inputs_embeds and attention_mask is
+// a cache tensor {batch, kv_heads, past, dim}; its present output has the
+// same name under "present." instead of "past_key_values.". A plain export
+// has 2 × num_layers fp32 tensors with dim = head_dim. The variants that
+// tools/kv_variant.py writes store them as fp16, or as int8 with a
+// per-position scale tensor (dim 1) after each (see medgemma_set_kv_precision).
+// Everything that copies caches around goes by bytes per head and position,
+// so it never needs to know which one is loaded.
+struct DecoderIO {
+  struct CacheTensor {
+    ONNXTensorElementDataType type;
+    int64_t dim;
+    size_t row_bytes; // one head, one position
+    int layer = 0;
+    bool key = false;   // a key (or key scale) tensor, rotated by RoPE
+    bool is_scale = false;
+    int scale = -1; // index of this int8 tensor's scale tensor
+  };
+  std::vector<std::string> in_names_s, out_names_s;
+  std::vector<const char *> in, out;
+  std::vector<CacheTensor> cache;
+  int64_t position_bytes = 0; // every cache tensor, one position
+  std::string precision = "fp32";
+
+  void load(Ort::Session &session) {
+    Ort::AllocatorWithDefaultOptions names;
+    in_names_s.clear();
+    out_names_s = {"logits"};
+    cache.clear();
+    position_bytes = 0;
+    std::vector<std::string> outputs;
+    for (size_t i = 0; i < session.GetOutputCount(); ++i)
+      outputs.push_back(session.GetOutputNameAllocated(i, names).get());
+    for (size_t i = 0; i < session.GetInputCount(); ++i) {
+      std::string name = session.GetInputNameAllocated(i, names).get();
+      in_names_s.push_back(name);
+      if (i < 2)
+        continue; // inputs_embeds, attention_mask
+      const std::string past = "past_key_values.";
+      if (name.compare(0, past.size(), past) != 0)
+        throw std::runtime_error("decoder input " + name + " is not a cache");
+      std::string present = "present." + name.substr(past.size());
+      if (std::find(outputs.begin(), outputs.end(), present) == outputs.end())
+        throw std::runtime_error("decoder has no output " + present);
+      out_names_s.push_back(present);
+      Ort::TypeInfo type_info = session.GetInputTypeInfo(i);
+      auto info = type_info.GetTensorTypeAndShapeInfo(); // a view into it
+      CacheTensor t;
+      // "<layer>.key", "<layer>.value", or either with "_scale".
+      const std::string role = name.substr(past.size());
+      t.layer = atoi(role.c_str());
+      t.key = role.find(".key") != std::string::npos;
+      t.is_scale = role.size() > 6 &&
+                   role.compare(role.size() - 6, 6, "_scale") == 0;
+      t.type = info.GetElementType();
+      t.dim = info.GetShape().back();
+      size_t elem = t.type == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT     ? 4
+                    : t.type == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16 ? 2
+                    : t.type == ONNX_TENSOR_ELEMENT_DATA_TYPE_INT8    ? 1
+                                                                      : 0;
+      if (!elem || t.dim <= 0)
+        throw std::runtime_error("unsupported cache input " + name);
+      t.row_bytes = elem * t.dim;
+      position_bytes += kv_heads * (int64_t)t.row_bytes;
+      if (t.is_scale && !cache.empty())
+        cache.back().scale = (int)cache.size(); // right after its data
+      cache.push_back(t);
+      if (t.type == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16)
+        precision = "fp16";
+      else if (t.type == ONNX_TENSOR_ELEMENT_DATA_TYPE_INT8)
+        precision = "int8";
+    }
+    in.clear();
+    out.clear();
+    for (const auto &s : in_names_s)
+      in.push_back(s.c_str());
+    for (const auto &s : out_names_s)
+      out.push_back(s.c_str());
+  }
+
+  // An empty (0-position) cache of this layout, for a new sequence.
+  std::vector<Ort::Value> empty_cache(const Ort::MemoryInfo &mi) const {
+    static int64_t dummy = 0;
+    std::vector<Ort::Value> kv;
+    for (const CacheTensor &t : cache) {
+      std::vector<int64_t> shape = {1, kv_heads, 0, t.dim};
+      kv.push_back(Ort::Value::CreateTensor(mi, &dummy, 0, shape.data(),
+                                            shape.size(), t.type));
+    }
+    return kv;
+  }
+};
+
+// MedGemmaKvPrecision of engines loaded from now on; see decoder_path.
+static std::atomic<int> g_kv_precision{MEDGEMMA_KV_FP32};
+
+// The decoder to load: the variant for g_kv_precision if the model directory
+// has it, model.onnx otherwise.
+static std::string decoder_path(const std::string &model_dir) {
+  const int precision = g_kv_precision.load();
+  const char *variant = precision == MEDGEMMA_KV_FP16   ? "model_kv16.onnx"
+                        : precision == MEDGEMMA_KV_INT8 ? "model_kv8.onnx"
+                                                        : nullptr;
+  if (variant) {
+    std::string path = model_dir + "/" + variant;
+    if (FILE *f = fopen(path.c_str(), "rb")) {
+      fclose(f);
+      return path;
+    }
+    LOGE("%s not found (see tools/kv_variant.py), using fp32 KV", variant);
+  }
+  return model_dir + "/model.onnx";
+}
+
+// Identifies the weights a KV snapshot was taken with: FNV-1a over the size
+// and the first and last MB of model.onnx and of its external data, if any.
+// The KV variants derive from model.onnx, so a snapshot moves between
+// precisions. Hashing all 3 GB would cost more than the prefill it saves.
+static uint64_t model_fingerprint(const std::string &model_dir) {
+  uint64_t h = 1469598103934665603ull;
+  auto mix = [&](const void *p, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+      h = (h ^ static_cast<const uint8_t *>(p)[i]) * 1099511628211ull;
+  };
+  std::vector<char> buf(1 << 20);
+  for (const char *name : {"/model.onnx", "/model.onnx.data",
+                           "/model.onnx_data"}) {
+    FILE *f = fopen((model_dir + name).c_str(), "rb");
+    if (!f)
+      continue;
+    const int64_t size = file_seek(f, 0, SEEK_END) ? file_tell(f) : -1;
+    mix(&size, sizeof(size));
+    for (int64_t at : {int64_t(0), std::max<int64_t>(0, size - buf.size())}) {
+      if (file_seek(f, at, SEEK_SET))
+        mix(buf.data(), fread(buf.data(), 1, buf.size(), f));
+    }
+    fclose(f);
+  }
+  return h;
+}
+
+// Positions the model was exported for: model.context_length in
+// genai_config.json, or search.max_length where an export only has that.
+// 0 if neither can be read; nothing is limited then.
+static int model_context_length(const std::string &model_dir) {
+  FILE *f = fopen((model_dir + "/genai_config.json").c_str(), "rb");
+  if (!f)
+    return 0;
+  std::string text;
+  char buf[4096];
+  for (size_t n; (n = fread(buf, 1, sizeof(buf), f)) > 0;)
+    text.append(buf, n);
+  fclose(f);
+  Json config;
+  if (!JsonParser(text).parse(config))
+    return 0;
+  const Json *model = config.get("model");
+  const Json *search = config.get("search");
+  double length = model ? model->number_or("context_length", 0) : 0;
+  if (length <= 0 && search)
+    length = search->number_or("max_length", 0);
+  return length > 0 ? static_cast<int>(length) : 0;
+}
+
+// ── KV spill ─────────────────────────────────────────────────────────────────
+// When memory stays critical, a sequence's cache moves out of anonymous
+// memory into a spill file on local flash, mapped MAP_SHARED. The mapping
+// holds two slots, each sized for the whole cache the sequence can still
+// grow to. The decoder reads the past cache from one slot and, through an
+// IoBinding, writes the present cache straight into the other, so a step
+// never needs a second anonymous copy of the cache. Those pages are file
+// backed: the kernel may write them back and drop them under pressure, and
+// faults them in again on the next step. Steps get slower but the report is
+// finished. The slot that was just read is hole-punched so stale data is
+// never written back.
+//
+// Spilling also checkpoints the sequence: paused under critical pressure it
+// keeps nothing but the file, and seq_restore() copies the cache back into
+// ordinary tensors once the level drops. The file is unlinked as soon as it
+// is created, so a crash leaves nothing behind. POSIX only.
+static std::string g_spill_dir; // guarded by g_log_mutex; "" → model dir
+
+class KvSpill {
+public:
+  // A spill file under `dir` with room for `capacity` positions of `io`'s
+  // cache, or null if it cannot be created or its blocks reserved.
+  static std::unique_ptr<KvSpill> create(const std::string &dir,
+                                         int64_t capacity,
+                                         const DecoderIO &io) {
+#ifdef _WIN32
+    (void)dir;
+    (void)capacity;
+    (void)io;
+    return nullptr;
+#else
+    std::string path = dir + "/.medgemma_spill_XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd < 0) {
+      LOGE("KV spill: cannot create %s: %s", path.c_str(), strerror(errno));
+      return nullptr;
+    }
+    unlink(path.c_str());
+    std::unique_ptr<KvSpill> spill(new KvSpill(fd, capacity, io));
+    const size_t total = 2 * spill->slot_bytes_;
+    if (ftruncate(fd, (off_t)total) != 0 || !spill->reserve(0)) {
+      LOGE("KV spill: cannot reserve %zu MB in %s: %s", total >> 20,
+           dir.c_str(), strerror(errno));
+      return nullptr;
+    }
+    void *base =
+        mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+      LOGE("KV spill: mmap: %s", strerror(errno));
+      return nullptr;
+    }
+    spill->base_ = static_cast<char *>(base);
+    return spill;
+#endif
+  }
+
+  ~KvSpill() {
+#ifndef _WIN32
+    if (base_)
+      munmap(base_, 2 * slot_bytes_);
+    close(fd_);
+#endif
+  }
+
+  int64_t capacity() const { return capacity_; }
+
+  // Copies `kv` ({1, kv_heads, len, dim} each) into the active slot, frees
+  // it and returns views of the copy. Starts writing it back at once: under
+  // pressure those pages are only reclaimable once clean.
+  std::vector<Ort::Value> store(std::vector<Ort::Value> &kv, int64_t len,
+                                const Ort::MemoryInfo &mi) {
+    for (size_t i = 0; i < kv.size(); ++i) {
+      if (len)
+        memcpy(tensor(active_, i), kv[i].GetTensorRawData(),
+               (size_t)len * kv_heads * io_.cache[i].row_bytes);
+      kv[i] = Ort::Value(nullptr); // free as we go
+    }
+#ifdef __linux__
+    sync_file_range(fd_, (off_t)(active_ * slot_bytes_), (off_t)slot_bytes_,
+                    SYNC_FILE_RANGE_WRITE);
+#endif
+    return views(active_, len, mi);
+  }
+
+  // The active slot's cache, `len` positions.
+  std::vector<Ort::Value> active(int64_t len, const Ort::MemoryInfo &mi) {
+    return views(active_, len, mi);
+  }
+
+  // The other slot, for the decoder's present outputs; false if its blocks
+  // could not be reserved (the file system is full).
+  bool next(int64_t len, std::vector<Ort::Value> &out,
+            const Ort::MemoryInfo &mi) {
+    if (len > capacity_ || !reserve(1 - active_))
+      return false;
+    out = views(1 - active_, len, mi);
+    return true;
+  }
+
+  // After a step: the slot just written becomes the active one and the one
+  // just read is dropped without being written back.
+  void flip() {
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+    fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+              (off_t)(active_ * slot_bytes_), (off_t)slot_bytes_);
+#endif
+    active_ = 1 - active_;
+  }
+
+private:
+  KvSpill(int fd, int64_t capacity, const DecoderIO &io)
+      : fd_(fd), capacity_(capacity), io_(io) {
+    // Tensor i of a slot starts at offsets_[i], sized for `capacity`.
+    for (const auto &t : io.cache) {
+      offsets_.push_back(slot_bytes_);
+      slot_bytes_ += (size_t)capacity * kv_heads * t.row_bytes;
+    }
+  }
+
+  char *tensor(int slot, size_t i) {
+    return base_ + slot * slot_bytes_ + offsets_[i];
+  }
+
+  std::vector<Ort::Value> views(int slot, int64_t len,
+                                const Ort::MemoryInfo &mi) {
+    std::vector<Ort::Value> kv;
+    for (size_t i = 0; i < io_.cache.size(); ++i) {
+      const DecoderIO::CacheTensor &t = io_.cache[i];
+      std::vector<int64_t> shape = {1, kv_heads, len, t.dim};
+      kv.push_back(Ort::Value::CreateTensor(
+          mi, tensor(slot, i), (size_t)len * kv_heads * t.row_bytes,
+          shape.data(), shape.size(), t.type));
+    }
+    return kv;
+  }
+
+  // Allocates the slot's blocks so a write through the mapping can never
+  // hit a full disk (SIGBUS).
+  bool reserve(int slot) {
+#ifdef _WIN32
+    (void)slot;
+    return false;
+#else
+    return posix_fallocate(fd_, (off_t)(slot * slot_bytes_),
+                           (off_t)slot_bytes_) == 0;
+#endif
+  }
+
+  int fd_;
+  int64_t capacity_;
+  const DecoderIO &io_; // the engine's, outlives every sequence
+  std::vector<size_t> offsets_;
+  size_t slot_bytes_ = 0;
+  char *base_ = nullptr;
+  int active_ = 0;
+};
+
+// ── Chat sessions ────────────────────────────────────────────────────────────
+// A chat follow-up used to resend, and re-prefill, the whole conversation.
+// medgemma_session_open() returns a session whose KV cache outlives its jobs:
+// a job submitted with params.session starts from that cache and leaves its
+// own turn in it, prompt and answer, closed with "<end_of_turn>\n" so the next
+// prompt is just the next turn. A session runs one job at a time.
+//
+// To keep a chat of any length at constant memory and per-token cost, the
+// cache is capped at `window` positions. When a prefill chunk or decode step
+// would go past it, seq_make_room() drops a block of the oldest positions
+// after the pinned start (the attention sink: the first `sink` positions, or
+// by default the session's first prompt, i.e. the patient context). Gemma
+// attends by position and GroupQueryAttention takes one valid length per row,
+// so the cache cannot keep holes: kv_evict() closes the gap and re-rotates
+// the later keys to their new positions. The mask stays a plain prefix and the
+// model sees a shorter, contiguous conversation. Dropping a quarter window at
+// a time keeps that copy rare.
+const int SESSION_WINDOW = 2048;   // default cap, the app's context length
+const int SESSION_MIN_ROOM = 2 * PREFILL_CHUNK_MAX; // window beyond the sink
+
+class MappedImage;
+
+// A piece of a prompt pushed ahead of its job (see Drafts).
+struct DraftSegment {
+  std::string text;
+  std::vector<uint8_t> image; // encoded, for the segment's <image>
+  int64_t end = 0;            // cache length once it is in (drafted only)
+
+  bool same(const DraftSegment &o) const {
+    return text == o.text && image == o.image;
+  }
+};
+
+struct ChatSession {
+  int64_t id = 0;
+  int window = SESSION_WINDOW;
+  int sink = 0;       // as requested; <= 0 → the first prompt
+  int64_t pinned = 0; // positions never evicted, fixed by the first job
+  // Guarded by the engine's queue_mutex.
+  bool busy = false; // a job holds the cache
+  bool lost = false; // a job stopped before its prompt was in; cache dropped
+  // Only touched by the scheduler, for the job holding the session.
+  std::vector<Ort::Value> kv;
+  int64_t kv_len = 0;
+  std::unique_ptr<KvSpill> spill;  // the cache is in a spill file
+  std::vector<int64_t> pending;    // the last job's sampled, unfed token
+  // Opened by medgemma_session_load: the kv_len positions are still in this
+  // mapped file (see KV snapshots), and `kv` may be views into it.
+  std::shared_ptr<const MappedImage> snapshot;
+  int32_t snapshot_precision = MEDGEMMA_KV_FP32; // the file's
+  // The next prompt's segments as medgemma_session_push left them, guarded
+  // by queue_mutex like the flags: `drafting` while the scheduler prefills
+  // one, `draft_stuck` if the next one is left to the job.
+  std::vector<DraftSegment> draft;
+  bool drafting = false;
+  bool draft_stuck = false;
+  // Scheduler only: the segments already in the cache, from `draft_base`
+  // on (-1: none).
+  std::vector<DraftSegment> drafted;
+  int64_t draft_base = -1;
+};
+
+// One head's row at one position as int8 with its own scale, the way
+// kv_variant.py stores it: absmax / 127, rounded to nearest. Returns the
+// scale.
+static float quantize_row(const float *x, int64_t dim, int8_t *q) {
+  float peak = 1e-8f;
+  for (int64_t d = 0; d < dim; ++d)
+    peak = std::max(peak, std::fabs(x[d]));
+  const float scale = peak / 127.0f;
+  for (int64_t d = 0; d < dim; ++d)
+    q[d] = (int8_t)std::max(-127.0f,
+                            std::min(127.0f, std::nearbyint(x[d] / scale)));
+  return scale;
+}
+
+// Rotates a key from position p to p + delta: GroupQueryAttention's RoPE
+// (non-interleaved: x[j] pairs with x[j + dim / 2]) at the layer's base.
+// Rotations add up, so the result is the key the decoder would have stored
+// at the new position.
+struct RopeShift {
+  std::vector<float> cos[2], sin[2]; // sliding-window layers, global layers
+
+  RopeShift(int64_t dim, int64_t delta) {
+    for (int g = 0; g < 2; ++g) {
+      const double base = g ? rope_global_base : rope_local_base;
+      const double scale = g ? rope_global_scale : 1.0;
+      for (int64_t j = 0; j < dim / 2; ++j) {
+        const double angle = delta * std::pow(base, -2.0 * j / dim) / scale;
+        cos[g].push_back((float)std::cos(angle));
+        sin[g].push_back((float)std::sin(angle));
+      }
+    }
+  }
+
+  void apply(float *x, int layer) const {
+    const int g = (layer + 1) % rope_global_every == 0;
+    const size_t half = cos[g].size();
+    for (size_t j = 0; j < half; ++j) {
+      const float a = x[j], b = x[j + half];
+      x[j] = a * cos[g][j] - b * sin[g][j];
+      x[j + half] = a * sin[g][j] + b * cos[g][j];
+    }
+  }
+};
+
+// Drops positions [sink, sink + n) of a `len`-position cache and moves the
+// later ones n positions down, re-rotating their keys. A spilled cache is
+// compacted in place in its slot (each head's rows only ever move down);
+// anything else gets new, smaller tensors.
+static void kv_evict(const DecoderIO &io, std::vector<Ort::Value> &kv,
+                     int64_t len, int64_t sink, int64_t n, KvSpill *spill,
+                     const Ort::MemoryInfo &mi) {
+  const int64_t kept = len - n;
+  std::vector<Ort::Value> out;
+  std::vector<char *> dst;
+  AllocScope scope(ALLOC_DECODE);
+  for (size_t i = 0; i < kv.size(); ++i) {
+    const DecoderIO::CacheTensor &ct = io.cache[i];
+    const size_t rb = ct.row_bytes;
+    char *src = static_cast<char *>(kv[i].GetTensorMutableRawData());
+    char *to = src;
+    if (!spill) {
+      std::vector<int64_t> shape = {1, kv_heads, kept, ct.dim};
+      out.push_back(Ort::Value::CreateTensor(&stage_allocator(), shape.data(),
+                                             shape.size(), ct.type));
+      to = static_cast<char *>(out.back().GetTensorMutableRawData());
+    }
+    for (int h = 0; h < kv_heads; ++h) {
+      char *from = src + h * len * rb, *row = to + h * kept * rb;
+      memmove(row, from, sink * rb);
+      memmove(row + sink * rb, from + (sink + n) * rb, (kept - sink) * rb);
+    }
+    dst.push_back(to);
+  }
+
+  const RopeShift shift(head_dim, -n);
+  std::vector<float> x(head_dim);
+  for (size_t i = 0; i < io.cache.size(); ++i) {
+    const DecoderIO::CacheTensor &ct = io.cache[i];
+    if (!ct.key || ct.is_scale || ct.dim != head_dim)
+      continue;
+    for (int h = 0; h < kv_heads; ++h) {
+      for (int64_t p = sink; p < kept; ++p) {
+        const int64_t r = h * kept + p;
+        if (ct.type == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT) {
+          shift.apply(reinterpret_cast<float *>(dst[i]) + r * head_dim,
+                      ct.layer);
+        } else if (ct.type == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16) {
+          auto *row = reinterpret_cast<Ort::Float16_t *>(dst[i]) + r * head_dim;
+          for (int d = 0; d < head_dim; ++d)
+            x[d] = row[d].ToFloat();
+          shift.apply(x.data(), ct.layer);
+          for (int d = 0; d < head_dim; ++d)
+            row[d] = Ort::Float16_t(x[d]);
+        } else if (ct.scale >= 0) { // int8 with a scale per head and position
+          auto *row = reinterpret_cast<int8_t *>(dst[i]) + r * head_dim;
+          float &scale = reinterpret_cast<float *>(dst[ct.scale])[r];
+          for (int d = 0; d < head_dim; ++d)
+            x[d] = row[d] * scale;
+          shift.apply(x.data(), ct.layer);
+          scale = quantize_row(x.data(), head_dim, row);
+        }
+      }
+    }
+  }
+  kv = spill ? spill->active(kept, mi) : std::move(out);
+}
+
+// ── Prompt templates ─────────────────────────────────────────────────────────
+// The report's instructions are the same few KB of text on every request.
+// medgemma_template_define() tokenizes a prompt's fixed text once and keeps
+// it as token IDs; a render then tokenizes only the values for its "{{…}}"
+// slots, and medgemma_submit_tokens() takes the result as it is. A fixed
+// part and the value after it are tokenized apart, so the spaces the part
+// ends with go with the value: Gemma's tokenizer glues a space to the word
+// after it.
+
+static const size_t MAX_TEMPLATES = 256; // distinct sources per engine
+
+struct PromptTemplate {
+  std::vector<std::vector<int64_t>> fixed; // one more than there are slots
+  std::vector<std::string> lead;           // per slot, spaces moved into it
+};
+
+// Appends the token IDs of `text`; `continued` drops the BOS the tokenizer
+// may put first.
+static void encode_append(OgaTokenizer *tok, const char *text, bool continued,
+                          std::vector<int64_t> &out) {
+  OgaSequences *seq = nullptr;
+  OgaCreateSequences(&seq);
+  OgaTokenizerEncode(tok, text, seq);
+  size_t count = OgaSequencesGetSequenceCount(seq, 0);
+  const int32_t *data = OgaSequencesGetSequenceData(seq, 0);
+  for (size_t i = 0; i < count; ++i)
+    if (!(continued && i == 0 && data[i] == 2))
+      out.push_back(static_cast<int64_t>(data[i]));
+  OgaDestroySequences(seq);
+}
+
+// A "{{" without a "}}" after it is text.
+static PromptTemplate template_parse(OgaTokenizer *tok,
+                                     const std::string &source) {
+  PromptTemplate t;
+  for (size_t pos = 0;;) {
+    size_t open = source.find("{{", pos);
+    size_t close = open == std::string::npos ? open : source.find("}}", open);
+    bool slot = close != std::string::npos;
+    std::string text = source.substr(pos, slot ? open - pos : source.size());
+    std::string lead;
+    while (slot && !text.empty() && text.back() == ' ') {
+      lead += ' ';
+      text.pop_back();
+    }
+    t.fixed.emplace_back();
+    if (!text.empty())
+      encode_append(tok, text.c_str(), true, t.fixed.back());
+    if (!slot)
+      return t;
+    t.lead.push_back(lead);
+    pos = close + 2;
+  }
+}
+
+// Appends `t` with `values` (null → empty) in its slots, in order.
+static void template_render(OgaTokenizer *tok, const PromptTemplate &t,
+                            const char *const *values,
+                            std::vector<int64_t> &out) {
+  for (size_t i = 0; i < t.lead.size(); ++i) {
+    out.insert(out.end(), t.fixed[i].begin(), t.fixed[i].end());
+    std::string value = t.lead[i] + (values[i] ? values[i] : "");
+    if (!value.empty())
+      encode_append(tok, value.c_str(), true, out);
+  }
+  out.insert(out.end(), t.fixed.back().begin(), t.fixed.back().end());
+}
+
+// ── Context planning ─────────────────────────────────────────────────────────
+// The model attends over at most context_length positions. A prompt that
+// fills them leaves nothing to generate, and the app used to guess at that
+// with 4 characters a token. medgemma_plan_context() measures the prompt's
+// segments with the tokenizer before anything is submitted and, over a
+// target, drops or shortens the segments the caller marked as expendable.
+// What still gets past it is turned away by seq_prepare before the prefill.
+
+// Tokens of `text`, without BOS.
+static int32_t count_tokens(OgaTokenizer *tok, const std::string &text) {
+  std::vector<int64_t> ids;
+  if (!text.empty())
+    encode_append(tok, text.c_str(), true, ids);
+  return static_cast<int32_t>(ids.size());
+}
+
+// Length of the longest start of `text` that ends between two characters
+// and is at most `budget` tokens. A binary search over the cut, each probe
+// tokenized: a token can span a cut, so characters are no guide.
+static size_t fit_prefix(OgaTokenizer *tok, const std::string &text,
+                         int32_t budget) {
+  std::vector<size_t> cuts; // UTF-8 character boundaries
+  for (size_t i = 0; i <= text.size(); ++i)
+    if (i == text.size() || (text[i] & 0xC0) != 0x80)
+      cuts.push_back(i);
+  size_t lo = 0, hi = cuts.size() - 1; // cuts[lo] fits
+  while (lo < hi) {
+    size_t mid = (lo + hi + 1) / 2;
+    if (count_tokens(tok, text.substr(0, cuts[mid])) <= budget)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return cuts[lo];
+}
+
+// ── Classification ───────────────────────────────────────────────────────────
+// Sorting patients only needs RED, YELLOW or GREEN, not the report behind
+// it. medgemma_submit_classify() runs a job that stops after the prefill: the
+// logits at the end of the prompt give each label's first token its
+// log-probability, and a label of several tokens gets the rest from one
+// decoder Run over them on top of the prompt's cache (seq_score_labels).
+// Normalised among the labels, these are the classification; their sum says
+// how much the model meant to answer with a label at all.
+
+struct LabelSet {
+  std::vector<int64_t> shared;             // what every label starts with
+  std::vector<std::vector<int64_t>> tails; // the rest of each, not empty
+  float temperature = 1;                   // divides the log-probabilities
+};
+
+// Tokenizes each label on its own and moves the tokens they all start with
+// to `shared`, leaving every label at least one. False if a label has none.
+static bool label_set(OgaTokenizer *tok, const char *const *labels,
+                      int32_t n, LabelSet &out) {
+  std::vector<std::vector<int64_t>> &tails = out.tails;
+  tails.assign(n, {});
+  size_t shortest = SIZE_MAX;
+  for (int32_t i = 0; i < n; ++i) {
+    if (labels[i] && *labels[i])
+      encode_append(tok, labels[i], true, tails[i]);
+    if (tails[i].empty())
+      return false;
+    shortest = std::min(shortest, tails[i].size());
+  }
+  size_t common = 0;
+  while (common + 1 < shortest &&
+         std::all_of(tails.begin(), tails.end(),
+                     [&](const std::vector<int64_t> &t) {
+                       return t[common] == tails[0][common];
+                     }))
+    ++common;
+  out.shared.assign(tails[0].begin(), tails[0].begin() + common);
+  for (auto &t : tails)
+    t.erase(t.begin(), t.begin() + common);
+  return true;
+}
+
+// log(sum(exp(x))) over a row of logits, without overflow.
+static double log_sum_exp(const float *x, size_t n) {
+  const float top = *std::max_element(x, x + n);
+  double sum = 0;
+  for (size_t i = 0; i < n; ++i)
+    sum += std::exp((double)x[i] - top);
+  return top + std::log(sum);
+}
+
+// The result from each label's log-probability (`logp`, one per label) and
+// that of their shared start (`shared_logp`), which only counts in coverage.
+static MedGemmaClassification classify_result(const LabelSet &set,
+                                              const std::vector<double> &logp,
+                                              double shared_logp) {
+  MedGemmaClassification out = {};
+  out.label = -1;
+  out.n_labels = (int32_t)set.tails.size();
+  if (logp.size() != set.tails.size())
+    return out;
+  const double top = *std::max_element(logp.begin(), logp.end());
+  double sum = 0, coverage = 0;
+  for (double l : logp) {
+    sum += std::exp((l - top) / set.temperature);
+    coverage += std::exp(shared_logp + l);
+  }
+  for (size_t i = 0; i < logp.size(); ++i) {
+    out.probs[i] = (float)(std::exp((logp[i] - top) / set.temperature) / sum);
+    if (out.label < 0 || out.probs[i] > out.probs[out.label])
+      out.label = (int32_t)i;
+  }
+  out.coverage = (float)std::min(coverage, 1.0);
+  return out;
+}
+
+struct InferenceJob;
+
+// Running totals behind medgemma_get_queue_stats, indexed by JobPriority.
+struct QueueCounters {
+  int64_t submitted = 0;
+  int64_t finished = 0;
+  int64_t preemptions = 0;
+  double wait_sum_ms[PRIORITY_COUNT] = {};
+  double wait_max_ms[PRIORITY_COUNT] = {};
+  int64_t wait_n[PRIORITY_COUNT] = {};
+  double ttft_sum_ms[PRIORITY_COUNT] = {};
+  int64_t ttft_n[PRIORITY_COUNT] = {};
+};
+
+// Behind medgemma_get_last_metrics: the last terminal job's timings and the
+// totals over all of them. Written by settle_job on whichever thread settles,
+// read from the caller's; the mutex is a leaf (nothing is taken under it).
+struct MetricsBook {
+  std::mutex mutex;
+  bool has_last = false;
+  MedGemmaJobTimings last = {};
+  MedGemmaCounters totals = {};
+
+  void record(const MedGemmaJobTimings &t) {
+    std::lock_guard<std::mutex> lock(mutex);
+    last = t;
+    has_last = true;
+    MedGemmaCounters &c = totals;
+    switch (t.status) {
+    case JOB_DONE: c.jobs_done++; break;
+    case JOB_CANCELLED: c.jobs_cancelled++; break;
+    case JOB_TIMED_OUT: c.jobs_timed_out++; break;
+    default: c.jobs_failed++; break;
+    }
+    c.images += t.image_tokens > 0;
+    c.prompt_tokens += t.prompt_tokens;
+    c.image_tokens += t.image_tokens;
+    c.generated_tokens += t.generated_tokens;
+    c.queue_ms += t.queue_ms;
+    c.image_ms += t.image_ms;
+    c.vision_ms += t.vision_ms;
+    c.embed_ms += t.embed_ms;
+    c.prefill_ms += t.prefill_ms;
+    c.decode_ms += t.decode_ms;
+    c.sample_ms += t.sample_ms;
+    c.detokenize_ms += t.detokenize_ms;
+    c.rss_peak_kb = std::max(c.rss_peak_kb, t.rss_peak_kb);
+    c.vision_peak_kb = std::max(c.vision_peak_kb, t.vision_peak_kb);
+    c.prefill_peak_kb = std::max(c.prefill_peak_kb, t.prefill_peak_kb);
+    c.decode_peak_kb = std::max(c.decode_peak_kb, t.decode_peak_kb);
+  }
+
+  int32_t read(MedGemmaJobTimings *out_last, MedGemmaCounters *out_totals) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (out_totals)
+      *out_totals = totals;
+    if (!has_last)
+      return 1;
+    if (out_last)
+      *out_last = last;
+    return 0;
+  }
+};
+
+class MedGemmaState {
+public:
+  std::string model_dir;
+  std::unique_ptr<Ort::Env> env;
+  std::unique_ptr<Ort::SessionOptions> session_options;
+  std::unique_ptr<Ort::SessionOptions>
+      vision_session_options; // lower RAM for vision encoder
+  std::unique_ptr<Ort::Session> v_sess, p_sess, e_sess, m_sess;
+  std::unique_ptr<OgaTokenizer, OgaTokenizerDeleter> tokenizer;
+  Ort::MemoryInfo memory_info;
+  int64_t image_token_id =
+      -1; // discovered at load time by tokenizing "<image>"
+  std::vector<int64_t> turn_close; // "<end_of_turn>\n", likewise
+
+  // Long-lived scheduler that owns every session Run (see scheduler_loop).
+  // Started by load_medgemma_4bit, stopped and joined by unload_medgemma.
+  std::thread worker;
+  std::mutex queue_mutex; // guards the fields below
+  std::condition_variable queue_cv;
+  std::deque<std::shared_ptr<InferenceJob>> queue;
+  int max_batch = DEFAULT_MAX_BATCH; // requests in flight at once
+  bool reload_vision = false;        // set by reset_inference_state
+  bool stopping = false;
+  std::map<int64_t, std::shared_ptr<ChatSession>> sessions;
+  bool draft_work = false; // a session_push the scheduler has not looked at
+  QueueCounters counters;
+  int running = 0; // admitted jobs, as of the scheduler's last round
+  MetricsBook metrics;
+  std::unique_ptr<Tracer> tracer; // set_trace_dir was called before load
+  MemoryMonitor memory;
+  MemoryEstimates estimates; // see plan_request
+  DecoderIO io;              // names and KV cache layout of m_sess
+  uint64_t model_hash = 0;   // model_fingerprint, for KV snapshots
+  int context_length = 0;    // model_context_length, 0 → unknown
+
+  // Prompt templates by ID - 1; a deque, so renders can hold on to one
+  // while another is defined.
+  std::mutex template_mutex; // guards the two below
+  std::deque<PromptTemplate> templates;
+  std::unordered_map<std::string, int32_t> template_ids; // by source
+
+  MedGemmaState(const char *path)
+      : model_dir(path), memory_info(Ort::MemoryInfo::CreateCpu(
+                             OrtArenaAllocator, OrtMemTypeDefault)) {
+    LOGI("Loading MedGemma from: %s", path);
+    {
+      std::lock_guard<std::mutex> lock(g_log_mutex);
+      if (!g_trace_dir.empty())
+        tracer = std::make_unique<Tracer>(g_trace_dir);
+    }
+    if (tracer)
+      LOGI("Tracing to %s", tracer->dir().c_str());
+    env = std::make_unique<Ort::Env>(ORT_LOGGING_LEVEL_WARNING, "MedGemma");
+    try {
+      env->RegisterAllocator(&stage_allocator());
+    } catch (const Ort::Exception &e) {
+      // Still registered from an earlier engine: ORT's env is process-wide.
+      LOGD("RegisterAllocator: %s", e.what());
+    }
+    session_options = std::make_unique<Ort::SessionOptions>();
+
+    // ── LLM session: prioritize low peak RAM over speed ──────────────
+    // int4 Gemma-2 dequantizes weights to fp32 during compute. With parallel
+    // threads, multiple layers dequantize simultaneously = ~480 MB spike.
+    // Single-threaded sequential execution cuts peak by ~60-70%.
+    session_options->SetIntraOpNumThreads(1);
+    session_options->SetInterOpNumThreads(1);
+    session_options->SetExecutionMode(ExecutionMode::ORT_SEQUENTIAL);
+    session_options->SetGraphOptimizationLevel(
+        GraphOptimizationLevel::ORT_ENABLE_BASIC);
+    session_options->AddConfigEntry("session.use_mmap", "1");
+    session_options->DisableMemPattern();
+    session_options->DisableCpuMemArena(); // free buffers immediately, don't
+                                           // cache in arena
+    session_options->AddConfigEntry("session.use_env_allocators", "1");
+
+    // ── Vision-specific session options (lower RAM footprint) ───────────
+    vision_session_options = std::make_unique<Ort::SessionOptions>();
+    vision_session_options->SetIntraOpNumThreads(
+        2); // fewer threads = less parallel RAM
+    vision_session_options->SetGraphOptimizationLevel(
+        GraphOptimizationLevel::ORT_ENABLE_BASIC);
+    vision_session_options->AddConfigEntry("session.use_mmap", "1");
+    vision_session_options
+        ->DisableMemPattern(); // don't pre-allocate memory pattern
+    vision_session_options
+        ->DisableCpuMemArena(); // release memory immediately after use
+    vision_session_options->SetExecutionMode(
+        ExecutionMode::ORT_SEQUENTIAL); // sequential = less peak RAM
+    vision_session_options->AddConfigEntry("session.use_env_allocators", "1");
+
+    OgaConfig *config = nullptr;
+    if (OgaCreateConfig(path, &config) == 0) {
+      OgaModel *temp_model = nullptr;
+      if (OgaCreateModelFromConfig(config, &temp_model) == 0) {
+        OgaTokenizer *tok = nullptr;
+        if (OgaCreateTokenizer(temp_model, &tok) == 0) {
+          tokenizer.reset(tok);
+          LOGI("Tokenizer loaded OK");
+
+          // ── Discover the image token ID ──────────────────────────────
+          // Do NOT hardcode — the actual ID depends on the tokenizer vocab.
+          // We tokenize the literal string "<image>" and take the first token
+          // that isn't BOS (token 2) as the image placeholder token.
+          const char *img_probe = "<image>";
+          OgaSequences *img_seq = nullptr;
+          OgaCreateSequences(&img_seq);
+          if (OgaTokenizerEncode(tok, img_probe, img_seq) == 0) {
+            size_t img_count = OgaSequencesGetSequenceCount(img_seq, 0);
+            const int32_t *img_data = OgaSequencesGetSequenceData(img_seq, 0);
+            LOGI("<image> tokenizes to %zu token(s):", img_count);
+            for (size_t ti = 0; ti < img_count; ++ti)
+              LOGI("  [%zu] = %d", ti, img_data[ti]);
+            // Take first non-BOS token as the image placeholder
+            for (size_t ti = 0; ti < img_count; ++ti) {
+              if (img_data[ti] != 2) { // 2 = BOS in Gemma vocab
+                image_token_id = static_cast<int64_t>(img_data[ti]);
+                break;
+              }
+            }
+          }
+          OgaDestroySequences(img_seq);
+          if (image_token_id < 0) {
+            // Fallback to known MedGemma value if probe failed
+            image_token_id = 255999;
+            LOGE("<image> token discovery failed — using fallback id=255999");
+          }
+          LOGI("Image token ID: %lld", image_token_id);
+
+          // What closes a model turn in a chat session's cache.
+          OgaSequences *close_seq = nullptr;
+          OgaCreateSequences(&close_seq);
+          if (OgaTokenizerEncode(tok, "<end_of_turn>\n", close_seq) == 0) {
+            size_t n = OgaSequencesGetSequenceCount(close_seq, 0);
+            const int32_t *ids = OgaSequencesGetSequenceData(close_seq, 0);
+            for (size_t ti = 0; ti < n; ++ti)
+              if (ids[ti] != 2)
+                turn_close.push_back(ids[ti]);
+          }
+          OgaDestroySequences(close_seq);
+          if (turn_close.empty())
+            turn_close = {EOS_IDS.back()};
+        } else {
+          LOGE("OgaCreateTokenizer FAILED");
+        }
+        OgaDestroyModel(temp_model);
+      } else {
+        LOGE("OgaCreateModelFromConfig FAILED");
+      }
+      OgaDestroyConfig(config);
+    } else {
+      LOGE("OgaCreateConfig FAILED: %s", path);
+    }
+
+    auto load = [&](const std::string &p, Ort::SessionOptions &opts) {
+      LOGI("Loading session: %s", p.c_str());
+      return open_session(*env, p, opts, tracer.get());
+    };
+    // Vision encoder + projection use memory-conservative options
+    v_sess = load(model_dir + "/vision_encoder.ort", *vision_session_options);
+    p_sess =
+        load(model_dir + "/vision_projection.ort", *vision_session_options);
+    estimates.vision_weights_kb = file_kb(model_dir + "/vision_encoder.ort") +
+                                  file_kb(model_dir + "/vision_projection.ort");
+    // Text sessions use standard options
+    e_sess = load(model_dir + "/embeddings.ort", *session_options);
+    m_sess = load(decoder_path(model_dir), *session_options);
+    io.load(*m_sess);
+    model_hash = model_fingerprint(model_dir);
+    context_length = model_context_length(model_dir);
+    LOGI("Context length: %d", context_length);
+    estimates.kv_position_bytes = io.position_bytes;
+    LOGI("Decoder KV cache: %s, %.1f KB per position", io.precision.c_str(),
+         io.position_bytes / 1024.0);
+    LOGI("All sessions loaded OK");
+  }
+};
+
+// ── Image processing
+// ────────────────────────────────────────────────────────── Memory layout
+// during this call (all freed before returning):
+//   raw JPEG buffer  : owned by caller, not freed here
+//   stb decoded img  : ~w*h*3 bytes  → freed with stbi_image_free()
+//   resized buffer   : 896*896*3 = 2.35 MB (vector, freed at end of scope)
+//   pixel_values     : 896*896*3*4 = 9.2 MB float (returned, freed by caller)
+// Peak usage while both resized + pixel_values exist: ~11.6 MB
+// After return only pixel_values remains until vision encoder runs.
+// `times`, if given, gets the decode / resize / normalize split.
+std::vector<float> process_image_bytes(const uint8_t *data, size_t len,
+                                       std::string &error_out,
+                                       MedGemmaJobTimings *times = nullptr) {
+  error_out.clear();
+  MedGemmaJobTimings unused;
+  MedGemmaJobTimings &t = times ? *times : unused;
+  auto phase_start = std::chrono::steady_clock::now();
+  auto lap = [&](double &field) {
+    field = ms_since(phase_start);
+    phase_start = std::chrono::steady_clock::now();
+  };
+  LOGD("process_image_bytes: %zu bytes input", len);
+
+  if (!data || len == 0) {
+    error_out = "[IMG_ERR] Input is null or empty";
+    LOGE("%s", error_out.c_str());
+    return {};
+  }
+
+  // ── Decode ────────────────────────────────────────────────────────
+  TraceSpan trace("image_decode");
+  int w = 0, h = 0, c = 0;
+  uint8_t *img = stbi_load_from_memory(reinterpret_cast<const stbi_uc *>(data),
+                                       static_cast<int>(len), &w, &h, &c, 3);
+
+  if (!img) {
+    const char *reason = stbi_failure_reason();
+    error_out = std::string("[IMG_ERR] Decode failed: ") +
+                (reason ? reason : "unknown");
+    LOGE("%s", error_out.c_str());
+    return {};
+  }
+  LOGD("Decoded OK: %dx%d ch=%d (%.1f KB)", w, h, c, (w * h * 3) / 1024.0f);
+  lap(t.image_decode_ms);
+  trace.next("image_resize");
+
+  // ── Resize to 896x896 ─────────────────────────────────────────────
+  const int TARGET = 896;
+  std::vector<float> pixel_values; // declared here so we can return it
+
+  {
+    // Inner scope: resized buffer lives here and is freed when scope exits,
+    // BEFORE pixel_values is fully populated — keeps peak RAM lower.
+    std::vector<uint8_t> resized(static_cast<size_t>(TARGET * TARGET * 3));
+
+    // stbir_resize_uint8_linear returns uint8_t* NOT int — must store as
+    // pointer
+    uint8_t *ok = stbir_resize_uint8_linear(img, w, h, 0, resized.data(),
+                                            TARGET, TARGET, 0, STBIR_RGB);
+
+    stbi_image_free(img); // free decoded image immediately after resize
+    img = nullptr;
+
+    if (ok == nullptr) {
+      error_out = "[IMG_ERR] Resize failed (stbir returned null)";
+      LOGE("%s", error_out.c_str());
+      return {};
+    }
+    LOGD("Resized to %dx%d (%.1f KB)", TARGET, TARGET,
+         (TARGET * TARGET * 3) / 1024.0f);
+    lap(t.image_resize_ms);
+    trace.next("image_normalize");
+
+    // ── HWC uint8 → CHW float32, SigLIP normalization ────────────────
+    // SigLIP (MedGemma's vision encoder) expects (value/255 - mean) / std
+    // with mean=[0.5,0.5,0.5] and std=[0.5,0.5,0.5] per channel.
+    // This is mathematically identical to (value/127.5 - 1.0) but written
+    // explicitly so the values are easy to update if the model changes.
+    // stb_image already outputs RGB order — do NOT swap to BGR.
+    constexpr float MEAN = 0.5f;
+    constexpr float STD = 0.5f;
+    pixel_values.resize(static_cast<size_t>(3 * TARGET * TARGET));
+    const int area = TARGET * TARGET;
+    for (int i = 0; i < area; ++i)
+      for (int ch = 0; ch < 3; ++ch)
+        pixel_values[ch * area + i] =
+            ((resized[i * 3 + ch] / 255.0f) - MEAN) / STD;
+    lap(t.image_normalize_ms);
+
+    // resized vector is freed here when scope exits (~2.35 MB freed)
+  }
+
+  LOGD("process_image_bytes OK: %zu floats (%.1f MB)", pixel_values.size(),
+       pixel_values.size() * 4 / (1024.0f * 1024.0f));
+  return pixel_values;
+}
+// ─────────────────────────────────────────────────────────────────────────────
+
+// ── Visual token pooling ─────────────────────────────────────────────────────
+// The projector hands over a 16×16 grid of visual tokens: 256 positions of
+// prefill per image, which is most of the time to the first token of an image
+// assessment on a slow device. medgemma_set_image_pooling() averages 2×2 or
+// 4×4 neighbours into one token, leaving an 8×8 grid of 64 or a 4×4 grid of
+// 16, and the <image> placeholder expands to that many positions instead.
+// Gemma 3's projector already gets to 16×16 by average pooling SigLIP's 64×64
+// patches, so the model has seen pooled tokens; what a coarser grid costs in
+// detail is measured with medgemma_bench --image-pooling.
+
+// MedGemmaImagePooling of requests from now on.
+static std::atomic<int> g_image_pooling{MEDGEMMA_IMAGE_POOL_NONE};
+
+// Side of the token grid for a MedGemmaImagePooling mode.
+static int pooled_grid(int pooling) {
+  return pooling == MEDGEMMA_IMAGE_POOL_4X4   ? 4
+         : pooling == MEDGEMMA_IMAGE_POOL_8X8 ? 8
+                                              : 16;
+}
+
+// Averages each block of the projector's 16×16 grid (row major, embed_dim
+// floats a token) into one token of a `grid`×`grid` one, in place. Tokens
+// that point different ways shrink when averaged, so each pooled token is
+// scaled back to the mean length of its block: the decoder expects tokens of
+// the projector's magnitude.
+static void pool_visual_tokens(std::vector<float> &embeds, int grid) {
+  const int side = 16, factor = side / grid;
+  if (factor <= 1 || embeds.size() != (size_t)num_patches * embed_dim)
+    return;
+  std::vector<float> out((size_t)grid * grid * embed_dim, 0.0f);
+  std::vector<double> length(grid * grid, 0.0);
+  for (int r = 0; r < side; ++r)
+    for (int c = 0; c < side; ++c) {
+      const int block = (r / factor) * grid + c / factor;
+      const float *src = &embeds[((size_t)r * side + c) * embed_dim];
+      float *dst = &out[(size_t)block * embed_dim];
+      double sq = 0;
+      for (int d = 0; d < embed_dim; ++d) {
+        dst[d] += src[d];
+        sq += (double)src[d] * src[d];
+      }
+      length[block] += std::sqrt(sq);
+    }
+  const int per_block = factor * factor;
+  for (int b = 0; b < grid * grid; ++b) {
+    float *dst = &out[(size_t)b * embed_dim];
+    double sq = 0;
+    for (int d = 0; d < embed_dim; ++d)
+      sq += (double)dst[d] * dst[d];
+    // The block's mean direction, at its tokens' mean length.
+    const double scale = sq > 0 ? length[b] / per_block / std::sqrt(sq) : 0;
+    for (int d = 0; d < embed_dim; ++d)
+      dst[d] = (float)(dst[d] * scale);
+  }
+  embeds.swap(out);
+}
+
+// ── Image file mapping ───────────────────────────────────────────────────────
+// Read-only mapping of an encoded image, so stb decodes straight from the page
+// cache instead of from a Dart Uint8List that was copied into the isolate
+// message and again into a calloc buffer. The fd (if given) stays owned by the
+// caller: the mapping keeps the file alive on its own once created.
+class MappedImage {
+public:
+  // `fd` > 0 wins over `path`. Returns null (and logs why) on failure.
+  static std::unique_ptr<MappedImage> open(const char *path, int fd) {
+    std::unique_ptr<MappedImage> m(new MappedImage());
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    bool own = false;
+    if (fd > 0) {
+      file = reinterpret_cast<HANDLE>(_get_osfhandle(fd));
+    } else if (path) {
+      file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr,
+                         OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+      own = true;
+    }
+    if (file == INVALID_HANDLE_VALUE) {
+      LOGE("MappedImage: cannot open %s", path ? path : "(fd)");
+      return nullptr;
+    }
+    LARGE_INTEGER size;
+    HANDLE mapping = nullptr;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+      mapping =
+          CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping) {
+      m->data_ = static_cast<const uint8_t *>(
+          MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+      CloseHandle(mapping); // the view holds its own reference
+    }
+    if (own)
+      CloseHandle(file);
+    if (!m->data_) {
+      LOGE("MappedImage: cannot map %s", path ? path : "(fd)");
+      return nullptr;
+    }
+    m->size_ = static_cast<size_t>(size.QuadPart);
+#else
+    int file = fd > 0 ? fd : (path ? ::open(path, O_RDONLY | O_CLOEXEC) : -1);
+    if (file < 0) {
+      LOGE("MappedImage: cannot open %s: %s", path ? path : "(fd)",
+           strerror(errno));
+      return nullptr;
+    }
+    struct stat st;
+    void *addr = MAP_FAILED;
+    if (fstat(file, &st) == 0 && st.st_size > 0)
+      addr = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ,
+                  MAP_PRIVATE, file, 0);
+    if (file != fd)
+      ::close(file);
+    if (addr == MAP_FAILED) {
+      LOGE("MappedImage: cannot map %s", path ? path : "(fd)");
+      return nullptr;
+    }
+    m->data_ = static_cast<const uint8_t *>(addr);
+    m->size_ = static_cast<size_t>(st.st_size);
+    // Start readahead now: the job usually waits in the queue (or behind the
+    // prompt prefill) before the decode touches these pages.
+    madvise(addr, m->size_, MADV_WILLNEED);
+#endif
+    return m;
+  }
+
+  ~MappedImage() {
+    if (!data_)
+      return;
+#ifdef _WIN32
+    UnmapViewOfFile(data_);
+#else
+    munmap(const_cast<uint8_t *>(data_), size_);
+#endif
+  }
+
+  const uint8_t *data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  MappedImage() = default;
+  MappedImage(const MappedImage &) = delete;
+  MappedImage &operator=(const MappedImage &) = delete;
+
+  const uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+};
+
+// ── Request control ──────────────────────────────────────────────────────────
+// Shared by every ORT Run of one request. cancel()/expire() may be called from
+// any thread: SetTerminate makes the Run in flight bail out at its next kernel
+// boundary, and the flags stop the host loops between steps.
+struct GenControl {
+  Ort::RunOptions run_opts;
+  std::atomic<bool> cancelled{false};
+  std::atomic<bool> timed_out{false};
+  bool has_deadline = false;
+  std::chrono::steady_clock::time_point deadline;
+
+  GenControl() { run_opts.SetRunLogSeverityLevel(3); }
+
+  void cancel() {
+    cancelled = true;
+    run_opts.SetTerminate();
+  }
+  void expire() {
+    timed_out = true;
+    run_opts.SetTerminate();
+  }
+  bool stop_requested() {
+    if (!cancelled && !timed_out && has_deadline &&
+        std::chrono::steady_clock::now() >= deadline)
+      expire();
+    return cancelled || timed_out;
+  }
+};
+
+typedef std::function<void(const char *)> EmitFn;
+
+// ── Stop strings ─────────────────────────────────────────────────────────────
+// When the recent output contains any of these, generation is complete.
+static const std::vector<std::string> STOP_STRINGS = {
+    "<end_of_turn>", // Gemma control token (text form)
+    "<eos>",         // explicit eos string
+    "---END OF REPORT---",
+    "--- END OF REPORT ---",
+    "End of Report",
+    "end of report",
+    // Common patterns the model emits before trailing disclaimers:
+    "Generated by KintaMed",
+    "Disclaimer:",
+    "DISCLAIMER:",
+    "Note: This AI",
+    "Note: This report",
+    "NOTE: This",
+    "*This report is",
+    "This is not medical advice",
+    "Confidentiality Notice",
+};
+
+// Rolling window of the last output characters, matched against STOP_STRINGS.
+struct StopMatcher {
+  static const size_t BUF_SIZE =
+      64; // keep last 64 chars — enough to match longest stop string
+  std::string buf;
+
+  // Appends `text` and returns true once a stop string has been produced.
+  bool feed(const char *text) {
+    if (!text)
+      return false;
+    buf += text;
+    // Keep only the last BUF_SIZE characters
+    if (buf.size() > BUF_SIZE * 2)
+      buf.erase(0, buf.size() - BUF_SIZE);
+
+    // 1. Standard exact match for controlled tokens like <eos>
+    for (const auto &ss : STOP_STRINGS) {
+      if (buf.size() >= ss.size()) {
+        if (buf.find(ss) != std::string::npos) {
+          LOGI("Stop string triggered (exact): '%s'", ss.c_str());
+          return true;
+        }
+      }
+    }
+
+    // 2. Normalized match for "END OF REPORT" to handle case, spacing, and
+    // punctuation variations
+    std::string normalized;
+    for (char c : buf) {
+      if (std::isalnum(c)) {
+        normalized += (char)std::tolower(c);
+      }
+    }
+
+    if (normalized.find("endofreport") != std::string::npos) {
+      LOGI("Stop string triggered (normalized): 'endofreport'");
+      return true;
+    }
+
+    if (normalized.find("generatedbykintamed") != std::string::npos) {
+      LOGI("Stop string triggered (normalized): 'generatedbykintamed'");
+      return true;
+    }
+
+    return false;
+  }
+};
+
+// Vision sessions are dropped after use to save ~430 MB; bring them back
+// before the next image. Runs on the scheduler thread.
+static void ensure_vision_sessions(MedGemmaState *state) {
+  auto reload = [&](const std::string &p, Ort::SessionOptions &opts) {
+    LOGI("Reloading: %s", p.c_str());
+    return open_session(*state->env, p, opts, state->tracer.get());
+  };
+  if (!state->v_sess) {
+    state->v_sess = reload(state->model_dir + "/vision_encoder.ort",
+                           *state->vision_session_options);
+    LOGI("vision_encoder reloaded");
+  }
+  if (!state->p_sess) {
+    state->p_sess = reload(state->model_dir + "/vision_projection.ort",
+                           *state->vision_session_options);
+    LOGI("vision_projection reloaded");
+  }
+}
+
+// Destroys the vision encoder + projection sessions (SigLIP and projection
+// weights) until the next image needs them.
+static void drop_vision_sessions(MedGemmaState *state) {
+  if (!state->v_sess && !state->p_sess)
+    return;
+  MedGemmaMemoryStatus before, after;
+  bool sampled = sample_memory(before);
+  if (state->tracer) {
+    if (state->v_sess)
+      state->tracer->end_session(*state->v_sess, "vision_encoder");
+    if (state->p_sess)
+      state->tracer->end_session(*state->p_sess, "vision_projection");
+  }
+  state->v_sess.reset();
+  state->p_sess.reset();
+  if (sampled && sample_memory(after) && before.available_kb >= 0)
+    LOGI("Vision sessions freed: RAM %lld MB → %lld MB (reclaimed %lld MB)",
+         (long long)(before.available_kb / 1024),
+         (long long)(after.available_kb / 1024),
+         (long long)((after.available_kb - before.available_kb) / 1024));
+  else
+    LOGI("Vision encoder + projection sessions freed");
+}
+
+// ── KV snapshots ─────────────────────────────────────────────────────────────
+// A reopened case used to rebuild its conversation from scratch: the image
+// through the vision encoder, then the whole prompt through prefill.
+// medgemma_session_save() writes a session's cache next to the assessment
+// instead, and medgemma_session_load() opens a session that continues it.
+//
+// The file is a header, then per cache tensor (layer by layer, key then
+// value) its positions {kv_heads, kv_len, head_dim} in the saving engine's
+// KV precision (medgemma_set_kv_precision), followed for int8 by one float
+// scale per head and position, each block 64-byte aligned. The cache is
+// written as it is, so the same engine resumes exactly where it stopped, and
+// an engine of another precision converts it. Loading only maps the file and
+// checks the header. The first job copies the cache out of the mapping, or
+// with an int8 decoder and file reads it in place, so the follow-up starts
+// answering after one prefill of its own turn.
+static const char KV_SNAPSHOT_MAGIC[8] = {'M', 'G', 'K', 'V', 'S', 'N', 'P', 2};
+
+struct KvSnapshotHeader {
+  char magic[8];
+  uint64_t model_hash;
+  int32_t tensors; // key and value per layer, scales not counted
+  int32_t kv_heads;
+  int32_t head_dim;
+  int32_t window;
+  int32_t sink;
+  int32_t precision; // MedGemmaKvPrecision of the blocks
+  int64_t kv_len;
+  int64_t pinned;
+  int64_t pending; // the unfed last token, -1 if none
+};
+
+static uint64_t align64(uint64_t n) { return (n + 63) & ~uint64_t(63); }
+
+// The MedGemmaKvPrecision a cache tensor is stored in.
+static int32_t kv_precision_of(const DecoderIO::CacheTensor &ct) {
+  return ct.scale >= 0 ? MEDGEMMA_KV_INT8
+         : ct.type == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16 ? MEDGEMMA_KV_FP16
+                                                            : MEDGEMMA_KV_FP32;
+}
+
+// Offsets of tensor i's block and (int8 only) scales for `len` positions.
+static uint64_t snapshot_offset(int64_t len, size_t i, bool scales,
+                                int32_t precision) {
+  const uint64_t elem = precision == MEDGEMMA_KV_INT8   ? 1
+                        : precision == MEDGEMMA_KV_FP16 ? 2
+                                                        : 4;
+  const uint64_t q = align64((uint64_t)kv_heads * len * head_dim * elem);
+  const uint64_t f =
+      precision == MEDGEMMA_KV_INT8
+          ? align64((uint64_t)kv_heads * len * sizeof(float))
+          : 0;
+  return align64(sizeof(KvSnapshotHeader)) + i * (q + f) + (scales ? q : 0);
+}
+
+// The cache tensors that hold keys or values, in snapshot order.
+static std::vector<size_t> snapshot_tensors(const DecoderIO &io) {
+  std::vector<size_t> data;
+  for (size_t i = 0; i < io.cache.size(); ++i)
+    if (!io.cache[i].is_scale)
+      data.push_back(i);
+  return data;
+}
+
+// Writes `path` through a temporary file renamed over it, so a reader never
+// sees half a snapshot and a session still mapping the old file keeps it.
+static bool write_replacing(const char *path,
+                            const std::function<bool(FILE *)> &body) {
+  const std::string tmp = std::string(path) + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "wb");
+  if (!f) {
+    LOGE("KV snapshot: cannot create %s: %s", tmp.c_str(), strerror(errno));
+    return false;
+  }
+  bool ok = body(f);
+  ok = fflush(f) == 0 && ok;
+#ifndef _WIN32
+  ok = ok && fsync(fileno(f)) == 0;
+#endif
+  ok = fclose(f) == 0 && ok;
+#ifdef _WIN32
+  if (ok)
+    remove(path); // rename does not replace on Windows
+#endif
+  if (!ok || rename(tmp.c_str(), path) != 0) {
+    LOGE("KV snapshot: cannot write %s: %s", path, strerror(errno));
+    remove(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Writes a session's cache, `kv` in io's layout (the session's own tensors or
+// views of its spill file).
+static bool snapshot_write(const MedGemmaState *state,
+                           const std::vector<Ort::Value> &kv,
+                           const ChatSession &session, const char *path) {
+  const DecoderIO &io = state->io;
+  const std::vector<size_t> data = snapshot_tensors(io);
+  KvSnapshotHeader h = {};
+  memcpy(h.magic, KV_SNAPSHOT_MAGIC, sizeof(h.magic));
+  h.model_hash = state->model_hash;
+  h.tensors = (int32_t)data.size();
+  h.kv_heads = (int32_t)kv_heads;
+  h.head_dim = (int32_t)head_dim;
+  h.window = session.window;
+  h.sink = session.sink;
+  h.precision = kv_precision_of(io.cache[data[0]]);
+  h.kv_len = session.kv_len;
+  h.pinned = session.pinned;
+  h.pending = session.pending.empty() ? -1 : session.pending[0];
+  const int64_t rows = kv_heads * h.kv_len;
+
+  return write_replacing(path, [&](FILE *f) {
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    for (size_t n = 0; ok && n < data.size(); ++n) {
+      const DecoderIO::CacheTensor &ct = io.cache[data[n]];
+      if (ct.dim != head_dim || kv_precision_of(ct) != h.precision ||
+          (ct.type == ONNX_TENSOR_ELEMENT_DATA_TYPE_INT8 && ct.scale < 0)) {
+        ok = false;
+        break;
+      }
+      const size_t bytes = (size_t)rows * ct.row_bytes;
+      ok = file_seek(f, snapshot_offset(h.kv_len, n, false, h.precision),
+                     SEEK_SET) &&
+           fwrite(kv[data[n]].GetTensorRawData(), 1, bytes, f) == bytes;
+      if (ok && ct.scale >= 0)
+        ok = file_seek(f, snapshot_offset(h.kv_len, n, true, h.precision),
+                       SEEK_SET) &&
+             fwrite(kv[ct.scale].GetTensorRawData(), sizeof(float), rows,
+                    f) == (size_t)rows;
+    }
+    // Pad to the full size, so the reader's size check covers the last block.
+    const int64_t total =
+        snapshot_offset(h.kv_len, data.size(), false, h.precision);
+    return ok && file_seek(f, total - 1, SEEK_SET) && fputc(0, f) == 0;
+  });
+}
+
+// Maps a snapshot and checks it against this engine; the cache stays in the
+// file until snapshot_restore(). Null (and logs why) if it does not fit.
+static std::shared_ptr<ChatSession> snapshot_open(const MedGemmaState *state,
+                                                  const char *path) {
+  std::shared_ptr<const MappedImage> map = MappedImage::open(path, 0);
+  if (!map)
+    return nullptr;
+  KvSnapshotHeader h;
+  const char *why = nullptr;
+  if (map->size() < sizeof(h)) {
+    why = "truncated";
+  } else {
+    memcpy(&h, map->data(), sizeof(h));
+    const size_t tensors = snapshot_tensors(state->io).size();
+    if (memcmp(h.magic, KV_SNAPSHOT_MAGIC, sizeof(h.magic)) != 0)
+      why = "not a KV snapshot";
+    else if (h.model_hash != state->model_hash)
+      why = "saved with other weights";
+    else if (h.tensors != (int32_t)tensors || h.kv_heads != kv_heads ||
+             h.head_dim != head_dim)
+      why = "saved with another cache layout";
+    else if (h.kv_len <= 0 || h.kv_len > h.window || h.pinned < 0 ||
+             h.pinned > h.kv_len || h.pending < -1 ||
+             h.pending >= vocab_size || h.sink < 0 ||
+             h.window < h.sink + SESSION_MIN_ROOM ||
+             h.precision < MEDGEMMA_KV_FP32 ||
+             h.precision > MEDGEMMA_KV_INT8 ||
+             map->size() <
+                 snapshot_offset(h.kv_len, tensors, false, h.precision))
+      why = "truncated or corrupt";
+  }
+  if (why) {
+    LOGE("KV snapshot %s: %s", path, why);
+    return nullptr;
+  }
+  auto session = std::make_shared<ChatSession>();
+  session->window = h.window;
+  session->sink = h.sink;
+  session->pinned = h.pinned;
+  session->kv_len = h.kv_len;
+  session->snapshot_precision = h.precision;
+  if (h.pending >= 0)
+    session->pending.push_back(h.pending);
+  session->snapshot = std::move(map);
+  return session;
+}
+
+// Turns a loaded snapshot into the session's cache: views of the mapping when
+// both are int8 (past caches are only ever read), else a copy in the
+// decoder's precision, converted if the file has another. Runs on the
+// scheduler, in the first job's preparation.
+static void snapshot_restore(MedGemmaState *state, ChatSession &session) {
+  const DecoderIO &io = state->io;
+  const std::vector<size_t> data = snapshot_tensors(io);
+  const uint8_t *base = session.snapshot->data();
+  const int32_t saved = session.snapshot_precision;
+  const int64_t len = session.kv_len, rows = kv_heads * len;
+  std::vector<Ort::Value> kv(io.cache.size());
+  std::vector<float> x(head_dim);
+  bool mapped = false;
+  AllocScope scope(ALLOC_PREFILL);
+  for (size_t n = 0; n < data.size(); ++n) {
+    const DecoderIO::CacheTensor &ct = io.cache[data[n]];
+    const int32_t precision = kv_precision_of(ct);
+    auto *src = const_cast<uint8_t *>(base + snapshot_offset(len, n, false,
+                                                             saved));
+    auto *scales = const_cast<float *>(reinterpret_cast<const float *>(
+        base + snapshot_offset(len, n, true, saved)));
+    std::vector<int64_t> shape = {1, kv_heads, len, head_dim};
+    std::vector<int64_t> scale_shape = {1, kv_heads, len, 1};
+    if (precision == MEDGEMMA_KV_INT8 && saved == MEDGEMMA_KV_INT8) {
+      kv[data[n]] = Ort::Value::CreateTensor(
+          state->memory_info, src, (size_t)rows * head_dim, shape.data(),
+          shape.size(), ct.type);
+      kv[ct.scale] = Ort::Value::CreateTensor(
+          state->memory_info, scales, (size_t)rows * sizeof(float),
+          scale_shape.data(), scale_shape.size(),
+          ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT);
+      mapped = true;
+      continue;
+    }
+    kv[data[n]] = Ort::Value::CreateTensor(&stage_allocator(), shape.data(),
+                                           shape.size(), ct.type);
+    void *dst = kv[data[n]].GetTensorMutableRawData();
+    if (precision == saved) {
+      memcpy(dst, src, (size_t)rows * ct.row_bytes);
+      continue;
+    }
+    float *dst_scales = nullptr;
+    if (ct.scale >= 0) {
+      kv[ct.scale] = Ort::Value::CreateTensor(
+          &stage_allocator(), scale_shape.data(), scale_shape.size(),
+          ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT);
+      dst_scales = kv[ct.scale].GetTensorMutableData<float>();
+    }
+    for (int64_t r = 0; r < rows; ++r) {
+      const int64_t at = r * head_dim;
+      if (saved == MEDGEMMA_KV_INT8) {
+        const auto *in = reinterpret_cast<const int8_t *>(src) + at;
+        for (int d = 0; d < head_dim; ++d)
+          x[d] = in[d] * scales[r];
+      } else if (saved == MEDGEMMA_KV_FP16) {
+        const auto *in = reinterpret_cast<const Ort::Float16_t *>(src) + at;
+        for (int d = 0; d < head_dim; ++d)
+          x[d] = in[d].ToFloat();
+      } else {
+        memcpy(x.data(), reinterpret_cast<const float *>(src) + at,
+               head_dim * sizeof(float));
+      }
+      if (precision == MEDGEMMA_KV_INT8) {
+        dst_scales[r] = quantize_row(x.data(), head_dim,
+                                     static_cast<int8_t *>(dst) + at);
+      } else if (precision == MEDGEMMA_KV_FP16) {
+        auto *out = static_cast<Ort::Float16_t *>(dst) + at;
+        for (int d = 0; d < head_dim; ++d)
+          out[d] = Ort::Float16_t(x[d]);
+      } else {
+        memcpy(static_cast<float *>(dst) + at, x.data(),
+               head_dim * sizeof(float));
+      }
+    }
+  }
+  session.kv = std::move(kv);
+  if (!mapped)
+    session.snapshot.reset(); // copied: the mapping is not needed any more
+}
+
+// ── Sequences ────────────────────────────────────────────────────────────────
+// One request moving through the decoder. seq_prepare() runs the vision
+// encoder/projection and builds the prompt embeddings, seq_prefill_chunk()
+// advances the prompt a planned chunk at a time and decode_step() adds
+// one token to every sequence of a DecodeBatch. The scheduler interleaves
+// these units across requests. Every piece of output (tokens as well as
+// [ERR]/[WARN] notices) goes through `emit`; `ctl` is polled between units
+// and its RunOptions are used for the sequence's own ORT Runs, so a cancel or
+// deadline also interrupts a step in flight.
+struct Sequence {
+  enum Phase { PREPARE, PREFILL, DECODE, DONE };
+  Phase phase = PREPARE;
+
+  int64_t id = 0; // job ID, names the sequence's trace track
+  GenControl *ctl = nullptr;
+  EmitFn emit;
+  int max_tokens = 512;    // as planned; the job's request until then
+  int prefill_chunk = PREFILL_CHUNK; // as planned
+  float temperature = 0.29f;
+  float top_p = 0.75f;
+  float rep_penalty = 1.30f;
+  const uint8_t *image = nullptr; // borrowed from the job until PREFILL
+  int image_len = 0;
+  const char *prompt = nullptr;
+  const std::vector<int64_t> *prompt_tokens = nullptr; // instead of prompt
+
+  std::vector<float> embeds; // prompt embeddings, freed after prefill
+  int64_t prefill_pos = 0;   // prompt positions already in the KV cache
+
+  // 2 * num_layers tensors {1, kv_heads, kv_len, head_dim}. Empty while the
+  // sequence's cache is packed into a DecodeBatch.
+  std::vector<Ort::Value> kv;
+  int64_t kv_len = 0;
+  std::unique_ptr<KvSpill> spill; // set while kv views a spill file
+  std::shared_ptr<ChatSession> session; // the cache continues this chat
+  bool answered = false;                // the whole prompt is in the cache
+  // Pushed segments that come before the prompt (see Drafts). A draft unit
+  // has no prompt of its own and stops once they are in the cache.
+  std::vector<DraftSegment> draft;
+  bool draft_only = false;
+  // A classification scores these after the prefill instead of generating
+  // (see Classification): one log-probability per label, and that of the
+  // labels' shared start, which ends the prompt.
+  const LabelSet *labels = nullptr;
+  std::vector<double> label_logp;
+  double shared_logp = 0;
+
+  int64_t next_id = -1; // sampled, not yet fed back
+  int generated = 0;    // tokens emitted so far
+
+  // Track generated token IDs for repetition penalty.
+  // We keep the last 128 tokens — enough to catch phrase loops.
+  std::vector<int64_t> recent;
+  StopMatcher stop;
+
+  MedGemmaJobTimings times = {}; // stage times, filled in as it runs
+
+  bool finished() const { return phase == DONE || ctl->stop_requested(); }
+  // Prompt positions not yet in the cache. The embeddings are freed once
+  // they all are, while prefill_pos keeps counting them.
+  int64_t prompt_left() const {
+    return embeds.empty() ? 0
+                          : (int64_t)(embeds.size() / embed_dim) - prefill_pos;
+  }
+};
+
+// Cancellation is silent (the caller asked for it); a deadline leaves a
+// marker so the reader knows the report was cut short.
+static void note_stop(Sequence &seq) {
+  LOGI("Inference stopped early (%s)",
+       seq.ctl->timed_out ? "deadline" : "cancelled");
+  if (seq.ctl->timed_out)
+    seq.emit("[WARN] Deadline reached, stopping");
+}
+
+// Reports an exception out of one of the sequence's units and retires it.
+// SetTerminate surfaces as an ORT exception out of the Run in flight.
+static void fail_sequence(Sequence &seq, const std::exception &e) {
+  seq.phase = Sequence::DONE;
+  if (seq.ctl->stop_requested())
+    return; // note_stop() runs when the sequence is retired
+  std::string err = std::string("[EXCEPTION] ") + e.what();
+  LOGE("%s", err.c_str());
+  seq.emit(err.c_str());
+}
+
+// Moves the sequence's cache into a spill file (see KvSpill). False if there
+// is no file to move it to; the cache then stays where it was.
+static bool seq_spill(MedGemmaState *state, Sequence &seq) {
+  if (seq.spill || seq.phase == Sequence::PREPARE)
+    return true; // nothing cached yet
+  std::string dir;
+  {
+    std::lock_guard<std::mutex> lock(g_log_mutex);
+    dir = g_spill_dir.empty() ? state->model_dir : g_spill_dir;
+  }
+  const int64_t capacity =
+      seq.prompt_left() + seq.kv_len + seq.max_tokens - seq.generated + 1;
+  auto started = std::chrono::steady_clock::now();
+  TraceSpan trace("kv_spill");
+  seq.spill = KvSpill::create(dir, capacity, state->io);
+  if (!seq.spill)
+    return false;
+  seq.kv = seq.spill->store(seq.kv, seq.kv_len, state->memory_info);
+  seq.times.spills++;
+  LOGI("Job %lld: KV cache spilled to flash (%lld positions, %.1f MB, "
+       "%.0f ms)",
+       (long long)seq.id, (long long)seq.kv_len,
+       kv_kb(state->estimates, seq.kv_len) / 1024.0,
+       ms_since(started));
+  return true;
+}
+
+// Copies a spilled cache back into ordinary tensors and drops the file.
+static void seq_restore(MedGemmaState *state, Sequence &seq) {
+  if (!seq.spill)
+    return;
+  TraceSpan trace("kv_restore");
+  AllocScope scope(ALLOC_DECODE);
+  OrtAllocator *alloc = &stage_allocator();
+  for (size_t i = 0; i < seq.kv.size(); ++i) {
+    const DecoderIO::CacheTensor &ct = state->io.cache[i];
+    std::vector<int64_t> shape = {1, kv_heads, seq.kv_len, ct.dim};
+    Ort::Value copy = Ort::Value::CreateTensor(alloc, shape.data(),
+                                               shape.size(), ct.type);
+    if (seq.kv_len)
+      memcpy(copy.GetTensorMutableRawData(), seq.kv[i].GetTensorRawData(),
+             (size_t)seq.kv_len * kv_heads * ct.row_bytes);
+    seq.kv[i] = std::move(copy);
+  }
+  seq.spill.reset();
+  LOGI("Job %lld: KV cache restored from flash (%lld positions)",
+       (long long)seq.id, (long long)seq.kv_len);
+}
+
+// Keeps a session's cache within its window before `needed` more positions
+// go in: drops max(overflow, a quarter of the evictable part) positions after
+// the pinned ones (see Chat sessions).
+static void seq_make_room(MedGemmaState *state, Sequence &seq,
+                          int64_t needed) {
+  const ChatSession *session = seq.session.get();
+  if (!session || seq.kv_len + needed <= session->window)
+    return;
+  const int64_t pinned = std::min(session->pinned, seq.kv_len);
+  const int64_t n = std::min(seq.kv_len - pinned,
+                             std::max(seq.kv_len + needed - session->window,
+                                      (session->window - pinned) / 4));
+  if (n <= 0)
+    return;
+  auto started = std::chrono::steady_clock::now();
+  TraceSpan trace("kv_evict");
+  kv_evict(state->io, seq.kv, seq.kv_len, pinned, n, seq.spill.get(),
+           state->memory_info);
+  seq.kv_len -= n;
+  seq.times.evicted_tokens += (int32_t)n;
+  LOGI("Job %lld: evicted cache positions %lld..%lld (%lld kept, %.1f ms)",
+       (long long)seq.id, (long long)pinned, (long long)(pinned + n - 1),
+       (long long)seq.kv_len, ms_since(started));
+}
+
+// One decoder Run over `inputs` (embeddings, mask, then the past cache).
+// Without a spill this is a plain Run. With one, the present cache of
+// `present_len` positions is written into the spill file's free slot.
+static std::vector<Ort::Value> run_decoder(MedGemmaState *state,
+                                           Ort::RunOptions &opts,
+                                           std::vector<Ort::Value> &inputs,
+                                           KvSpill *spill,
+                                           int64_t present_len) {
+  const DecoderIO &io = state->io;
+  if (!spill)
+    return state->m_sess->Run(opts, io.in.data(), inputs.data(),
+                              inputs.size(), io.out.data(), io.out.size());
+  std::vector<Ort::Value> present;
+  if (!spill->next(present_len, present, state->memory_info))
+    throw std::runtime_error("no space left for the KV spill file");
+  Ort::IoBinding binding(*state->m_sess);
+  for (size_t i = 0; i < inputs.size(); ++i)
+    binding.BindInput(io.in[i], inputs[i]);
+  binding.BindOutput(io.out[0], state->memory_info);
+  for (size_t i = 0; i < present.size(); ++i)
+    binding.BindOutput(io.out[i + 1], present[i]);
+  state->m_sess->Run(opts, binding);
+  std::vector<Ort::Value> out = binding.GetOutputValues();
+  spill->flip();
+  return out;
+}
+
+static int64_t sample_next(MedGemmaState *state, Sequence &seq,
+                           const float *logits, size_t vocab) {
+  TraceSpan trace("sample");
+  auto started = std::chrono::steady_clock::now();
+  std::vector<float> last(logits, logits + vocab);
+  int64_t id = sample_top_p(last, seq.top_p, seq.temperature, &seq.recent,
+                            seq.rep_penalty, state->tokenizer.get());
+  seq.times.sample_ms += ms_since(started);
+  return id;
+}
+
+// Emits a freshly sampled token and decides whether the sequence goes on.
+static void seq_accept(MedGemmaState *state, Sequence &seq, int64_t id) {
+  if (std::find(EOS_IDS.begin(), EOS_IDS.end(), id) != EOS_IDS.end()) {
+    LOGI("EOS after %d tokens", seq.generated);
+    seq.next_id = -1; // nothing left to feed
+    seq.phase = Sequence::DONE;
+    return;
+  }
+  seq.next_id = id;
+  seq.generated++;
+  seq.recent.push_back(id);
+  if (seq.recent.size() > 128)
+    seq.recent.erase(seq.recent.begin());
+
+  int32_t to_dec = static_cast<int32_t>(id);
+  const char *decoded = nullptr;
+  auto decode_started = std::chrono::steady_clock::now();
+  {
+    TraceSpan trace("detokenize");
+    OgaTokenizerDecode(state->tokenizer.get(), &to_dec, 1, &decoded);
+  }
+  seq.times.detokenize_ms += ms_since(decode_started);
+  if (decoded) {
+    TraceSpan trace("emit");
+    seq.emit(decoded);
+  }
+
+  if (seq.stop.feed(decoded)) {
+    LOGI("Stop string triggered after %d tokens", seq.generated);
+    seq.phase = Sequence::DONE;
+  } else if (seq.generated >= seq.max_tokens) {
+    seq.phase = Sequence::DONE;
+  }
+}
+
+// Lays the prompt out for prefill: the projected image block in place of each
+// image token (nothing if there is no image), `embed_token(id)` — embed_dim
+// floats — for every other token. Returns how many image tokens it saw.
+template <typename EmbedToken>
+static int splice_prompt_embeds(std::vector<float> &out,
+                                const std::vector<int64_t> &tokens,
+                                int64_t image_token_id,
+                                const std::vector<float> &image_embeds,
+                                EmbedToken embed_token) {
+  out.reserve(out.size() + tokens.size() * embed_dim + image_embeds.size());
+  int injections = 0;
+  for (int64_t id : tokens) {
+    if (id == image_token_id) {
+      injections++;
+      out.insert(out.end(), image_embeds.begin(), image_embeds.end());
+    } else {
+      const float *row = embed_token(id);
+      out.insert(out.end(), row, row + embed_dim);
+    }
+  }
+  return injections;
+}
+
+// Right-padded attention mask, one row of `width` per sequence: row b has
+// valid[b] ones, then zeros.
+static void fill_attention_mask(std::vector<int64_t> &mask,
+                                const std::vector<int64_t> &valid,
+                                int64_t width) {
+  mask.assign(valid.size() * width, 0);
+  for (size_t b = 0; b < valid.size(); ++b)
+    std::fill_n(mask.begin() + b * width, std::min(valid[b], width), 1);
+}
+
+// Cuts a session's cache back to the drafted segments that `want` still
+// starts with. Returns how many that is; the rest are to be prefilled.
+static size_t draft_reconcile(MedGemmaState *state, ChatSession &session,
+                              const std::vector<DraftSegment> &want) {
+  size_t keep = 0;
+  while (keep < session.drafted.size() && keep < want.size() &&
+         session.drafted[keep].same(want[keep]))
+    keep++;
+  if (session.draft_base < 0)
+    return 0;
+  const int64_t end =
+      keep ? session.drafted[keep - 1].end : session.draft_base;
+  session.drafted.resize(keep);
+  if (!keep)
+    session.draft_base = -1;
+  if (session.kv_len > end) {
+    if (session.snapshot && session.kv.empty())
+      snapshot_restore(state, session);
+    TraceSpan trace("kv_truncate");
+    kv_evict(state->io, session.kv, session.kv_len, end,
+             session.kv_len - end, session.spill.get(), state->memory_info);
+    LOGI("Session %lld: draft cut back to %zu segment(s), %lld positions",
+         (long long)session.id, keep, (long long)end);
+    session.kv_len = end;
+  }
+  return keep;
+}
+
+// Steps 1–5: tokenize → plan → optional image → vision encoder/projection →
+// prompt embeddings. `in` carries what the scheduler knows about the other
+// jobs (keep_vision: another request with an image is already waiting); the
+// prompt's own inputs are filled in here once it is tokenized.
+static void seq_prepare(MedGemmaState *state, Sequence &seq, PlanInput in) {
+  // Segments already drafted stay in the cache; the others go in first,
+  // with the last image among them unless the job brought its own.
+  ChatSession *session = seq.session.get();
+  const size_t drafted =
+      session ? draft_reconcile(state, *session, seq.draft) : 0;
+  for (size_t i = seq.draft.size(); i-- > drafted && !seq.image;)
+    if (!seq.draft[i].image.empty()) {
+      seq.image = seq.draft[i].image.data();
+      seq.image_len = (int)seq.draft[i].image.size();
+    }
+  // The conversation starts with this prompt, drafted part included.
+  const bool opening =
+      session && (session->kv_len == 0 || session->draft_base == 0);
+  if (session && session->drafted.empty())
+    session->draft_base = session->kv_len;
+
+  GenControl &ctl = *seq.ctl;
+  const EmitFn &emit = seq.emit;
+  const uint8_t *image_bytes = seq.image;
+  const int image_len = seq.image_len;
+  LOGI("generate: image_len=%d max_tokens=%d", image_len, seq.max_tokens);
+  TraceSpan trace("prepare");
+  seq.times.rss_start_kb = rss_kb();
+  note_rss(seq.times);
+
+  // ── Step 1: Tokenize ──────────────────────────────────────────────
+  LOGI("--- STEP 1: Tokenize ---");
+  auto tokenize_start = std::chrono::steady_clock::now();
+  // A session's cache goes on from its last turn: feed what that left
+  // unfed, close it, and no BOS mid-conversation. Drafted segments leave
+  // the turn open for the rest of the prompt.
+  const bool resume = session && session->kv_len > 0;
+  std::vector<int64_t> tokens;
+  {
+    TraceSpan tokenize("tokenize");
+    if (resume && session->drafted.empty()) {
+      tokens = session->pending;
+      tokens.insert(tokens.end(), state->turn_close.begin(),
+                    state->turn_close.end());
+    } else if (!resume) {
+      tokens.push_back(2); // BOS
+    }
+
+    for (size_t i = drafted; i < seq.draft.size(); ++i)
+      encode_append(state->tokenizer.get(), seq.draft[i].text.c_str(),
+                    resume || i > drafted, tokens);
+    if (seq.prompt) {
+      encode_append(state->tokenizer.get(), seq.prompt,
+                    resume || drafted < seq.draft.size(), tokens);
+    } else if (seq.prompt_tokens) { // BOS is ours to add, as above
+      const std::vector<int64_t> &ids = *seq.prompt_tokens;
+      tokens.insert(tokens.end(), ids.begin() + (ids[0] == 2), ids.end());
+    }
+    if (seq.labels) // the labels' common start is read with the prompt
+      tokens.insert(tokens.end(), seq.labels->shared.begin(),
+                    seq.labels->shared.end());
+  }
+  seq.times.tokenize_ms = ms_since(tokenize_start);
+  LOGI("Tokenized: %zu tokens", tokens.size());
+
+  // ── Step 2: Plan against the memory that is free right now ─────────
+  in.prompt_tokens = (int)tokens.size();
+  in.image_slots =
+      image_bytes && image_len > 0
+          ? (int)std::count(tokens.begin(), tokens.end(), state->image_token_id)
+          : 0;
+  in.max_tokens = seq.max_tokens;
+  in.cached_tokens = resume ? (int)session->kv_len : 0;
+  in.window = session ? session->window : 0;
+  in.context = state->context_length;
+  const int grid = pooled_grid(g_image_pooling.load());
+  in.image_positions = grid * grid;
+  const int prompt_positions =
+      in.prompt_tokens + in.image_slots * (in.image_positions - 1);
+  if (!session && in.context > 0 && prompt_positions >= in.context) {
+    // Turned away before the vision encoder and the prefill: it could not
+    // get a single token out (see medgemma_plan_context).
+    std::string err = "[ERR] Prompt too long: " +
+                      std::to_string(prompt_positions) +
+                      " tokens, over the model's context limit of " +
+                      std::to_string(in.context);
+    LOGE("%s", err.c_str());
+    emit(err.c_str());
+    seq.phase = Sequence::DONE;
+    return;
+  }
+  in.vision_resident = state->v_sess && state->p_sess;
+  MedGemmaMemoryStatus mem = state->memory.last();
+  RequestPlan plan = plan_request(in, mem.available_kb, state->estimates);
+  seq.prefill_chunk = plan.prefill_chunk;
+  seq.max_tokens = plan.max_tokens;
+  seq.times.plan_prefill_chunk = plan.prefill_chunk;
+  seq.times.plan_max_tokens = plan.max_tokens;
+  seq.times.plan_peak_kb = plan.peak_kb;
+  seq.times.plan_budget_kb = plan.budget_kb;
+  LOGI("Plan: image=%d keep_vision=%d chunk=%d max_tokens=%d peak=%lld MB "
+       "budget=%lld MB",
+       plan.image, plan.keep_vision, plan.prefill_chunk, plan.max_tokens,
+       (long long)(plan.peak_kb / 1024), (long long)(plan.budget_kb / 1024));
+  if (plan.max_tokens < in.max_tokens)
+    LOGI("Plan: max_tokens %d → %d to fit memory and context",
+         in.max_tokens, plan.max_tokens);
+
+  // ── Step 3+4: Vision encode → project → copy embeddings → FREE ────
+  // We use a scope so pixel_values + ORT vision tensors are freed
+  // before we start building the large final_embeds buffer.
+  std::vector<float> projected_embeds_vec; // 256 * 2560 * 4 = 2.5 MB
+
+  if (in.image_slots > 0 && !plan.image) {
+    // Skip the image rather than let the low-memory killer take the engine
+    // down halfway through the report.
+    std::string oom_err =
+        "[IMG_ERR] Not enough free memory for the vision encoder (" +
+        std::to_string(mem.available_kb / 1024) +
+        " MB available). Try closing other apps.";
+    LOGE("%s", oom_err.c_str());
+    emit(oom_err.c_str());
+  } else if (plan.image) {
+    LOGI("--- STEP 3: Image decode + resize ---");
+    std::string img_error;
+
+    // pixel_values: 896*896*3*4 = 9.2 MB
+    auto image_start = std::chrono::steady_clock::now();
+    std::vector<float> pixel_values = process_image_bytes(
+        image_bytes, static_cast<size_t>(image_len), img_error, &seq.times);
+    seq.times.image_ms = ms_since(image_start);
+
+    if (!img_error.empty()) {
+      LOGE("%s", img_error.c_str());
+      emit(img_error.c_str());
+      // Fall through: proceed text-only
+    }
+
+    if (!pixel_values.empty()) {
+      if (ctl.stop_requested())
+        goto skip_vision;
+      auto vision_start = std::chrono::steady_clock::now();
+      {
+        TraceSpan load("vision_load");
+        ensure_vision_sessions(state);
+      }
+      seq.times.vision_load_ms = ms_since(vision_start);
+      LOGI("--- STEP 4: Vision encoder ---");
+      {
+        AllocScope alloc(ALLOC_VISION);
+        auto step_start = std::chrono::steady_clock::now();
+        TraceSpan run("vision_encoder.Run");
+        std::vector<int64_t> v_shape = {1, 3, 896, 896};
+        auto v_input = Ort::Value::CreateTensor<float>(
+            state->memory_info, pixel_values.data(), pixel_values.size(),
+            v_shape.data(), v_shape.size());
+
+        const char *v_in[] = {"pixel_values"};
+        const char *v_out[] = {"image_features"};
+        auto v_res =
+            state->v_sess->Run(ctl.run_opts, v_in, &v_input, 1, v_out, 1);
+        run.next("free_pixels");
+        LOGI("Vision encoder done");
+        seq.times.vision_encode_ms = ms_since(step_start);
+        note_rss(seq.times);
+
+        // Free pixel_values now — no longer needed (9.2 MB freed)
+        {
+          std::vector<float> tmp;
+          pixel_values.swap(tmp);
+        }
+        LOGD("pixel_values freed");
+
+        LOGI("--- STEP 4b: Vision projection ---");
+        step_start = std::chrono::steady_clock::now();
+        run.next("vision_projection.Run");
+        const char *p_in[] = {"image_features"};
+        const char *p_out[] = {"visual_tokens"};
+        auto p_res =
+            state->p_sess->Run(ctl.run_opts, p_in, &v_res[0], 1, p_out, 1);
+
+        // Copy projected embeddings out before p_res goes out of scope
+        float *proj_data = p_res[0].GetTensorMutableData<float>();
+        projected_embeds_vec.assign(proj_data,
+                                    proj_data + num_patches * embed_dim);
+        pool_visual_tokens(projected_embeds_vec, grid);
+        LOGI("Vision projection done (%d tokens, %.1f MB embed)",
+             in.image_positions,
+             projected_embeds_vec.size() * 4 / (1024.0f * 1024.0f));
+        seq.times.vision_project_ms = ms_since(step_start);
+        note_rss(seq.times);
+        seq.times.vision_peak_kb = alloc.peak_kb();
+        MemoryEstimates &est = state->estimates;
+        MemoryEstimates::calibrate(est.vision_work_kb, est.vision_measured,
+                                   seq.times.vision_peak_kb);
+
+        // v_res and p_res ORT tensors freed here when scope exits
+      }
+      seq.times.vision_ms = ms_since(vision_start);
+
+      // ── FREE VISION SESSIONS — weights not needed until the next image ─
+      // v_sess holds SigLIP encoder weights, p_sess holds projection weights.
+      // Destroying them here reclaims their RAM before the generation loop.
+      if (plan.keep_vision) {
+        LOGI("Vision sessions kept: another image request is queued");
+      } else {
+        drop_vision_sessions(state);
+      }
+      // The encoder's activations are pooled in sizes the decoder never
+      // asks for; give them (and the heap the weights left) back now.
+      stage_allocator().release();
+    }
+  } else {
+    LOGI("No image — text-only mode");
+  }
+skip_vision:; // stop requested
+  if (ctl.stop_requested())
+    return;
+
+  // ── Step 5: Build embeddings ──────────────────────────────────────
+  LOGI("--- STEP 5: Build embeddings ---");
+  AllocScope alloc(ALLOC_PREFILL);
+  auto embed_start = std::chrono::steady_clock::now();
+  TraceSpan build("build_embeddings");
+  std::vector<float> &final_embeds = seq.embeds;
+
+  LOGI("Image token ID in use: %lld — watching for it in %zu tokens",
+       state->image_token_id, tokens.size());
+  Ort::Value token_embedding(nullptr);
+  int img_injections = splice_prompt_embeds(
+      final_embeds, tokens, state->image_token_id, projected_embeds_vec,
+      [&](int64_t id) {
+        std::vector<int64_t> tid = {id}, t_s = {1, 1};
+        auto t_tensor = create_tensor(tid, t_s, state->memory_info);
+        TraceSpan run("embeddings.Run");
+        const char *e_in[] = {"input_ids"};
+        const char *e_out[] = {"embeddings"};
+        auto e_res =
+            state->e_sess->Run(ctl.run_opts, e_in, &t_tensor, 1, e_out, 1);
+        token_embedding = std::move(e_res[0]);
+        return token_embedding.GetTensorData<float>();
+      });
+  if (!projected_embeds_vec.empty())
+    seq.times.image_tokens =
+        img_injections * (int)(projected_embeds_vec.size() / embed_dim);
+
+  // Free projected_embeds_vec — it is now baked into final_embeds (2.5 MB
+  // freed)
+  {
+    std::vector<float> tmp;
+    projected_embeds_vec.swap(tmp);
+  }
+  seq.times.embed_ms = seq.times.tokenize_ms + ms_since(embed_start);
+  note_rss(seq.times);
+  seq.times.prefill_peak_kb = alloc.peak_kb();
+  seq.times.prompt_tokens =
+      static_cast<int32_t>(final_embeds.size() / embed_dim);
+  LOGI("Embeddings built: seq_len=%zu, final_embeds=%.1f MB, "
+       "image_injections=%d",
+       final_embeds.size() / embed_dim,
+       final_embeds.size() * 4 / (1024.0f * 1024.0f), img_injections);
+  if (img_injections == 0 && image_bytes && image_len > 0) {
+    LOGE("WARNING: image bytes provided but image token was NEVER found in "
+         "prompt!");
+    LOGE("  Image token ID searched: %lld", state->image_token_id);
+    LOGE("  Tokens in prompt: %zu", tokens.size());
+    LOGE("  First 10 token IDs:");
+    for (size_t ti = 0; ti < std::min(tokens.size(), (size_t)10); ++ti)
+      LOGE("    [%zu] = %lld", ti, tokens[ti]);
+    emit("[WARN] Image not grounded — <image> token missing from "
+         "prompt. Output may be hallucinated.");
+  }
+
+  // Start from the session's cache, or an empty one
+  const int64_t positions = (int64_t)(final_embeds.size() / embed_dim);
+  if (resume) {
+    if (session->snapshot && session->kv.empty())
+      snapshot_restore(state, *session);
+    seq.kv = std::move(session->kv);
+    seq.kv_len = session->kv_len;
+    seq.spill = std::move(session->spill);
+    session->kv.clear();
+    session->kv_len = 0;
+    seq.times.cached_tokens = (int32_t)seq.kv_len;
+    LOGI("Session %lld: continuing from %lld cached positions",
+         (long long)session->id, (long long)seq.kv_len);
+    // The spill file was sized for the previous turn.
+    if (seq.spill &&
+        seq.spill->capacity() < seq.kv_len + positions + seq.max_tokens + 1)
+      seq_restore(state, seq);
+  } else {
+    seq.kv = state->io.empty_cache(state->memory_info);
+    seq.kv_len = 0;
+  }
+  if (opening && !seq.draft_only)
+    session->pinned =
+        session->sink > 0
+            ? std::min<int64_t>(session->sink,
+                                session->window - SESSION_MIN_ROOM)
+            : std::min<int64_t>(seq.kv_len + positions, session->window / 2);
+  if (session && !seq.draft_only) { // the drafted part is now this turn's
+    session->drafted.clear();
+    session->draft_base = -1;
+  }
+  seq.prefill_pos = 0;
+  seq.image = nullptr; // the job may drop its copy now
+  seq.image_len = 0;
+  seq.phase = Sequence::PREFILL;
+  LOGI("--- STEP 6: Chunked prefill + generation ---");
+}
+
+// Adds to each label's log-probability that of its tokens after the first:
+// one decoder Run over all but its last token on top of the prompt's cache.
+// Only the logits are asked for, and the cache is lent to the Run and taken
+// back as it was.
+static void seq_score_labels(MedGemmaState *state, Sequence &seq) {
+  const LabelSet &set = *seq.labels;
+  for (size_t i = 0; i < set.tails.size(); ++i) {
+    const std::vector<int64_t> &tail = set.tails[i];
+    if (tail.size() < 2)
+      continue;
+    TraceSpan trace("score_label");
+    AllocScope alloc(ALLOC_DECODE);
+    const int64_t n = (int64_t)tail.size() - 1;
+    std::vector<int64_t> ids(tail.begin(), tail.end() - 1);
+    auto ids_t = create_tensor(ids, {1, n}, state->memory_info);
+    const char *e_in[] = {"input_ids"};
+    const char *e_out[] = {"embeddings"};
+    auto emb = state->e_sess->Run(seq.ctl->run_opts, e_in, &ids_t, 1, e_out, 1);
+
+    std::vector<int64_t> mask;
+    fill_attention_mask(mask, {seq.kv_len + n}, seq.kv_len + n);
+    std::vector<Ort::Value> inputs;
+    inputs.reserve(2 + seq.kv.size());
+    inputs.push_back(std::move(emb[0]));
+    inputs.push_back(
+        create_tensor(mask, {1, seq.kv_len + n}, state->memory_info));
+    for (auto &t : seq.kv)
+      inputs.push_back(std::move(t));
+    std::vector<Ort::Value> res;
+    try {
+      TraceSpan run("decoder.Run");
+      res = state->m_sess->Run(seq.ctl->run_opts, state->io.in.data(),
+                               inputs.data(), inputs.size(),
+                               state->io.out.data(), 1);
+    } catch (...) {
+      for (size_t k = 0; k < seq.kv.size(); ++k)
+        seq.kv[k] = std::move(inputs[k + 2]);
+      throw;
+    }
+    for (size_t k = 0; k < seq.kv.size(); ++k)
+      seq.kv[k] = std::move(inputs[k + 2]);
+    const float *lg = res[0].GetTensorData<float>();
+    size_t vs = res[0].GetTensorTypeAndShapeInfo().GetShape().back();
+    for (int64_t k = 0; k < n; ++k)
+      seq.label_logp[i] +=
+          lg[k * vs + tail[k + 1]] - log_sum_exp(lg + k * vs, vs);
+  }
+}
+
+// Adds to `shared_logp` what a prefill chunk's logits say of the labels'
+// shared start: each row predicts the position after its own, and the rows
+// are the chunk's last ones.
+static void seq_score_shared(Sequence &seq, const Ort::Value &logits,
+                             int64_t chunk_end, int64_t total_prefill) {
+  const std::vector<int64_t> &shared = seq.labels->shared;
+  const int64_t first = total_prefill - (int64_t)shared.size();
+  if (shared.empty() || chunk_end < first)
+    return;
+  const float *lg = logits.GetTensorData<float>();
+  auto info = logits.GetTensorTypeAndShapeInfo();
+  const size_t vs = info.GetShape().back();
+  const int64_t rows = (int64_t)(info.GetElementCount() / vs);
+  for (int64_t r = 0; r < rows; ++r) {
+    const int64_t next = chunk_end - rows + r + 1;
+    if (next >= first && next < total_prefill)
+      seq.shared_logp += lg[r * vs + shared[next - first]] -
+                         log_sum_exp(lg + r * vs, vs);
+  }
+}
+
+// Step 6a: feeds the next `chunk` (the planned one, less under memory
+// pressure) prompt positions. The last chunk samples the first token and
+// moves the sequence to DECODE.
+static void seq_prefill_chunk(MedGemmaState *state, Sequence &seq,
+                              int chunk) {
+  const int64_t total_prefill = (int64_t)(seq.embeds.size() / embed_dim);
+  if (total_prefill == 0) {
+    LOGE("Prefill produced no token");
+    seq.emit("[ERR] Prefill failed");
+    seq.phase = Sequence::DONE;
+    return;
+  }
+  const int64_t chunk_start = seq.prefill_pos;
+  const int64_t chunk_len =
+      std::min((int64_t)chunk, total_prefill - chunk_start);
+  seq_make_room(state, seq, chunk_len);
+  TraceSpan trace("prefill_chunk");
+  AllocScope alloc(ALLOC_PREFILL);
+  if (t_tracer)
+    trace.args = "\"pos\":" + std::to_string(chunk_start) +
+                 ",\"len\":" + std::to_string(chunk_len);
+
+  std::vector<Ort::Value> m_inputs;
+  m_inputs.reserve(2 + seq.kv.size());
+
+  // Slice this chunk's embeddings from final_embeds
+  size_t offset = chunk_start * embed_dim;
+  size_t count = chunk_len * embed_dim;
+  std::vector<int64_t> c_shape = {1, chunk_len, (int64_t)embed_dim};
+  m_inputs.push_back(Ort::Value::CreateTensor<float>(
+      state->memory_info, seq.embeds.data() + offset, count, c_shape.data(),
+      c_shape.size()));
+
+  // Build attention mask: past KV positions + current chunk
+  std::vector<int64_t> chunk_mask;
+  fill_attention_mask(chunk_mask, {seq.kv_len + chunk_len},
+                      seq.kv_len + chunk_len);
+  m_inputs.push_back(create_tensor(chunk_mask, {1, seq.kv_len + chunk_len},
+                                   state->memory_info));
+  for (auto &t : seq.kv)
+    m_inputs.push_back(std::move(t));
+
+  LOGD("Prefill chunk [%lld..%lld] kv_len=%lld", chunk_start,
+       chunk_start + chunk_len - 1, seq.kv_len);
+  auto chunk_started = std::chrono::steady_clock::now();
+
+  std::vector<Ort::Value> chunk_res;
+  try {
+    TraceSpan run("decoder.Run");
+    chunk_res = run_decoder(state, seq.ctl->run_opts, m_inputs,
+                            seq.spill.get(), seq.kv_len + chunk_len);
+  } catch (...) {
+    for (size_t i = 0; i < seq.kv.size(); ++i)
+      seq.kv[i] = std::move(m_inputs[i + 2]);
+    throw;
+  }
+
+  // Update KV cache (old KV tensors freed with m_inputs)
+  for (size_t i = 1; i < chunk_res.size(); ++i)
+    seq.kv[i - 1] = std::move(chunk_res[i]);
+  seq.kv_len += chunk_len;
+  seq.prefill_pos += chunk_len;
+  if (seq.labels) {
+    if (chunk_start == 0)
+      seq.shared_logp = 0;
+    seq_score_shared(seq, chunk_res[0], seq.prefill_pos - 1, total_prefill);
+  }
+  seq.times.prefill_chunks++;
+  if (seq.spill)
+    seq.times.spill_steps++;
+  note_rss(seq.times); // logits still held: the chunk's high-water mark
+  seq.times.prefill_peak_kb =
+      std::max(seq.times.prefill_peak_kb, alloc.peak_kb());
+  MemoryEstimates &est = state->estimates;
+  MemoryEstimates::calibrate(est.decoder_work_kb, est.decoder_measured,
+                             alloc.peak_kb() -
+                                 kv_kb(est, seq.kv_len - chunk_len) -
+                                 kv_kb(est, seq.kv_len) -
+                                 logits_kb(chunk_len));
+  auto chunk_done = [&]() {
+    double ms = ms_since(chunk_started);
+    seq.times.prefill_ms += ms;
+    seq.times.prefill_chunk_max_ms =
+        std::max(seq.times.prefill_chunk_max_ms, ms);
+  };
+
+  if (seq.prefill_pos < total_prefill || seq.draft_only) {
+    chunk_done();
+    // Free logits tensor immediately (up to 64×262144×4 = 64 MB per chunk)
+    Ort::Value _drop = std::move(chunk_res[0]);
+    if (seq.prefill_pos == total_prefill) { // a draft: nothing to sample
+      std::vector<float>().swap(seq.embeds);
+      seq.answered = true;
+      seq.phase = Sequence::DONE;
+    }
+    return;
+  }
+
+  // Last chunk: sample the first token from its final position.
+  float *lg = chunk_res[0].GetTensorMutableData<float>();
+  size_t vs = chunk_res[0].GetTensorTypeAndShapeInfo().GetShape().back();
+  size_t tot = chunk_res[0].GetTensorTypeAndShapeInfo().GetElementCount();
+  if (seq.labels) { // a classification scores its labels there instead
+    const float *last = lg + tot - vs;
+    const double norm = log_sum_exp(last, vs);
+    seq.label_logp.clear();
+    for (const auto &tail : seq.labels->tails)
+      seq.label_logp.push_back(last[tail[0]] - norm);
+    {
+      Ort::Value _drop = std::move(chunk_res[0]);
+    }
+    std::vector<float>().swap(seq.embeds);
+    chunk_done();
+    auto score_started = std::chrono::steady_clock::now();
+    seq_score_labels(state, seq);
+    seq.times.decode_ms += ms_since(score_started);
+    LOGI("Prefill complete, %zu labels scored", seq.label_logp.size());
+    seq.answered = true;
+    seq.phase = Sequence::DONE;
+    return;
+  }
+  int64_t first = sample_next(state, seq, lg + tot - vs, vs);
+  {
+    Ort::Value _drop = std::move(chunk_res[0]);
+  }
+  // Free the full prefill embeddings now — no longer needed
+  std::vector<float>().swap(seq.embeds);
+  chunk_done();
+  LOGI("Prefill complete, first token id=%lld", first);
+
+  seq.phase = Sequence::DECODE;
+  seq.answered = true;
+  seq_accept(state, seq, first);
+}
+
+// ── Batched decode ───────────────────────────────────────────────────────────
+// Sequences that decode together. Their caches are packed into one
+// {B, kv_heads, width, dim} tensor per cache input, right-padded: row b holds
+// members[b]->kv_len valid positions and GroupQueryAttention takes that length
+// from the row's mask (seqlens_k = sum(mask) - 1). Each step writes the new
+// token at position kv_len of its row and returns present tensors one wider,
+// so the packing stays valid across steps; caches are only copied when the
+// membership changes. A single member is moved in and out without copying.
+struct DecodeBatch {
+  const DecoderIO &io;
+  std::vector<Sequence *> members;
+  std::vector<Ort::Value> kv;
+  int64_t width = 0;
+
+  explicit DecodeBatch(const DecoderIO &io) : io(io) {}
+};
+
+// Moves every member's cache back into Sequence::kv and empties the batch.
+static void batch_unpack(DecodeBatch &batch) {
+  if (batch.members.size() == 1 && batch.members[0]->kv_len == batch.width) {
+    batch.members[0]->kv = std::move(batch.kv);
+  } else {
+    AllocScope scope(ALLOC_DECODE);
+    OrtAllocator *alloc = &stage_allocator();
+    const int64_t B = (int64_t)batch.members.size();
+    for (int64_t b = 0; b < B; ++b) {
+      Sequence *seq = batch.members[b];
+      if (seq->finished() && !seq->session)
+        continue; // retiring — its cache is simply dropped
+      seq->kv.clear();
+      for (size_t i = 0; i < batch.kv.size(); ++i) {
+        const DecoderIO::CacheTensor &ct = batch.io.cache[i];
+        std::vector<int64_t> shape = {1, kv_heads, seq->kv_len, ct.dim};
+        const size_t row = (size_t)seq->kv_len * ct.row_bytes;
+        const size_t stride = (size_t)batch.width * ct.row_bytes;
+        const char *src =
+            static_cast<const char *>(batch.kv[i].GetTensorRawData());
+        Ort::Value t = Ort::Value::CreateTensor(alloc, shape.data(),
+                                                shape.size(), ct.type);
+        char *dst = static_cast<char *>(t.GetTensorMutableRawData());
+        for (int h = 0; h < kv_heads; ++h)
+          memcpy(dst + h * row, src + (b * kv_heads + h) * stride, row);
+        seq->kv.push_back(std::move(t));
+      }
+    }
+  }
+  batch.kv.clear();
+  batch.members.clear();
+  batch.width = 0;
+}
+
+// Packs the caches of `members` (all in DECODE) into the batch.
+static void batch_pack(DecodeBatch &batch,
+                       const std::vector<Sequence *> &members) {
+  batch.members = members;
+  if (members.empty())
+    return;
+  if (members.size() == 1) {
+    batch.kv = std::move(members[0]->kv);
+    batch.width = members[0]->kv_len;
+    members[0]->kv.clear();
+    return;
+  }
+  const int64_t B = (int64_t)members.size();
+  batch.width = 0;
+  for (auto *seq : members)
+    batch.width = std::max(batch.width, seq->kv_len);
+  LOGD("Packing decode batch: B=%lld width=%lld", (long long)B,
+       (long long)batch.width);
+
+  AllocScope scope(ALLOC_DECODE);
+  OrtAllocator *alloc = &stage_allocator();
+  for (size_t i = 0; i < batch.io.cache.size(); ++i) {
+    const DecoderIO::CacheTensor &ct = batch.io.cache[i];
+    std::vector<int64_t> shape = {B, kv_heads, batch.width, ct.dim};
+    const size_t stride = (size_t)batch.width * ct.row_bytes;
+    Ort::Value t =
+        Ort::Value::CreateTensor(alloc, shape.data(), shape.size(), ct.type);
+    char *dst = static_cast<char *>(t.GetTensorMutableRawData());
+    memset(dst, 0, (size_t)B * kv_heads * stride);
+    for (int64_t b = 0; b < B; ++b) {
+      Sequence *seq = members[b];
+      const char *src =
+          static_cast<const char *>(seq->kv[i].GetTensorRawData());
+      const size_t row = (size_t)seq->kv_len * ct.row_bytes;
+      for (int h = 0; h < kv_heads; ++h)
+        memcpy(dst + (b * kv_heads + h) * stride, src + h * row, row);
+      seq->kv[i] = Ort::Value(nullptr); // free as we go
+    }
+    batch.kv.push_back(std::move(t));
+  }
+  for (auto *seq : members)
+    seq->kv.clear();
+}
+
+// Step 6b: one decode step for every member. A lone member runs with its own
+// RunOptions so a cancel interrupts the step; a shared step runs with
+// `shared_opts` and members stop between steps instead. A spilled sequence
+// always decodes alone, its cache moving between the spill file's slots.
+static void decode_step(MedGemmaState *state, DecodeBatch &batch,
+                        Ort::RunOptions &shared_opts) {
+  const int64_t B = (int64_t)batch.members.size();
+  Ort::RunOptions &opts =
+      B == 1 ? batch.members[0]->ctl->run_opts : shared_opts;
+  TraceSpan trace("decode_step");
+  AllocScope alloc(ALLOC_DECODE);
+  if (t_tracer)
+    trace.args = "\"batch\":" + std::to_string(B) +
+                 ",\"width\":" + std::to_string(batch.width);
+  TraceSpan phase("embeddings.Run");
+
+  // Embed every member's pending token in one run ({B,1} → {B,1,D})
+  std::vector<int64_t> nid_v(B), nid_s = {B, 1};
+  for (int64_t b = 0; b < B; ++b)
+    nid_v[b] = batch.members[b]->next_id;
+  auto nid_t = create_tensor(nid_v, nid_s, state->memory_info);
+  const char *ein[] = {"input_ids"};
+  const char *eout[] = {"embeddings"};
+  auto n_emb_res = state->e_sess->Run(opts, ein, &nid_t, 1, eout, 1);
+  phase.next("decoder.Run");
+
+  // Attention mask: row b has kv_len past positions + 1 new token, then
+  // zeros up to the shared width (right padding).
+  const int64_t mask_w = batch.width + 1;
+  std::vector<int64_t> valid(B), dec_mask;
+  for (int64_t b = 0; b < B; ++b)
+    valid[b] = batch.members[b]->kv_len + 1;
+  fill_attention_mask(dec_mask, valid, mask_w);
+
+  std::vector<Ort::Value> m_inputs;
+  m_inputs.reserve(2 + batch.kv.size());
+  m_inputs.push_back(std::move(n_emb_res[0]));
+  m_inputs.push_back(create_tensor(dec_mask, {B, mask_w}, state->memory_info));
+  for (auto &t : batch.kv)
+    m_inputs.push_back(std::move(t));
+
+  LOGD("Decode step: B=%lld width=%lld", (long long)B,
+       (long long)batch.width);
+  auto step_started = std::chrono::steady_clock::now();
+
+  KvSpill *spill = B == 1 ? batch.members[0]->spill.get() : nullptr;
+  std::vector<Ort::Value> d_res;
+  try {
+    d_res = run_decoder(state, opts, m_inputs, spill, batch.width + 1);
+  } catch (...) {
+    for (size_t i = 0; i < batch.kv.size(); ++i)
+      batch.kv[i] = std::move(m_inputs[i + 2]);
+    throw;
+  }
+
+  // Replace KV cache entries (old KV tensors freed with m_inputs)
+  for (size_t i = 1; i < d_res.size(); ++i)
+    batch.kv[i - 1] = std::move(d_res[i]);
+  batch.width += 1;
+  phase.next("sample_batch");
+
+  // Decode logits: {B,1,256000} = B MB — sample, then free
+  const float *dlg = d_res[0].GetTensorMutableData<float>();
+  size_t dvs = d_res[0].GetTensorTypeAndShapeInfo().GetShape().back();
+  for (int64_t b = 0; b < B; ++b) {
+    Sequence *seq = batch.members[b];
+    seq->kv_len += 1; // kv now includes the token we just processed
+    t_trace_track = seq->id;
+    seq_accept(state, *seq, sample_next(state, *seq, dlg + b * dvs, dvs));
+    t_trace_track = 0;
+  }
+  double step_ms = ms_since(step_started);
+  int64_t rss = rss_kb(); // logits still held: the step's high-water mark
+  int64_t tensors_kb = alloc.peak_kb();
+  for (auto *seq : batch.members) {
+    MedGemmaJobTimings &t = seq->times;
+    t.decode_ms += step_ms;
+    t.decode_step_max_ms = std::max(t.decode_step_max_ms, step_ms);
+    t.decode_steps++;
+    t.max_batch_seen = std::max(t.max_batch_seen, static_cast<int32_t>(B));
+    t.rss_end_kb = rss;
+    t.rss_peak_kb = std::max(t.rss_peak_kb, rss);
+    t.decode_peak_kb = std::max(t.decode_peak_kb, tensors_kb);
+    t.spill_steps += spill != nullptr;
+  }
+}
+
+// ── Output ring ──────────────────────────────────────────────────────────────
+// Single-producer / single-consumer byte ring between the generating thread and
+// whoever drains the job (medgemma_read). Lock-free: head is only written by
+// the producer, tail only by the consumer. Capacity is a power of two.
+class ByteRing {
+public:
+  explicit ByteRing(size_t capacity_pow2)
+      : buf_(new char[capacity_pow2]), mask_(capacity_pow2 - 1) {}
+
+  size_t readable() const {
+    return head_.load(std::memory_order_acquire) -
+           tail_.load(std::memory_order_relaxed);
+  }
+
+  // Blocks (politely) while the ring is full so a slow reader throttles
+  // generation instead of losing text. Returns false if `abort` fired first.
+  bool write(const char *data, size_t len, const std::function<bool()> &abort) {
+    while (len > 0) {
+      size_t head = head_.load(std::memory_order_relaxed);
+      size_t used = head - tail_.load(std::memory_order_acquire);
+      size_t space = (mask_ + 1) - used;
+      if (space == 0) {
+        if (abort())
+          return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        continue;
+      }
+      size_t n = std::min(space, len);
+      for (size_t i = 0; i < n; ++i)
+        buf_[(head + i) & mask_] = data[i];
+      head_.store(head + n, std::memory_order_release);
+      data += n;
+      len -= n;
+    }
+    return true;
+  }
+
+  // Copies up to `max` bytes. When the copy would stop inside a multi-byte
+  // UTF-8 sequence the partial sequence is left for the next read, so every
+  // chunk handed to Dart decodes cleanly.
+  size_t read(char *out, size_t max) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    size_t avail = head_.load(std::memory_order_acquire) - tail;
+    size_t n = std::min(avail, max);
+    if (n < avail && n > 0) {
+      size_t cut = n;
+      for (size_t back = 1; back <= 3 && back <= n; ++back) {
+        unsigned char c =
+            static_cast<unsigned char>(buf_[(tail + n - back) & mask_]);
+        if ((c & 0xC0) == 0x80)
+          continue; // continuation byte — keep looking for the lead byte
+        size_t seq = (c & 0xE0) == 0xC0   ? 2
+                     : (c & 0xF0) == 0xE0 ? 3
+                     : (c & 0xF8) == 0xF0 ? 4
+                                          : 1;
+        if (seq > back)
+          cut = n - back;
+        break;
+      }
+      if (cut > 0)
+        n = cut;
+    }
+    for (size_t i = 0; i < n; ++i)
+      out[i] = buf_[(tail + i) & mask_];
+    tail_.store(tail + n, std::memory_order_release);
+    return n;
+  }
+
+private:
+  std::unique_ptr<char[]> buf_;
+  size_t mask_;
+  std::atomic<size_t> head_{0};
+  std::atomic<size_t> tail_{0};
+};
+
+// ── Dart native ports ────────────────────────────────────────────────────────
+// Output is pushed to Dart with Dart_PostCObject, whose address Dart hands us
+// via medgemma_init_dart_api(NativeApi.postCObject). Only the slice of
+// dart_native_api.h we need is mirrored here; the union keeps its full size
+// because the VM reads the struct by value.
+typedef int64_t Dart_Port;
+enum Dart_CObject_Type : int32_t {
+  Dart_CObject_kNull = 0,
+  Dart_CObject_kBool,
+  Dart_CObject_kInt32,
+  Dart_CObject_kInt64,
+  Dart_CObject_kDouble,
+  Dart_CObject_kString,
+};
+struct Dart_CObject {
+  Dart_CObject_Type type;
+  union {
+    bool as_bool;
+    int32_t as_int32;
+    int64_t as_int64;
+    double as_double;
+    const char *as_string;
+    struct {
+      int32_t type;
+      intptr_t length;
+      uint8_t *data;
+      void *peer;
+      void *callback;
+    } as_external_typed_data; // largest member — sizes the union
+  } value;
+};
+typedef bool (*Dart_PostCObject_Type)(Dart_Port port_id, Dart_CObject *msg);
+
+static std::atomic<Dart_PostCObject_Type> g_post_cobject{nullptr};
+
+static bool post_string(Dart_Port port, const char *text) {
+  Dart_PostCObject_Type post = g_post_cobject.load();
+  if (!post)
+    return false;
+  Dart_CObject msg;
+  msg.type = Dart_CObject_kString;
+  msg.value.as_string = text; // copied by the VM before PostCObject returns
+  return post(port, &msg);
+}
+
+// Length of `s` without a multi-byte UTF-8 sequence cut off at its end. A
+// byte-fallback token can emit half of "°" or "µ"; a Dart string has to be
+// whole, so the rest waits for the next piece.
+static size_t utf8_complete(const std::string &s) {
+  for (size_t back = 1; back <= 3 && back <= s.size(); ++back) {
+    unsigned char c = static_cast<unsigned char>(s[s.size() - back]);
+    if ((c & 0xC0) == 0x80)
+      continue; // continuation byte — keep looking for the lead byte
+    size_t seq = (c & 0xE0) == 0xC0   ? 2
+                 : (c & 0xF0) == 0xE0 ? 3
+                 : (c & 0xF8) == 0xF0 ? 4
+                                      : 1;
+    return seq > back ? s.size() - back : s.size();
+  }
+  return s.size();
+}
+
+static bool post_int(Dart_Port port, int32_t value) {
+  Dart_PostCObject_Type post = g_post_cobject.load();
+  if (!post)
+    return false;
+  Dart_CObject msg;
+  msg.type = Dart_CObject_kInt32;
+  msg.value.as_int32 = value;
+  return post(port, &msg);
+}
+
+// ── Async jobs ───────────────────────────────────────────────────────────────
+// medgemma_submit() queues a request and returns immediately with a job ID.
+// Each engine owns one long-lived scheduler thread that runs queued jobs,
+// several at a time (see scheduler_loop). Output is either posted straight to
+// a Dart ReceivePort (dart_port set) or kept in a ByteRing that the caller
+// drains with medgemma_poll/medgemma_read. medgemma_cancel() and the optional
+// deadline both go through GenControl, so a stop takes effect mid-step rather
+// than after max_tokens.
+
+class IsolatedEngine;
+
+struct InferenceJob {
+  int64_t id = 0;
+  MedGemmaState *state = nullptr;
+  IsolatedEngine *isolated = nullptr; // set instead of `state` (see below)
+  MetricsBook *metrics = nullptr;     // the owning engine's, either kind
+  std::vector<uint8_t> image;
+  std::unique_ptr<MappedImage> image_map; // set instead of `image`
+  std::string prompt;
+  std::vector<int64_t> prompt_tokens; // instead of prompt, see Prompt templates
+  int max_tokens = 512;
+
+  int64_t dart_port = 0;
+  int priority = PRIORITY_NORMAL;
+  MedGemmaJobParams params = {}; // as submitted (sampling knobs)
+  std::chrono::steady_clock::time_point submitted_at;
+  bool admitted = false;        // scheduler thread only
+  bool first_token_seen = false; // scheduler thread only
+
+  std::shared_ptr<ChatSession> session; // params.session, held until done
+  LabelSet labels; // a classification's, see Classification
+  MedGemmaClassification classification = {-1, 0, {}, 0};
+
+  GenControl ctl;
+  Sequence seq; // decoder state while admitted
+  ByteRing ring{1 << 16}; // 64 KB ≈ a few thousand tokens of slack
+  std::string port_tail;  // unfinished UTF-8 held back from dart_port
+  std::atomic<int32_t> status{JOB_QUEUED};
+  MedGemmaJobTimings timings = {}; // final copy, readable once finished
+  bool failed = false; // an [ERR]/[EXCEPTION] was emitted
+  std::atomic<bool> finished{false};
+  bool released = false; // guarded by g_jobs_mutex
+};
+
+static std::mutex g_jobs_mutex;
+static std::unordered_map<int64_t, std::shared_ptr<InferenceJob>> g_jobs;
+static std::atomic<int64_t> g_next_job_id{1};
+static std::atomic<int64_t> g_next_session_id{1};
+
+static std::shared_ptr<InferenceJob> find_job(int64_t id) {
+  std::lock_guard<std::mutex> lock(g_jobs_mutex);
+  auto it = g_jobs.find(id);
+  return it == g_jobs.end() ? nullptr : it->second;
+}
+
+// ── Deadline watchdog ────────────────────────────────────────────────────────
+// One lazily started thread sleeps until the earliest pending deadline and
+// expires that job's GenControl, which interrupts the ORT Run in flight.
+// Heap-allocated and never freed: the detached thread may still be waiting on
+// the condition variable when static destructors run at process exit.
+struct DeadlineWatchdog {
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::multimap<std::chrono::steady_clock::time_point,
+                std::weak_ptr<InferenceJob>>
+      deadlines;
+
+  void loop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      if (deadlines.empty()) {
+        cv.wait(lock);
+        continue;
+      }
+      if (cv.wait_until(lock, deadlines.begin()->first) ==
+          std::cv_status::no_timeout)
+        continue; // new (possibly earlier) deadline registered
+      auto now = std::chrono::steady_clock::now();
+      while (!deadlines.empty() && deadlines.begin()->first <= now) {
+        if (auto job = deadlines.begin()->second.lock()) {
+          if (!job->finished) {
+            LOGI("Job %lld hit its deadline", (long long)job->id);
+            job->ctl.expire();
+          }
+        }
+        deadlines.erase(deadlines.begin());
+      }
+    }
+  }
+};
+
+static void watch_deadline(const std::shared_ptr<InferenceJob> &job) {
+  static DeadlineWatchdog *watchdog = [] {
+    auto *w = new DeadlineWatchdog;
+    std::thread([w] { w->loop(); }).detach();
+    return w;
+  }();
+  std::lock_guard<std::mutex> lock(watchdog->mutex);
+  watchdog->deadlines.emplace(job->ctl.deadline, job);
+  watchdog->cv.notify_one();
+}
+
+// Publishes a terminal status. Port jobs get it as the final (int) message; a
+// job released while it was running is dropped here. The engine's metrics are
+// updated first, so they are current by the time the caller sees the status.
+static void settle_job(const std::shared_ptr<InferenceJob> &job,
+                       int32_t status) {
+  job->timings.status = status;
+  job->timings.total_ms = ms_since(job->submitted_at);
+  if (job->metrics)
+    job->metrics->record(job->timings);
+  {
+    // Timings first: a reader that sees the terminal status may ask for them.
+    std::lock_guard<std::mutex> lock(g_jobs_mutex);
+    job->finished = true;
+    if (job->released)
+      g_jobs.erase(job->id);
+  }
+  job->status = status;
+  LOGI("Job %lld finished with status %d", (long long)job->id, (int)status);
+  if (job->dart_port) {
+    if (!job->port_tail.empty()) // never completed: U+FFFD, as Dart would
+      post_string(job->dart_port, "\xEF\xBF\xBD");
+    post_int(job->dart_port, status);
+  }
+}
+
+// Gives a finished job's chat session its cache back. If the whole prompt
+// got in, the cache keeps the turn for the next prompt. If it stopped halfway
+// through the prompt, a session that had a conversation is marked lost (an
+// empty one just stays empty).
+static void session_keep(InferenceJob &job) {
+  Sequence &seq = job.seq;
+  std::shared_ptr<ChatSession> session = std::move(job.session);
+  seq.session.reset();
+  if (!session)
+    return;
+  bool lost = false;
+  if (seq.answered) {
+    session->snapshot.reset(); // the cache has moved on from its file
+    session->kv = std::move(seq.kv);
+    session->kv_len = seq.kv_len;
+    session->spill = std::move(seq.spill);
+    session->pending.clear();
+    if (seq.next_id >= 0) // sampled and shown, never fed back
+      session->pending.push_back(seq.next_id);
+  } else if (!seq.kv.empty()) {
+    lost = seq.times.cached_tokens > 0;
+  }
+  std::lock_guard<std::mutex> lock(job.state->queue_mutex);
+  session->busy = false;
+  session->lost = session->lost || lost;
+  if (lost)
+    LOGE("Session %lld lost: job %lld stopped inside its prompt",
+         (long long)session->id, (long long)job.id);
+}
+
+static void finish_job(const std::shared_ptr<InferenceJob> &job) {
+  session_keep(*job);
+  // Input buffers and decoder state are no longer needed; only the unread
+  // output stays alive until the job is released.
+  std::vector<uint8_t>().swap(job->image);
+  job->image_map.reset();
+  std::string().swap(job->prompt);
+  std::vector<int64_t>().swap(job->prompt_tokens);
+  job->seq.kv.clear();
+  std::vector<float>().swap(job->seq.embeds);
+  job->seq.emit = nullptr;
+  job->timings = job->seq.times;
+  job->timings.generated_tokens = job->seq.generated;
+  job->timings.kv_len = static_cast<int32_t>(job->seq.kv_len);
+  job->timings.rss_end_kb = rss_kb();
+  if (!job->labels.tails.empty())
+    job->classification = classify_result(job->labels, job->seq.label_logp,
+                                          job->seq.shared_logp);
+
+  settle_job(job, job->ctl.timed_out   ? JOB_TIMED_OUT
+                  : job->ctl.cancelled ? JOB_CANCELLED
+                  : job->failed        ? JOB_FAILED
+                                       : JOB_DONE);
+}
+
+// Routes one piece of output to the job's port or ring. A ring write blocks
+// while the ring is full, which stalls the whole batch: ring readers must keep
+// draining (Dart uses a port instead).
+static void emit_job_output(InferenceJob *job, const char *text) {
+  if (!text)
+    return;
+  if (!strncmp(text, "[ERR]", 5) || !strncmp(text, "[EXCEPTION]", 11))
+    job->failed = true;
+  if (job->dart_port) {
+    // Only whole UTF-8 sequences, like ByteRing::read hands out.
+    std::string &pending = job->port_tail;
+    pending += text;
+    size_t n = utf8_complete(pending);
+    if (n == pending.size()) {
+      post_string(job->dart_port, pending.c_str());
+      pending.clear();
+    } else if (n > 0) {
+      post_string(job->dart_port, pending.substr(0, n).c_str());
+      pending.erase(0, n);
+    }
+  } else
+    job->ring.write(text, strlen(text),
+                    [job]() { return job->ctl.stop_requested(); });
+}
+
+// Wires the job's Sequence to its inputs and output sink on admission.
+static void start_job(InferenceJob *job) {
+  Sequence &seq = job->seq;
+  if (seq.ctl) { // resuming after preemption: KV cache and position kept
+    job->status = JOB_RUNNING;
+    return;
+  }
+  seq.id = job->id;
+  seq.ctl = &job->ctl;
+  seq.max_tokens = job->max_tokens;
+  if (job->prompt_tokens.empty())
+    seq.prompt = job->prompt.c_str();
+  else
+    seq.prompt_tokens = &job->prompt_tokens;
+  seq.session = job->session;
+  if (!job->labels.tails.empty())
+    seq.labels = &job->labels;
+  if (job->params.temperature > 0)
+    seq.temperature = job->params.temperature;
+  if (job->params.top_p > 0)
+    seq.top_p = std::min(job->params.top_p, 1.0f);
+  if (job->params.repetition_penalty > 0)
+    seq.rep_penalty = job->params.repetition_penalty;
+  if (job->image_map) {
+    seq.image = job->image_map->data();
+    seq.image_len = static_cast<int>(job->image_map->size());
+  } else if (!job->image.empty()) {
+    seq.image = job->image.data();
+    seq.image_len = static_cast<int>(job->image.size());
+  }
+  seq.emit = [job](const char *text) { emit_job_output(job, text); };
+  job->status = JOB_RUNNING;
+}
+
+// True while the job still has an image to run through the vision encoder.
+static bool job_has_image(const InferenceJob &job) {
+  return job.seq.phase == Sequence::PREPARE &&
+         (job.image_map || !job.image.empty());
+}
+
+// Highest priority first, then submit order. Paused jobs keep their original
+// ID, so they resume ahead of newer work of the same class.
+static bool runs_before(const InferenceJob &a, const InferenceJob &b) {
+  return a.priority != b.priority ? a.priority > b.priority : a.id < b.id;
+}
+
+// ── Drafts ───────────────────────────────────────────────────────────────────
+// A prompt that is typed over a minute, like the intake form, need not wait
+// for the submit to be prefilled. medgemma_session_push() sets one segment of
+// a session's next prompt; while the engine has no job, the scheduler feeds
+// the segments into the session's cache one at a time, and the job submitted
+// to the session later prefills only what is left: the segments still
+// missing, then its own prompt. The cache records where each segment ends, so
+// an edit cuts it back to the end of the last segment that is unchanged.
+//
+// A draft never evicts: a segment that would leave less than SESSION_MIN_ROOM
+// of the window, or would lose its image to a memory plan, is left to the
+// job. So is everything while memory is at MEDGEMMA_MEM_HIGH or above, and
+// the rest of a segment once a job is queued.
+
+// True if the session's cache does not match its draft yet.
+static bool draft_pending(const ChatSession &s) {
+  if (s.busy || s.lost || s.drafting || s.draft_stuck)
+    return false;
+  if (s.drafted.size() != s.draft.size())
+    return true;
+  for (size_t i = 0; i < s.draft.size(); ++i)
+    if (!s.drafted[i].same(s.draft[i]))
+      return true;
+  return false;
+}
+
+// Runs one draft unit if a session has one; false if none had.
+static bool draft_step(MedGemmaState *state, int pressure) {
+  std::shared_ptr<ChatSession> session;
+  std::vector<DraftSegment> want;
+  {
+    std::lock_guard<std::mutex> lock(state->queue_mutex);
+    state->draft_work = false;
+    if (state->stopping || pressure >= MEDGEMMA_MEM_HIGH)
+      return false; // the job will do it
+    for (auto &entry : state->sessions)
+      if (draft_pending(*entry.second)) {
+        session = entry.second;
+        break;
+      }
+    if (!session)
+      return false;
+    session->drafting = true;
+    // The segments up to the first one that is not in the cache.
+    size_t keep = 0;
+    while (keep < session->drafted.size() && keep < session->draft.size() &&
+           session->drafted[keep].same(session->draft[keep]))
+      keep++;
+    want.assign(session->draft.begin(),
+                session->draft.begin() +
+                    std::min(keep + 1, session->draft.size()));
+    state->draft_work = true; // come back for the next one
+  }
+
+  bool stuck = false;
+  GenControl ctl;
+  Sequence seq;
+  seq.ctl = &ctl;
+  seq.emit = [](const char *) {};
+  seq.max_tokens = 0;
+  seq.session = session;
+  seq.draft = want;
+  seq.draft_only = true;
+  auto started = std::chrono::steady_clock::now();
+  int64_t cached = 0;
+  try {
+    const size_t keep = draft_reconcile(state, *session, want);
+    cached = session->kv_len;
+    if (keep < want.size()) {
+      seq_prepare(state, seq, PlanInput());
+      const int64_t positions = (int64_t)(seq.embeds.size() / embed_dim);
+      const bool lost_image =
+          !want.back().image.empty() && seq.times.image_tokens == 0;
+      stuck = lost_image || seq.kv_len + positions >
+                                session->window - SESSION_MIN_ROOM;
+      while (!stuck && seq.phase == Sequence::PREFILL) {
+        {
+          std::lock_guard<std::mutex> lock(state->queue_mutex);
+          if (!state->queue.empty())
+            break; // a job came in: it takes over from here
+        }
+        seq_prefill_chunk(state, seq, seq.prefill_chunk);
+      }
+    }
+  } catch (const std::exception &e) {
+    LOGE("Session %lld: draft failed: %s", (long long)session->id, e.what());
+    stuck = true;
+  }
+  if (!seq.kv.empty()) { // seq_prepare took the session's cache
+    session->kv = std::move(seq.kv);
+    session->kv_len = seq.kv_len;
+    session->spill = std::move(seq.spill);
+  }
+  if (seq.answered) {
+    session->drafted.push_back(want.back());
+    session->drafted.back().end = seq.kv_len;
+    LOGI("Session %lld: drafted segment %zu (%lld → %lld positions, "
+         "%.0f ms)",
+         (long long)session->id, want.size() - 1, (long long)cached,
+         (long long)seq.kv_len, ms_since(started));
+  }
+  std::lock_guard<std::mutex> lock(state->queue_mutex);
+  session->drafting = false;
+  session->draft_stuck = stuck;
+  return true;
+}
+
+// ── Scheduler ────────────────────────────────────────────────────────────────
+// Per-engine worker: one thread for the engine's lifetime, so a request costs
+// a queue push instead of a thread/isolate spawn. Up to max_batch requests are
+// in flight at once. Each round retires finished sequences, admits queued
+// jobs, runs one prepare or prefill-chunk unit for the oldest newcomer and then
+// one batched decode step for every sequence already generating — new users
+// start streaming after their own prefill rather than after everyone else's
+// report, and a shared step costs far less than B separate ones.
+//
+// When the engine is full and a queued job outranks a running one, the
+// lowest-priority, most recently admitted job is paused between two steps: it
+// goes back to the queue with its Sequence (KV cache, prompt position, sampler
+// state) intact and resumes where it stopped once capacity frees up. On
+// phones (max_batch 1) this lets a chat follow-up overtake a long report.
+// On shutdown the remaining queue is cancelled so every job still reaches a
+// terminal status.
+//
+// Each round also reads the memory monitor's level (see MemoryMonitor) and
+// degrades instead of waiting for the low-memory killer: caches go when the
+// level rises, images and new admissions stop at MEDGEMMA_MEM_HIGH, and at
+// MEDGEMMA_MEM_CRITICAL every KV cache is spilled to flash (see KvSpill) and
+// the engine pauses for up to MEM_PAUSE_MS. If the level does not drop, the
+// jobs carry on from their spill files, one step at a time; they are only
+// stopped if there was nowhere to spill to. Spilled caches come back into
+// RAM once the level is below MEDGEMMA_MEM_HIGH.
+static void scheduler_loop(MedGemmaState *state) {
+#ifdef ANDROID
+  // Lower this thread's priority so the UI/main thread stays responsive.
+  // ANDROID_PRIORITY_BACKGROUND = 10, keeps UI at normal priority (0).
+  // Without this, heavy CPU usage here starves the main thread → ANR dialog.
+  struct sched_param sp = {0};
+  sched_setscheduler(0, SCHED_BATCH, &sp); // batch scheduling = lower priority
+  setpriority(PRIO_PROCESS, 0, 10);        // nice value 10 = background
+#endif
+
+  t_tracer = state->tracer.get();
+  std::vector<std::shared_ptr<InferenceJob>> active; // admission order
+  DecodeBatch batch(state->io);
+  Ort::RunOptions shared_opts; // batched steps; members stop between steps
+  shared_opts.SetRunLogSeverityLevel(3);
+  int last_pressure = MEDGEMMA_MEM_OK;
+  bool paused = false; // this critical spell's pause is over
+
+  auto decoding = [&]() {
+    std::vector<Sequence *> members;
+    for (auto &job : active)
+      if (job->seq.phase == Sequence::DECODE && !job->seq.finished() &&
+          !job->seq.spill)
+        members.push_back(&job->seq);
+    return members;
+  };
+
+  for (;;) {
+    bool reload_vision = false;
+    bool image_queued = false;
+    int pressure = MEDGEMMA_MEM_OK;
+    {
+      std::unique_lock<std::mutex> lock(state->queue_mutex);
+      state->queue_cv.wait(lock, [&]() {
+        return state->stopping || state->reload_vision ||
+               !state->queue.empty() || !active.empty() ||
+               state->draft_work;
+      });
+      if (state->stopping && state->queue.empty() && active.empty())
+        return;
+      // Stopped jobs (and, while stopping, everything) are admitted regardless
+      // of capacity so they are retired below instead of holding their KV.
+      for (auto it = state->queue.begin(); it != state->queue.end();) {
+        if (state->stopping || (*it)->ctl.stop_requested()) {
+          start_job(it->get());
+          active.push_back(std::move(*it));
+          it = state->queue.erase(it);
+        } else {
+          ++it;
+        }
+      }
+      pressure = state->memory.level(); // after the wait, not before
+      const int capacity =
+          pressure >= MEDGEMMA_MEM_HIGH ? 1 : state->max_batch;
+      while (!state->queue.empty()) {
+        auto best = std::min_element(
+            state->queue.begin(), state->queue.end(),
+            [](const std::shared_ptr<InferenceJob> &a,
+               const std::shared_ptr<InferenceJob> &b) {
+              return runs_before(*a, *b);
+            });
+        if ((int)active.size() >= capacity) {
+          // Full: make room only for a job that outranks someone running.
+          auto victim = active.end();
+          for (auto it = active.begin(); it != active.end(); ++it)
+            if (!(*it)->seq.finished() &&
+                (victim == active.end() || runs_before(**victim, **it)))
+              victim = it;
+          if (victim == active.end() ||
+              (*victim)->priority >= (*best)->priority)
+            break;
+          LOGI("Preempting job %lld (priority %d) for job %lld (priority %d)",
+               (long long)(*victim)->id, (*victim)->priority,
+               (long long)(*best)->id, (*best)->priority);
+          (*victim)->status = JOB_QUEUED;
+          state->queue.push_back(std::move(*victim));
+          active.erase(victim);
+          state->counters.preemptions++;
+          continue; // `best` may be stale after push_back
+        }
+        std::shared_ptr<InferenceJob> job = std::move(*best);
+        state->queue.erase(best);
+        if (!job->admitted) {
+          job->admitted = true;
+          double wait = ms_since(job->submitted_at);
+          job->seq.times.queue_ms = wait;
+          QueueCounters &c = state->counters;
+          c.wait_sum_ms[job->priority] += wait;
+          c.wait_n[job->priority]++;
+          c.wait_max_ms[job->priority] =
+              std::max(c.wait_max_ms[job->priority], wait);
+        }
+        start_job(job.get());
+        active.push_back(std::move(job));
+      }
+      for (auto &job : state->queue)
+        image_queued = image_queued || job_has_image(*job);
+      state->running = (int)active.size();
+      reload_vision = state->reload_vision;
+      state->reload_vision = false;
+    }
+
+    if (reload_vision) {
+      try {
+        ensure_vision_sessions(state);
+      } catch (const std::exception &e) {
+        LOGE("Vision session reload EXCEPTION: %s", e.what());
+      }
+    }
+
+    // ── Retire ────────────────────────────────────────────────────────
+    if (decoding() != batch.members)
+      batch_unpack(batch); // before any member's job goes away
+    for (auto it = active.begin(); it != active.end();) {
+      Sequence &seq = (*it)->seq;
+      if (!seq.finished()) {
+        ++it;
+        continue;
+      }
+      if (seq.ctl->stop_requested())
+        note_stop(seq);
+      else
+        LOGI("Inference complete");
+      finish_job(*it);
+      it = active.erase(it);
+      std::lock_guard<std::mutex> lock(state->queue_mutex);
+      state->counters.finished++;
+      state->running = (int)active.size();
+    }
+    if (active.empty()) {
+      if (draft_step(state, pressure))
+        continue; // idle: prefill what the drafts already have
+      stage_allocator().release(); // idle: hand the pool back to the OS
+      continue;
+    }
+
+    // ── Memory pressure ───────────────────────────────────────────────
+    if (pressure > last_pressure && pressure >= MEDGEMMA_MEM_MODERATE) {
+      stage_allocator().release();
+      drop_vision_sessions(state);
+    }
+    last_pressure = pressure;
+    if (pressure == MEDGEMMA_MEM_CRITICAL) {
+      batch_unpack(batch);
+      bool spilled = true;
+      for (auto &job : active)
+        if (!job->seq.finished())
+          spilled = seq_spill(state, job->seq) && spilled;
+      stage_allocator().release();
+      if (!paused) {
+        paused = true;
+        LOGI("Memory critical: pausing %zu job(s)", active.size());
+        state->memory.wait_below(MEDGEMMA_MEM_CRITICAL, MEM_PAUSE_MS, [&]() {
+          for (auto &job : active)
+            if (!job->ctl.stop_requested())
+              return false;
+          return true; // all cancelled (or unloading): retire them
+        });
+        continue; // re-read the level and retire before running anything
+      }
+      if (!spilled) {
+        for (auto &job : active) {
+          if (job->seq.finished() || job->seq.spill)
+            continue;
+          job->seq.emit("[WARN] Low RAM, stopping");
+          job->seq.phase = Sequence::DONE;
+        }
+        continue;
+      }
+      // Still critical: go on from the spill files.
+    } else {
+      paused = false;
+      if (pressure < MEDGEMMA_MEM_HIGH)
+        for (auto &job : active)
+          seq_restore(state, job->seq);
+    }
+
+    // ── One prepare / prefill unit for the first newcomer ────────────
+    std::shared_ptr<InferenceJob> newcomer;
+    for (auto &job : active)
+      if ((job->seq.phase == Sequence::PREPARE ||
+           job->seq.phase == Sequence::PREFILL) &&
+          (!newcomer || runs_before(*job, *newcomer)))
+        newcomer = job;
+    if (newcomer) {
+      const std::shared_ptr<InferenceJob> &job = newcomer;
+      Sequence &seq = job->seq;
+      t_trace_track = job->id;
+      try {
+        if (seq.phase == Sequence::PREPARE) {
+          PlanInput in;
+          in.keep_vision = image_queued;
+          in.pressure = pressure;
+          for (auto &other : active) {
+            if (other == job || other->seq.finished())
+              continue;
+            const Sequence &o = other->seq;
+            if (o.phase == Sequence::PREPARE && job_has_image(*other))
+              in.keep_vision = true;
+            // Cache still to come, held twice during each decoder Run.
+            int64_t ahead = o.max_tokens - o.generated + o.prompt_left();
+            in.others_kb +=
+                2 * kv_kb(state->estimates, std::max<int64_t>(0, ahead));
+          }
+          seq_prepare(state, seq, in);
+        } else {
+          seq_prefill_chunk(state, seq,
+                            pressure >= MEDGEMMA_MEM_HIGH
+                                ? std::min(seq.prefill_chunk,
+                                           PREFILL_CHUNK_MIN)
+                                : seq.prefill_chunk);
+        }
+      } catch (const std::exception &e) {
+        fail_sequence(seq, e);
+      }
+      t_trace_track = 0;
+      if (seq.generated > 0 && !job->first_token_seen) {
+        job->first_token_seen = true;
+        double ttft = ms_since(job->submitted_at);
+        seq.times.first_token_ms = ttft;
+        LOGI("Job %lld first token after %.0f ms", (long long)job->id, ttft);
+        std::lock_guard<std::mutex> lock(state->queue_mutex);
+        state->counters.ttft_sum_ms[job->priority] += ttft;
+        state->counters.ttft_n[job->priority]++;
+      }
+    }
+
+    // ── Sessions at their window make room (see seq_make_room) ───────
+    for (auto &job : active) {
+      Sequence &seq = job->seq;
+      if (!seq.session || seq.phase != Sequence::DECODE || seq.finished() ||
+          seq.kv_len < seq.session->window)
+        continue;
+      if (std::find(batch.members.begin(), batch.members.end(), &seq) !=
+          batch.members.end())
+        batch_unpack(batch); // repacked below
+      try {
+        seq_make_room(state, seq, 1);
+      } catch (const std::exception &e) {
+        fail_sequence(seq, e);
+      }
+    }
+
+    // ── One decode step for everyone generating ──────────────────────
+    for (auto &job : active) {
+      Sequence &seq = job->seq;
+      if (!seq.spill || seq.phase != Sequence::DECODE || seq.finished())
+        continue;
+      DecodeBatch solo(state->io); // moves the views in and out, no copy
+      batch_pack(solo, {&seq});
+      t_trace_track = job->id;
+      try {
+        decode_step(state, solo, shared_opts);
+      } catch (const std::exception &e) {
+        fail_sequence(seq, e);
+      }
+      t_trace_track = 0;
+      batch_unpack(solo);
+    }
+    std::vector<Sequence *> members = decoding();
+    if (members != batch.members) {
+      batch_unpack(batch);
+      batch_pack(batch, members);
+    }
+    if (batch.members.empty())
+      continue;
+    try {
+      decode_step(state, batch, shared_opts);
+    } catch (const std::exception &e) {
+      for (auto *seq : batch.members)
+        fail_sequence(*seq, e);
+      continue;
+    }
+  }
+}
+
+// ── Isolated engine ──────────────────────────────────────────────────────────
+// load_medgemma_isolated() runs the engine in a child process (medgemma_daemon)
+// so an ORT crash or the low-memory killer costs a restart of that child, not
+// the app hosting the UI. The handle it returns works with every export: jobs
+// are ordinary InferenceJobs on this side (poll/read/release/ports unchanged)
+// whose output arrives through the shared-memory rings in medgemma_ipc.h.
+//
+// One supervisor thread per engine spawns the child, pumps its events and,
+// when the socket reports the child gone, fails the jobs it was running and
+// starts a new one. Weights are mmap'd (session.use_mmap), so a restart finds
+// them in the page cache instead of reading 3.8 GB again.
+#ifndef _WIN32
+
+class IsolatedEngine {
+public:
+  std::string model_dir;
+  std::string daemon_path;
+  std::thread supervisor;
+
+  std::mutex mutex; // guards everything below
+  std::condition_variable cv;
+  void *base = nullptr; // mapped ipc::Block of the current child
+  std::unique_ptr<ipc::Block> block;
+  int sock = -1;
+  pid_t pid = -1;
+  bool ready = false;    // current child has loaded the model
+  bool stopping = false; // unload_medgemma
+  bool dead = false;     // gave up restarting
+  uint64_t generation = 0; // bumped whenever a child goes away
+  int restarts = 0;
+  int max_batch = 0; // replayed to every new child, 0 → its default
+  // Template sources by ID - 1. Each render sends its source and the child
+  // defines it on first sight, so templates outlive a restart.
+  std::vector<std::string> templates;
+  std::unordered_map<int64_t, std::shared_ptr<InferenceJob>> live;
+  std::unordered_map<int64_t, std::vector<uint8_t>> replies; // by ID / tag
+  int64_t next_tag = -1; // call tags are negative, job IDs positive
+
+  std::mutex call_mutex; // one synchronous call at a time (owns the slab)
+  MetricsBook metrics;   // fed from the children's final StatusMsg timings
+};
+
+static std::mutex g_isolated_mutex;
+static std::vector<IsolatedEngine *> g_isolated;
+
+static IsolatedEngine *as_isolated(void *handle) {
+  std::lock_guard<std::mutex> lock(g_isolated_mutex);
+  for (auto *eng : g_isolated)
+    if (eng == handle)
+      return eng;
+  return nullptr;
+}
+
+// The daemon ships next to this library: as libmedgemma_daemon.so inside an
+// Android APK (the only place apps may exec from), as medgemma_daemon in the
+// same directory or in ../bin on desktop.
+static std::string find_daemon() {
+  Dl_info info;
+  if (!dladdr(reinterpret_cast<void *>(&as_isolated), &info) ||
+      !info.dli_fname)
+    return "";
+  std::string dir = info.dli_fname;
+  size_t slash = dir.rfind('/');
+  dir = slash == std::string::npos ? "." : dir.substr(0, slash);
+  for (const char *name : {"/libmedgemma_daemon.so", "/medgemma_daemon",
+                           "/../bin/medgemma_daemon"})
+    if (access((dir + name).c_str(), X_OK) == 0)
+      return dir + name;
+  return "";
+}
+
+// Anonymous shared memory the child inherits. memfd where the kernel has it
+// (3.17+), otherwise an unlinked file in the model directory.
+static int create_shared_block(const std::string &fallback_dir) {
+  int fd = -1;
+#ifdef SYS_memfd_create
+  fd = static_cast<int>(syscall(SYS_memfd_create, "medgemma_ipc", 1u));
+#endif
+  if (fd < 0) {
+    std::string tmpl = fallback_dir + "/.medgemma_ipc_XXXXXX";
+    fd = mkstemp(&tmpl[0]);
+    if (fd >= 0) {
+      unlink(tmpl.c_str());
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+  }
+  if (fd >= 0 && ftruncate(fd, static_cast<off_t>(ipc::block_size())) != 0) {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+static void ring_doorbell(int sock) {
+  char b = 1;
+  // Non-blocking: a full socket buffer already holds an unread wakeup.
+  (void)!send(sock, &b, 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+// Pushes one request to the current child. Caller holds eng->mutex; waits
+// (unlocked) while the ring is full. False if there is no live child.
+static bool send_request(IsolatedEngine *eng,
+                         std::unique_lock<std::mutex> &lock, uint32_t type,
+                         int64_t id, const void *a = nullptr,
+                         uint32_t a_len = 0, const void *b = nullptr,
+                         uint32_t b_len = 0) {
+  if (sizeof(ipc::MsgHeader) + a_len + b_len > ipc::REQUEST_RING_BYTES)
+    return false;
+  for (;;) {
+    if (!eng->ready || eng->stopping)
+      return false;
+    if (eng->block->requests.push(type, id, a, a_len, b, b_len))
+      break;
+    uint64_t gen = eng->generation;
+    eng->cv.wait_for(lock, std::chrono::milliseconds(1));
+    if (eng->generation != gen)
+      return false;
+  }
+  ring_doorbell(eng->sock);
+  return true;
+}
+
+// Waits for the reply to `id`. Empty optional-by-flag if the child died first.
+static bool wait_reply(IsolatedEngine *eng, std::unique_lock<std::mutex> &lock,
+                       int64_t id, std::vector<uint8_t> &out) {
+  uint64_t gen = eng->generation;
+  bool got = eng->cv.wait_for(lock, std::chrono::seconds(30), [&] {
+    return eng->replies.count(id) || eng->generation != gen || eng->stopping;
+  });
+  auto it = eng->replies.find(id);
+  if (!got || it == eng->replies.end())
+    return false;
+  out = std::move(it->second);
+  eng->replies.erase(it);
+  return true;
+}
+
+// Waits up to `timeout` for a child that has loaded the model.
+static bool wait_ready(IsolatedEngine *eng, std::unique_lock<std::mutex> &lock,
+                       std::chrono::seconds timeout) {
+  return eng->cv.wait_for(lock, timeout, [&] {
+    return eng->ready || eng->dead || eng->stopping;
+  }) && eng->ready && !eng->stopping;
+}
+
+// fork + exec of the daemon with the block and socket as fds 3 and 4 of its
+// own numbering (passed on the command line). Everything exec needs is built
+// before fork: the child of a multi-threaded process may only call
+// async-signal-safe functions.
+static bool spawn_daemon(IsolatedEngine *eng) {
+  int shm = create_shared_block(eng->model_dir);
+  if (shm < 0) {
+    LOGE("isolated: shared memory: %s", strerror(errno));
+    return false;
+  }
+  void *base = mmap(nullptr, ipc::block_size(), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, shm, 0);
+  int sv[2];
+  if (base == MAP_FAILED ||
+      socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+    LOGE("isolated: mmap/socketpair: %s", strerror(errno));
+    if (base != MAP_FAILED)
+      munmap(base, ipc::block_size());
+    close(shm);
+    return false;
+  }
+  auto block = std::make_unique<ipc::Block>(base, true);
+
+  std::string shm_arg = std::to_string(shm), sock_arg = std::to_string(sv[1]);
+  std::string log_path, trace_dir, spill_dir;
+  MemoryPaths mem_paths, default_paths;
+  {
+    std::lock_guard<std::mutex> lock(g_log_mutex);
+    log_path = g_log_path;
+    trace_dir = g_trace_dir;
+    spill_dir = g_spill_dir;
+    mem_paths = g_memory_paths;
+  }
+  std::string level_arg = std::to_string(g_log_level.load());
+  std::string kv_arg = std::to_string(g_kv_precision.load());
+  std::string pool_arg = std::to_string(g_image_pooling.load());
+  std::vector<const char *> argv = {eng->daemon_path.c_str(),
+                                    "--model",
+                                    eng->model_dir.c_str(),
+                                    "--shm-fd",
+                                    shm_arg.c_str(),
+                                    "--sock-fd",
+                                    sock_arg.c_str()};
+  if (!log_path.empty()) {
+    argv.push_back("--log");
+    argv.push_back(log_path.c_str());
+  }
+  argv.push_back("--log-level");
+  argv.push_back(level_arg.c_str());
+  argv.push_back("--kv");
+  argv.push_back(kv_arg.c_str());
+  argv.push_back("--image-pooling");
+  argv.push_back(pool_arg.c_str());
+  if (!trace_dir.empty()) {
+    argv.push_back("--trace");
+    argv.push_back(trace_dir.c_str());
+  }
+  if (mem_paths.meminfo != default_paths.meminfo) {
+    argv.push_back("--meminfo");
+    argv.push_back(mem_paths.meminfo.c_str());
+  }
+  if (mem_paths.psi != default_paths.psi) {
+    argv.push_back("--psi");
+    argv.push_back(mem_paths.psi.c_str());
+  }
+  if (!mem_paths.cgroup.empty()) {
+    argv.push_back("--cgroup");
+    argv.push_back(mem_paths.cgroup.c_str());
+  }
+  if (!spill_dir.empty()) {
+    argv.push_back("--spill");
+    argv.push_back(spill_dir.c_str());
+  }
+  argv.push_back(nullptr);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    fcntl(shm, F_SETFD, 0); // keep these two across exec
+    fcntl(sv[1], F_SETFD, 0);
+    execv(argv[0], const_cast<char *const *>(argv.data()));
+    _exit(127);
+  }
+  close(shm); // the mapping keeps the block alive
+  close(sv[1]);
+  if (pid < 0) {
+    LOGE("isolated: fork: %s", strerror(errno));
+    munmap(base, ipc::block_size());
+    close(sv[0]);
+    return false;
+  }
+  fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+  LOGI("isolated: started %s (pid %d)", argv[0], (int)pid);
+
+  std::lock_guard<std::mutex> lock(eng->mutex);
+  eng->base = base;
+  eng->block = std::move(block);
+  eng->sock = sv[0];
+  eng->pid = pid;
+  return true;
+}
+
+static void handle_event(IsolatedEngine *eng, const ipc::MsgHeader &h,
+                         std::vector<uint8_t> &payload) {
+  int32_t value = 0;
+  if (payload.size() >= sizeof(value))
+    memcpy(&value, payload.data(), sizeof(value));
+
+  if (h.type == ipc::MSG_READY) {
+    std::unique_lock<std::mutex> lock(eng->mutex);
+    LOGI("isolated: engine ready in pid %d", (int)value);
+    eng->ready = true;
+    if (eng->max_batch > 0)
+      send_request(eng, lock, ipc::MSG_SET_MAX_BATCH, 0, &eng->max_batch,
+                   sizeof(eng->max_batch));
+    eng->cv.notify_all();
+    return;
+  }
+  if (h.type == ipc::MSG_SUBMITTED || h.type == ipc::MSG_STATS ||
+      h.type == ipc::MSG_TOKENS || h.type == ipc::MSG_RESULT ||
+      h.type == ipc::MSG_CONTEXT_PLAN) {
+    std::lock_guard<std::mutex> lock(eng->mutex);
+    eng->replies[h.id] = std::move(payload);
+    eng->cv.notify_all();
+    return;
+  }
+
+  std::shared_ptr<InferenceJob> job;
+  {
+    std::lock_guard<std::mutex> lock(eng->mutex);
+    auto it = eng->live.find(h.id);
+    if (it == eng->live.end())
+      return;
+    job = it->second;
+    if (h.type == ipc::MSG_STATUS && value >= JOB_DONE)
+      eng->live.erase(it);
+  }
+  // Outside eng->mutex: a ring write may block and settle_job takes
+  // g_jobs_mutex, which medgemma_release holds while calling cancel_job.
+  if (h.type == ipc::MSG_TEXT) {
+    job->status = JOB_RUNNING;
+    std::string text(payload.begin(), payload.end());
+    emit_job_output(job.get(), text.c_str());
+  } else if (h.type == ipc::MSG_STATUS) {
+    if (payload.size() == sizeof(ipc::StatusMsg)) {
+      memcpy(&job->timings,
+             payload.data() + offsetof(ipc::StatusMsg, timings),
+             sizeof(job->timings));
+      memcpy(&job->classification,
+             payload.data() + offsetof(ipc::StatusMsg, classification),
+             sizeof(job->classification));
+    }
+    if (value >= JOB_DONE)
+      settle_job(job, value);
+    else
+      job->status = value;
+  }
+}
+
+// Relays the current child's events until it goes away (or unload shuts the
+// socket). Returns whether it ever became ready.
+static bool pump_events(IsolatedEngine *eng) {
+  bool was_ready = false;
+  std::vector<uint8_t> payload;
+  ipc::MsgHeader h;
+  for (bool open = true; open;) {
+    pollfd pfd = {eng->sock, POLLIN, 0};
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+      break;
+    char drain[256];
+    for (;;) {
+      ssize_t n = recv(eng->sock, drain, sizeof(drain), 0);
+      if (n > 0)
+        continue;
+      if (n == 0 || (errno != EAGAIN && errno != EINTR))
+        open = false; // EOF: the child exited (or we are unloading)
+      break;
+    }
+    // Only this thread pops events or replaces the block; drain even after
+    // EOF so output written just before a clean exit is not lost.
+    ipc::PopResult got;
+    while ((got = eng->block->events.pop(h, payload)) == ipc::POP_OK) {
+      was_ready |= h.type == ipc::MSG_READY;
+      handle_event(eng, h, payload);
+    }
+    if (got == ipc::POP_CORRUPT) {
+      // The child wrote garbage: treat it like a crash, and restart it.
+      LOGE("isolated: corrupt event from pid %d, killing it", (int)eng->pid);
+      if (eng->pid > 0)
+        kill(eng->pid, SIGKILL);
+      break;
+    }
+  }
+  return was_ready;
+}
+
+// Reaps the current child (killing it if it outlives unload by 10 s), then
+// fails whatever it was still running.
+static void retire_daemon(IsolatedEngine *eng) {
+  pid_t pid;
+  std::unordered_map<int64_t, std::shared_ptr<InferenceJob>> orphans;
+  {
+    std::lock_guard<std::mutex> lock(eng->mutex);
+    pid = eng->pid;
+    eng->ready = false;
+    eng->generation++;
+    orphans.swap(eng->live);
+    eng->cv.notify_all();
+  }
+  int wstatus = 0;
+  for (int waited = 0; pid > 0; waited += 10) {
+    pid_t r = waitpid(pid, &wstatus, WNOHANG);
+    if (r == pid || (r < 0 && errno != EINTR))
+      break;
+    if (waited == 10000) {
+      LOGE("isolated: pid %d did not exit, killing it", (int)pid);
+      kill(pid, SIGKILL);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  if (WIFSIGNALED(wstatus))
+    LOGE("isolated: engine pid %d killed by signal %d", (int)pid,
+         WTERMSIG(wstatus));
+  else
+    LOGI("isolated: engine pid %d exited with %d", (int)pid,
+         WEXITSTATUS(wstatus));
+
+  for (auto &kv : orphans) {
+    auto &job = kv.second;
+    if (job->ctl.cancelled) {
+      settle_job(job, JOB_CANCELLED);
+      continue;
+    }
+    emit_job_output(job.get(),
+                    "[ERR] The inference engine stopped unexpectedly and is "
+                    "restarting. Please try again.");
+    settle_job(job, JOB_FAILED);
+  }
+
+  std::lock_guard<std::mutex> lock(eng->mutex);
+  close(eng->sock);
+  munmap(eng->base, ipc::block_size());
+  eng->sock = -1;
+  eng->base = nullptr;
+  eng->block.reset();
+  eng->pid = -1;
+}
+
+// Restarts a crashed child with backoff; gives up after three children in a
+// row die before loading the model (bad model dir, missing daemon, ...).
+static void supervise(IsolatedEngine *eng) {
+  int failed_starts = 0;
+  for (;;) {
+    bool spawned = spawn_daemon(eng);
+    bool was_ready = spawned && pump_events(eng);
+    if (spawned)
+      retire_daemon(eng);
+
+    std::unique_lock<std::mutex> lock(eng->mutex);
+    if (eng->stopping)
+      break;
+    failed_starts = was_ready ? 0 : failed_starts + 1;
+    if (failed_starts >= 3) {
+      LOGE("isolated: engine failed to start %d times, giving up",
+           failed_starts);
+      eng->dead = true;
+      eng->cv.notify_all();
+      break;
+    }
+    eng->restarts++;
+    auto backoff = std::chrono::milliseconds(500 << failed_starts);
+    LOGE("isolated: restarting engine (restart #%d)", eng->restarts);
+    if (eng->cv.wait_for(lock, backoff, [&] { return eng->stopping; }))
+      break;
+  }
+}
+
+static void *isolated_load(const char *model_dir, const char *daemon_path) {
+  auto *eng = new IsolatedEngine();
+  eng->model_dir = model_dir;
+  eng->daemon_path =
+      daemon_path && daemon_path[0] ? std::string(daemon_path) : find_daemon();
+  if (eng->daemon_path.empty() || access(eng->daemon_path.c_str(), X_OK)) {
+    LOGE("load_medgemma_isolated: medgemma_daemon not found");
+    delete eng;
+    return nullptr;
+  }
+  eng->supervisor = std::thread(supervise, eng);
+  {
+    std::unique_lock<std::mutex> lock(eng->mutex);
+    // Loading the model takes tens of seconds on a phone.
+    if (!wait_ready(eng, lock, std::chrono::seconds(600))) {
+      eng->stopping = true;
+      if (eng->sock >= 0)
+        shutdown(eng->sock, SHUT_RDWR);
+      eng->cv.notify_all();
+      lock.unlock();
+      eng->supervisor.join();
+      delete eng;
+      LOGE("load_medgemma_isolated: engine did not start");
+      return nullptr;
+    }
+  }
+  std::lock_guard<std::mutex> lock(g_isolated_mutex);
+  g_isolated.push_back(eng);
+  return eng;
+}
+
+static void isolated_unload(IsolatedEngine *eng) {
+  {
+    std::lock_guard<std::mutex> lock(g_isolated_mutex);
+    g_isolated.erase(std::find(g_isolated.begin(), g_isolated.end(), eng));
+  }
+  {
+    // Closing our end is the daemon's signal to cancel everything and exit.
+    std::lock_guard<std::mutex> lock(eng->mutex);
+    eng->stopping = true;
+    if (eng->sock >= 0)
+      shutdown(eng->sock, SHUT_RDWR);
+    eng->cv.notify_all();
+  }
+  eng->supervisor.join();
+  delete eng;
+}
+
+static int64_t isolated_submit(IsolatedEngine *eng, const uint8_t *image_bytes,
+                               int image_len, const char *prompt,
+                               const int64_t *tokens, int32_t n_tokens,
+                               const MedGemmaJobParams *params,
+                               const char *const *labels = nullptr,
+                               int32_t n_labels = 0) {
+  // An fd is the caller's and may be closed right after submit: copy it now.
+  std::unique_ptr<MappedImage> image_map;
+  if ((!image_bytes || image_len <= 0) && params && params->image_fd > 0) {
+    image_map = MappedImage::open(nullptr, params->image_fd);
+    if (!image_map)
+      return -1;
+    image_bytes = image_map->data();
+    image_len = static_cast<int>(
+        std::min<size_t>(image_map->size(), ipc::IMAGE_SLAB_BYTES + 1));
+  }
+  if (!image_bytes)
+    image_len = 0;
+  if (image_len > static_cast<int>(ipc::IMAGE_SLAB_BYTES)) {
+    LOGE("medgemma_submit: image larger than %u bytes, pass it by path",
+         ipc::IMAGE_SLAB_BYTES);
+    return -1;
+  }
+
+  auto job = std::make_shared<InferenceJob>();
+  job->id = g_next_job_id++;
+  job->isolated = eng;
+  job->metrics = &eng->metrics;
+  job->submitted_at = std::chrono::steady_clock::now();
+  if (params) {
+    job->dart_port = params->dart_port;
+    job->priority = params->priority;
+  }
+  if (job->dart_port && !g_post_cobject.load()) {
+    LOGE("medgemma_submit: dart_port set before medgemma_init_dart_api");
+    return -1;
+  }
+
+  ipc::SubmitMsg msg = {};
+  if (params)
+    msg.params = *params;
+  msg.params.image_path = nullptr;
+  msg.params.image_fd = 0;
+  msg.params.dart_port = 0;
+  msg.image_len = static_cast<uint32_t>(image_len);
+  std::string strings = prompt ? prompt : "";
+  msg.prompt_len = static_cast<uint32_t>(strings.size());
+  if (!image_len && params && params->image_path) {
+    msg.path_len = static_cast<uint32_t>(strlen(params->image_path));
+    strings += params->image_path;
+  }
+  if (!prompt) {
+    msg.token_count = static_cast<uint32_t>(n_tokens);
+    strings.append(reinterpret_cast<const char *>(tokens),
+                   n_tokens * sizeof(int64_t));
+  }
+  msg.label_count = static_cast<uint32_t>(n_labels);
+  for (int32_t i = 0; i < n_labels; ++i) {
+    uint32_t len = labels[i] ? static_cast<uint32_t>(strlen(labels[i])) : 0;
+    strings.append(reinterpret_cast<const char *>(&len), sizeof(len));
+    strings.append(labels[i] ? labels[i] : "", len);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(g_jobs_mutex);
+    g_jobs[job->id] = job;
+  }
+  std::lock_guard<std::mutex> call(eng->call_mutex);
+  std::unique_lock<std::mutex> lock(eng->mutex);
+  // A restart in progress delays the submit instead of failing it.
+  bool accepted = false;
+  if (wait_ready(eng, lock, std::chrono::seconds(120))) {
+    if (image_len)
+      memcpy(eng->block->image_slab, image_bytes, image_len);
+    eng->live[job->id] = job;
+    std::vector<uint8_t> reply;
+    accepted = send_request(eng, lock, ipc::MSG_SUBMIT, job->id, &msg,
+                            sizeof(msg), strings.data(),
+                            static_cast<uint32_t>(strings.size())) &&
+               wait_reply(eng, lock, job->id, reply) && reply.size() >= 4 &&
+               reply[0] != 0;
+    if (image_len && eng->base) // the daemon copied it: drop the pages
+      madvise(eng->block->image_slab, image_len, MADV_REMOVE);
+    if (!accepted)
+      eng->live.erase(job->id);
+  }
+  lock.unlock();
+  if (!accepted) {
+    LOGE("medgemma_submit: isolated engine rejected job %lld",
+         (long long)job->id);
+    std::lock_guard<std::mutex> jobs_lock(g_jobs_mutex);
+    g_jobs.erase(job->id);
+    return -1;
+  }
+  LOGI("medgemma_submit: job %lld sent to the engine process",
+       (long long)job->id);
+  return job->id;
+}
+
+// Fire-and-forget control messages; dropped while no child is running.
+static void isolated_send(IsolatedEngine *eng, uint32_t type, int64_t id,
+                          int32_t value = 0) {
+  std::unique_lock<std::mutex> lock(eng->mutex);
+  if (type == ipc::MSG_SET_MAX_BATCH)
+    eng->max_batch = value;
+  send_request(eng, lock, type, id, &value, sizeof(value));
+}
+
+// The daemon keeps the session and maps this ID to its own. Sent without a
+// reply: if it is lost to a restart, submits to it fail like for any unknown
+// session.
+static int64_t isolated_session_open(IsolatedEngine *eng, int32_t window,
+                                     int32_t sink) {
+  int64_t id = g_next_session_id++;
+  const int32_t payload[2] = {window, sink};
+  std::unique_lock<std::mutex> lock(eng->mutex);
+  send_request(eng, lock, ipc::MSG_SESSION_OPEN, id, payload, sizeof(payload));
+  return id;
+}
+
+// Snapshot files are read and written by the daemon; these wait for it.
+static int32_t isolated_session_call(IsolatedEngine *eng, uint32_t type,
+                                     int64_t session, const char *path) {
+  std::lock_guard<std::mutex> call(eng->call_mutex);
+  std::unique_lock<std::mutex> lock(eng->mutex);
+  int64_t tag = eng->next_tag--;
+  std::vector<uint8_t> reply;
+  int32_t result = -1;
+  if (send_request(eng, lock, type, tag, &session, sizeof(session), path,
+                   static_cast<uint32_t>(strlen(path))) &&
+      wait_reply(eng, lock, tag, reply) && reply.size() == sizeof(result))
+    memcpy(&result, reply.data(), sizeof(result));
+  return result;
+}
+
+static int32_t isolated_session_save(IsolatedEngine *eng, int64_t session,
+                                     const char *path) {
+  return isolated_session_call(eng, ipc::MSG_SESSION_SAVE, session, path);
+}
+
+static int64_t isolated_session_load(IsolatedEngine *eng, const char *path) {
+  int64_t id = g_next_session_id++;
+  return isolated_session_call(eng, ipc::MSG_SESSION_LOAD, id, path) == 0
+             ? id
+             : -1;
+}
+
+// Waits for the daemon like a submit: the image goes through the slab.
+static int32_t isolated_session_push(IsolatedEngine *eng, int64_t session,
+                                     int32_t index, const char *text,
+                                     const uint8_t *image_bytes,
+                                     int32_t image_len) {
+  if (!text || !image_bytes || image_len <= 0)
+    image_len = 0;
+  if (image_len > static_cast<int32_t>(ipc::IMAGE_SLAB_BYTES)) {
+    LOGE("medgemma_session_push: image larger than %u bytes",
+         ipc::IMAGE_SLAB_BYTES);
+    return -1;
+  }
+  ipc::SessionPushMsg msg = {};
+  msg.session = session;
+  msg.index = index;
+  msg.has_text = text != nullptr;
+  msg.image_len = static_cast<uint32_t>(image_len);
+  msg.text_len = text ? static_cast<uint32_t>(strlen(text)) : 0;
+  std::lock_guard<std::mutex> call(eng->call_mutex);
+  std::unique_lock<std::mutex> lock(eng->mutex);
+  if (!wait_ready(eng, lock, std::chrono::seconds(120)))
+    return -1;
+  if (image_len)
+    memcpy(eng->block->image_slab, image_bytes, image_len);
+  int64_t tag = eng->next_tag--;
+  std::vector<uint8_t> reply;
+  int32_t result = -1;
+  if (send_request(eng, lock, ipc::MSG_SESSION_PUSH, tag, &msg, sizeof(msg),
+                   text, msg.text_len) &&
+      wait_reply(eng, lock, tag, reply) && reply.size() == sizeof(result))
+    memcpy(&result, reply.data(), sizeof(result));
+  if (image_len && eng->base)
+    madvise(eng->block->image_slab, image_len, MADV_REMOVE);
+  return result;
+}
+
+static int32_t isolated_template_define(IsolatedEngine *eng,
+                                        const char *source) {
+  std::lock_guard<std::mutex> lock(eng->mutex);
+  auto &sources = eng->templates;
+  auto it = std::find(sources.begin(), sources.end(), source);
+  if (it != sources.end())
+    return static_cast<int32_t>(it - sources.begin()) + 1;
+  if (sources.size() >= MAX_TEMPLATES)
+    return -1;
+  sources.push_back(source);
+  return static_cast<int32_t>(sources.size());
+}
+
+static int32_t isolated_template_render(IsolatedEngine *eng, int32_t id,
+                                        const char *const *values,
+                                        int32_t n_values, int64_t *out_tokens,
+                                        int32_t max_tokens) {
+  if (n_values < 0 || (n_values > 0 && !values))
+    return -1;
+  ipc::TemplateRenderMsg msg = {};
+  msg.max_tokens = max_tokens;
+  msg.n_values = n_values;
+  std::string payload;
+  for (int32_t i = 0; i < n_values; ++i) {
+    uint32_t len = values[i] ? static_cast<uint32_t>(strlen(values[i])) : 0;
+    payload.append(reinterpret_cast<const char *>(&len), sizeof(len));
+    payload.append(values[i] ? values[i] : "", len);
+  }
+  std::lock_guard<std::mutex> call(eng->call_mutex);
+  std::unique_lock<std::mutex> lock(eng->mutex);
+  if (id < 1 || id > static_cast<int32_t>(eng->templates.size()))
+    return -1;
+  const std::string &source = eng->templates[id - 1];
+  msg.source_len = static_cast<uint32_t>(source.size());
+  payload.insert(0, source);
+  int64_t tag = eng->next_tag--;
+  std::vector<uint8_t> reply;
+  int64_t count = -1;
+  if (!send_request(eng, lock, ipc::MSG_TEMPLATE_RENDER, tag, &msg,
+                    sizeof(msg), payload.data(),
+                    static_cast<uint32_t>(payload.size())) ||
+      !wait_reply(eng, lock, tag, reply) || reply.size() < sizeof(count))
+    return -1;
+  memcpy(&count, reply.data(), sizeof(count));
+  size_t n = std::min<size_t>((reply.size() - sizeof(count)) / sizeof(int64_t),
+                              max_tokens > 0 ? max_tokens : 0);
+  if (out_tokens && n)
+    memcpy(out_tokens, reply.data() + sizeof(count), n * sizeof(int64_t));
+  return static_cast<int32_t>(count);
+}
+
+static int32_t isolated_plan_context(IsolatedEngine *eng,
+                                     const char *const *segments,
+                                     const int32_t *fit, int32_t n_segments,
+                                     int32_t images, int32_t reserve_tokens,
+                                     int32_t max_prompt_tokens,
+                                     int32_t *kept_bytes,
+                                     int32_t *segment_tokens,
+                                     MedGemmaContextPlan *out) {
+  // The reply, 8 bytes a segment, has to fit the event ring.
+  if (!out || n_segments < 0 || (n_segments > 0 && !segments) ||
+      n_segments > (int32_t)(ipc::EVENT_RING_BYTES / 4 / 8))
+    return -1;
+  ipc::PlanContextMsg msg = {};
+  msg.n_segments = n_segments;
+  msg.images = images;
+  msg.reserve_tokens = reserve_tokens;
+  msg.max_prompt_tokens = max_prompt_tokens;
+  std::string payload;
+  for (int32_t i = 0; i < n_segments; ++i) {
+    int32_t f = fit ? fit[i] : MEDGEMMA_SEGMENT_KEEP;
+    uint32_t len =
+        segments[i] ? static_cast<uint32_t>(strlen(segments[i])) : 0;
+    payload.append(reinterpret_cast<const char *>(&f), sizeof(f));
+    payload.append(reinterpret_cast<const char *>(&len), sizeof(len));
+    payload.append(segments[i] ? segments[i] : "", len);
+  }
+  std::lock_guard<std::mutex> call(eng->call_mutex);
+  std::unique_lock<std::mutex> lock(eng->mutex);
+  int64_t tag = eng->next_tag--;
+  std::vector<uint8_t> reply;
+  const size_t n = static_cast<size_t>(n_segments);
+  if (!send_request(eng, lock, ipc::MSG_PLAN_CONTEXT, tag, &msg, sizeof(msg),
+                    payload.data(), static_cast<uint32_t>(payload.size())) ||
+      !wait_reply(eng, lock, tag, reply) ||
+      reply.size() != sizeof(*out) + 2 * n * sizeof(int32_t))
+    return -1;
+  memcpy(out, reply.data(), sizeof(*out));
+  const uint8_t *per_segment = reply.data() + sizeof(*out);
+  if (kept_bytes && n)
+    memcpy(kept_bytes, per_segment, n * sizeof(int32_t));
+  if (segment_tokens && n)
+    memcpy(segment_tokens, per_segment + n * sizeof(int32_t),
+           n * sizeof(int32_t));
+  return 0;
+}
+
+static int32_t isolated_stats(IsolatedEngine *eng, MedGemmaQueueStats *out) {
+  std::lock_guard<std::mutex> call(eng->call_mutex);
+  std::unique_lock<std::mutex> lock(eng->mutex);
+  int64_t tag = eng->next_tag--;
+  std::vector<uint8_t> reply;
+  if (!send_request(eng, lock, ipc::MSG_GET_STATS, tag) ||
+      !wait_reply(eng, lock, tag, reply) || reply.size() != sizeof(*out))
+    return -1;
+  memcpy(out, reply.data(), sizeof(*out));
+  return 0;
+}
+
+static int isolated_tokenize(IsolatedEngine *eng, const char *text,
+                             int64_t *out_tokens, int max_tokens) {
+  std::lock_guard<std::mutex> call(eng->call_mutex);
+  std::unique_lock<std::mutex> lock(eng->mutex);
+  int64_t tag = eng->next_tag--;
+  int32_t max = max_tokens;
+  std::vector<uint8_t> reply;
+  if (!send_request(eng, lock, ipc::MSG_TOKENIZE, tag, &max, sizeof(max),
+                    text, static_cast<uint32_t>(strlen(text))) ||
+      !wait_reply(eng, lock, tag, reply) || reply.size() < sizeof(int64_t))
+    return 0;
+  int64_t count = 0;
+  memcpy(&count, reply.data(), sizeof(count));
+  int n = std::min<int>(
+      static_cast<int>((reply.size() - sizeof(count)) / sizeof(int64_t)),
+      std::max(max_tokens, 0));
+  if (n < count && n < max_tokens)
+    LOGI("medgemma_tokenize: %lld tokens, only %d fit the daemon's reply",
+         (long long)count, n);
+  memcpy(out_tokens, reply.data() + sizeof(count), n * sizeof(int64_t));
+  return n;
+}
+
+#else // _WIN32: in-process only
+
+class IsolatedEngine {};
+static IsolatedEngine *as_isolated(void *) { return nullptr; }
+
+#endif
+
+// Stops a job wherever it runs; a daemon-side job is told over the ring.
+static void cancel_job(InferenceJob &job) {
+  job.ctl.cancel();
+#ifndef _WIN32
+  if (job.isolated)
+    isolated_send(job.isolated, ipc::MSG_CANCEL, job.id);
+#endif
+}
+
+extern "C" {
+
+// ── Call this from Dart immediately after loading the library
+// ───────────────── path should be something like:
+// getApplicationDocumentsDirectory() + "/medgemma_log.txt"
 EXPORT void set_log_path(const char *path) {
   std::lock_guard<std::mutex> lock(g_log_mutex);
+  async_log().drain_locked(); // queued lines belong to the old file
   if (g_log_file) {
     fclose(g_log_file);
     g_log_file = nullptr;
   }
+  g_log_path = path ? path : "";
   if (path && path[0] != '\0') {
     g_log_file = fopen(path, "a"); // append so logs survive across calls
     if (g_log_file) {
@@ -463,10 +5501,75 @@ EXPORT void set_log_path(const char *path) {
   }
 }
 
+// Runtime log threshold (see "File + platform logging"). Running isolated
+// engines are told too; children started later inherit it.
+EXPORT void medgemma_set_log_level(int32_t level) {
+  g_log_level = std::max<int32_t>(MEDGEMMA_LOG_DEBUG,
+                                  std::min<int32_t>(level, MEDGEMMA_LOG_ERROR));
+#ifndef _WIN32
+  std::lock_guard<std::mutex> lock(g_isolated_mutex);
+  for (auto *eng : g_isolated)
+    isolated_send(eng, ipc::MSG_SET_LOG_LEVEL, 0, g_log_level.load());
+#endif
+}
+
+// Opt-in tracing (see "Tracing" above) for engines loaded after this call;
+// null or "" turns it off again. `dir` must exist. An isolated engine's child
+// writes its trace there when it exits.
+EXPORT void set_trace_dir(const char *dir) {
+  std::lock_guard<std::mutex> lock(g_log_mutex);
+  g_trace_dir = dir ? dir : "";
+}
+
+EXPORT void medgemma_set_memory_paths(const char *meminfo, const char *psi,
+                                      const char *cgroup_dir) {
+  MemoryPaths paths;
+  if (meminfo && *meminfo)
+    paths.meminfo = meminfo;
+  if (psi && *psi)
+    paths.psi = psi;
+  if (cgroup_dir)
+    paths.cgroup = cgroup_dir;
+  std::lock_guard<std::mutex> lock(g_log_mutex);
+  g_memory_paths = paths;
+}
+
+EXPORT void medgemma_set_kv_precision(int32_t precision) {
+  g_kv_precision = precision;
+}
+
+// See "Visual token pooling". Running isolated engines are told too;
+// children started later inherit it.
+EXPORT void medgemma_set_image_pooling(int32_t pooling) {
+  g_image_pooling = pooling >= MEDGEMMA_IMAGE_POOL_NONE &&
+                            pooling <= MEDGEMMA_IMAGE_POOL_4X4
+                        ? pooling
+                        : MEDGEMMA_IMAGE_POOL_NONE;
+#ifndef _WIN32
+  std::lock_guard<std::mutex> lock(g_isolated_mutex);
+  for (auto *eng : g_isolated)
+    isolated_send(eng, ipc::MSG_SET_IMAGE_POOLING, 0, g_image_pooling.load());
+#endif
+}
+
+EXPORT void medgemma_set_spill_dir(const char *dir) {
+  std::lock_guard<std::mutex> lock(g_log_mutex);
+  g_spill_dir = dir ? dir : "";
+}
+
+EXPORT int32_t medgemma_get_memory_status(MedGemmaMemoryStatus *out) {
+  MedGemmaMemoryStatus s;
+  bool ok = sample_memory(s);
+  if (out)
+    *out = s;
+  return ok ? 0 : -1;
+}
+
 EXPORT void *load_medgemma_4bit(const char *model_dir) {
   LOGI("load_medgemma_4bit: %s", model_dir);
   try {
     auto *s = new MedGemmaState(model_dir);
+    s->worker = std::thread(scheduler_loop, s);
     LOGI("Engine ready, handle=%p", (void *)s);
     return s;
   } catch (const std::exception &e) {
@@ -475,579 +5578,795 @@ EXPORT void *load_medgemma_4bit(const char *model_dir) {
   }
 }
 
+// Same engine in a child process (medgemma_daemon), restarted automatically if
+// it dies; see "Isolated engine" above. `daemon_path` may be null to look next
+// to this library. Returns null if the daemon is missing or never loads the
+// model, so callers can fall back to load_medgemma_4bit.
+EXPORT void *load_medgemma_isolated(const char *model_dir,
+                                    const char *daemon_path) {
+  LOGI("load_medgemma_isolated: %s", model_dir);
+#ifdef _WIN32
+  (void)daemon_path;
+  LOGE("load_medgemma_isolated: not supported on Windows");
+  return nullptr;
+#else
+  return isolated_load(model_dir, daemon_path);
+#endif
+}
+
 EXPORT void unload_medgemma(void *handle) {
   LOGI("unload_medgemma");
-  if (handle)
-    delete static_cast<MedGemmaState *>(handle);
+#ifndef _WIN32
+  if (auto eng = as_isolated(handle))
+    return isolated_unload(eng);
+#endif
+  auto state = static_cast<MedGemmaState *>(handle);
+  if (!state)
+    return;
+  // Queued and running jobs are cancelled; the terminate flag gets the
+  // scheduler out of ORT within one step, then it drains the queue and exits.
+  {
+    std::lock_guard<std::mutex> lock(state->queue_mutex);
+    state->stopping = true;
+  }
+  {
+    std::lock_guard<std::mutex> lock(g_jobs_mutex);
+    for (auto &kv : g_jobs)
+      if (kv.second->state == state && !kv.second->finished)
+        kv.second->ctl.cancel();
+  }
+  state->queue_cv.notify_all();
+  if (state->worker.joinable())
+    state->worker.join();
+  if (state->tracer) {
+    const std::pair<std::unique_ptr<Ort::Session> *, const char *> sessions[] =
+        {{&state->v_sess, "vision_encoder"},
+         {&state->p_sess, "vision_projection"},
+         {&state->e_sess, "embeddings"},
+         {&state->m_sess, "decoder"}};
+    for (auto &s : sessions)
+      if (*s.first)
+        state->tracer->end_session(**s.first, s.second);
+    state->tracer->write();
+  }
+  delete state;
 }
 
 EXPORT int medgemma_tokenize(void *handle, const char *text,
                              int64_t *out_tokens, int max_tokens) {
+#ifndef _WIN32
+  if (auto eng = as_isolated(handle))
+    return text && out_tokens ? isolated_tokenize(eng, text, out_tokens,
+                                                  max_tokens)
+                              : 0;
+#endif
   auto state = static_cast<MedGemmaState *>(handle);
   if (!state || !state->tokenizer)
     return 0;
 
-  OgaSequences *seq = nullptr;
-  OgaCreateSequences(&seq);
-  OgaTokenizerEncode(state->tokenizer.get(), text, seq);
-  size_t count = OgaSequencesGetSequenceCount(seq, 0);
-  const int32_t *data = OgaSequencesGetSequenceData(seq, 0);
-  int actual = std::min((int)count, max_tokens);
-  for (int i = 0; i < actual; ++i)
-    out_tokens[i] = static_cast<int64_t>(data[i]);
-  OgaDestroySequences(seq);
-  return actual;
+  std::vector<int64_t> tokens;
+  encode_append(state->tokenizer.get(), text, false, tokens);
+  int actual = std::min((int)tokens.size(), max_tokens);
+  std::copy(tokens.begin(), tokens.begin() + std::max(actual, 0), out_tokens);
+  return std::max(actual, 0);
 }
 
-EXPORT void run_medgemma_inference(void *handle, uint8_t *image_bytes,
-                                   int image_len, const char *prompt,
-                                   int max_tokens, TokenCallback callback) {
-  if (max_tokens <= 0)
-    max_tokens = 512;
-  LOGI("run_medgemma_inference: image_len=%d max_tokens=%d", image_len,
-       max_tokens);
-
-#ifdef ANDROID
-  // Lower this thread's priority so the UI/main thread stays responsive.
-  // ANDROID_PRIORITY_BACKGROUND = 10, keeps UI at normal priority (0).
-  // Without this, heavy CPU usage here starves the main thread → ANR dialog.
-  struct sched_param sp = {0};
-  sched_setscheduler(0, SCHED_BATCH, &sp); // batch scheduling = lower priority
-  setpriority(PRIO_PROCESS, 0, 10);        // nice value 10 = background
+// See "Prompt templates". Both tokenize on the caller's thread, like
+// medgemma_tokenize; a source seen before costs a lookup.
+EXPORT int32_t medgemma_template_define(void *handle, const char *source) {
+#ifndef _WIN32
+  if (auto eng = as_isolated(handle))
+    return source ? isolated_template_define(eng, source) : -1;
 #endif
   auto state = static_cast<MedGemmaState *>(handle);
-  if (!state) {
-    if (callback)
-      callback("[ERR] Engine handle is null");
-    return;
+  if (!state || !state->tokenizer || !source)
+    return -1;
+  {
+    std::lock_guard<std::mutex> lock(state->template_mutex);
+    auto it = state->template_ids.find(source);
+    if (it != state->template_ids.end())
+      return it->second;
   }
+  PromptTemplate t = template_parse(state->tokenizer.get(), source);
+  size_t fixed = 0;
+  for (auto &part : t.fixed)
+    fixed += part.size();
 
-  try {
-    // ── Step 1+2: Vision encode → project → copy embeddings → FREE ────
-    // We use a scope so pixel_values + ORT vision tensors are freed
-    // before we start building the large final_embeds buffer.
-    std::vector<float> projected_embeds_vec; // 256 * 2560 * 4 = 2.5 MB
-
-    if (image_bytes && image_len > 0) {
-      LOGI("--- STEP 1: Image decode + resize ---");
-      std::string img_error;
-
-      // pixel_values: 896*896*3*4 = 9.2 MB
-      std::vector<float> pixel_values = process_image_bytes(
-          image_bytes, static_cast<size_t>(image_len), img_error);
-
-      if (!img_error.empty()) {
-        LOGE("%s", img_error.c_str());
-        if (callback)
-          callback(img_error.c_str());
-        // Fall through: proceed text-only
-      }
+  std::lock_guard<std::mutex> lock(state->template_mutex);
+  auto it = state->template_ids.find(source); // defined meanwhile
+  if (it != state->template_ids.end())
+    return it->second;
+  if (state->templates.size() >= MAX_TEMPLATES) {
+    LOGE("medgemma_template_define: more than %zu templates", MAX_TEMPLATES);
+    return -1;
+  }
+  state->templates.push_back(std::move(t));
+  int32_t id = static_cast<int32_t>(state->templates.size());
+  state->template_ids.emplace(source, id);
+  LOGI("Template %d: %zu fixed tokens, %zu slots", id, fixed,
+       state->templates.back().lead.size());
+  return id;
+}
 
-      if (!pixel_values.empty()) {
-        // Pre-flight RAM check — vision encoder needs ~400 MB working memory on
-        // top of the 9.2 MB input tensor. Abort early rather than let Android
-        // OOM kill us.
-        long avail_kb = 0;
-#ifdef ANDROID
-        FILE *memf = fopen("/proc/meminfo", "r");
-        if (memf) {
-          char line[128];
-          while (fgets(line, sizeof(line), memf)) {
-            if (strncmp(line, "MemAvailable:", 13) == 0) {
-              sscanf(line + 13, " %ld", &avail_kb);
-              break;
-            }
-          }
-          fclose(memf);
-        }
-        LOGI("Available RAM before vision encoder: %ld MB", avail_kb / 1024);
-        if (avail_kb > 0 && avail_kb < 600 * 1024) { // less than 600 MB free
-          std::string oom_err =
-              "[IMG_ERR] Insufficient RAM for vision encoder (" +
-              std::to_string(avail_kb / 1024) +
-              " MB free, need ~600 MB). "
-              "Try closing other apps.";
-          LOGE("%s", oom_err.c_str());
-          if (callback)
-            callback(oom_err.c_str());
-          pixel_values.clear();
-          pixel_values.shrink_to_fit();
-          goto skip_vision; // jump past vision block safely
-        }
+EXPORT int32_t medgemma_template_render(void *handle, int32_t id,
+                                        const char *const *values,
+                                        int32_t n_values, int64_t *out_tokens,
+                                        int32_t max_tokens) {
+#ifndef _WIN32
+  if (auto eng = as_isolated(handle))
+    return isolated_template_render(eng, id, values, n_values, out_tokens,
+                                    max_tokens);
 #endif
-        LOGI("--- STEP 2: Vision encoder ---");
-        {
-          std::vector<int64_t> v_shape = {1, 3, 896, 896};
-          auto v_input = Ort::Value::CreateTensor<float>(
-              state->memory_info, pixel_values.data(), pixel_values.size(),
-              v_shape.data(), v_shape.size());
-
-          const char *v_in[] = {"pixel_values"};
-          const char *v_out[] = {"image_features"};
-          auto v_res = state->v_sess->Run(Ort::RunOptions{nullptr}, v_in,
-                                          &v_input, 1, v_out, 1);
-          LOGI("Vision encoder done");
-
-          // Free pixel_values now — no longer needed (9.2 MB freed)
-          {
-            std::vector<float> tmp;
-            pixel_values.swap(tmp);
-          }
-          LOGD("pixel_values freed");
-
-          LOGI("--- STEP 3: Vision projection ---");
-          const char *p_in[] = {"image_features"};
-          const char *p_out[] = {"visual_tokens"};
-          auto p_res = state->p_sess->Run(Ort::RunOptions{nullptr}, p_in,
-                                          &v_res[0], 1, p_out, 1);
+  auto state = static_cast<MedGemmaState *>(handle);
+  if (!state || !state->tokenizer || (n_values > 0 && !values))
+    return -1;
+  const PromptTemplate *t = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(state->template_mutex);
+    if (id >= 1 && id <= (int32_t)state->templates.size())
+      t = &state->templates[id - 1];
+  }
+  if (!t || n_values != (int32_t)t->lead.size()) {
+    LOGE("medgemma_template_render: %s", t ? "wrong number of values"
+                                           : "unknown template");
+    return -1;
+  }
+  std::vector<int64_t> tokens;
+  template_render(state->tokenizer.get(), *t, values, tokens);
+  if (out_tokens && max_tokens > 0)
+    std::copy(tokens.begin(),
+              tokens.begin() + std::min<size_t>(tokens.size(), max_tokens),
+              out_tokens);
+  return static_cast<int32_t>(tokens.size());
+}
 
-          // Copy projected embeddings out before p_res goes out of scope
-          float *proj_data = p_res[0].GetTensorMutableData<float>();
-          projected_embeds_vec.assign(proj_data, proj_data + 256 * embed_dim);
-          LOGI("Vision projection done (%.1f MB embed)",
-               projected_embeds_vec.size() * 4 / (1024.0f * 1024.0f));
+// See "Context planning".
+EXPORT int32_t medgemma_plan_context(void *handle, const char *const *segments,
+                                     const int32_t *fit, int32_t n_segments,
+                                     int32_t images, int32_t reserve_tokens,
+                                     int32_t max_prompt_tokens,
+                                     int32_t *kept_bytes,
+                                     int32_t *segment_tokens,
+                                     MedGemmaContextPlan *out) {
+#ifndef _WIN32
+  if (auto eng = as_isolated(handle))
+    return isolated_plan_context(eng, segments, fit, n_segments, images,
+                                 reserve_tokens, max_prompt_tokens,
+                                 kept_bytes, segment_tokens, out);
+#endif
+  auto state = static_cast<MedGemmaState *>(handle);
+  if (!state || !state->tokenizer || !out || n_segments < 0 ||
+      (n_segments > 0 && !segments) || images < 0)
+    return -1;
+  OgaTokenizer *tok = state->tokenizer.get();
+  auto fit_of = [&](int32_t i) {
+    return fit ? fit[i] : static_cast<int32_t>(MEDGEMMA_SEGMENT_KEEP);
+  };
 
-          // v_res and p_res ORT tensors freed here when scope exits
-        }
+  MedGemmaContextPlan plan = {};
+  plan.context_tokens = state->context_length;
+  const int grid = pooled_grid(g_image_pooling.load());
+  plan.image_tokens = images * grid * grid;
+  int64_t target = state->context_length > 0
+                       ? state->context_length - std::max(reserve_tokens, 0)
+                       : INT32_MAX;
+  if (max_prompt_tokens > 0)
+    target = std::min<int64_t>(target, max_prompt_tokens);
 
-        // ── FREE VISION SESSIONS — weights never needed again ─────────
-        // v_sess holds SigLIP encoder weights, p_sess holds projection weights.
-        // Destroying them here reclaims their RAM before the generation loop.
-        {
-          long before_kb = 0, after_kb = 0;
-#ifdef ANDROID
-          FILE *mf = fopen("/proc/meminfo", "r");
-          char ln[128];
-          if (mf) {
-            while (fgets(ln, sizeof(ln), mf))
-              if (!strncmp(ln, "MemAvailable:", 13)) {
-                sscanf(ln + 13, " %ld", &before_kb);
-                break;
-              }
-            fclose(mf);
-          }
-#endif
-          state->v_sess.reset(); // destroys vision encoder session + weights
-          state->p_sess.reset(); // destroys vision projection session + weights
-#ifdef ANDROID
-          mf = fopen("/proc/meminfo", "r");
-          if (mf) {
-            while (fgets(ln, sizeof(ln), mf))
-              if (!strncmp(ln, "MemAvailable:", 13)) {
-                sscanf(ln + 13, " %ld", &after_kb);
-                break;
-              }
-            fclose(mf);
-          }
-          LOGI("Vision sessions freed: RAM %ld MB → %ld MB (reclaimed %ld MB)",
-               before_kb / 1024, after_kb / 1024,
-               (after_kb - before_kb) / 1024);
-#else
-          LOGI("Vision encoder + projection sessions freed");
-#endif
-        }
-      }
-    } else {
-      LOGI("No image — text-only mode");
-    }
-  skip_vision:; // RAM guard jump target
-
-    // ── Step 4: Tokenize ──────────────────────────────────────────────
-    LOGI("--- STEP 4: Tokenize ---");
-    std::vector<int64_t> tokens;
-    tokens.push_back(2); // BOS
-
-    OgaSequences *seq = nullptr;
-    OgaCreateSequences(&seq);
-    OgaTokenizerEncode(state->tokenizer.get(), prompt, seq);
-    size_t count = OgaSequencesGetSequenceCount(seq, 0);
-    const int32_t *tdata = OgaSequencesGetSequenceData(seq, 0);
-    for (size_t i = 0; i < count; ++i)
-      tokens.push_back(static_cast<int64_t>(tdata[i]));
-    OgaDestroySequences(seq);
-    LOGI("Tokenized: %zu tokens", tokens.size());
-
-    // ── Step 5: Build embeddings ──────────────────────────────────────
-    LOGI("--- STEP 5: Build embeddings ---");
-    std::vector<float> final_embeds;
-    std::vector<int64_t> attn_mask;
-    final_embeds.reserve((tokens.size() + num_patches) * embed_dim);
-    attn_mask.reserve(2048);
-
-    LOGI("Image token ID in use: %lld — watching for it in %zu tokens",
-         state->image_token_id, tokens.size());
-    int img_injections = 0;
-    for (auto id : tokens) {
-      if (id == state->image_token_id) {
-        img_injections++;
-        if (!projected_embeds_vec.empty()) {
-          final_embeds.insert(final_embeds.end(), projected_embeds_vec.begin(),
-                              projected_embeds_vec.end());
-          attn_mask.insert(attn_mask.end(), num_patches, 1);
-        }
-      } else {
-        std::vector<int64_t> tid = {id}, t_s = {1, 1};
-        auto t_tensor = create_tensor(tid, t_s, state->memory_info);
-        const char *e_in[] = {"input_ids"};
-        const char *e_out[] = {"embeddings"};
-        auto e_res = state->e_sess->Run(Ort::RunOptions{nullptr}, e_in,
-                                        &t_tensor, 1, e_out, 1);
-        float *e_ptr = e_res[0].GetTensorMutableData<float>();
-        final_embeds.insert(final_embeds.end(), e_ptr, e_ptr + embed_dim);
-        attn_mask.push_back(1);
-      }
+  std::vector<std::string> text(n_segments);
+  std::vector<int32_t> tokens(n_segments);
+  int64_t total = 1 + plan.image_tokens; // BOS
+  for (int32_t i = 0; i < n_segments; ++i) {
+    text[i] = segments[i] ? segments[i] : "";
+    tokens[i] = count_tokens(tok, text[i]);
+    total += tokens[i];
+  }
+  // Whole segments go first, earliest first, then ends are cut.
+  for (int32_t i = 0; i < n_segments && total > target; ++i)
+    if (fit_of(i) == MEDGEMMA_SEGMENT_DROP) {
+      total -= tokens[i];
+      tokens[i] = 0;
+      text[i].clear();
+    }
+  for (int32_t i = 0; i < n_segments && total > target; ++i)
+    if (fit_of(i) == MEDGEMMA_SEGMENT_TRUNCATE) {
+      int64_t budget = std::max<int64_t>(0, tokens[i] - (total - target));
+      text[i].resize(fit_prefix(tok, text[i], (int32_t)budget));
+      int32_t kept = count_tokens(tok, text[i]);
+      total -= tokens[i] - kept;
+      tokens[i] = kept;
     }
 
-    // Free projected_embeds_vec — it is now baked into final_embeds (2.5 MB
-    // freed)
-    {
-      std::vector<float> tmp;
-      projected_embeds_vec.swap(tmp);
-    }
-    LOGI("Embeddings built: seq_len=%zu, final_embeds=%.1f MB, "
-         "image_injections=%d",
-         attn_mask.size(), final_embeds.size() * 4 / (1024.0f * 1024.0f),
-         img_injections);
-    if (img_injections == 0 && image_bytes && image_len > 0) {
-      LOGE("WARNING: image bytes provided but image token was NEVER found in "
-           "prompt!");
-      LOGE("  Image token ID searched: %lld", state->image_token_id);
-      LOGE("  Tokens in prompt: %zu", tokens.size());
-      LOGE("  First 10 token IDs:");
-      for (size_t ti = 0; ti < std::min(tokens.size(), (size_t)10); ++ti)
-        LOGE("    [%zu] = %lld", ti, tokens[ti]);
-      if (callback)
-        callback("[WARN] Image not grounded — <image> token missing from "
-                 "prompt. Output may be hallucinated.");
-    }
-
-    // ── Step 6: Chunked prefill + generation loop ────────────────────
-    // Problem: sending all 174 tokens at once produces logits {1,174,256000}
-    // = 178 MB on Android. Solution: chunk prefill into PREFILL_CHUNK tokens
-    // at a time, each producing only {1,CHUNK,256000} logits = much smaller.
-    // We discard all but the last chunk's final token logits.
-    LOGI("--- STEP 6: Chunked prefill + generation ---");
-
-    const int PREFILL_CHUNK = 16; // 16 tokens × 256000 × 4 = 16.4 MB per chunk
-    const int64_t total_prefill = (int64_t)(final_embeds.size() / embed_dim);
-
-    // Build initial empty KV cache
-    std::vector<Ort::Value> m_inputs;
-    float dummy_kv = 0.0f;
-    // placeholder inputs_embeds and attention_mask — replaced each step
-    m_inputs.push_back(Ort::Value::CreateTensor<float>(
-        state->memory_info, &dummy_kv, 0,
-        std::vector<int64_t>{1, 0, (int64_t)embed_dim}.data(), 3));
-    m_inputs.push_back(create_tensor({}, {1, 0}, state->memory_info));
-    for (int i = 0; i < 34; ++i) {
-      std::vector<int64_t> kv_s = {1, 4, 0, 256};
-      m_inputs.push_back(Ort::Value::CreateTensor<float>(
-          state->memory_info, &dummy_kv, 0, kv_s.data(), 4));
-      m_inputs.push_back(Ort::Value::CreateTensor<float>(
-          state->memory_info, &dummy_kv, 0, kv_s.data(), 4));
-    }
-
-    // RunOptions applied to every LLM step
-    Ort::RunOptions run_opts;
-    run_opts.SetRunLogSeverityLevel(3);
-
-    std::vector<std::string> in_names_s = {"inputs_embeds", "attention_mask"};
-    std::vector<std::string> out_names_s = {"logits"};
-    for (int i = 0; i < 34; ++i) {
-      in_names_s.push_back("past_key_values." + std::to_string(i) + ".key");
-      in_names_s.push_back("past_key_values." + std::to_string(i) + ".value");
-      out_names_s.push_back("present." + std::to_string(i) + ".key");
-      out_names_s.push_back("present." + std::to_string(i) + ".value");
-    }
-    std::vector<const char *> m_in, m_out;
-    for (const auto &s : in_names_s)
-      m_in.push_back(s.c_str());
-    for (const auto &s : out_names_s)
-      m_out.push_back(s.c_str());
-
-    // ── Chunked prefill ───────────────────────────────────────────────
-    int64_t next_id = -1;
-    int64_t kv_len = 0; // grows with each chunk
-
-    // Track generated token IDs for repetition penalty.
-    // We keep the last 128 tokens — enough to catch phrase loops.
-    std::vector<int64_t> generated_ids;
-    generated_ids.reserve(128);
-
-    // ── Stop strings ──────────────────────────────────────────────────
-    // When the full output ends with any of these, generation is complete.
-    // Keeps a rolling buffer of the last N chars of output to match against.
-    const std::vector<std::string> STOP_STRINGS = {
-        "<end_of_turn>", // Gemma control token (text form)
-        "<eos>",         // explicit eos string
-        "---END OF REPORT---",
-        "--- END OF REPORT ---",
-        "End of Report",
-        "end of report",
-        // Common patterns the model emits before trailing disclaimers:
-        "Generated by KintaMed",
-        "Disclaimer:",
-        "DISCLAIMER:",
-        "Note: This AI",
-        "Note: This report",
-        "NOTE: This",
-        "*This report is",
-        "This is not medical advice",
-        "Confidentiality Notice",
-    };
-    const size_t STOP_BUF_SIZE =
-        64; // keep last 64 chars — enough to match longest stop string
-    std::string stop_buf; // rolling window of recent output
-    stop_buf.reserve(STOP_BUF_SIZE * 2);
-    bool stop_triggered = false;
-
-    // Helper: append text to rolling buffer and check stop strings
-    auto check_stop = [&](const char *text) -> bool {
-      if (!text)
-        return false;
-      stop_buf += text;
-      // Keep only the last STOP_BUF_SIZE characters
-      if (stop_buf.size() > STOP_BUF_SIZE * 2)
-        stop_buf.erase(0, stop_buf.size() - STOP_BUF_SIZE);
-
-      // 1. Standard exact match for controlled tokens like <eos>
-      for (const auto &ss : STOP_STRINGS) {
-        if (stop_buf.size() >= ss.size()) {
-          if (stop_buf.find(ss) != std::string::npos) {
-            LOGI("Stop string triggered (exact): '%s'", ss.c_str());
-            return true;
-          }
-        }
-      }
+  plan.prompt_tokens = static_cast<int32_t>(total);
+  plan.generation_budget =
+      state->context_length > 0
+          ? std::max<int32_t>(0, state->context_length - plan.prompt_tokens)
+          : -1;
+  plan.fits = total <= target;
+  for (int32_t i = 0; i < n_segments; ++i) {
+    if (kept_bytes)
+      kept_bytes[i] = static_cast<int32_t>(text[i].size());
+    if (segment_tokens)
+      segment_tokens[i] = tokens[i];
+  }
+  *out = plan;
+  LOGI("Context plan: %d segments, %d images → %d tokens of %d (%s)",
+       n_segments, images, plan.prompt_tokens, plan.context_tokens,
+       plan.fits ? "fits" : "over");
+  return 0;
+}
 
-      // 2. Normalized match for "END OF REPORT" to handle case, spacing, and
-      // punctuation variations
-      std::string normalized;
-      for (char c : stop_buf) {
-        if (std::isalnum(c)) {
-          normalized += (char)std::tolower(c);
-        }
-      }
+// ── Async job API ────────────────────────────────────────────────────────────
+// Call once with NativeApi.postCObject before submitting jobs with dart_port.
+EXPORT void medgemma_init_dart_api(void *post_cobject) {
+  g_post_cobject = reinterpret_cast<Dart_PostCObject_Type>(post_cobject);
+}
 
-      if (normalized.find("endofreport") != std::string::npos) {
-        LOGI("Stop string triggered (normalized): 'endofreport'");
-        return true;
-      }
+// The prompt is `prompt`, or `tokens` when that is null.
+static int64_t submit_local(MedGemmaState *state, const uint8_t *image_bytes,
+                            int image_len, const char *prompt,
+                            const int64_t *tokens, int32_t n_tokens,
+                            const MedGemmaJobParams *params,
+                            LabelSet *labels = nullptr) {
+  auto job = std::make_shared<InferenceJob>();
+  job->id = g_next_job_id++;
+  job->state = state;
+  job->metrics = &state->metrics;
+  job->submitted_at = std::chrono::steady_clock::now();
+  if (prompt)
+    job->prompt = prompt;
+  else
+    job->prompt_tokens.assign(tokens, tokens + n_tokens);
+  if (image_bytes && image_len > 0) {
+    job->image.assign(image_bytes, image_bytes + image_len);
+  } else if (params && (params->image_fd > 0 || params->image_path)) {
+    job->image_map = MappedImage::open(params->image_path, params->image_fd);
+    if (!job->image_map)
+      return -1;
+    if (job->image_map->size() > INT32_MAX) {
+      LOGE("medgemma_submit: image file too large (%zu bytes)",
+           job->image_map->size());
+      return -1;
+    }
+  }
+  if (params && params->max_tokens > 0)
+    job->max_tokens = params->max_tokens;
+  if (labels)
+    job->labels = std::move(*labels);
+  if (params) {
+    job->params = *params;
+    job->params.image_path = nullptr; // not owned, only valid during submit
+    job->dart_port = params->dart_port;
+    if (params->priority > PRIORITY_NORMAL && params->priority < PRIORITY_COUNT)
+      job->priority = params->priority;
+  }
+  if (params && params->deadline_ms > 0) {
+    job->ctl.has_deadline = true;
+    job->ctl.deadline = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds(params->deadline_ms);
+  }
+  if (job->dart_port && !g_post_cobject.load()) {
+    LOGE("medgemma_submit: dart_port set before medgemma_init_dart_api");
+    return -1;
+  }
+  if (params && params->session) {
+    std::lock_guard<std::mutex> lock(state->queue_mutex);
+    auto it = state->sessions.find(params->session);
+    const char *why = it == state->sessions.end() ? "unknown"
+                      : it->second->busy          ? "busy"
+                      : it->second->lost          ? "lost"
+                                                  : nullptr;
+    if (why) {
+      LOGE("medgemma_submit: session %lld is %s", (long long)params->session,
+           why);
+      return -1;
+    }
+    it->second->busy = true;
+    job->session = it->second;
+    // The pushed segments are this prompt's beginning (see Drafts).
+    job->seq.draft = std::move(it->second->draft);
+    it->second->draft.clear();
+    it->second->draft_stuck = false;
+  }
+  LOGI("medgemma_submit: job %lld image_len=%zu%s %s max_tokens=%d "
+       "deadline_ms=%d port=%s priority=%d",
+       (long long)job->id,
+       job->image_map ? job->image_map->size() : job->image.size(),
+       job->image_map ? " (mapped)" : "",
+       prompt ? "text" : "tokens", job->max_tokens,
+       params ? params->deadline_ms : 0, job->dart_port ? "yes" : "no",
+       job->priority);
 
-      if (normalized.find("generatedbykintamed") != std::string::npos) {
-        LOGI("Stop string triggered (normalized): 'generatedbykintamed'");
-        return true;
+  {
+    std::lock_guard<std::mutex> lock(g_jobs_mutex);
+    g_jobs[job->id] = job;
+  }
+  if (job->ctl.has_deadline)
+    watch_deadline(job);
+  {
+    std::lock_guard<std::mutex> lock(state->queue_mutex);
+    if (state->stopping) {
+      job->ctl.cancel();
+      if (job->session) {
+        job->session->busy = false; // finish_job would take the lock
+        job->session.reset();
       }
+      finish_job(job);
+      return job->id;
+    }
+    state->queue.push_back(job);
+    state->counters.submitted++;
+  }
+  state->queue_cv.notify_one();
+  return job->id;
+}
 
-      return false;
-    };
+// Returns a job ID (> 0) or -1. `params` may be null for defaults. The image
+// and prompt are copied (or the image file mapped), so the caller can free
+// its buffers and close its fd immediately.
+EXPORT int64_t medgemma_submit(void *handle, const uint8_t *image_bytes,
+                               int image_len, const char *prompt,
+                               const MedGemmaJobParams *params) {
+#ifndef _WIN32
+  if (auto eng = as_isolated(handle))
+    return prompt ? isolated_submit(eng, image_bytes, image_len, prompt,
+                                    nullptr, 0, params)
+                  : -1;
+#endif
+  auto state = static_cast<MedGemmaState *>(handle);
+  if (!state || !prompt) {
+    LOGE("medgemma_submit: null %s", state ? "prompt" : "engine handle");
+    return -1;
+  }
+  return submit_local(state, image_bytes, image_len, prompt, nullptr, 0,
+                      params);
+}
 
-    for (int64_t chunk_start = 0; chunk_start < total_prefill;
-         chunk_start += PREFILL_CHUNK) {
-      int64_t chunk_len =
-          std::min((int64_t)PREFILL_CHUNK, total_prefill - chunk_start);
-
-      // Slice this chunk's embeddings from final_embeds
-      size_t offset = chunk_start * embed_dim;
-      size_t count = chunk_len * embed_dim;
-      std::vector<int64_t> c_shape = {1, chunk_len, (int64_t)embed_dim};
-      m_inputs[0] = Ort::Value::CreateTensor<float>(
-          state->memory_info, final_embeds.data() + offset, count,
-          c_shape.data(), c_shape.size());
-
-      // Build attention mask: past KV positions + current chunk
-      std::vector<int64_t> chunk_mask(kv_len + chunk_len, 1);
-      m_inputs[1] = create_tensor(chunk_mask, {1, kv_len + chunk_len},
-                                  state->memory_info);
-
-      LOGD("Prefill chunk [%lld..%lld] kv_len=%lld", chunk_start,
-           chunk_start + chunk_len - 1, kv_len);
-
-      auto chunk_res =
-          state->m_sess->Run(run_opts, m_in.data(), m_inputs.data(),
-                             m_inputs.size(), m_out.data(), m_out.size());
-
-      // Extract next_id from last token of this chunk (only needed for final
-      // chunk)
-      bool is_last_chunk = (chunk_start + chunk_len >= total_prefill);
-      if (is_last_chunk) {
-        float *lg = chunk_res[0].GetTensorMutableData<float>();
-        size_t vs = chunk_res[0].GetTensorTypeAndShapeInfo().GetShape().back();
-        size_t tot = chunk_res[0].GetTensorTypeAndShapeInfo().GetElementCount();
-        std::vector<float> last_lg(lg + tot - vs, lg + tot);
-        next_id = sample_top_p(last_lg, 0.75f, 0.29f, &generated_ids, 1.30f,
-                               state->tokenizer.get());
-        LOGI("Prefill complete, first token id=%lld", next_id);
-      }
+// Like medgemma_submit, with the prompt as token IDs (see Prompt
+// templates).
+EXPORT int64_t medgemma_submit_tokens(void *handle, const uint8_t *image_bytes,
+                                      int image_len, const int64_t *tokens,
+                                      int32_t n_tokens,
+                                      const MedGemmaJobParams *params) {
+  bool valid = tokens && n_tokens > 0;
+  for (int32_t i = 0; valid && i < n_tokens; ++i)
+    valid = tokens[i] >= 0 && tokens[i] < vocab_size;
+  if (!valid) {
+    LOGE("medgemma_submit_tokens: no tokens, or an ID out of range");
+    return -1;
+  }
+#ifndef _WIN32
+  if (auto eng = as_isolated(handle))
+    return isolated_submit(eng, image_bytes, image_len, nullptr, tokens,
+                           n_tokens, params);
+#endif
+  auto state = static_cast<MedGemmaState *>(handle);
+  if (!state) {
+    LOGE("medgemma_submit_tokens: null engine handle");
+    return -1;
+  }
+  return submit_local(state, image_bytes, image_len, nullptr, tokens,
+                      n_tokens, params);
+}
 
-      // Free logits tensor immediately (up to 16×256000×4 = 16 MB per chunk)
-      {
-        Ort::Value _drop = std::move(chunk_res[0]);
-      }
+// See "Chat sessions". The cache of a session is freed when it is closed, or
+// when its running job ends after that.
+EXPORT int64_t medgemma_session_open(void *handle, int32_t window_tokens,
+                                     int32_t sink_tokens) {
+#ifndef _WIN32
+  if (auto eng = as_isolated(handle))
+    return isolated_session_open(eng, window_tokens, sink_tokens);
+#endif
+  auto state = static_cast<MedGemmaState *>(handle);
+  if (!state)
+    return -1;
+  auto session = std::make_shared<ChatSession>();
+  session->sink = std::max(sink_tokens, 0);
+  if (window_tokens > 0)
+    session->window = window_tokens;
+  if (state->context_length > 0) // positions past it are out of the model
+    session->window = std::min(session->window, state->context_length);
+  if (session->window < session->sink + SESSION_MIN_ROOM) {
+    LOGE("medgemma_session_open: window %d leaves no room after a sink of %d "
+         "(needs %d)",
+         session->window, session->sink, SESSION_MIN_ROOM);
+    return -1;
+  }
+  session->id = g_next_session_id++;
+  std::lock_guard<std::mutex> lock(state->queue_mutex);
+  state->sessions[session->id] = session;
+  LOGI("Session %lld opened: window %d sink %d", (long long)session->id,
+       session->window, session->sink);
+  return session->id;
+}
 
-      // Update KV cache
-      kv_len += chunk_len;
-      for (size_t i = 1; i < chunk_res.size(); ++i)
-        m_inputs[i + 1] = std::move(chunk_res[i]);
-    }
+EXPORT void medgemma_session_close(void *handle, int64_t session) {
+#ifndef _WIN32
+  if (auto eng = as_isolated(handle))
+    return isolated_send(eng, ipc::MSG_SESSION_CLOSE, session);
+#endif
+  auto state = static_cast<MedGemmaState *>(handle);
+  if (!state)
+    return;
+  std::shared_ptr<ChatSession> closed;
+  {
+    std::lock_guard<std::mutex> lock(state->queue_mutex);
+    auto it = state->sessions.find(session);
+    if (it == state->sessions.end())
+      return;
+    closed = std::move(it->second);
+    state->sessions.erase(it);
+  }
+  LOGI("Session %lld closed", (long long)session);
+  // Its cache is freed here unless a job still holds it, most likely while
+  // the scheduler is idle and no longer trimming the pool it goes to.
+  closed.reset();
+  stage_allocator().release();
+}
 
-    // Free the full prefill embeddings now — no longer needed
-    {
-      std::vector<float> tmp;
-      final_embeds.swap(tmp);
+// See "Drafts". Segments after `index` are dropped when it changes.
+EXPORT int32_t medgemma_session_push(void *handle, int64_t session,
+                                     int32_t index, const char *text,
+                                     const uint8_t *image_bytes,
+                                     int32_t image_len) {
+#ifndef _WIN32
+  if (auto eng = as_isolated(handle))
+    return isolated_session_push(eng, session, index, text, image_bytes,
+                                 image_len);
+#endif
+  auto state = static_cast<MedGemmaState *>(handle);
+  if (!state)
+    return -1;
+  DraftSegment segment;
+  if (text)
+    segment.text = text;
+  if (text && image_bytes && image_len > 0)
+    segment.image.assign(image_bytes, image_bytes + image_len);
+  {
+    std::lock_guard<std::mutex> lock(state->queue_mutex);
+    auto it = state->sessions.find(session);
+    const char *why =
+        it == state->sessions.end() ? "unknown"
+        : it->second->busy          ? "busy"
+        : it->second->lost          ? "lost"
+        : index < 0 || (size_t)index > it->second->draft.size()
+            ? "missing the segments before this one"
+            : nullptr;
+    if (why) {
+      LOGE("medgemma_session_push: session %lld is %s", (long long)session,
+           why);
+      return -1;
     }
-    LOGD("final_embeds freed after chunked prefill");
+    std::vector<DraftSegment> &draft = it->second->draft;
+    if (text && (size_t)index < draft.size() &&
+        draft[index].same(segment))
+      return 0;
+    draft.resize(index);
+    if (text)
+      draft.push_back(std::move(segment));
+    it->second->draft_stuck = false;
+    state->draft_work = true;
+  }
+  state->queue_cv.notify_one();
+  return 0;
+}
 
-    // Bail if prefill failed
-    if (next_id < 0) {
-      LOGE("Prefill produced no token");
-      if (callback)
-        callback("[ERR] Prefill failed");
-      return;
+// See "KV snapshots". The session is marked busy while its cache is written,
+// so a submit to it fails meanwhile instead of changing it underneath.
+EXPORT int32_t medgemma_session_save(void *handle, int64_t session,
+                                     const char *path) {
+#ifndef _WIN32
+  if (auto eng = as_isolated(handle))
+    return path ? isolated_session_save(eng, session, path) : -1;
+#endif
+  auto state = static_cast<MedGemmaState *>(handle);
+  if (!state || !path)
+    return -1;
+  std::shared_ptr<ChatSession> s;
+  {
+    std::lock_guard<std::mutex> lock(state->queue_mutex);
+    auto it = state->sessions.find(session);
+    const char *why = it == state->sessions.end() ? "unknown"
+                      : it->second->busy          ? "busy"
+                      : it->second->lost          ? "lost"
+                      : !it->second->kv_len       ? "empty"
+                      : it->second->drafting ||
+                              !it->second->drafted.empty()
+                          ? "drafting"
+                          : nullptr;
+    if (why) {
+      LOGE("medgemma_session_save: session %lld is %s", (long long)session,
+           why);
+      return -1;
     }
+    s = it->second;
+    s->busy = true;
+  }
+  auto started = std::chrono::steady_clock::now();
+  bool ok;
+  if (s->kv.empty()) { // loaded and not used since: the file is the snapshot
+    const MappedImage &map = *s->snapshot;
+    ok = write_replacing(path, [&](FILE *f) {
+      return fwrite(map.data(), 1, map.size(), f) == map.size();
+    });
+  } else {
+    std::vector<Ort::Value> spilled;
+    if (s->spill)
+      spilled = s->spill->active(s->kv_len, state->memory_info);
+    ok = snapshot_write(state, s->spill ? spilled : s->kv, *s, path);
+  }
+  {
+    std::lock_guard<std::mutex> lock(state->queue_mutex);
+    s->busy = false;
+  }
+  if (ok)
+    LOGI("Session %lld saved to %s: %lld positions in %.1f ms",
+         (long long)session, path, (long long)s->kv_len, ms_since(started));
+  return ok ? 0 : -1;
+}
 
-    // Emit first token if not EOS
-    if (std::find(EOS_IDS.begin(), EOS_IDS.end(), next_id) == EOS_IDS.end()) {
-      generated_ids.push_back(next_id);
-      if (generated_ids.size() > 128)
-        generated_ids.erase(generated_ids.begin());
-      int32_t to_dec0 = static_cast<int32_t>(next_id);
-      const char *decoded0 = nullptr;
-      OgaTokenizerDecode(state->tokenizer.get(), &to_dec0, 1, &decoded0);
-      if (decoded0 && callback)
-        callback(decoded0);
-      stop_triggered = check_stop(decoded0);
-    }
-
-    // ── Autoregressive decode loop ────────────────────────────────────
-    for (int step = 0; step < (max_tokens - 1) && !stop_triggered; ++step) {
-      // Embed next_id and run one decode step (logits = {1,1,256000} = 1 MB
-      // only)
-      std::vector<int64_t> nid_v = {next_id}, nid_s = {1, 1};
-      auto nid_t = create_tensor(nid_v, nid_s, state->memory_info);
-      const char *ein[] = {"input_ids"};
-      const char *eout[] = {"embeddings"};
-      auto n_emb_res =
-          state->e_sess->Run(Ort::RunOptions{nullptr}, ein, &nid_t, 1, eout, 1);
-
-      m_inputs[0] = std::move(n_emb_res[0]);
-
-      // Attention mask: kv_len past positions + 1 new token
-      // kv_len=174 on first decode step → mask size = 175 ✓
-      // Do NOT increment kv_len here — only once after the run
-      std::vector<int64_t> dec_mask(kv_len + 1, 1);
-      m_inputs[1] = create_tensor(dec_mask, {1, (int64_t)dec_mask.size()},
-                                  state->memory_info);
-
-      LOGD("Decode step %d: kv_len=%lld mask_size=%zu", step, kv_len,
-           dec_mask.size());
-
-      auto d_res =
-          state->m_sess->Run(run_opts, m_in.data(), m_inputs.data(),
-                             m_inputs.size(), m_out.data(), m_out.size());
-
-      // Decode logits: always {1,1,256000} = 1 MB — free immediately
-      float *dlg = d_res[0].GetTensorMutableData<float>();
-      size_t dvs = d_res[0].GetTensorTypeAndShapeInfo().GetShape().back();
-      size_t dtot = d_res[0].GetTensorTypeAndShapeInfo().GetElementCount();
-      std::vector<float> d_last(dlg + dtot - dvs, dlg + dtot);
-      {
-        Ort::Value _drop = std::move(d_res[0]);
-      } // free logits tensor
-
-      next_id = sample_top_p(d_last, 0.75f, 0.29f, &generated_ids, 1.30f,
-                             state->tokenizer.get());
-      {
-        std::vector<float> tmp;
-        d_last.swap(tmp);
-      }
+EXPORT int64_t medgemma_session_load(void *handle, const char *path) {
+#ifndef _WIN32
+  if (auto eng = as_isolated(handle))
+    return path ? isolated_session_load(eng, path) : -1;
+#endif
+  auto state = static_cast<MedGemmaState *>(handle);
+  if (!state || !path)
+    return -1;
+  std::shared_ptr<ChatSession> session = snapshot_open(state, path);
+  if (!session)
+    return -1;
+  session->id = g_next_session_id++;
+  std::lock_guard<std::mutex> lock(state->queue_mutex);
+  state->sessions[session->id] = session;
+  LOGI("Session %lld loaded from %s: %lld positions", (long long)session->id,
+       path, (long long)session->kv_len);
+  return session->id;
+}
 
-      if (std::find(EOS_IDS.begin(), EOS_IDS.end(), next_id) != EOS_IDS.end()) {
-        LOGI("EOS at decode step %d", step + 1);
-        break;
-      }
+// Returns the JobStatus, or -1 for an unknown/released job. Once a terminal
+// status has been observed, a medgemma_read() returning 0 means the stream is
+// fully drained.
+EXPORT int32_t medgemma_poll(int64_t job_id) {
+  auto job = find_job(job_id);
+  return job ? job->status.load() : -1;
+}
 
-      generated_ids.push_back(next_id);
-      if (generated_ids.size() > 128)
-        generated_ids.erase(generated_ids.begin());
+// Copies pending output into `out` (never splitting a UTF-8 sequence).
+// Returns the byte count, 0 if nothing is pending, -1 for an unknown job.
+EXPORT int32_t medgemma_read(int64_t job_id, char *out, int32_t out_len) {
+  auto job = find_job(job_id);
+  if (!job || !out || out_len <= 0)
+    return job ? 0 : -1;
+  size_t n = job->ring.read(out, static_cast<size_t>(out_len));
+  return static_cast<int32_t>(n);
+}
 
-      int32_t to_dec = static_cast<int32_t>(next_id);
-      const char *decoded = nullptr;
-      OgaTokenizerDecode(state->tokenizer.get(), &to_dec, 1, &decoded);
-      if (decoded && callback)
-        callback(decoded);
+// Stops a queued or running job; the ORT step in flight is terminated.
+// Returns 1 if the job was still live, 0 otherwise.
+EXPORT int32_t medgemma_cancel(int64_t job_id) {
+  auto job = find_job(job_id);
+  if (!job || job->finished)
+    return 0;
+  LOGI("medgemma_cancel: job %lld", (long long)job_id);
+  cancel_job(*job);
+  return 1;
+}
 
-      if (check_stop(decoded)) {
-        LOGI("Stop string triggered at decode step %d", step + 1);
-        stop_triggered = true;
-        break;
-      }
+// Per-stage times of a finished job (see MedGemmaJobTimings). Returns 0, or -1
+// for an unknown job or one that is still running.
+EXPORT int32_t medgemma_get_job_timings(int64_t job_id,
+                                        MedGemmaJobTimings *out) {
+  auto job = find_job(job_id);
+  if (!job || !out || !job->finished)
+    return -1;
+  *out = job->timings;
+  return 0;
+}
 
-      // Increment ONCE after the run — kv now includes the token we just
-      // processed
-      kv_len += 1;
+// See "Classification". The labels are tokenized here (in the daemon for an
+// isolated engine) and the job continues like any other.
+EXPORT int64_t medgemma_submit_classify(void *handle,
+                                        const uint8_t *image_bytes,
+                                        int image_len, const char *prompt,
+                                        const char *const *labels,
+                                        int32_t n_labels,
+                                        const MedGemmaJobParams *params) {
+  if (!prompt || !labels || n_labels < 1 || n_labels > MEDGEMMA_MAX_LABELS) {
+    LOGE("medgemma_submit_classify: no prompt, or not 1..%d labels",
+         (int)MEDGEMMA_MAX_LABELS);
+    return -1;
+  }
+  MedGemmaJobParams p = params ? *params : MedGemmaJobParams{};
+  p.max_tokens = 1; // planned for, never generated
+  p.session = 0;
+#ifndef _WIN32
+  if (auto eng = as_isolated(handle))
+    return isolated_submit(eng, image_bytes, image_len, prompt, nullptr, 0,
+                           &p, labels, n_labels);
+#endif
+  auto state = static_cast<MedGemmaState *>(handle);
+  if (!state) {
+    LOGE("medgemma_submit_classify: null engine handle");
+    return -1;
+  }
+  LabelSet set;
+  if (!label_set(state->tokenizer.get(), labels, n_labels, set)) {
+    LOGE("medgemma_submit_classify: a label has no tokens");
+    return -1;
+  }
+  set.temperature = p.label_temperature > 0 ? p.label_temperature : 1.0f;
+  LOGI("medgemma_submit_classify: %d labels, %zu tokens in common", n_labels,
+       set.shared.size());
+  return submit_local(state, image_bytes, image_len, prompt, nullptr, 0, &p,
+                      &set);
+}
 
-      // Replace KV cache entries (old KV tensors freed by move)
-      for (size_t i = 1; i < d_res.size(); ++i)
-        m_inputs[i + 1] = std::move(d_res[i]);
+EXPORT int32_t medgemma_get_classification(int64_t job_id,
+                                           MedGemmaClassification *out) {
+  auto job = find_job(job_id);
+  if (!job || !out || !job->finished || job->timings.status != JOB_DONE ||
+      job->classification.label < 0)
+    return -1;
+  *out = job->classification;
+  return 0;
+}
 
-#ifdef ANDROID
-      if (step % 20 == 0) {
-        long ram_kb = 0;
-        FILE *mf3 = fopen("/proc/meminfo", "r");
-        char ln3[128];
-        if (mf3) {
-          while (fgets(ln3, sizeof(ln3), mf3))
-            if (!strncmp(ln3, "MemAvailable:", 13)) {
-              sscanf(ln3 + 13, " %ld", &ram_kb);
-              break;
-            }
-          fclose(mf3);
-        }
-        LOGI("Decode step %d — RAM: %ld MB", step + 1, ram_kb / 1024);
-        if (ram_kb > 0 && ram_kb < 200 * 1024) {
-          if (callback)
-            callback("[WARN] Low RAM, stopping");
-          break;
-        }
-      }
-#endif
+// Waits like run_medgemma_inference; the job's output is only notices.
+EXPORT int32_t medgemma_classify(void *handle, const uint8_t *image_bytes,
+                                 int image_len, const char *prompt,
+                                 const char *const *labels, int32_t n_labels,
+                                 const MedGemmaJobParams *params,
+                                 MedGemmaClassification *out) {
+  MedGemmaJobParams p = params ? *params : MedGemmaJobParams{};
+  p.dart_port = 0;
+  int64_t id = medgemma_submit_classify(handle, image_bytes, image_len,
+                                        prompt, labels, n_labels, &p);
+  MedGemmaClassification result = {-1, n_labels, {}, 0};
+  if (id > 0) {
+    char buf[1024];
+    for (;;) {
+      int32_t status = medgemma_poll(id);
+      if (medgemma_read(id, buf, sizeof(buf)) > 0)
+        continue;
+      if (status < 0 || status >= JOB_DONE)
+        break;
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
     }
+    medgemma_get_classification(id, &result);
+    medgemma_release(id);
+  }
+  if (out)
+    *out = result;
+  return result.label;
+}
 
-    LOGI("Inference complete");
+// Forgets a job. A job that is still running is cancelled and cleans itself up
+// when the scheduler retires it.
+EXPORT void medgemma_release(int64_t job_id) {
+  std::lock_guard<std::mutex> lock(g_jobs_mutex);
+  auto it = g_jobs.find(job_id);
+  if (it == g_jobs.end())
+    return;
+  if (it->second->finished) {
+    g_jobs.erase(it);
+  } else {
+    it->second->released = true;
+    cancel_job(*it->second);
+  }
+}
 
-  } catch (const std::exception &e) {
-    std::string err = std::string("[EXCEPTION] ") + e.what();
-    LOGE("%s", err.c_str());
+// Blocking entry point kept for older callers: runs as a job and relays its
+// output to `callback` on the calling thread (the scheduler thread must never
+// call into Dart).
+EXPORT void run_medgemma_inference(void *handle, uint8_t *image_bytes,
+                                   int image_len, const char *prompt,
+                                   int max_tokens, TokenCallback callback) {
+  LOGI("run_medgemma_inference: image_len=%d max_tokens=%d", image_len,
+       max_tokens);
+  MedGemmaJobParams params = {};
+  params.max_tokens = max_tokens;
+  int64_t id = medgemma_submit(handle, image_bytes, image_len, prompt, &params);
+  if (id < 0) {
     if (callback)
-      callback(err.c_str());
+      callback("[ERR] Engine handle is null");
+    return;
+  }
+  char buf[4096 + 1];
+  for (;;) {
+    // Poll before reading: after a terminal status an empty read means done.
+    int32_t status = medgemma_poll(id);
+    int32_t n = medgemma_read(id, buf, sizeof(buf) - 1);
+    if (n > 0) {
+      buf[n] = '\0';
+      if (callback)
+        callback(buf);
+      continue;
+    }
+    if (status < 0 || status >= JOB_DONE)
+      break;
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  medgemma_release(id);
+}
+
+// Upper bound on requests decoded together; takes effect at the next
+// admission. Larger batches trade RAM (one KV cache each) for throughput.
+EXPORT void medgemma_set_max_batch(void *handle, int32_t max_batch) {
+#ifndef _WIN32
+  if (auto eng = as_isolated(handle))
+    return isolated_send(eng, ipc::MSG_SET_MAX_BATCH, 0, max_batch);
+#endif
+  auto state = static_cast<MedGemmaState *>(handle);
+  if (!state)
+    return;
+  std::lock_guard<std::mutex> lock(state->queue_mutex);
+  state->max_batch = std::max(1, std::min(max_batch, 16));
+  LOGI("medgemma_set_max_batch: %d", state->max_batch);
+}
+
+// Snapshot of the engine's queue: depth, preemptions and per-class latency.
+// Returns 0 on success, -1 for a null handle or `out`.
+EXPORT int32_t medgemma_get_queue_stats(void *handle, MedGemmaQueueStats *out) {
+#ifndef _WIN32
+  if (auto eng = as_isolated(handle))
+    return out ? isolated_stats(eng, out) : -1;
+#endif
+  auto state = static_cast<MedGemmaState *>(handle);
+  if (!state || !out)
+    return -1;
+  std::lock_guard<std::mutex> lock(state->queue_mutex);
+  const QueueCounters &c = state->counters;
+  *out = MedGemmaQueueStats();
+  for (auto &job : state->queue)
+    ++(job->admitted ? out->paused : out->queued);
+  out->running = state->running;
+  out->max_batch = state->max_batch;
+  out->submitted = c.submitted;
+  out->finished = c.finished;
+  out->preemptions = c.preemptions;
+  for (int p = 0; p < PRIORITY_COUNT; ++p) {
+    out->queue_wait_avg_ms[p] =
+        c.wait_n[p] ? c.wait_sum_ms[p] / c.wait_n[p] : 0;
+    out->queue_wait_max_ms[p] = c.wait_max_ms[p];
+    out->first_token_avg_ms[p] =
+        c.ttft_n[p] ? c.ttft_sum_ms[p] / c.ttft_n[p] : 0;
   }
+  return 0;
+}
+
+// Where the last finished job's time and memory went, plus totals since load.
+// Served from this side for an isolated engine too, so it never waits on the
+// child and the totals outlive a daemon restart.
+EXPORT int32_t medgemma_get_last_metrics(void *handle, MedGemmaJobTimings *last,
+                                         MedGemmaCounters *totals) {
+#ifndef _WIN32
+  if (auto eng = as_isolated(handle))
+    return eng->metrics.read(last, totals);
+#endif
+  auto state = static_cast<MedGemmaState *>(handle);
+  if (!state)
+    return -1;
+  return state->metrics.read(last, totals);
 }
 
+// Reloads the vision sessions freed after the last image. Asynchronous: the
+// scheduler reloads them between steps (images also reload them on demand),
+// so this never blocks the UI thread behind a running batch.
 EXPORT void reset_inference_state(void *handle) {
   LOGI("reset_inference_state called");
+#ifndef _WIN32
+  if (auto eng = as_isolated(handle))
+    return isolated_send(eng, ipc::MSG_RESET_VISION, 0);
+#endif
   auto state = static_cast<MedGemmaState *>(handle);
   if (!state)
     return;
-  try {
-    auto reload = [&](const std::string &p, Ort::SessionOptions &opts) {
-      LOGI("Reloading: %s", p.c_str());
-      return std::make_unique<Ort::Session>(*state->env, p.c_str(), opts);
-    };
-    if (!state->v_sess) {
-      state->v_sess = reload(state->model_dir + "/vision_encoder.ort",
-                             *state->vision_session_options);
-      LOGI("vision_encoder reloaded");
-    }
-    if (!state->p_sess) {
-      state->p_sess = reload(state->model_dir + "/vision_projection.ort",
-                             *state->vision_session_options);
-      LOGI("vision_projection reloaded");
-    }
-    LOGI("reset_inference_state complete");
-  } catch (const std::exception &e) {
-    LOGE("reset_inference_state EXCEPTION: %s", e.what());
+  {
+    std::lock_guard<std::mutex> lock(state->queue_mutex);
+    state->reload_vision = true;
   }
+  state->queue_cv.notify_one();
 }
 
 } // extern "C"
\ No newline at end of file
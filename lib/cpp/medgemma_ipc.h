@@ -0,0 +1,241 @@
+// ── Engine process IPC ───────────────────────────────────────────────────────
+// Wire format between libmedgemma_bridge (client, inside the app) and
+// medgemma_daemon (the child process that owns the ORT sessions) when the
+// engine runs isolated — see load_medgemma_isolated().
+//
+// One shared-memory block (a memfd, inherited by the child) holds two
+// single-producer / single-consumer message rings and an image slab:
+//
+//   [IpcHeader][request ring data][event ring data][image slab]
+//
+// Requests flow app → daemon, events daemon → app. Ring positions are free-
+// running 32-bit counters in lock-free atomics, so they work across processes.
+// Each side writes one byte to a socketpair after pushing messages; the same
+// socket reports the peer's death as EOF, which is how a crash is noticed.
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "medgemma_api.h"
+
+namespace ipc {
+
+static const uint32_t MAGIC = 0x4D474531; // "MGE1"
+static const uint32_t REQUEST_RING_BYTES = 1u << 20;
+static const uint32_t EVENT_RING_BYTES = 1u << 18;
+// Encoded photos only (the daemon decodes); larger files go by path.
+static const uint32_t IMAGE_SLAB_BYTES = 32u << 20;
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free,
+              "ring counters must be address-free across processes");
+
+enum MsgType : uint32_t {
+  // app → daemon
+  MSG_SUBMIT = 1, // SubmitMsg + prompt + image path + prompt tokens +
+                  // labels; image bytes in the slab
+  MSG_CANCEL,
+  MSG_SET_MAX_BATCH, // payload: int32
+  MSG_RESET_VISION,
+  MSG_GET_STATS,
+  // int32 max_tokens + text; replied with MSG_TOKENS: int64 token count,
+  // then the IDs (at most max_tokens, fewer if they would not fit the ring)
+  MSG_TOKENIZE,
+  MSG_SET_LOG_LEVEL, // payload: int32 MedGemmaLogLevel
+  MSG_SESSION_OPEN,  // id: app session ID; payload: int32 window + int32 sink
+  MSG_SESSION_CLOSE, // id: app session ID
+  MSG_SESSION_SAVE,  // int64 app session ID + path; replied with MSG_RESULT
+  MSG_SESSION_LOAD,  // int64 new app session ID + path; likewise
+  MSG_SESSION_PUSH,  // SessionPushMsg + text; image in the slab; MSG_RESULT
+  // TemplateRenderMsg + source + each value as uint32 length + bytes;
+  // replied with MSG_TOKENS: int64 token count (or -1), then the IDs
+  MSG_TEMPLATE_RENDER,
+  // PlanContextMsg + per segment int32 fit, uint32 length and bytes;
+  // replied with MSG_CONTEXT_PLAN
+  MSG_PLAN_CONTEXT,
+  MSG_SET_IMAGE_POOLING, // payload: int32 MedGemmaImagePooling
+  // daemon → app
+  MSG_READY = 64, // engine loaded; payload: int32 pid
+  MSG_SUBMITTED,  // payload: int32 1 accepted / 0 rejected; slab free again
+  MSG_TEXT,       // payload: UTF-8 output (whole sequences only)
+  MSG_STATUS,     // payload: int32 JobStatus, or StatusMsg when terminal
+  MSG_STATS,      // payload: MedGemmaQueueStats
+  MSG_TOKENS,     // payload: int64 token count, then int64 token IDs
+  MSG_RESULT,     // payload: int32 0 done / -1 failed
+  // payload: MedGemmaContextPlan, then int32 kept bytes and int32 tokens per
+  // segment; empty if the plan failed
+  MSG_CONTEXT_PLAN,
+};
+
+// `id` is the app-side job ID for job messages, a call tag for replies.
+struct MsgHeader {
+  uint32_t type;
+  uint32_t len; // payload bytes following the header
+  int64_t id;
+};
+
+struct SubmitMsg {
+  MedGemmaJobParams params; // pointers and dart_port are meaningless here
+  uint32_t image_len;       // bytes at the start of the slab, 0 → none
+  uint32_t prompt_len;
+  uint32_t path_len; // image_path, used when image_len == 0
+  uint32_t token_count; // int64 prompt IDs, instead of the prompt when > 0
+  // > 0 → medgemma_submit_classify; each label as uint32 length + bytes
+  uint32_t label_count;
+};
+
+struct SessionPushMsg {
+  int64_t session; // app session ID
+  int32_t index;
+  int32_t has_text;   // 0 → drop the segments from `index` on
+  uint32_t image_len; // bytes at the start of the slab
+  uint32_t text_len;
+};
+
+struct TemplateRenderMsg {
+  int32_t max_tokens;
+  int32_t n_values;
+  uint32_t source_len;
+};
+
+struct PlanContextMsg {
+  int32_t n_segments;
+  int32_t images;
+  int32_t reserve_tokens;
+  int32_t max_prompt_tokens;
+};
+
+struct StatusMsg {
+  int32_t status;
+  int32_t reserved;
+  MedGemmaJobTimings timings;
+  MedGemmaClassification classification; // label -1 unless a classification
+};
+
+struct RingState {
+  alignas(64) std::atomic<uint32_t> head;
+  alignas(64) std::atomic<uint32_t> tail;
+};
+
+struct IpcHeader {
+  uint32_t magic;
+  uint32_t total_bytes;
+  RingState requests;
+  RingState events;
+};
+
+inline size_t block_size() {
+  return sizeof(IpcHeader) + REQUEST_RING_BYTES + EVENT_RING_BYTES +
+         IMAGE_SLAB_BYTES;
+}
+
+enum PopResult { POP_EMPTY, POP_OK, POP_CORRUPT };
+
+// View over one ring inside the mapped block. Not thread-safe on either side:
+// each process serialises its own writers.
+class MsgRing {
+public:
+  MsgRing(RingState *state, uint8_t *data, uint32_t capacity)
+      : s_(state), data_(data), mask_(capacity - 1) {}
+
+  uint32_t capacity() const { return mask_ + 1; }
+
+  // False if the ring lacks room right now (caller waits and retries).
+  bool push(uint32_t type, int64_t id, const void *a, uint32_t a_len,
+            const void *b = nullptr, uint32_t b_len = 0) {
+    MsgHeader h{type, a_len + b_len, id};
+    uint32_t need = sizeof(h) + h.len;
+    uint32_t head = s_->head.load(std::memory_order_relaxed);
+    uint32_t used = head - s_->tail.load(std::memory_order_acquire);
+    if (capacity() - used < need)
+      return false;
+    copy_in(head, &h, sizeof(h));
+    copy_in(head + sizeof(h), a, a_len);
+    copy_in(head + sizeof(h) + a_len, b, b_len);
+    s_->head.store(head + need, std::memory_order_release);
+    return true;
+  }
+
+  // Pops the next message into `h` and `payload` (resized to fit). A message
+  // that claims more than the writer has published is POP_CORRUPT and stays
+  // in the ring: the other process is broken and has to be dropped, and its
+  // length is never trusted for an allocation.
+  template <typename Bytes> PopResult pop(MsgHeader &h, Bytes &payload) {
+    uint32_t tail = s_->tail.load(std::memory_order_relaxed);
+    uint32_t avail = s_->head.load(std::memory_order_acquire) - tail;
+    if (avail == 0)
+      return POP_EMPTY;
+    if (avail < sizeof(h) || avail > capacity())
+      return POP_CORRUPT;
+    copy_out(tail, &h, sizeof(h));
+    if (h.len > avail - sizeof(h))
+      return POP_CORRUPT;
+    payload.resize(h.len);
+    copy_out(tail + sizeof(h), payload.data(), h.len);
+    s_->tail.store(tail + sizeof(h) + h.len, std::memory_order_release);
+    return POP_OK;
+  }
+
+private:
+  RingState *s_;
+  uint8_t *data_;
+  uint32_t mask_;
+
+  void copy_in(uint32_t pos, const void *src, uint32_t len) {
+    const uint8_t *p = static_cast<const uint8_t *>(src);
+    for (uint32_t done = 0; done < len;) {
+      uint32_t at = (pos + done) & mask_;
+      uint32_t n = std::min(len - done, capacity() - at);
+      memcpy(data_ + at, p + done, n);
+      done += n;
+    }
+  }
+
+  void copy_out(uint32_t pos, void *dst, uint32_t len) {
+    uint8_t *p = static_cast<uint8_t *>(dst);
+    for (uint32_t done = 0; done < len;) {
+      uint32_t at = (pos + done) & mask_;
+      uint32_t n = std::min(len - done, capacity() - at);
+      memcpy(p + done, data_ + at, n);
+      done += n;
+    }
+  }
+};
+
+// The three regions of a mapped block. `init` formats a fresh block (app side).
+struct Block {
+  IpcHeader *header;
+  MsgRing requests;
+  MsgRing events;
+  uint8_t *image_slab;
+
+  explicit Block(void *base, bool init = false)
+      : header(static_cast<IpcHeader *>(base)),
+        requests(&header->requests,
+                 static_cast<uint8_t *>(base) + sizeof(IpcHeader),
+                 REQUEST_RING_BYTES),
+        events(&header->events,
+               static_cast<uint8_t *>(base) + sizeof(IpcHeader) +
+                   REQUEST_RING_BYTES,
+               EVENT_RING_BYTES),
+        image_slab(static_cast<uint8_t *>(base) + sizeof(IpcHeader) +
+                   REQUEST_RING_BYTES + EVENT_RING_BYTES) {
+    if (init) {
+      header->magic = MAGIC;
+      header->total_bytes = static_cast<uint32_t>(block_size());
+      header->requests.head = 0;
+      header->requests.tail = 0;
+      header->events.head = 0;
+      header->events.tail = 0;
+    }
+  }
+
+  bool valid() const {
+    return header->magic == MAGIC && header->total_bytes == block_size();
+  }
+};
+
+} // namespace ipc
@@ -0,0 +1,282 @@
+// ── Minimal JSON ─────────────────────────────────────────────────────────────
+// Just enough for the native tools (medgemma_server requests, medgemma_bench
+// corpora) and the engine's trace export: objects, arrays, strings (with \u
+// escapes), numbers, booleans and null, plus an escaper for writing JSON by
+// hand and a writer for re-emitting parsed values. No external dependency.
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+struct Json {
+  enum Type { NUL, BOOL, NUM, STR, ARR, OBJ } type = NUL;
+  bool b = false;
+  double num = 0;
+  std::string str;
+  std::vector<Json> arr;
+  std::map<std::string, Json> obj;
+
+  const Json *get(const char *key) const {
+    if (type != OBJ)
+      return nullptr;
+    auto it = obj.find(key);
+    return it == obj.end() ? nullptr : &it->second;
+  }
+  double number_or(const char *key, double def) const {
+    const Json *v = get(key);
+    return v && v->type == NUM ? v->num : def;
+  }
+  std::string string_or(const char *key, const std::string &def) const {
+    const Json *v = get(key);
+    return v && v->type == STR ? v->str : def;
+  }
+  bool bool_or(const char *key, bool def) const {
+    const Json *v = get(key);
+    return v && v->type == BOOL ? v->b : def;
+  }
+};
+
+class JsonParser {
+public:
+  explicit JsonParser(const std::string &text) : p_(text.c_str()) {}
+
+  bool parse(Json &out) {
+    if (!value(out, 0))
+      return false;
+    ws();
+    return *p_ == '\0';
+  }
+
+private:
+  const char *p_;
+
+  void ws() {
+    while (*p_ == ' ' || *p_ == '\t' || *p_ == '\n' || *p_ == '\r')
+      ++p_;
+  }
+
+  bool literal(const char *word) {
+    size_t n = strlen(word);
+    if (strncmp(p_, word, n))
+      return false;
+    p_ += n;
+    return true;
+  }
+
+  static void put_utf8(std::string &s, uint32_t cp) {
+    if (cp < 0x80) {
+      s += (char)cp;
+    } else if (cp < 0x800) {
+      s += (char)(0xC0 | (cp >> 6));
+      s += (char)(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+      s += (char)(0xE0 | (cp >> 12));
+      s += (char)(0x80 | ((cp >> 6) & 0x3F));
+      s += (char)(0x80 | (cp & 0x3F));
+    } else {
+      s += (char)(0xF0 | (cp >> 18));
+      s += (char)(0x80 | ((cp >> 12) & 0x3F));
+      s += (char)(0x80 | ((cp >> 6) & 0x3F));
+      s += (char)(0x80 | (cp & 0x3F));
+    }
+  }
+
+  bool hex4(uint32_t &cp) {
+    cp = 0;
+    for (int i = 0; i < 4; ++i, ++p_) {
+      char c = *p_;
+      cp <<= 4;
+      if (c >= '0' && c <= '9')
+        cp |= c - '0';
+      else if (c >= 'a' && c <= 'f')
+        cp |= c - 'a' + 10;
+      else if (c >= 'A' && c <= 'F')
+        cp |= c - 'A' + 10;
+      else
+        return false;
+    }
+    return true;
+  }
+
+  bool string(std::string &s) {
+    if (*p_ != '"')
+      return false;
+    ++p_;
+    while (*p_ && *p_ != '"') {
+      if (*p_ != '\\') {
+        s += *p_++;
+        continue;
+      }
+      ++p_;
+      switch (*p_++) {
+      case '"': s += '"'; break;
+      case '\\': s += '\\'; break;
+      case '/': s += '/'; break;
+      case 'b': s += '\b'; break;
+      case 'f': s += '\f'; break;
+      case 'n': s += '\n'; break;
+      case 'r': s += '\r'; break;
+      case 't': s += '\t'; break;
+      case 'u': {
+        uint32_t cp;
+        if (!hex4(cp))
+          return false;
+        if (cp >= 0xD800 && cp < 0xDC00 && p_[0] == '\\' && p_[1] == 'u') {
+          uint32_t lo;
+          p_ += 2;
+          if (!hex4(lo))
+            return false;
+          cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+        }
+        put_utf8(s, cp);
+        break;
+      }
+      default:
+        return false;
+      }
+    }
+    if (*p_ != '"')
+      return false;
+    ++p_;
+    return true;
+  }
+
+  bool value(Json &v, int depth) {
+    if (depth > 32)
+      return false;
+    ws();
+    switch (*p_) {
+    case '{': {
+      ++p_;
+      v.type = Json::OBJ;
+      ws();
+      if (*p_ == '}')
+        return ++p_, true;
+      for (;;) {
+        std::string key;
+        ws();
+        if (!string(key))
+          return false;
+        ws();
+        if (*p_++ != ':')
+          return false;
+        if (!value(v.obj[key], depth + 1))
+          return false;
+        ws();
+        if (*p_ == ',') {
+          ++p_;
+          continue;
+        }
+        return *p_++ == '}';
+      }
+    }
+    case '[': {
+      ++p_;
+      v.type = Json::ARR;
+      ws();
+      if (*p_ == ']')
+        return ++p_, true;
+      for (;;) {
+        v.arr.emplace_back();
+        if (!value(v.arr.back(), depth + 1))
+          return false;
+        ws();
+        if (*p_ == ',') {
+          ++p_;
+          continue;
+        }
+        return *p_++ == ']';
+      }
+    }
+    case '"':
+      v.type = Json::STR;
+      return string(v.str);
+    case 't':
+      v.type = Json::BOOL;
+      v.b = true;
+      return literal("true");
+    case 'f':
+      v.type = Json::BOOL;
+      return literal("false");
+    case 'n':
+      return literal("null");
+    default: {
+      char *end = nullptr;
+      v.num = strtod(p_, &end);
+      if (end == p_)
+        return false;
+      v.type = Json::NUM;
+      p_ = end;
+      return true;
+    }
+    }
+  }
+};
+
+inline std::string json_escape(const std::string &s) {
+  std::string out;
+  out.reserve(s.size() + 2);
+  for (unsigned char c : s) {
+    switch (c) {
+    case '"': out += "\\\""; break;
+    case '\\': out += "\\\\"; break;
+    case '\n': out += "\\n"; break;
+    case '\r': out += "\\r"; break;
+    case '\t': out += "\\t"; break;
+    default:
+      if (c < 0x20) {
+        char buf[8];
+        snprintf(buf, sizeof(buf), "\\u%04x", c);
+        out += buf;
+      } else {
+        out += (char)c;
+      }
+    }
+  }
+  return out;
+}
+
+// Compact serialisation of a parsed value. Object keys come out sorted.
+inline void json_dump(const Json &v, std::string &out) {
+  switch (v.type) {
+  case Json::NUL: out += "null"; break;
+  case Json::BOOL: out += v.b ? "true" : "false"; break;
+  case Json::NUM: {
+    char buf[32];
+    if (v.num > -9e15 && v.num < 9e15 && v.num == (double)(long long)v.num)
+      snprintf(buf, sizeof(buf), "%lld", (long long)v.num);
+    else
+      snprintf(buf, sizeof(buf), "%.17g", v.num);
+    out += buf;
+    break;
+  }
+  case Json::STR: out += '"' + json_escape(v.str) + '"'; break;
+  case Json::ARR:
+    out += '[';
+    for (size_t i = 0; i < v.arr.size(); ++i) {
+      if (i)
+        out += ',';
+      json_dump(v.arr[i], out);
+    }
+    out += ']';
+    break;
+  case Json::OBJ: {
+    out += '{';
+    bool first = true;
+    for (const auto &kv : v.obj) {
+      if (!first)
+        out += ',';
+      first = false;
+      out += '"' + json_escape(kv.first) + "\":";
+      json_dump(kv.second, out);
+    }
+    out += '}';
+    break;
+  }
+  }
+}
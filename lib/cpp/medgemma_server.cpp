@@ -0,0 +1,664 @@
+// ── medgemma_server ──────────────────────────────────────────────────────────
+// Serves one loaded engine to every tool at a clinic hub through a subset of
+// the OpenAI chat API, so intake tablets and scripts share a single 3.8 GB
+// model instead of each loading their own:
+//
+//   GET  /health                 engine queue stats
+//   GET  /v1/models              the one loaded model
+//   POST /v1/chat/completions    messages, max_tokens, temperature, top_p,
+//                                repetition_penalty*, priority*, timeout_ms*,
+//                                stream (SSE)          (* = extension)
+//
+// It listens on a Unix domain socket (default) or on 127.0.0.1 only — never on
+// an external interface; LAN devices go through a reverse proxy if at all.
+// Each connection gets a thread that submits one job and relays its output;
+// queueing, batching and priorities are the engine scheduler's business.
+//
+// file:// image URLs are refused unless --image-dir names the one directory
+// they may point into; otherwise any client could have the server read any
+// file it can.
+//
+//   medgemma_server --model DIR [--socket PATH | --port N] [--max-batch N]
+//                   [--image-dir DIR]
+//   curl --unix-socket /tmp/medgemma.sock http://x/v1/chat/completions
+//        -d '{"messages":[{"role":"user","content":"Hi"}],"stream":true}'
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "medgemma_api.h"
+#include "medgemma_json.h"
+
+static const char *MODEL_ID = "medgemma-4b";
+static const size_t MAX_REQUEST_BYTES = 32u << 20; // room for a base64 photo
+
+static bool base64_decode(const char *in, size_t len,
+                          std::vector<uint8_t> &out) {
+  static int8_t table[256];
+  static bool init = [] {
+    memset(table, -1, sizeof(table));
+    const char *abc =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    for (int i = 0; i < 64; ++i)
+      table[(unsigned char)abc[i]] = (int8_t)i;
+    return true;
+  }();
+  (void)init;
+  out.clear();
+  out.reserve(len * 3 / 4);
+  uint32_t acc = 0;
+  int bits = 0;
+  for (size_t i = 0; i < len; ++i) {
+    unsigned char c = in[i];
+    if (c == '=' || c == '\n' || c == '\r')
+      continue;
+    if (table[c] < 0)
+      return false;
+    acc = (acc << 6) | table[c];
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      out.push_back((uint8_t)(acc >> bits));
+    }
+  }
+  return true;
+}
+
+// ── HTTP ─────────────────────────────────────────────────────────────────────
+
+struct HttpRequest {
+  std::string method, path, body;
+};
+
+static bool send_all(int fd, const std::string &data) {
+  size_t off = 0;
+  while (off < data.size()) {
+    ssize_t n = send(fd, data.data() + off, data.size() - off, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    off += (size_t)n;
+  }
+  return true;
+}
+
+// Reads one request (headers + Content-Length body). Returns an HTTP status
+// to fail with, or 0 on success.
+static int read_request(int fd, HttpRequest &req) {
+  std::string buf;
+  size_t header_end = std::string::npos;
+  char chunk[16384];
+  while (header_end == std::string::npos) {
+    ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+    if (n <= 0)
+      return 400;
+    buf.append(chunk, (size_t)n);
+    header_end = buf.find("\r\n\r\n");
+    if (header_end == std::string::npos && buf.size() > 64 * 1024)
+      return 431;
+  }
+
+  size_t line_end = buf.find("\r\n");
+  std::string line = buf.substr(0, line_end);
+  size_t sp1 = line.find(' '), sp2 = line.rfind(' ');
+  if (sp1 == std::string::npos || sp2 == sp1)
+    return 400;
+  req.method = line.substr(0, sp1);
+  req.path = line.substr(sp1 + 1, sp2 - sp1 - 1);
+  size_t q = req.path.find('?');
+  if (q != std::string::npos)
+    req.path.resize(q);
+
+  size_t content_length = 0;
+  std::string headers = buf.substr(line_end + 2, header_end - line_end - 2);
+  for (size_t pos = 0; pos < headers.size();) {
+    size_t end = headers.find("\r\n", pos);
+    if (end == std::string::npos)
+      end = headers.size();
+    std::string h = headers.substr(pos, end - pos);
+    pos = end + 2;
+    size_t colon = h.find(':');
+    if (colon == std::string::npos)
+      continue;
+    std::string name = h.substr(0, colon);
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    if (name == "content-length")
+      content_length = strtoull(h.c_str() + colon + 1, nullptr, 10);
+  }
+  if (content_length > MAX_REQUEST_BYTES)
+    return 413;
+
+  req.body = buf.substr(header_end + 4);
+  while (req.body.size() < content_length) {
+    ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+    if (n <= 0)
+      return 400;
+    req.body.append(chunk, (size_t)n);
+  }
+  req.body.resize(content_length);
+  return 0;
+}
+
+static const char *status_text(int code) {
+  switch (code) {
+  case 200: return "OK";
+  case 400: return "Bad Request";
+  case 404: return "Not Found";
+  case 405: return "Method Not Allowed";
+  case 413: return "Payload Too Large";
+  case 431: return "Request Header Fields Too Large";
+  case 503: return "Service Unavailable";
+  default: return "Internal Server Error";
+  }
+}
+
+static void send_json(int fd, int code, const std::string &body) {
+  char head[256];
+  snprintf(head, sizeof(head),
+           "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\n"
+           "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+           code, status_text(code), body.size());
+  send_all(fd, head + body);
+}
+
+static void send_error(int fd, int code, const std::string &message) {
+  send_json(fd, code,
+            "{\"error\":{\"message\":\"" + json_escape(message) +
+                "\",\"type\":\"" +
+                (code < 500 ? "invalid_request_error" : "server_error") +
+                "\"}}");
+}
+
+// ── Chat completions ─────────────────────────────────────────────────────────
+
+static void *g_engine = nullptr;
+static std::atomic<int64_t> g_completion_seq{1};
+static std::string g_image_dir; // realpath of --image-dir; empty = no files
+static std::atomic<bool> g_stopping{false};
+
+// A file:// URL's path if it names a file inside --image-dir once symlinks
+// and ".." are resolved.
+static bool image_file(const std::string &url, std::string &path,
+                       std::string &error) {
+  if (g_image_dir.empty()) {
+    error = "file:// image URLs are off (start the server with --image-dir)";
+    return false;
+  }
+  char resolved[PATH_MAX];
+  if (!realpath(url.c_str() + 7, resolved)) {
+    error = "image file not found";
+    return false;
+  }
+  path = resolved;
+  const std::string root =
+      g_image_dir.back() == '/' ? g_image_dir : g_image_dir + "/";
+  if (path.compare(0, root.size(), root) != 0) {
+    error = "image file is outside --image-dir";
+    return false;
+  }
+  return true;
+}
+
+// body[key] clamped to [lo, hi], or `def` if absent. False for a number JSON
+// cannot hold (1e999 parses as infinity).
+static bool read_number(const Json &body, const char *key, double def,
+                        double lo, double hi, double &out,
+                        std::string &error) {
+  out = body.number_or(key, def);
+  if (!std::isfinite(out)) {
+    error = std::string(key) + " is not a finite number";
+    return false;
+  }
+  out = std::min(std::max(out, lo), hi);
+  return true;
+}
+
+// Text of an OpenAI message `content` (string or array of parts); the first
+// image part is decoded into `image` / `image_path`.
+static bool read_content(const Json &content, std::string &text,
+                         std::vector<uint8_t> &image, std::string &image_path,
+                         bool &has_image, std::string &error) {
+  if (content.type == Json::STR) {
+    text = content.str;
+    return true;
+  }
+  if (content.type != Json::ARR) {
+    error = "message content must be a string or an array of parts";
+    return false;
+  }
+  for (const Json &part : content.arr) {
+    const Json *type = part.get("type");
+    if (!type || type->type != Json::STR)
+      continue;
+    if (type->str == "text") {
+      const Json *t = part.get("text");
+      if (t && t->type == Json::STR)
+        text += t->str;
+    } else if (type->str == "image_url") {
+      const Json *iu = part.get("image_url");
+      const Json *url = iu ? (iu->type == Json::STR ? iu : iu->get("url"))
+                           : nullptr;
+      if (!url || url->type != Json::STR) {
+        error = "image_url part without a url";
+        return false;
+      }
+      if (has_image) {
+        error = "only one image per request is supported";
+        return false;
+      }
+      const std::string &u = url->str;
+      if (u.compare(0, 5, "data:") == 0) {
+        size_t comma = u.find(',');
+        if (comma == std::string::npos ||
+            u.rfind(";base64", comma) == std::string::npos ||
+            !base64_decode(u.data() + comma + 1, u.size() - comma - 1,
+                           image)) {
+          error = "image data URL must be base64";
+          return false;
+        }
+      } else if (u.compare(0, 7, "file://") == 0) {
+        // mapped by the engine, never copied here
+        if (!image_file(u, image_path, error))
+          return false;
+      } else {
+        error = "image_url must be a data: or file:// URL (no network)";
+        return false;
+      }
+      has_image = true;
+    }
+  }
+  return true;
+}
+
+// OpenAI messages → Gemma chat template. System text is folded into the first
+// user turn (Gemma has no system role); the image placeholder goes into the
+// turn that carried the image.
+static bool build_prompt(const Json &messages, std::string &prompt,
+                         std::vector<uint8_t> &image, std::string &image_path,
+                         std::string &error) {
+  if (messages.type != Json::ARR || messages.arr.empty()) {
+    error = "messages must be a non-empty array";
+    return false;
+  }
+  std::string system;
+  bool has_image = false;
+  for (const Json &m : messages.arr) {
+    const Json *role = m.get("role");
+    const Json *content = m.get("content");
+    if (!role || role->type != Json::STR || !content) {
+      error = "each message needs a role and content";
+      return false;
+    }
+    std::string text;
+    bool had_image = has_image;
+    if (!read_content(*content, text, image, image_path, has_image, error))
+      return false;
+    if (role->str == "system" || role->str == "developer") {
+      system += text + "\n\n";
+      continue;
+    }
+    bool model = role->str == "assistant";
+    prompt += model ? "<start_of_turn>model\n" : "<start_of_turn>user\n";
+    if (!model) {
+      prompt += system;
+      system.clear();
+    }
+    if (has_image && !had_image)
+      prompt += "<image>\n";
+    prompt += text + "<end_of_turn>\n";
+  }
+  prompt += "<start_of_turn>model\n";
+  return true;
+}
+
+static std::string sse_chunk(const std::string &id, time_t created,
+                             const std::string &delta_json,
+                             const char *finish_reason) {
+  std::string reason =
+      finish_reason ? std::string("\"") + finish_reason + "\"" : "null";
+  return "data: {\"id\":\"" + id +
+         "\",\"object\":\"chat.completion.chunk\",\"created\":" +
+         std::to_string((long long)created) + ",\"model\":\"" + MODEL_ID +
+         "\",\"choices\":[{\"index\":0,\"delta\":" + delta_json +
+         ",\"finish_reason\":" + reason + "}]}\n\n";
+}
+
+static void handle_chat(int fd, const HttpRequest &req) {
+  Json body;
+  if (!JsonParser(req.body).parse(body) || body.type != Json::OBJ)
+    return send_error(fd, 400, "request body is not valid JSON");
+
+  std::string prompt, image_path, error;
+  std::vector<uint8_t> image;
+  const Json *messages = body.get("messages");
+  if (!messages || !build_prompt(*messages, prompt, image, image_path, error))
+    return send_error(fd, 400, error.empty() ? "missing messages" : error);
+
+  double max_tokens, max_completion_tokens, timeout_ms, temperature, top_p,
+      repetition_penalty;
+  if (!read_number(body, "max_tokens", 512, 1, 1 << 17, max_tokens, error) ||
+      !read_number(body, "max_completion_tokens", max_tokens, 1, 1 << 17,
+                   max_completion_tokens, error) ||
+      !read_number(body, "timeout_ms", 0, 0, INT32_MAX, timeout_ms, error) ||
+      !read_number(body, "temperature", 0, 0, 100, temperature, error) ||
+      !read_number(body, "top_p", 0, 0, 1, top_p, error) ||
+      !read_number(body, "repetition_penalty", 0, 0, 100, repetition_penalty,
+                   error))
+    return send_error(fd, 400, error);
+  MedGemmaJobParams params = {};
+  params.max_tokens = (int32_t)max_completion_tokens;
+  params.deadline_ms = (int32_t)timeout_ms;
+  params.temperature = (float)temperature;
+  params.top_p = (float)top_p;
+  params.repetition_penalty = (float)repetition_penalty;
+  params.image_path = image_path.empty() ? nullptr : image_path.c_str();
+  const Json *prio = body.get("priority");
+  if (prio && prio->type == Json::STR && prio->str == "high")
+    params.priority = PRIORITY_HIGH;
+  // temperature 0 means greedy in the OpenAI API, not "engine default"
+  const Json *temp = body.get("temperature");
+  if (temp && temp->type == Json::NUM && temp->num <= 0)
+    params.temperature = 0.001f;
+  bool stream = body.bool_or("stream", false);
+
+  const uint8_t *bytes = image.empty() ? nullptr : image.data();
+  int64_t job = medgemma_submit(g_engine, bytes, (int)image.size(),
+                                prompt.c_str(), &params);
+  if (job < 0)
+    return send_error(fd, 400, "engine rejected the request (see log)");
+  std::vector<uint8_t>().swap(image); // the engine has its own copy
+
+  std::string id =
+      "chatcmpl-" + std::to_string((long long)g_completion_seq++);
+  time_t created = time(nullptr);
+  if (stream) {
+    const char *opening = "{\"role\":\"assistant\",\"content\":\"\"}";
+    bool ok = send_all(fd, "HTTP/1.1 200 OK\r\n"
+                           "Content-Type: text/event-stream\r\n"
+                           "Cache-Control: no-cache\r\n"
+                           "Connection: close\r\n\r\n") &&
+              send_all(fd, sse_chunk(id, created, opening, nullptr));
+    if (!ok)
+      medgemma_cancel(job);
+  }
+
+  std::string text;
+  char buf[4096];
+  int32_t status;
+  for (;;) {
+    // Poll before reading: after a terminal status an empty read means done.
+    status = medgemma_poll(job);
+    int32_t n = medgemma_read(job, buf, sizeof(buf));
+    if (n > 0) {
+      std::string piece(buf, (size_t)n);
+      if (stream) {
+        // A dropped client cancels its job instead of generating for nobody.
+        if (!send_all(fd, sse_chunk(id, created,
+                                    "{\"content\":\"" + json_escape(piece) +
+                                        "\"}",
+                                    nullptr)))
+          medgemma_cancel(job);
+      } else {
+        text += piece;
+      }
+      continue;
+    }
+    if (status < 0 || status >= JOB_DONE)
+      break;
+    if (g_stopping)
+      medgemma_cancel(job); // the server is going away; so is the engine
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  MedGemmaJobTimings timings = {};
+  medgemma_get_job_timings(job, &timings);
+  medgemma_release(job);
+
+  // "length" means the answer was cut at the token limit: the one asked
+  // for, or less if the context had no room for more.
+  const int32_t limit = timings.plan_max_tokens > 0
+                            ? std::min(timings.plan_max_tokens,
+                                       params.max_tokens)
+                            : params.max_tokens;
+  const char *finish =
+      status == JOB_DONE && timings.generated_tokens >= limit ? "length"
+                                                              : "stop";
+  if (stream) {
+    send_all(fd, sse_chunk(id, created, "{}", finish) + "data: [DONE]\n\n");
+    return;
+  }
+  if (status == JOB_FAILED && text.empty())
+    return send_error(fd, 500, "inference failed");
+  send_json(fd, 200,
+            "{\"id\":\"" + id +
+                "\",\"object\":\"chat.completion\",\"created\":" +
+                std::to_string((long long)created) + ",\"model\":\"" +
+                MODEL_ID +
+                "\",\"choices\":[{\"index\":0,\"message\":{\"role\":"
+                "\"assistant\",\"content\":\"" +
+                json_escape(text) + "\"},\"finish_reason\":\"" + finish +
+                "\"}]}");
+}
+
+static void handle_health(int fd) {
+  MedGemmaQueueStats s;
+  if (medgemma_get_queue_stats(g_engine, &s) != 0)
+    return send_error(fd, 503, "engine not loaded");
+  char body[512];
+  snprintf(body, sizeof(body),
+           "{\"status\":\"ok\",\"model\":\"%s\",\"queued\":%d,\"paused\":%d,"
+           "\"running\":%d,\"max_batch\":%d,\"submitted\":%lld,"
+           "\"finished\":%lld,\"preemptions\":%lld,"
+           "\"queue_wait_avg_ms\":[%.1f,%.1f],"
+           "\"first_token_avg_ms\":[%.1f,%.1f]}",
+           MODEL_ID, s.queued, s.paused, s.running, s.max_batch,
+           (long long)s.submitted, (long long)s.finished,
+           (long long)s.preemptions, s.queue_wait_avg_ms[0],
+           s.queue_wait_avg_ms[1], s.first_token_avg_ms[0],
+           s.first_token_avg_ms[1]);
+  send_json(fd, 200, body);
+}
+
+// Open connections, so that shutdown can cut them off and wait for their
+// threads before the engine goes away under them.
+static std::mutex g_conn_mutex;
+static std::condition_variable g_conn_done;
+static std::set<int> g_conns;
+
+static void serve_connection(int fd) {
+  HttpRequest req;
+  int err = read_request(fd, req);
+  if (err) {
+    send_error(fd, err, status_text(err));
+  } else if (req.path == "/v1/chat/completions" ||
+             req.path == "/chat/completions") {
+    if (req.method != "POST")
+      send_error(fd, 405, "use POST");
+    else
+      handle_chat(fd, req);
+  } else if (req.path == "/v1/models" || req.path == "/models") {
+    send_json(fd, 200,
+              std::string("{\"object\":\"list\",\"data\":[{\"id\":\"") +
+                  MODEL_ID +
+                  "\",\"object\":\"model\",\"owned_by\":\"local\"}]}");
+  } else if (req.path == "/health") {
+    handle_health(fd);
+  } else {
+    send_error(fd, 404, "unknown endpoint " + req.path);
+  }
+  {
+    std::lock_guard<std::mutex> lock(g_conn_mutex);
+    g_conns.erase(fd);
+    close(fd);
+    // Under the lock: once main sees the set empty, this thread touches
+    // nothing of the server's again.
+    g_conn_done.notify_all();
+  }
+}
+
+// ── Main ─────────────────────────────────────────────────────────────────────
+
+static std::atomic<int> g_listen_fd{-1};
+
+static void on_signal(int) {
+  int fd = g_listen_fd.exchange(-1);
+  if (fd >= 0)
+    shutdown(fd, SHUT_RDWR); // unblocks accept(); main then unloads
+}
+
+static void usage() {
+  fprintf(stderr,
+          "usage: medgemma_server --model DIR [--socket PATH | --port N]\n"
+          "                       [--max-batch N] [--log FILE]\n"
+          "                       [--image-dir DIR]\n"
+          "Listens on a Unix socket (default /tmp/medgemma.sock) or on\n"
+          "127.0.0.1:N. Never binds an external interface.\n");
+}
+
+int main(int argc, char **argv) {
+  std::string model_dir, socket_path = "/tmp/medgemma.sock", log_path,
+      image_dir;
+  int port = 0, max_batch = 0;
+  for (int i = 1; i < argc; ++i) {
+    std::string a = argv[i];
+    bool has_value = i + 1 < argc;
+    if (a == "--model" && has_value)
+      model_dir = argv[++i];
+    else if (a == "--socket" && has_value)
+      socket_path = argv[++i];
+    else if (a == "--port" && has_value)
+      port = atoi(argv[++i]);
+    else if (a == "--max-batch" && has_value)
+      max_batch = atoi(argv[++i]);
+    else if (a == "--log" && has_value)
+      log_path = argv[++i];
+    else if (a == "--image-dir" && has_value)
+      image_dir = argv[++i];
+    else
+      return usage(), 2;
+  }
+  if (model_dir.empty())
+    return usage(), 2;
+  if (!image_dir.empty()) {
+    char resolved[PATH_MAX];
+    if (!realpath(image_dir.c_str(), resolved)) {
+      fprintf(stderr, "medgemma_server: --image-dir %s: %s\n",
+              image_dir.c_str(), strerror(errno));
+      return 1;
+    }
+    g_image_dir = resolved;
+  }
+
+  if (!log_path.empty())
+    set_log_path(log_path.c_str());
+  g_engine = load_medgemma_4bit(model_dir.c_str());
+  if (!g_engine) {
+    fprintf(stderr, "medgemma_server: failed to load %s\n", model_dir.c_str());
+    return 1;
+  }
+  if (max_batch > 0)
+    medgemma_set_max_batch(g_engine, max_batch);
+
+  int fd;
+  if (port > 0) {
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+      fprintf(stderr, "medgemma_server: bind 127.0.0.1:%d: %s\n", port,
+              strerror(errno));
+      return 1;
+    }
+  } else {
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "medgemma_server: socket path too long\n");
+      return 1;
+    }
+    strcpy(addr.sun_path, socket_path.c_str());
+    unlink(socket_path.c_str()); // stale socket from a previous run
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+      fprintf(stderr, "medgemma_server: bind %s: %s\n", socket_path.c_str(),
+              strerror(errno));
+      return 1;
+    }
+  }
+  if (listen(fd, 64) != 0) {
+    fprintf(stderr, "medgemma_server: listen: %s\n", strerror(errno));
+    return 1;
+  }
+  g_listen_fd = fd;
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  if (port > 0)
+    fprintf(stderr, "medgemma_server: listening on 127.0.0.1:%d\n", port);
+  else
+    fprintf(stderr, "medgemma_server: listening on %s\n",
+            socket_path.c_str());
+
+  for (;;) {
+    int client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (client < 0) {
+      if (g_listen_fd < 0)
+        break; // shut down by on_signal
+      if (errno != EINTR) {
+        // Out of descriptors, or a client gave up before we got to it:
+        // the server is fine, just busy. Give connections time to close.
+        fprintf(stderr, "medgemma_server: accept: %s\n", strerror(errno));
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      }
+      continue;
+    }
+    {
+      std::lock_guard<std::mutex> lock(g_conn_mutex);
+      g_conns.insert(client);
+    }
+    std::thread(serve_connection, client).detach();
+  }
+
+  fprintf(stderr, "medgemma_server: shutting down\n");
+  close(fd);
+  {
+    // Clients get EOF, their jobs are cancelled, and every connection
+    // thread is out of the engine before it is unloaded.
+    g_stopping = true;
+    std::unique_lock<std::mutex> lock(g_conn_mutex);
+    for (int c : g_conns)
+      shutdown(c, SHUT_RDWR);
+    g_conn_done.wait(lock, [] { return g_conns.empty(); });
+  }
+  if (port <= 0)
+    unlink(socket_path.c_str());
+  unload_medgemma(g_engine);
+  return 0;
+}
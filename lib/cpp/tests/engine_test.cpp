@@ -0,0 +1,1016 @@
+// ── Engine end-to-end tests ──────────────────────────────────────────────────
+// Runs the full pipeline (image decode → vision → embeddings → chunked prefill
+// → batched decode) against the tiny fixture from make_tiny_model.py, through
+// the public C API only:
+//
+//   medgemma_engine_test MODEL_DIR [DAEMON_PATH]
+//
+// The fixture's weights are random, so nothing is compared with expected
+// text. Instead every path that should produce the same tokens is checked
+// against every other one: repeated runs, image bytes vs. path, the blocking
+// entry point, batched vs. solo decoding and the isolated engine. A scheduler,
+// KV-cache or padding regression shows up as a mismatch.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "medgemma_api.h"
+
+static int g_failures = 0;
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "  FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);        \
+      ++g_failures;                                                            \
+    }                                                                          \
+  } while (0)
+
+static std::string g_model_dir, g_daemon_path, g_image_path;
+static std::vector<uint8_t> g_image;
+
+struct Output {
+  int status = -1;
+  std::string text;
+  MedGemmaJobTimings timings = {};
+};
+
+static const char *PROMPT =
+    "<start_of_turn>user\nFever and cough for three days, what next?"
+    "<end_of_turn>\n<start_of_turn>model\n";
+static const char *FOLLOW_UP =
+    "<start_of_turn>user\nAnd if the fever stays above 39?<end_of_turn>\n"
+    "<start_of_turn>model\n";
+static const char *IMAGE_PROMPT =
+    "<start_of_turn>user\n<image>\nDescribe the wound.<end_of_turn>\n"
+    "<start_of_turn>model\n";
+
+// Greedy, so outputs are comparable between runs.
+static MedGemmaJobParams greedy(int max_tokens) {
+  MedGemmaJobParams p = {};
+  p.max_tokens = max_tokens;
+  p.temperature = 0.001f;
+  return p;
+}
+
+static Output drain(int64_t job, bool release = true) {
+  Output out;
+  char buf[1024];
+  for (;;) {
+    int32_t status = medgemma_poll(job);
+    int32_t n = medgemma_read(job, buf, sizeof(buf));
+    if (n > 0) {
+      out.text.append(buf, n);
+      continue;
+    }
+    if (status < 0 || status >= JOB_DONE) {
+      out.status = status;
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  medgemma_get_job_timings(job, &out.timings);
+  if (release)
+    medgemma_release(job);
+  return out;
+}
+
+static Output run(void *engine, const char *prompt,
+                  const MedGemmaJobParams &p, bool image_bytes = false) {
+  int64_t job = medgemma_submit(engine, image_bytes ? g_image.data() : nullptr,
+                                image_bytes ? (int)g_image.size() : 0, prompt,
+                                &p);
+  if (job <= 0)
+    return Output();
+  return drain(job);
+}
+
+// ── Tests ────────────────────────────────────────────────────────────────────
+
+static void test_tokenize(void *engine) {
+  int64_t tokens[64];
+  CHECK(medgemma_tokenize(engine, "<image>", tokens, 64) == 1);
+  CHECK(medgemma_tokenize(engine, "fever and cough", tokens, 64) > 0);
+}
+
+static void test_text_job(void *engine) {
+  Output out = run(engine, PROMPT, greedy(12));
+  CHECK(out.status == JOB_DONE);
+  CHECK(!out.text.empty());
+  const MedGemmaJobTimings &t = out.timings;
+  CHECK(t.prompt_tokens > 0);
+  CHECK(t.image_tokens == 0);
+  CHECK(t.generated_tokens > 0 && t.generated_tokens <= 12);
+  CHECK(t.prefill_chunks > 0);
+  CHECK(t.decode_steps == t.generated_tokens - 1);
+  CHECK(t.plan_prefill_chunk > 0 && t.plan_max_tokens == 12);
+  CHECK(t.prefill_chunks ==
+        (t.prompt_tokens + t.plan_prefill_chunk - 1) / t.plan_prefill_chunk);
+}
+
+static void test_image_job(void *engine) {
+  MedGemmaJobParams p = greedy(8);
+  p.image_path = g_image_path.c_str();
+  Output by_path = run(engine, IMAGE_PROMPT, p);
+  CHECK(by_path.status == JOB_DONE);
+  CHECK(by_path.timings.image_tokens == 256);
+  CHECK(by_path.timings.prompt_tokens > 256);
+  CHECK(by_path.timings.vision_ms > 0);
+
+  // The vision sessions are dropped after use and reloaded here.
+  Output by_bytes = run(engine, IMAGE_PROMPT, greedy(8), true);
+  CHECK(by_bytes.status == JOB_DONE);
+  CHECK(by_bytes.text == by_path.text);
+}
+
+static void test_deterministic(void *engine) {
+  Output a = run(engine, PROMPT, greedy(16));
+  Output b = run(engine, PROMPT, greedy(16));
+  CHECK(a.status == JOB_DONE && b.status == JOB_DONE);
+  CHECK(a.text == b.text);
+}
+
+static std::string g_callback_text;
+
+static void test_blocking_entry(void *engine) {
+  Output job = run(engine, IMAGE_PROMPT, greedy(8), true);
+  g_callback_text.clear();
+  std::vector<uint8_t> image = g_image;
+  // Uses the engine's default sampling, so only check it streams something.
+  run_medgemma_inference(engine, image.data(), (int)image.size(),
+                         IMAGE_PROMPT, 8,
+                         [](const char *t) { g_callback_text += t; });
+  CHECK(job.status == JOB_DONE);
+  CHECK(!g_callback_text.empty());
+}
+
+// What a Dart ReceivePort would get: the engine posts through whatever
+// medgemma_init_dart_api was given, so a stand-in records the messages. Only
+// the start of Dart_CObject is read (type, then the value union).
+struct PortMessage {
+  bool is_int;
+  std::string text;
+  int32_t status;
+};
+static std::mutex g_port_mutex;
+static std::vector<PortMessage> g_port_messages;
+
+static bool record_post(int64_t, void *msg) {
+  struct {
+    int32_t type;
+    union {
+      int32_t as_int32;
+      const char *as_string;
+    } value;
+  } m;
+  memcpy(&m, msg, sizeof(m));
+  std::lock_guard<std::mutex> lock(g_port_mutex);
+  g_port_messages.push_back({m.type == 2, m.type == 5 ? m.value.as_string
+                                                      : "",
+                             m.type == 2 ? m.value.as_int32 : 0});
+  return true;
+}
+
+// Whether `s` ends on a whole UTF-8 sequence, not halfway through one.
+static bool utf8_whole(const std::string &s) {
+  for (size_t i = 0; i < s.size();) {
+    unsigned char c = s[i];
+    size_t n = c < 0x80                ? 1
+               : (c & 0xE0) == 0xC0    ? 2
+               : (c & 0xF0) == 0xE0    ? 3
+                                       : 4;
+    if (i + n > s.size())
+      return false;
+    i += n;
+  }
+  return true;
+}
+
+// A port job streams the same text as a ring job, in pieces Dart can decode,
+// and ends with its status.
+static void test_dart_port(void *engine) {
+  Output ring = run(engine, PROMPT, greedy(12));
+  medgemma_init_dart_api((void *)&record_post);
+  g_port_messages.clear();
+  MedGemmaJobParams p = greedy(12);
+  p.dart_port = 42;
+  int64_t job = medgemma_submit(engine, nullptr, 0, PROMPT, &p);
+  CHECK(job > 0);
+  for (int i = 0; i < 30000; ++i) {
+    {
+      std::lock_guard<std::mutex> lock(g_port_mutex);
+      if (!g_port_messages.empty() && g_port_messages.back().is_int)
+        break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  medgemma_release(job);
+  std::lock_guard<std::mutex> lock(g_port_mutex);
+  CHECK(!g_port_messages.empty() && g_port_messages.back().is_int &&
+        g_port_messages.back().status == JOB_DONE);
+  std::string text;
+  for (const PortMessage &m : g_port_messages) {
+    CHECK(m.is_int == (&m == &g_port_messages.back()));
+    CHECK(utf8_whole(m.text));
+    text += m.text;
+  }
+  CHECK(text == ring.text);
+}
+
+// Sequences of different lengths share decode steps (right-padded); each must
+// still produce exactly what it produces alone.
+static void test_batched_matches_solo(void *engine) {
+  const char *prompts[] = {
+      PROMPT,
+      "<start_of_turn>user\nChild with a rash.<end_of_turn>\n"
+      "<start_of_turn>model\n",
+      IMAGE_PROMPT,
+  };
+  const int n = 3;
+  Output solo[n];
+  for (int i = 0; i < n; ++i) {
+    MedGemmaJobParams p = greedy(10);
+    p.image_path = prompts[i] == IMAGE_PROMPT ? g_image_path.c_str() : nullptr;
+    solo[i] = run(engine, prompts[i], p);
+  }
+  medgemma_set_max_batch(engine, 4);
+  int64_t jobs[n];
+  for (int i = 0; i < n; ++i) {
+    MedGemmaJobParams p = greedy(10);
+    p.image_path = prompts[i] == IMAGE_PROMPT ? g_image_path.c_str() : nullptr;
+    jobs[i] = medgemma_submit(engine, nullptr, 0, prompts[i], &p);
+  }
+  int max_batch_seen = 0;
+  for (int i = 0; i < n; ++i) {
+    Output batched = drain(jobs[i]);
+    CHECK(batched.status == JOB_DONE);
+    CHECK(batched.text == solo[i].text);
+    max_batch_seen = std::max(max_batch_seen, batched.timings.max_batch_seen);
+  }
+  CHECK(max_batch_seen > 1);
+}
+
+static void test_cancel(void *engine) {
+  MedGemmaJobParams p = greedy(400);
+  int64_t job = medgemma_submit(engine, nullptr, 0, PROMPT, &p);
+  char buf[256];
+  while (medgemma_poll(job) < JOB_DONE && medgemma_read(job, buf, 1) == 0)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  CHECK(medgemma_cancel(job) == 1);
+  Output out = drain(job);
+  CHECK(out.status == JOB_CANCELLED);
+  CHECK(out.timings.generated_tokens < 400);
+}
+
+static void test_deadline(void *engine) {
+  MedGemmaJobParams p = greedy(400);
+  p.deadline_ms = 1;
+  Output out = run(engine, IMAGE_PROMPT, p, true);
+  CHECK(out.status == JOB_TIMED_OUT);
+}
+
+static void test_queue_stats(void *engine) {
+  MedGemmaQueueStats stats;
+  CHECK(medgemma_get_queue_stats(engine, &stats) == 0);
+  CHECK(stats.queued == 0 && stats.running == 0);
+  CHECK(stats.finished > 0 && stats.finished <= stats.submitted);
+}
+
+// The last job's stage split must add up and land in the running totals.
+static void test_metrics(void *engine) {
+  MedGemmaCounters before;
+  CHECK(medgemma_get_last_metrics(engine, nullptr, &before) == 0);
+  Output out = run(engine, IMAGE_PROMPT, greedy(8), true);
+  MedGemmaJobTimings last;
+  MedGemmaCounters after;
+  CHECK(medgemma_get_last_metrics(engine, &last, &after) == 0);
+  CHECK(last.status == JOB_DONE);
+  CHECK(last.generated_tokens == out.timings.generated_tokens);
+  CHECK(last.image_decode_ms > 0 && last.vision_encode_ms > 0);
+  CHECK(last.image_decode_ms + last.image_resize_ms +
+            last.image_normalize_ms <= last.image_ms + 0.5);
+  CHECK(last.vision_encode_ms + last.vision_project_ms <= last.vision_ms);
+  CHECK(last.tokenize_ms <= last.embed_ms);
+  CHECK(last.prefill_chunk_max_ms <= last.prefill_ms);
+  CHECK(last.decode_step_max_ms <= last.decode_ms);
+  CHECK(last.sample_ms > 0 && last.detokenize_ms > 0);
+  CHECK(last.total_ms >= last.first_token_ms);
+  CHECK(last.kv_len == last.prompt_tokens + last.decode_steps);
+  CHECK(last.rss_peak_kb >= last.rss_start_kb && last.rss_start_kb > 0);
+  CHECK(last.vision_peak_kb > 0 && last.prefill_peak_kb > 0);
+  CHECK(last.decode_peak_kb > 0);
+  CHECK(after.decode_peak_kb >= last.decode_peak_kb);
+  CHECK(after.jobs_done == before.jobs_done + 1);
+  CHECK(after.images == before.images + 1);
+  CHECK(after.generated_tokens ==
+        before.generated_tokens + last.generated_tokens);
+  CHECK(medgemma_get_last_metrics(nullptr, &last, &after) == -1);
+}
+
+// Atomically, so the monitor thread never samples a half-written file.
+static void write_file(const std::string &path, const std::string &text) {
+  std::ofstream(path + ".tmp") << text;
+  rename((path + ".tmp").c_str(), path.c_str());
+}
+
+static void sleep_ms(int ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+// The memory monitor reads fake procfs/cgroup files here. The engine must
+// plan each request for what is free — the largest prefill chunks with room
+// to spare, a shorter report when the cache would not fit — and degrade with
+// the level instead of failing: no image under high pressure, and under
+// critical pressure a pause with the KV cache spilled to flash that resumes
+// cleanly, or a report finished from flash if the pressure persists.
+static void test_memory_pressure(void *engine) {
+  Output baseline = run(engine, PROMPT, greedy(6));
+  char tmpl[] = "/tmp/medgemma_mem_XXXXXX";
+  const std::string dir = mkdtemp(tmpl);
+  const std::string meminfo = dir + "/meminfo", psi = dir + "/pressure";
+  auto available_mb = [&](int mb) {
+    write_file(meminfo, "MemTotal:        8000000 kB\nMemAvailable:    " +
+                            std::to_string(mb * 1024) + " kB\n");
+  };
+  const int sample_ms = 400; // > one monitor period
+
+  available_mb(4096);
+  medgemma_set_memory_paths(meminfo.c_str(), psi.c_str(), dir.c_str());
+  MedGemmaMemoryStatus s;
+  CHECK(medgemma_get_memory_status(&s) == 0);
+  CHECK(s.level == MEDGEMMA_MEM_OK && s.available_kb == 4096 * 1024);
+  CHECK(s.psi_some_avg10 < 0 && s.cgroup_limit_kb < 0);
+
+  write_file(psi, "some avg10=35.00 avg60=9.00 avg300=2.00 total=1\n"
+                  "full avg10=1.00 avg60=0.00 avg300=0.00 total=1\n");
+  CHECK(medgemma_get_memory_status(&s) == 0);
+  CHECK(s.level == MEDGEMMA_MEM_HIGH && s.psi_some_avg10 == 35.0);
+  remove(psi.c_str());
+
+  write_file(dir + "/memory.max", "1073741824\n");
+  write_file(dir + "/memory.current", "536870912\n");
+  CHECK(medgemma_get_memory_status(&s) == 0);
+  CHECK(s.available_kb == 512 * 1024 && s.level == MEDGEMMA_MEM_HIGH);
+  write_file(dir + "/memory.max", "max\n");
+  CHECK(medgemma_get_memory_status(&s) == 0);
+  CHECK(s.cgroup_limit_kb < 0 && s.level == MEDGEMMA_MEM_OK);
+
+  sleep_ms(sample_ms);
+  Output roomy = run(engine, PROMPT, greedy(6));
+  CHECK(roomy.status == JOB_DONE && roomy.text == baseline.text);
+  CHECK(roomy.timings.plan_prefill_chunk == 64);
+  CHECK(roomy.timings.plan_budget_kb > 3000 * 1024);
+  CHECK(roomy.timings.plan_peak_kb <= roomy.timings.plan_budget_kb);
+
+  available_mb(700); // 2 × the cache of ~1000 positions
+  sleep_ms(sample_ms);
+  MedGemmaJobParams longer = greedy(100000);
+  int64_t clamped = medgemma_submit(engine, nullptr, 0, PROMPT, &longer);
+  char first[256];
+  for (int i = 0; i < 5000; ++i) // planned once it streams
+    if (medgemma_read(clamped, first, sizeof(first)) > 0)
+      break;
+    else
+      sleep_ms(1);
+  medgemma_cancel(clamped);
+  Output cut = drain(clamped);
+  CHECK(cut.timings.plan_max_tokens >= 64);
+  CHECK(cut.timings.plan_max_tokens < 2000);
+  CHECK(cut.timings.plan_peak_kb <= cut.timings.plan_budget_kb);
+
+  available_mb(400);
+  sleep_ms(sample_ms);
+  Output no_image = run(engine, IMAGE_PROMPT, greedy(4), true);
+  CHECK(no_image.status == JOB_DONE);
+  CHECK(no_image.text.find("[IMG_ERR]") != std::string::npos);
+  CHECK(no_image.timings.image_tokens == 0);
+
+  available_mb(100);
+  sleep_ms(sample_ms);
+  MedGemmaJobParams p = greedy(6);
+  int64_t job = medgemma_submit(engine, nullptr, 0, PROMPT, &p);
+  sleep_ms(2 * sample_ms);
+  CHECK(medgemma_poll(job) < JOB_DONE);
+  available_mb(4096);
+  Output resumed = drain(job);
+  CHECK(resumed.status == JOB_DONE && resumed.text == baseline.text);
+
+  medgemma_set_spill_dir(dir.c_str());
+  Output long_baseline = run(engine, PROMPT, greedy(100));
+  p = greedy(100);
+  job = medgemma_submit(engine, nullptr, 0, PROMPT, &p);
+  std::string head;
+  char buf[256];
+  while (head.empty() && medgemma_poll(job) < JOB_DONE)
+    if (int n = medgemma_read(job, buf, sizeof(buf)); n > 0)
+      head.append(buf, n);
+  available_mb(100); // spilled mid-report, then back in RAM
+  sleep_ms(2 * sample_ms);
+  available_mb(4096);
+  Output restored = drain(job);
+  CHECK(restored.status == JOB_DONE);
+  CHECK(head + restored.text == long_baseline.text);
+
+  available_mb(100); // never eases: finished from the spill file
+  sleep_ms(sample_ms);
+  Output spilled = run(engine, PROMPT, greedy(6));
+  CHECK(spilled.status == JOB_DONE && spilled.text == baseline.text);
+  CHECK(spilled.timings.spills == 1 && spilled.timings.spill_steps > 0);
+  medgemma_set_spill_dir(nullptr);
+
+  medgemma_set_memory_paths(nullptr, nullptr, nullptr);
+  for (const char *f : {"/meminfo", "/memory.max", "/memory.current"})
+    remove((dir + f).c_str());
+  remove(dir.c_str());
+  sleep_ms(sample_ms);
+}
+
+// Runs `turns` greedy turns in a new session: PROMPT, then FOLLOW_UPs.
+static std::vector<Output> chat(void *engine, int turns, int window,
+                                int sink, int max_tokens) {
+  std::vector<Output> outs;
+  int64_t session = medgemma_session_open(engine, window, sink);
+  CHECK(session > 0);
+  MedGemmaJobParams p = greedy(max_tokens);
+  p.session = session;
+  for (int turn = 0; turn < turns; ++turn)
+    outs.push_back(run(engine, turn ? FOLLOW_UP : PROMPT, p));
+  medgemma_session_close(engine, session);
+  return outs;
+}
+
+// The fp16 and int8 KV decoders run the same requests in less cache memory.
+// Their text may differ from fp32's, as rounding the cache can flip a token.
+// Session eviction re-rotates keys in each storage format.
+static void test_kv_precision(void *) {
+  int64_t plan_kb[3] = {}, decode_kb[3] = {};
+  for (int precision : {MEDGEMMA_KV_FP32, MEDGEMMA_KV_FP16, MEDGEMMA_KV_INT8}) {
+    medgemma_set_kv_precision(precision);
+    void *engine = load_medgemma_4bit(g_model_dir.c_str());
+    CHECK(engine != nullptr);
+    if (!engine)
+      break;
+    Output a = run(engine, PROMPT, greedy(16));
+    Output b = run(engine, PROMPT, greedy(16));
+    CHECK(a.status == JOB_DONE && a.timings.generated_tokens > 0);
+    CHECK(b.text == a.text);
+    int evicted = 0;
+    for (const Output &turn : chat(engine, 8, 192, 4, 16)) {
+      CHECK(turn.status == JOB_DONE);
+      evicted += turn.timings.evicted_tokens;
+    }
+    CHECK(evicted > 0);
+    plan_kb[precision] = a.timings.plan_peak_kb;
+    decode_kb[precision] = a.timings.decode_peak_kb;
+    unload_medgemma(engine);
+  }
+  medgemma_set_kv_precision(MEDGEMMA_KV_FP32);
+  CHECK(plan_kb[MEDGEMMA_KV_INT8] < plan_kb[MEDGEMMA_KV_FP16]);
+  CHECK(plan_kb[MEDGEMMA_KV_FP16] < plan_kb[MEDGEMMA_KV_FP32]);
+  CHECK(decode_kb[MEDGEMMA_KV_INT8] < decode_kb[MEDGEMMA_KV_FP16]);
+  CHECK(decode_kb[MEDGEMMA_KV_FP16] < decode_kb[MEDGEMMA_KV_FP32]);
+}
+
+// A session's cache outlives its jobs: a follow-up prefills only itself and
+// answers as if the whole conversation had been sent. A long chat stays
+// within its window by evicting old positions, the same way every time.
+static void test_chat_session(void *engine) {
+  std::vector<Output> short_chat = chat(engine, 2, 0, 0, 4);
+  std::string whole = std::string(PROMPT) + short_chat[0].text +
+                      "<end_of_turn>\n" + FOLLOW_UP;
+  Output resent = run(engine, whole.c_str(), greedy(4));
+  CHECK(short_chat[1].status == JOB_DONE);
+  CHECK(short_chat[1].timings.cached_tokens > 0);
+  CHECK(short_chat[1].timings.prompt_tokens < resent.timings.prompt_tokens);
+  CHECK(short_chat[1].text == resent.text);
+
+  std::vector<Output> a = chat(engine, 8, 192, 4, 16);
+  std::vector<Output> b = chat(engine, 8, 192, 4, 16);
+  int evicted = 0;
+  for (size_t i = 0; i < a.size(); ++i) {
+    CHECK(a[i].status == JOB_DONE && a[i].text == b[i].text);
+    CHECK((a[i].timings.cached_tokens > 0) == (i > 0));
+    CHECK(a[i].timings.kv_len <= 192);
+    evicted += a[i].timings.evicted_tokens;
+  }
+  CHECK(evicted > 0);
+
+  // One job at a time; closed or too small sessions are refused.
+  int64_t session = medgemma_session_open(engine, 0, 0);
+  MedGemmaJobParams p = greedy(400);
+  p.session = session;
+  int64_t job = medgemma_submit(engine, nullptr, 0, PROMPT, &p);
+  CHECK(job > 0);
+  CHECK(medgemma_submit(engine, nullptr, 0, FOLLOW_UP, &p) == -1);
+  medgemma_cancel(job);
+  drain(job);
+  medgemma_session_close(engine, session);
+  CHECK(medgemma_submit(engine, nullptr, 0, FOLLOW_UP, &p) == -1);
+  CHECK(medgemma_session_open(engine, 64, 0) == -1);
+}
+
+// Saves a one-turn session to `path` and returns the follow-up's answer in
+// that session, for comparison with the same follow-up in a loaded copy.
+static Output save_first_turn(void *engine, const std::string &path) {
+  int64_t session = medgemma_session_open(engine, 0, 0);
+  MedGemmaJobParams p = greedy(8);
+  p.session = session;
+  CHECK(medgemma_session_save(engine, session, path.c_str()) == -1); // empty
+  CHECK(run(engine, PROMPT, p).status == JOB_DONE);
+  CHECK(medgemma_session_save(engine, session, path.c_str()) == 0);
+  Output next = run(engine, FOLLOW_UP, p);
+  medgemma_session_close(engine, session);
+  return next;
+}
+
+static Output follow_up_from(void *engine, const std::string &path) {
+  int64_t session = medgemma_session_load(engine, path.c_str());
+  CHECK(session > 0);
+  MedGemmaJobParams p = greedy(8);
+  p.session = session;
+  Output out = run(engine, FOLLOW_UP, p);
+  medgemma_session_close(engine, session);
+  return out;
+}
+
+// A saved session continues after a restart without prefilling its
+// conversation again. The snapshot keeps the engine's own KV precision, so
+// the same engine answers exactly as the original session did; another
+// precision of the same weights converts it, and a damaged or foreign file
+// is refused.
+static void test_kv_snapshot(void *engine) {
+  char tmpl[] = "/tmp/medgemma_kv_XXXXXX";
+  const std::string dir = mkdtemp(tmpl);
+  const std::string path = dir + "/case.kv", bad = dir + "/bad.kv";
+
+  Output original = save_first_turn(engine, path);
+  Output loaded = follow_up_from(engine, path);
+  CHECK(loaded.status == JOB_DONE);
+  CHECK(loaded.timings.cached_tokens == original.timings.cached_tokens);
+  CHECK(loaded.timings.prompt_tokens == original.timings.prompt_tokens);
+  CHECK(loaded.text == original.text);
+
+  medgemma_set_kv_precision(MEDGEMMA_KV_INT8);
+  void *int8 = load_medgemma_4bit(g_model_dir.c_str());
+  medgemma_set_kv_precision(MEDGEMMA_KV_FP32);
+  CHECK(int8 != nullptr);
+  if (int8) {
+    CHECK(follow_up_from(int8, path).status == JOB_DONE); // saved from fp32
+    Output native = save_first_turn(int8, path);
+    CHECK(follow_up_from(int8, path).text == native.text);
+    unload_medgemma(int8);
+    CHECK(follow_up_from(engine, path).status == JOB_DONE); // saved from int8
+  }
+
+  std::ifstream in(path, std::ios::binary);
+  std::string bytes((std::istreambuf_iterator<char>(in)), {});
+  bytes[8] ^= 1; // the model fingerprint
+  write_file(bad, bytes);
+  CHECK(medgemma_session_load(engine, bad.c_str()) == -1);
+  bytes[8] ^= 1;
+  // pinned past kv_len, then a pending token outside the vocabulary
+  int64_t kv_len, field;
+  memcpy(&kv_len, &bytes[40], sizeof(kv_len));
+  std::string header = bytes;
+  field = kv_len + 1;
+  memcpy(&header[48], &field, sizeof(field));
+  write_file(bad, header);
+  CHECK(medgemma_session_load(engine, bad.c_str()) == -1);
+  header = bytes;
+  field = (int64_t)1 << 40;
+  memcpy(&header[56], &field, sizeof(field));
+  write_file(bad, header);
+  CHECK(medgemma_session_load(engine, bad.c_str()) == -1);
+  write_file(bad, bytes.substr(0, bytes.size() / 2));
+  CHECK(medgemma_session_load(engine, bad.c_str()) == -1);
+  CHECK(medgemma_session_load(engine, (dir + "/none.kv").c_str()) == -1);
+  CHECK(medgemma_session_save(engine, 987654, path.c_str()) == -1);
+
+  remove(path.c_str());
+  remove(bad.c_str());
+  remove(dir.c_str());
+}
+
+static const char *INTAKE = "<start_of_turn>user\nPatient: 34 years, female.\n";
+static const char *QUESTION =
+    "Fever and cough for three days, what next?<end_of_turn>\n"
+    "<start_of_turn>model\n";
+
+// Pushes an intake (patient, `vitals`, image) into `session`, waits
+// `wait_ms` for the engine to draft it, then asks QUESTION.
+static Output intake(void *engine, int64_t session, const char *vitals,
+                     int wait_ms) {
+  CHECK(medgemma_session_push(engine, session, 0, INTAKE, nullptr, 0) == 0);
+  CHECK(medgemma_session_push(engine, session, 1, vitals, nullptr, 0) == 0);
+  CHECK(medgemma_session_push(engine, session, 2, "<image>\n", g_image.data(),
+                              (int)g_image.size()) == 0);
+  sleep_ms(wait_ms);
+  MedGemmaJobParams p = greedy(8);
+  p.session = session;
+  return run(engine, QUESTION, p);
+}
+
+static Output intake(void *engine, const char *vitals, int wait_ms) {
+  int64_t session = medgemma_session_open(engine, 0, 0);
+  Output out = intake(engine, session, vitals, wait_ms);
+  medgemma_session_close(engine, session);
+  return out;
+}
+
+// Segments pushed ahead of the submit are prefilled while the engine is
+// idle, image included, so the job prefills only its question. It answers as
+// if it had been sent the whole prompt, and an edit redrafts only from the
+// segment that changed.
+static void test_draft(void *engine) {
+  const char *vitals = "Vitals: BP 120/80, HR 88.\n";
+  const char *edited = "Vitals: BP 90/60, HR 120.\n";
+  Output sent = intake(engine, vitals, 0);
+  Output drafted = intake(engine, vitals, 1500);
+  CHECK(drafted.status == JOB_DONE && drafted.text == sent.text);
+  CHECK(drafted.timings.cached_tokens > 256);
+  CHECK(drafted.timings.image_tokens == 0);
+  CHECK(drafted.timings.cached_tokens + drafted.timings.prompt_tokens ==
+        sent.timings.cached_tokens + sent.timings.prompt_tokens);
+
+  int64_t session = medgemma_session_open(engine, 0, 0);
+  intake(engine, session, vitals, 0); // a turn to keep
+  Output next = intake(engine, session, edited, 1500);
+  CHECK(next.status == JOB_DONE && next.timings.cached_tokens > 256);
+  medgemma_session_close(engine, session);
+
+  session = medgemma_session_open(engine, 0, 0);
+  CHECK(medgemma_session_push(engine, session, 0, INTAKE, nullptr, 0) == 0);
+  CHECK(medgemma_session_push(engine, session, 1, vitals, nullptr, 0) == 0);
+  sleep_ms(500);
+  Output redrafted = intake(engine, session, edited, 1500);
+  CHECK(redrafted.text == intake(engine, edited, 0).text);
+  CHECK(redrafted.timings.prompt_tokens == drafted.timings.prompt_tokens);
+  CHECK(medgemma_session_push(engine, session, 2, INTAKE, nullptr, 0) == -1);
+  CHECK(medgemma_session_push(engine, session, 0, nullptr, nullptr, 0) == 0);
+  CHECK(medgemma_session_push(engine, session, 1, INTAKE, nullptr, 0) == -1);
+  medgemma_session_close(engine, session);
+  CHECK(medgemma_session_push(engine, session, 0, INTAKE, nullptr, 0) == -1);
+}
+
+// PROMPT as a template: the fixed text tokenized once, "three" per render.
+static const char *PROMPT_TEMPLATE =
+    "<start_of_turn>user\nFever and cough for {{days}} days, what next?"
+    "<end_of_turn>\n<start_of_turn>model\n";
+
+static std::vector<int64_t> render(void *engine, int32_t id,
+                                   std::vector<const char *> values) {
+  std::vector<int64_t> tokens(512);
+  int32_t n = medgemma_template_render(engine, id, values.data(),
+                                       (int32_t)values.size(), tokens.data(),
+                                       (int32_t)tokens.size());
+  tokens.resize(n > 0 ? n : 0);
+  return tokens;
+}
+
+static Output run_tokens(void *engine, const std::vector<int64_t> &tokens,
+                         const MedGemmaJobParams &p) {
+  int64_t job = medgemma_submit_tokens(engine, nullptr, 0, tokens.data(),
+                                       (int32_t)tokens.size(), &p);
+  return job > 0 ? drain(job) : Output();
+}
+
+static void test_template(void *engine) {
+  int32_t id = medgemma_template_define(engine, PROMPT_TEMPLATE);
+  CHECK(id > 0);
+  CHECK(medgemma_template_define(engine, PROMPT_TEMPLATE) == id);
+  std::vector<int64_t> whole(512);
+  whole.resize(medgemma_tokenize(engine, PROMPT, whole.data(), 512));
+  std::vector<int64_t> tokens = render(engine, id, {"three"});
+  CHECK(tokens == whole);
+
+  Output text = run(engine, PROMPT, greedy(12));
+  Output by_tokens = run_tokens(engine, tokens, greedy(12));
+  CHECK(by_tokens.status == JOB_DONE);
+  CHECK(by_tokens.text == text.text);
+  CHECK(by_tokens.timings.prompt_tokens == text.timings.prompt_tokens);
+
+  // A short buffer still learns the length; bad input is refused.
+  int64_t few[4];
+  const char *value = "three";
+  CHECK(medgemma_template_render(engine, id, &value, 1, few, 4) ==
+        (int32_t)tokens.size());
+  CHECK(medgemma_template_render(engine, id, nullptr, 0, few, 4) == -1);
+  CHECK(medgemma_template_render(engine, id + 1000, &value, 1, few, 4) == -1);
+  int64_t bad[] = {2, -5};
+  CHECK(medgemma_submit_tokens(engine, nullptr, 0, bad, 2, nullptr) == -1);
+  CHECK(medgemma_submit_tokens(engine, nullptr, 0, bad, 0, nullptr) == -1);
+  int32_t plain = medgemma_template_define(engine, "no slots {{ here");
+  CHECK(plain > 0 && plain != id);
+  CHECK(medgemma_template_render(engine, plain, nullptr, 0, few, 4) > 0);
+}
+
+static std::string repeat(const char *text, int times) {
+  std::string out;
+  while (times-- > 0)
+    out += text;
+  return out;
+}
+
+static void test_context(void *engine) {
+  std::vector<int64_t> ids(512);
+  ids.resize(medgemma_tokenize(engine, PROMPT, ids.data(), 512));
+  const int32_t own = (int32_t)ids.size() - (ids[0] == 2);
+  MedGemmaContextPlan plan;
+  CHECK(medgemma_plan_context(engine, &PROMPT, nullptr, 1, 1, 0, 0, nullptr,
+                              nullptr, &plan) == 0);
+  CHECK(plan.context_tokens == 2048 && plan.image_tokens == 256);
+  CHECK(plan.prompt_tokens == 1 + own + 256);
+  CHECK(plan.generation_budget == 2048 - plan.prompt_tokens && plan.fits);
+
+  // Over the target the history goes, then the notes are cut to the token.
+  const std::string history = repeat("Seen last week for a rash. ", 200);
+  const std::string notes = repeat("Fever and cough for three days. ", 400);
+  const char *segments[] = {"<start_of_turn>user\n", history.c_str(),
+                            notes.c_str(),
+                            "What next?<end_of_turn>\n<start_of_turn>model\n"};
+  const int32_t fit[] = {MEDGEMMA_SEGMENT_KEEP, MEDGEMMA_SEGMENT_DROP,
+                         MEDGEMMA_SEGMENT_TRUNCATE, MEDGEMMA_SEGMENT_KEEP};
+  int32_t kept[4], tokens[4];
+  CHECK(medgemma_plan_context(engine, segments, fit, 4, 0, 16, 0, kept,
+                              tokens, &plan) == 0);
+  CHECK(plan.fits && plan.prompt_tokens <= 2048 - 16);
+  CHECK(plan.prompt_tokens > 2048 - 16 - 8);
+  CHECK(kept[0] == (int32_t)strlen(segments[0]) && kept[1] == 0);
+  CHECK(kept[2] > 0 && kept[2] < (int32_t)notes.size());
+  CHECK(plan.prompt_tokens == 1 + tokens[0] + tokens[2] + tokens[3]);
+  const std::string cut = notes.substr(0, kept[2]);
+  const std::string near = segments[0] + cut + segments[3];
+  std::vector<int64_t> cut_ids(4096);
+  cut_ids.resize(medgemma_tokenize(engine, cut.c_str(), cut_ids.data(), 4096));
+  CHECK((int32_t)cut_ids.size() - (cut_ids[0] == 2) == tokens[2]);
+  CHECK(medgemma_plan_context(engine, segments, fit, 4, 0, 0, 64, kept,
+                              tokens, &plan) == 0);
+  CHECK(plan.prompt_tokens <= 64 && plan.generation_budget >= 2048 - 64);
+  CHECK(medgemma_plan_context(engine, segments, nullptr, 4, 0, 0, 0, kept,
+                              tokens, &plan) == 0);
+  CHECK(!plan.fits && kept[1] == (int32_t)history.size());
+  CHECK(medgemma_plan_context(engine, segments, fit, -1, 0, 0, 0, kept,
+                              tokens, &plan) == -1);
+
+  // The engine turns away what cannot fit before any prefill, and lets
+  // what barely does generate only to the end of the context.
+  const std::string whole = std::string(segments[0]) + history + notes +
+                            segments[3];
+  Output over = run(engine, whole.c_str(), greedy(8));
+  CHECK(over.status == JOB_FAILED);
+  CHECK(over.text.find("[ERR] Prompt too long") != std::string::npos);
+  CHECK(over.timings.prefill_chunks == 0);
+  Output capped = run(engine, near.c_str(), greedy(2048));
+  CHECK(capped.status == JOB_DONE);
+  CHECK(capped.timings.plan_max_tokens ==
+        2048 - capped.timings.prompt_tokens);
+}
+
+// Pooling shrinks the image to 64 or 16 positions, which the timings and the
+// context plan both report; switching back gives the unpooled answer again.
+static void test_image_pooling(void *engine) {
+  Output full = run(engine, IMAGE_PROMPT, greedy(8), true);
+  CHECK(full.timings.image_tokens == 256);
+  const int32_t sizes[] = {64, 16};
+  const int32_t modes[] = {MEDGEMMA_IMAGE_POOL_8X8, MEDGEMMA_IMAGE_POOL_4X4};
+  MedGemmaContextPlan plan;
+  for (int i = 0; i < 2; ++i) {
+    medgemma_set_image_pooling(modes[i]);
+    Output pooled = run(engine, IMAGE_PROMPT, greedy(8), true);
+    CHECK(pooled.status == JOB_DONE && !pooled.text.empty());
+    CHECK(pooled.timings.image_tokens == sizes[i]);
+    CHECK(pooled.timings.prompt_tokens ==
+          full.timings.prompt_tokens - (256 - sizes[i]));
+    CHECK(medgemma_plan_context(engine, &IMAGE_PROMPT, nullptr, 1, 1, 0, 0,
+                                nullptr, nullptr, &plan) == 0);
+    CHECK(plan.image_tokens == sizes[i]);
+  }
+  medgemma_set_image_pooling(MEDGEMMA_IMAGE_POOL_NONE);
+  CHECK(run(engine, IMAGE_PROMPT, greedy(8), true).text == full.text);
+}
+
+static MedGemmaClassification classify(void *engine, const char *prompt,
+                                       std::vector<const char *> labels,
+                                       float temperature = 0,
+                                       bool image_bytes = false) {
+  MedGemmaJobParams p = {};
+  p.label_temperature = temperature;
+  MedGemmaClassification out;
+  medgemma_classify(engine, image_bytes ? g_image.data() : nullptr,
+                    image_bytes ? (int)g_image.size() : 0, prompt,
+                    labels.data(), (int32_t)labels.size(), &p, &out);
+  return out;
+}
+
+// The labels' probabilities come from the prefill alone, sum to 1 and follow
+// the labels around; a label that goes on past a shared word is scored over
+// all its tokens, so it can only lose probability, and so can labels behind
+// a shared word once another label no longer shares it. (The fixture's random
+// logits are sharp enough for coverage to round to 0, so it is only bounded.)
+static void test_classify(void *engine) {
+  MedGemmaClassification c = classify(engine, PROMPT, {"RED", "YELLOW",
+                                                       "GREEN"});
+  CHECK(c.label >= 0 && c.label < 3 && c.n_labels == 3);
+  CHECK(c.coverage >= 0 && c.coverage <= 1);
+  CHECK(std::abs(c.probs[0] + c.probs[1] + c.probs[2] - 1) < 1e-4f);
+  CHECK(c.probs[c.label] >= c.probs[0] && c.probs[c.label] >= c.probs[2]);
+  MedGemmaClassification swapped =
+      classify(engine, PROMPT, {"GREEN", "YELLOW", "RED"});
+  CHECK(swapped.probs[0] == c.probs[2] && swapped.probs[2] == c.probs[0]);
+  CHECK(swapped.label == 2 - c.label);
+  MedGemmaClassification flat =
+      classify(engine, PROMPT, {"RED", "YELLOW", "GREEN"}, 4);
+  CHECK(flat.label == c.label && flat.probs[c.label] <= c.probs[c.label]);
+  const char *levels[] = {"RED", "YELLOW", "GREEN"};
+  MedGemmaJobParams sampling = {};
+  sampling.temperature = 4; // a generation knob, not label_temperature
+  MedGemmaClassification same;
+  medgemma_classify(engine, nullptr, 0, PROMPT, levels, 3, &sampling, &same);
+  CHECK(same.probs[c.label] == c.probs[c.label]);
+
+  MedGemmaClassification word = classify(engine, PROMPT, {"urgent", "later"});
+  MedGemmaClassification longer =
+      classify(engine, PROMPT, {"urgent care", "later"});
+  CHECK(longer.label >= 0 && longer.coverage <= word.coverage);
+  CHECK(longer.probs[0] < word.probs[0]);
+  MedGemmaClassification shared =
+      classify(engine, PROMPT, {"level RED", "level GREEN"});
+  CHECK(shared.label >= 0 && shared.n_labels == 2);
+  MedGemmaClassification unshared =
+      classify(engine, PROMPT, {"level RED", "level GREEN", "later"});
+  CHECK(shared.coverage <= unshared.coverage + 1e-6f);
+
+  const char *labels[] = {"RED", "GREEN"};
+  MedGemmaJobParams p = greedy(0);
+  p.image_path = g_image_path.c_str();
+  int64_t job = medgemma_submit_classify(engine, nullptr, 0, IMAGE_PROMPT,
+                                         labels, 2, &p);
+  CHECK(job > 0);
+  Output out = drain(job, false);
+  MedGemmaClassification image;
+  CHECK(out.status == JOB_DONE && out.text.empty());
+  CHECK(medgemma_get_classification(job, &image) == 0 && image.label >= 0);
+  CHECK(out.timings.image_tokens == 256 && out.timings.prefill_chunks > 0);
+  CHECK(out.timings.generated_tokens == 0);
+  medgemma_release(job);
+  CHECK(medgemma_get_classification(job, &image) == -1);
+
+  const char *empty[] = {"RED", ""};
+  CHECK(medgemma_submit_classify(engine, nullptr, 0, PROMPT, empty, 2,
+                                 nullptr) == -1);
+  CHECK(medgemma_submit_classify(engine, nullptr, 0, PROMPT, labels, 0,
+                                 nullptr) == -1);
+  CHECK(medgemma_submit_classify(engine, nullptr, 0, PROMPT, labels,
+                                 MEDGEMMA_MAX_LABELS + 1, nullptr) == -1);
+}
+
+// The same model in a medgemma_daemon child must give the same tokens.
+static void test_isolated(void *engine) {
+  Output local = run(engine, IMAGE_PROMPT, greedy(8), true);
+  void *isolated = load_medgemma_isolated(g_model_dir.c_str(),
+                                          g_daemon_path.c_str());
+  CHECK(isolated != nullptr);
+  if (!isolated)
+    return;
+  Output remote = run(isolated, IMAGE_PROMPT, greedy(8), true);
+  CHECK(remote.status == JOB_DONE);
+  CHECK(remote.text == local.text);
+  CHECK(remote.timings.image_tokens == 256);
+  MedGemmaJobTimings last;
+  MedGemmaCounters totals;
+  CHECK(medgemma_get_last_metrics(isolated, &last, &totals) == 0);
+  CHECK(last.status == JOB_DONE && last.vision_encode_ms > 0);
+  CHECK(totals.jobs_done == 1);
+  std::vector<Output> local_chat = chat(engine, 2, 0, 0, 8);
+  std::vector<Output> remote_chat = chat(isolated, 2, 0, 0, 8);
+  CHECK(remote_chat[1].timings.cached_tokens > 0);
+  CHECK(remote_chat[1].text == local_chat[1].text);
+  char tmpl[] = "/tmp/medgemma_kv_XXXXXX";
+  const std::string snapshot = std::string(mkdtemp(tmpl)) + "/case.kv";
+  save_first_turn(engine, snapshot);
+  CHECK(follow_up_from(isolated, snapshot).text ==
+        follow_up_from(engine, snapshot).text);
+  remove(snapshot.c_str());
+  remove(snapshot.substr(0, snapshot.rfind('/')).c_str());
+  Output drafted = intake(isolated, "Vitals: HR 88.\n", 1500);
+  CHECK(drafted.timings.cached_tokens > 256);
+  CHECK(drafted.text == intake(engine, "Vitals: HR 88.\n", 0).text);
+  // More tokens than the daemon's reply can carry: cut short, not a hang.
+  std::string huge;
+  for (int i = 0; i < 40000; ++i)
+    huge += "fever ";
+  std::vector<int64_t> ids(50000), local_ids(50000);
+  int n = medgemma_tokenize(isolated, huge.c_str(), ids.data(), 50000);
+  CHECK(n > 0 && n < medgemma_tokenize(engine, huge.c_str(), local_ids.data(),
+                                       50000));
+  CHECK(std::equal(ids.begin(), ids.begin() + n, local_ids.begin()));
+  CHECK(medgemma_tokenize(isolated, "fever", ids.data(), 0) == 0);
+  int32_t id = medgemma_template_define(isolated, PROMPT_TEMPLATE);
+  std::vector<int64_t> tokens = render(isolated, id, {"three"});
+  CHECK(!tokens.empty() &&
+        tokens == render(engine,
+                         medgemma_template_define(engine, PROMPT_TEMPLATE),
+                         {"three"}));
+  CHECK(run_tokens(isolated, tokens, greedy(12)).text ==
+        run(engine, PROMPT, greedy(12)).text);
+  MedGemmaContextPlan local_plan, remote_plan;
+  const char *segments[] = {PROMPT, "Seen last week for a rash."};
+  const int32_t fit[] = {MEDGEMMA_SEGMENT_KEEP, MEDGEMMA_SEGMENT_TRUNCATE};
+  int32_t local_kept[2], remote_kept[2];
+  CHECK(medgemma_plan_context(isolated, segments, fit, 2, 1, 0, 280,
+                              remote_kept, nullptr, &remote_plan) == 0);
+  medgemma_plan_context(engine, segments, fit, 2, 1, 0, 280, local_kept,
+                        nullptr, &local_plan);
+  CHECK(remote_plan.prompt_tokens == local_plan.prompt_tokens);
+  CHECK(remote_kept[1] == local_kept[1]);
+  medgemma_set_image_pooling(MEDGEMMA_IMAGE_POOL_8X8); // reaches the daemon
+  CHECK(run(isolated, IMAGE_PROMPT, greedy(8), true).timings.image_tokens ==
+        64);
+  medgemma_set_image_pooling(MEDGEMMA_IMAGE_POOL_NONE);
+  MedGemmaClassification local_class =
+      classify(engine, IMAGE_PROMPT, {"RED", "urgent care"}, 0, true);
+  MedGemmaClassification remote_class =
+      classify(isolated, IMAGE_PROMPT, {"RED", "urgent care"}, 0, true);
+  CHECK(remote_class.label == local_class.label);
+  CHECK(remote_class.probs[0] == local_class.probs[0]);
+  unload_medgemma(isolated);
+}
+
+// ── Main ─────────────────────────────────────────────────────────────────────
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: medgemma_engine_test MODEL_DIR [DAEMON_PATH]\n");
+    return 2;
+  }
+  g_model_dir = argv[1];
+  g_daemon_path = argc > 2 ? argv[2] : "";
+  g_image_path = g_model_dir + "/image.ppm";
+  std::ifstream f(g_image_path, std::ios::binary);
+  g_image.assign(std::istreambuf_iterator<char>(f), {});
+  if (g_image.empty()) {
+    fprintf(stderr, "medgemma_engine_test: no %s (run make_tiny_model.py)\n",
+            g_image_path.c_str());
+    return 2;
+  }
+
+  void *engine = load_medgemma_4bit(g_model_dir.c_str());
+  if (!engine) {
+    fprintf(stderr, "medgemma_engine_test: failed to load %s\n",
+            g_model_dir.c_str());
+    return 1;
+  }
+
+  struct Test {
+    const char *name;
+    void (*fn)(void *);
+  };
+  std::vector<Test> tests = {
+      {"tokenize", test_tokenize},
+      {"text_job", test_text_job},
+      {"image_job", test_image_job},
+      {"deterministic", test_deterministic},
+      {"blocking_entry", test_blocking_entry},
+      {"dart_port", test_dart_port},
+      {"batched_matches_solo", test_batched_matches_solo},
+      {"cancel", test_cancel},
+      {"deadline", test_deadline},
+      {"queue_stats", test_queue_stats},
+      {"metrics", test_metrics},
+      {"memory_pressure", test_memory_pressure},
+      {"kv_precision", test_kv_precision},
+      {"chat_session", test_chat_session},
+      {"kv_snapshot", test_kv_snapshot},
+      {"draft", test_draft},
+      {"template", test_template},
+      {"context", test_context},
+      {"image_pooling", test_image_pooling},
+      {"classify", test_classify},
+  };
+  if (!g_daemon_path.empty())
+    tests.push_back({"isolated", test_isolated});
+
+  for (const Test &t : tests) {
+    int before = g_failures;
+    auto t0 = std::chrono::steady_clock::now();
+    t.fn(engine);
+    double ms = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - t0)
+                    .count();
+    printf("%-4s %-22s %7.0f ms\n", g_failures == before ? "ok" : "FAIL",
+           t.name, ms);
+  }
+  unload_medgemma(engine);
+  printf("%d check%s failed\n", g_failures, g_failures == 1 ? "" : "s");
+  return g_failures ? 1 : 0;
+}
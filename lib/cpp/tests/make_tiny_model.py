@@ -0,0 +1,380 @@
+"""Writes a tiny random-weight stand-in for the MedGemma model directory.
+
+The files have the same names, I/O names and ranks as the real export, so
+libmedgemma_bridge loads them unchanged and every stage runs (image decode,
+vision encoder + projection, embeddings, chunked prefill, batched decode,
+tokenizer), along with the fp16 and int8 KV decoders tools/kv_variant.py
+derives from model.onnx. Shapes the engine hard-codes are kept (34 layers,
+4 KV heads of 256, hidden size 2560, 256 image tokens); everything else is
+as small as it gets. The whole directory is ~25 MB and is generated in a
+second, offline:
+
+    python3 make_tiny_model.py OUT_DIR [--vocab 512] [--seed 0]
+
+Needs numpy, onnx and onnxruntime (for the .ort conversion). The weights are
+random, so the output text is gibberish; tests compare runs with each other,
+never with expected prose.
+"""
+
+import argparse
+import json
+import os
+import sys
+from collections import Counter
+
+import numpy as np
+import onnx
+import onnxruntime as ort
+from onnx import TensorProto, helper, numpy_helper
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), "..", "tools"))
+import kv_variant  # noqa: E402  (fp16/int8 KV decoders, lib/cpp/tools)
+
+# Geometry the engine hard-codes (medgemma_inference.cpp).
+NUM_LAYERS = 34
+KV_HEADS = 4
+HEAD_DIM = 256
+EMBED_DIM = 2560
+NUM_PATCHES = 256
+IMAGE_SIZE = 896
+# Rotary embeddings: five sliding-window layers, then one global layer.
+ROPE_GLOBAL_EVERY = 6
+ROPE_LOCAL_BASE = 10000.0
+ROPE_GLOBAL_BASE = 1000000.0
+ROPE_GLOBAL_SCALE = 8.0
+MAX_POSITIONS = 2048  # rows of the cos/sin caches
+
+# Gemma special token IDs the engine relies on (BOS, EOS set {1, 106}).
+PAD, EOS, BOS, UNK = 0, 1, 2, 3
+START_OF_TURN, END_OF_TURN = 105, 106
+FIRST_BYTE_TOKEN = 107
+
+# Tokenizer merges are learnt from this, so prompts like the app's produce
+# multi-character tokens rather than one token per byte.
+MERGE_TEXT = """
+<start_of_turn>user Patient: adult, fever and cough for three days. Vitals:
+BP 120/80, SpO2 96%, temperature 38.5 C, heart rate 96. Give the triage level
+(RED, YELLOW or GREEN), differential diagnosis, urgent actions and reasoning.
+<end_of_turn> <start_of_turn>model Triage level: YELLOW. The patient has a
+fever with a productive cough; consider pneumonia, bronchitis or malaria.
+"""
+
+
+def save(model, out_dir, name):
+    model.ir_version = 9
+    onnx.checker.check_model(model)
+    onnx.save(model, os.path.join(out_dir, name))
+
+
+def to_ort(out_dir, name):
+    """Converts NAME.onnx to NAME.ort, the format the engine loads."""
+    opts = ort.SessionOptions()
+    opts.graph_optimization_level = ort.GraphOptimizationLevel.ORT_ENABLE_BASIC
+    opts.optimized_model_filepath = os.path.join(out_dir, name + ".ort")
+    opts.add_session_config_entry("session.save_model_format", "ORT")
+    ort.InferenceSession(os.path.join(out_dir, name + ".onnx"), opts,
+                         providers=["CPUExecutionProvider"])
+    os.remove(os.path.join(out_dir, name + ".onnx"))
+
+
+def opsets(*extra):
+    return [helper.make_opsetid("", 17)] + list(extra)
+
+
+# ── Vision ───────────────────────────────────────────────────────────────────
+
+def make_vision(out_dir, rng):
+    # 896×896 → 16×16 average pool = 256 patches of 3 channels.
+    pool = IMAGE_SIZE // 16
+    graph = helper.make_graph(
+        [helper.make_node("AveragePool", ["pixel_values"], ["pooled"],
+                          kernel_shape=[pool, pool], strides=[pool, pool]),
+         helper.make_node("Reshape", ["pooled", "shape"], ["flat"]),
+         helper.make_node("Transpose", ["flat"], ["image_features"],
+                          perm=[0, 2, 1])],
+        "vision_encoder",
+        [helper.make_tensor_value_info("pixel_values", TensorProto.FLOAT,
+                                       [1, 3, IMAGE_SIZE, IMAGE_SIZE])],
+        [helper.make_tensor_value_info("image_features", TensorProto.FLOAT,
+                                       [1, NUM_PATCHES, 3])],
+        [numpy_helper.from_array(np.array([1, 3, NUM_PATCHES], np.int64),
+                                 "shape")])
+    save(helper.make_model(graph, opset_imports=opsets()), out_dir,
+         "vision_encoder.onnx")
+
+    weight = rng.standard_normal((3, EMBED_DIM)).astype(np.float32)
+    graph = helper.make_graph(
+        [helper.make_node("MatMul", ["image_features", "W"],
+                          ["visual_tokens"])],
+        "vision_projection",
+        [helper.make_tensor_value_info("image_features", TensorProto.FLOAT,
+                                       [1, NUM_PATCHES, 3])],
+        [helper.make_tensor_value_info("visual_tokens", TensorProto.FLOAT,
+                                       [1, NUM_PATCHES, EMBED_DIM])],
+        [numpy_helper.from_array(weight, "W")])
+    save(helper.make_model(graph, opset_imports=opsets()), out_dir,
+         "vision_projection.onnx")
+
+
+# ── Text ─────────────────────────────────────────────────────────────────────
+
+def make_embeddings(out_dir, rng, vocab):
+    table = (rng.standard_normal((vocab, EMBED_DIM)) * 0.5).astype(np.float32)
+    graph = helper.make_graph(
+        [helper.make_node("Gather", ["table", "input_ids"], ["embeddings"],
+                          axis=0)],
+        "embeddings",
+        [helper.make_tensor_value_info("input_ids", TensorProto.INT64,
+                                       ["batch", "seq"])],
+        [helper.make_tensor_value_info("embeddings", TensorProto.FLOAT,
+                                       ["batch", "seq", EMBED_DIM])],
+        [numpy_helper.from_array(table, "table")])
+    save(helper.make_model(graph, opset_imports=opsets()), out_dir,
+         "embeddings.onnx")
+
+
+def rope_caches(base, scale):
+    """GQA's cos/sin caches {MAX_POSITIONS, HEAD_DIM / 2} for one RoPE base."""
+    inv = 1.0 / base ** (np.arange(0, HEAD_DIM, 2) / HEAD_DIM) / scale
+    angles = np.outer(np.arange(MAX_POSITIONS), inv)
+    return np.cos(angles).astype(np.float32), np.sin(angles).astype(np.float32)
+
+
+def make_decoder(out_dir, rng, vocab):
+    """Residual stack of weightless GroupQueryAttention layers.
+
+    Attention is real (causal, rotary, padded via attention_mask, with a
+    growing KV cache), so batching and cache bugs change the output the way
+    they would with the real model.
+    """
+    hidden = KV_HEADS * HEAD_DIM
+    inputs = [
+        helper.make_tensor_value_info("inputs_embeds", TensorProto.FLOAT,
+                                      ["batch", "seq", EMBED_DIM]),
+        helper.make_tensor_value_info("attention_mask", TensorProto.INT64,
+                                      ["batch", "total"]),
+    ]
+    outputs = [helper.make_tensor_value_info("logits", TensorProto.FLOAT,
+                                             ["batch", "seq", vocab])]
+    consts = [
+        numpy_helper.from_array(np.array([0], np.int64), "zero"),
+        numpy_helper.from_array(np.array([1], np.int64), "one"),
+        numpy_helper.from_array(np.array([2], np.int64), "axis2"),
+        numpy_helper.from_array(np.array([hidden], np.int64), "hidden"),
+        numpy_helper.from_array(
+            (rng.standard_normal((hidden, vocab)) * 0.05).astype(np.float32),
+            "lm_head"),
+    ]
+    for name, base, scale in (("local", ROPE_LOCAL_BASE, 1.0),
+                              ("global", ROPE_GLOBAL_BASE, ROPE_GLOBAL_SCALE)):
+        cos, sin = rope_caches(base, scale)
+        consts += [numpy_helper.from_array(cos, f"cos_{name}"),
+                   numpy_helper.from_array(sin, f"sin_{name}")]
+    nodes = [
+        helper.make_node("Slice", ["inputs_embeds", "zero", "hidden", "axis2"],
+                         ["h0"]),
+        # GQA wants per-row (valid length - 1) and the total length.
+        helper.make_node("ReduceSum", ["attention_mask", "one"], ["valid"],
+                         keepdims=0),
+        helper.make_node("Sub", ["valid", "one"], ["last"]),
+        helper.make_node("Cast", ["last"], ["seqlens_k"], to=TensorProto.INT32),
+        helper.make_node("Shape", ["attention_mask"], ["mask_shape"]),
+        helper.make_node("Gather", ["mask_shape", "one"], ["total1"], axis=0),
+        helper.make_node("Squeeze", ["total1"], ["total0"]),
+        helper.make_node("Cast", ["total0"], ["total_len"],
+                         to=TensorProto.INT32),
+    ]
+    h = "h0"
+    for i in range(NUM_LAYERS):
+        past_k, past_v = f"past_key_values.{i}.key", f"past_key_values.{i}.value"
+        pres_k, pres_v = f"present.{i}.key", f"present.{i}.value"
+        inputs += [
+            helper.make_tensor_value_info(
+                past_k, TensorProto.FLOAT, ["batch", KV_HEADS, "past", HEAD_DIM]),
+            helper.make_tensor_value_info(
+                past_v, TensorProto.FLOAT, ["batch", KV_HEADS, "past", HEAD_DIM]),
+        ]
+        outputs += [
+            helper.make_tensor_value_info(
+                pres_k, TensorProto.FLOAT, ["batch", KV_HEADS, "total", HEAD_DIM]),
+            helper.make_tensor_value_info(
+                pres_v, TensorProto.FLOAT, ["batch", KV_HEADS, "total", HEAD_DIM]),
+        ]
+        rope = "global" if (i + 1) % ROPE_GLOBAL_EVERY == 0 else "local"
+        nodes += [
+            helper.make_node(
+                "GroupQueryAttention",
+                [h, h, h, past_k, past_v, "seqlens_k", "total_len",
+                 f"cos_{rope}", f"sin_{rope}"],
+                [f"attn{i}", pres_k, pres_v], domain="com.microsoft",
+                num_heads=KV_HEADS, kv_num_heads=KV_HEADS, do_rotary=1),
+            helper.make_node("Add", [h, f"attn{i}"], [f"h{i + 1}"]),
+        ]
+        h = f"h{i + 1}"
+    nodes.append(helper.make_node("MatMul", [h, "lm_head"], ["logits"]))
+    graph = helper.make_graph(nodes, "decoder", inputs, outputs, consts)
+    model = helper.make_model(
+        graph, opset_imports=opsets(helper.make_opsetid("com.microsoft", 1)))
+    model.ir_version = 9
+    onnx.save(model, os.path.join(out_dir, "model.onnx")) # contrib op: no check
+
+
+# ── Tokenizer ────────────────────────────────────────────────────────────────
+# Gemma-style byte-fallback BPE in tokenizer.json, loaded by onnxruntime-genai
+# through genai_config.json like the real one.
+
+def learn_merges(text, budget):
+    words = [["▁"] + list(w) for w in text.split()]
+    merges = []
+    while len(merges) < budget:
+        pairs = Counter()
+        for w in words:
+            pairs.update(zip(w, w[1:]))
+        if not pairs:
+            break
+        (a, b), count = pairs.most_common(1)[0]
+        if count < 2:
+            break
+        merges.append((a, b))
+        for w in words:
+            i = 0
+            while i < len(w) - 1:
+                if w[i] == a and w[i + 1] == b:
+                    w[i:i + 2] = [a + b]
+                i += 1
+    return merges
+
+
+def make_tokenizer(out_dir, vocab_size):
+    image_token = vocab_size - 1
+    special = {PAD: "<pad>", EOS: "<eos>", BOS: "<bos>", UNK: "<unk>",
+               START_OF_TURN: "<start_of_turn>", END_OF_TURN: "<end_of_turn>",
+               image_token: "<image>"}
+    vocab = {}
+    for i in range(4, START_OF_TURN):
+        vocab[f"<unused{i - 4}>"] = i
+    vocab.update({name: i for i, name in special.items()})
+    for b in range(256):
+        vocab[f"<0x{b:02X}>"] = FIRST_BYTE_TOKEN + b
+    next_id = FIRST_BYTE_TOKEN + 256
+    for piece in ["▁"] + [chr(c) for c in range(33, 127)]:
+        vocab[piece] = next_id
+        next_id += 1
+    if next_id > image_token:
+        raise SystemExit(f"--vocab must be at least {next_id + 1}")
+    merges = learn_merges(MERGE_TEXT, image_token - next_id)
+    for a, b in merges:
+        if a + b not in vocab:
+            vocab[a + b] = next_id
+            next_id += 1
+
+    added = [{"id": i, "content": name, "single_word": False, "lstrip": False,
+              "rstrip": False, "normalized": False, "special": True}
+             for i, name in sorted(special.items())]
+    tokenizer = {
+        "version": "1.0",
+        "truncation": None,
+        "padding": None,
+        "added_tokens": added,
+        "normalizer": {"type": "Replace", "pattern": {"String": " "},
+                       "content": "▁"},
+        "pre_tokenizer": None,
+        "post_processor": None,
+        "decoder": {"type": "Sequence", "decoders": [
+            {"type": "Replace", "pattern": {"String": "▁"}, "content": " "},
+            {"type": "ByteFallback"},
+            {"type": "Fuse"},
+        ]},
+        "model": {"type": "BPE", "dropout": None, "unk_token": "<unk>",
+                  "continuing_subword_prefix": None,
+                  "end_of_word_suffix": None, "fuse_unk": True,
+                  "byte_fallback": True, "vocab": vocab,
+                  "merges": [f"{a} {b}" for a, b in merges]},
+    }
+    with open(os.path.join(out_dir, "tokenizer.json"), "w",
+              encoding="utf-8") as f:
+        json.dump(tokenizer, f, ensure_ascii=False)
+
+    config = {
+        "add_bos_token": False, "add_eos_token": False,
+        "bos_token": "<bos>", "eos_token": "<eos>", "pad_token": "<pad>",
+        "unk_token": "<unk>", "tokenizer_class": "GemmaTokenizer",
+        "model_max_length": 2048,
+        "added_tokens_decoder": {str(t["id"]): t for t in added},
+    }
+    with open(os.path.join(out_dir, "tokenizer_config.json"), "w") as f:
+        json.dump(config, f, indent=2)
+
+
+def make_genai_config(out_dir, vocab):
+    layers = {
+        "inputs": {"inputs_embeds": "inputs_embeds",
+                   "attention_mask": "attention_mask",
+                   "past_key_names": "past_key_values.%d.key",
+                   "past_value_names": "past_key_values.%d.value"},
+        "outputs": {"logits": "logits",
+                    "present_key_names": "present.%d.key",
+                    "present_value_names": "present.%d.value"},
+    }
+    config = {
+        "model": {
+            "bos_token_id": BOS, "eos_token_id": [EOS, END_OF_TURN],
+            "pad_token_id": PAD, "context_length": 2048, "vocab_size": vocab,
+            "type": "gemma3_text",
+            "decoder": dict(filename="model.onnx", head_size=HEAD_DIM,
+                            hidden_size=EMBED_DIM, num_attention_heads=KV_HEADS,
+                            num_hidden_layers=NUM_LAYERS,
+                            num_key_value_heads=KV_HEADS,
+                            session_options={}, **layers),
+        },
+        "search": {"do_sample": False, "max_length": 2048, "num_beams": 1,
+                   "temperature": 1.0, "top_k": 1, "top_p": 1.0},
+    }
+    with open(os.path.join(out_dir, "genai_config.json"), "w") as f:
+        json.dump(config, f, indent=2)
+
+
+# ── Test inputs ──────────────────────────────────────────────────────────────
+
+def make_inputs(out_dir):
+    # A small gradient photo (PPM decodes everywhere) and a bench corpus.
+    w, h = 120, 90
+    y, x = np.mgrid[0:h, 0:w]
+    rgb = np.stack([x * 255 // w, y * 255 // h, (x + y) % 256], -1)
+    with open(os.path.join(out_dir, "image.ppm"), "wb") as f:
+        f.write(b"P6\n%d %d\n255\n" % (w, h))
+        f.write(rgb.astype(np.uint8).tobytes())
+    corpus = [
+        {"id": "text", "prompt": "Fever and cough for three days.",
+         "max_tokens": 16},
+        {"id": "image", "prompt": "Describe the wound.", "image": "image.ppm",
+         "max_tokens": 16},
+    ]
+    with open(os.path.join(out_dir, "corpus.jsonl"), "w") as f:
+        f.writelines(json.dumps(line) + "\n" for line in corpus)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("out_dir")
+    parser.add_argument("--vocab", type=int, default=512)
+    parser.add_argument("--seed", type=int, default=0)
+    args = parser.parse_args()
+
+    os.makedirs(args.out_dir, exist_ok=True)
+    rng = np.random.default_rng(args.seed)
+    make_tokenizer(args.out_dir, args.vocab)
+    make_genai_config(args.out_dir, args.vocab)
+    make_vision(args.out_dir, rng)
+    make_embeddings(args.out_dir, rng, args.vocab)
+    make_decoder(args.out_dir, rng, args.vocab)
+    for kind in ("fp16", "int8"):
+        kv_variant.write_variant(args.out_dir, kind)
+    for name in ("vision_encoder", "vision_projection", "embeddings"):
+        to_ort(args.out_dir, name)
+    make_inputs(args.out_dir)
+    print(f"tiny model written to {args.out_dir}")
+
+
+if __name__ == "__main__":
+    main()
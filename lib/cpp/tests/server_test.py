@@ -0,0 +1,156 @@
+#!/usr/bin/env python3
+"""End-to-end test of medgemma_server against the tiny fixture.
+
+    server_test.py SERVER_BINARY MODEL_DIR
+
+Starts the server on a temporary Unix socket, sends plain and streaming
+/v1/chat/completions requests plus a few it must refuse, then stops it with
+SIGTERM while a stream is still open. The model's weights are random, so
+only the shape of the answers is checked, never their text.
+"""
+
+import http.client
+import json
+import os
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+failures = 0
+
+
+def check(cond, what):
+    global failures
+    if not cond:
+        print(f"  FAIL {what}", file=sys.stderr)
+        failures += 1
+
+
+class UnixConnection(http.client.HTTPConnection):
+    def __init__(self, path, timeout=120):
+        super().__init__("localhost", timeout=timeout)
+        self.path = path
+
+    def connect(self):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.settimeout(self.timeout)
+        self.sock.connect(self.path)
+
+
+def post(sock, body):
+    conn = UnixConnection(sock)
+    conn.request("POST", "/v1/chat/completions", json.dumps(body),
+                 {"Content-Type": "application/json"})
+    return conn, conn.getresponse()
+
+
+def chat(sock, body):
+    conn, resp = post(sock, body)
+    data = resp.read()
+    conn.close()
+    return resp.status, json.loads(data)
+
+
+def messages(text, image=None):
+    content = [{"type": "text", "text": text}]
+    if image:
+        content.insert(0, {"type": "image_url", "image_url": {"url": image}})
+    return [{"role": "user", "content": content}]
+
+
+def test_plain(sock):
+    status, r = chat(sock, {"messages": messages("Fever for three days?"),
+                            "max_tokens": 4, "temperature": 0})
+    check(status == 200, "plain request status")
+    check(r.get("object") == "chat.completion", "plain object")
+    choice = r["choices"][0]
+    check(choice["message"]["role"] == "assistant", "plain role")
+    check(isinstance(choice["message"]["content"], str), "plain content")
+    check(choice["finish_reason"] in ("stop", "length"), "plain finish")
+
+
+def test_stream(sock):
+    conn, resp = post(sock, {"messages": messages("Fever for three days?"),
+                             "max_tokens": 4, "stream": True})
+    check(resp.status == 200, "stream status")
+    check(resp.getheader("Content-Type") == "text/event-stream",
+          "stream content type")
+    events = [line[len(b"data: "):].decode()
+              for line in resp.read().split(b"\n")
+              if line.startswith(b"data: ")]
+    conn.close()
+    check(events and events[-1] == "[DONE]", "stream ends with [DONE]")
+    chunks = [json.loads(e) for e in events[:-1]]
+    check(all(c["object"] == "chat.completion.chunk" for c in chunks),
+          "stream chunk objects")
+    check(chunks and chunks[0]["choices"][0]["delta"].get("role") ==
+          "assistant", "stream opens with the role")
+    reasons = [c["choices"][0]["finish_reason"] for c in chunks]
+    check(reasons and reasons[-1] in ("stop", "length") and
+          all(r is None for r in reasons[:-1]), "stream finish_reason")
+
+
+def test_limits(sock, model_dir):
+    # A completion cut at max_tokens says so.
+    status, r = chat(sock, {"messages": messages("Fever?"),
+                            "max_tokens": -5})
+    check(status == 200 and r["choices"][0]["finish_reason"] == "length",
+          "max_tokens clamped to 1 and reported as a length stop")
+    conn = UnixConnection(sock)
+    conn.request("POST", "/v1/chat/completions",
+                 '{"messages":[{"role":"user","content":"Hi"}],'
+                 '"max_tokens":1e999}')
+    check(conn.getresponse().status == 400, "infinite max_tokens refused")
+    conn.close()
+
+    image = os.path.join(model_dir, "image.ppm")
+    status, _ = chat(sock, {"messages": messages("Describe the wound.",
+                                                 "file://" + image),
+                            "max_tokens": 2})
+    check(status == 200, "file:// image inside --image-dir")
+    for url in ("file:///etc/passwd",
+                "file://" + os.path.join(model_dir, "..", "..", "etc",
+                                         "passwd")):
+        status, r = chat(sock, {"messages": messages("Read this.", url)})
+        check(status == 400 and "error" in r, f"{url} refused")
+
+
+def main():
+    server, model_dir = sys.argv[1], os.path.abspath(sys.argv[2])
+    with tempfile.TemporaryDirectory() as tmp:
+        sock = os.path.join(tmp, "medgemma.sock")
+        proc = subprocess.Popen([server, "--model", model_dir,
+                                 "--socket", sock, "--image-dir", model_dir])
+        try:
+            for _ in range(600):
+                if os.path.exists(sock) or proc.poll() is not None:
+                    break
+                time.sleep(0.1)
+            check(os.path.exists(sock), "server listening")
+            if os.path.exists(sock):
+                test_plain(sock)
+                test_stream(sock)
+                test_limits(sock, model_dir)
+
+                # Shutting down with a client mid-stream: it gets cut off
+                # and the server still unloads cleanly.
+                conn, resp = post(sock, {"messages": messages("Go on."),
+                                         "max_tokens": 100000,
+                                         "stream": True})
+                resp.readline()
+                proc.send_signal(signal.SIGTERM)
+                check(proc.wait(timeout=60) == 0, "clean exit on SIGTERM")
+                conn.close()
+        finally:
+            if proc.poll() is None:
+                proc.kill()
+                proc.wait()
+    print(f"{failures} checks failed")
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
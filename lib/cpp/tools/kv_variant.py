@@ -0,0 +1,177 @@
+"""Writes a decoder variant whose KV cache is stored as fp16 or int8.
+
+The engine keeps every sequence's cache between steps in the decoder's own
+past/present tensors, fp32 in the exported model.onnx (~272 KB per position
+for MedGemma's 34 layers). This rewrites only the graph's cache boundary:
+
+  fp16  past_key_values.* / present.* become float16, with a Cast on either
+        side of the attention, which still computes in fp32. Half the memory.
+  int8  each past_key_values.N.key|value becomes int8 plus a float
+        ...key_scale|value_scale input {batch, kv_heads, past, 1}. That is
+        one scale per head and position, the absolute maximum of its
+        head_dim values / 127. The present outputs are quantized the same
+        way in the graph. About a quarter of the memory.
+
+Only one layer's cache is ever dequantized at a time inside a Run. The
+weights are untouched: the variant refers to model.onnx's external data, so
+it is written next to it in seconds and costs no extra disk:
+
+    python3 kv_variant.py MODEL_DIR --kv fp16   # → MODEL_DIR/model_kv16.onnx
+    python3 kv_variant.py MODEL_DIR --kv int8   # → MODEL_DIR/model_kv8.onnx
+
+The engine loads it when medgemma_set_kv_precision() asks for that mode.
+Needs onnx.
+"""
+
+import argparse
+import os
+
+import onnx
+from onnx import TensorProto, helper, numpy_helper
+
+import numpy as np
+
+PAST, PRESENT = "past_key_values.", "present."
+FILES = {"fp16": "model_kv16.onnx", "int8": "model_kv8.onnx"}
+
+
+def _opset(model):
+    return next((o.version for o in model.opset_import
+                 if o.domain in ("", "ai.onnx")), 17)
+
+
+def _reduce_max_last(model, x, out):
+    """ReduceMax over the last axis, keepdims; axes moved to an input in 18."""
+    if _opset(model) >= 18:
+        return [helper.make_node("ReduceMax", [x, "kv_variant/last_axis"],
+                                 [out], keepdims=1)]
+    return [helper.make_node("ReduceMax", [x], [out], axes=[-1], keepdims=1)]
+
+
+def _retype(value_info, elem_type, last_dim=None):
+    """A copy of a graph input/output with another element type."""
+    vi = onnx.ValueInfoProto()
+    vi.CopyFrom(value_info)
+    vi.type.tensor_type.elem_type = elem_type
+    if last_dim is not None:
+        dims = vi.type.tensor_type.shape.dim
+        dims[len(dims) - 1].Clear()
+        dims[len(dims) - 1].dim_value = last_dim
+    return vi
+
+
+def convert(model, kind):
+    """Returns `model` with its KV cache I/O stored as `kind`."""
+    graph = model.graph
+    inputs, outputs, nodes = [], [], []
+    renamed = {}  # original past name → fp32 tensor inside the graph
+
+    for vi in graph.input:
+        if not vi.name.startswith(PAST):
+            inputs.append(vi)
+            continue
+        name, fp32 = vi.name, vi.name + "/fp32"
+        renamed[name] = fp32
+        if kind == "fp16":
+            inputs.append(_retype(vi, TensorProto.FLOAT16))
+            nodes.append(helper.make_node("Cast", [name], [fp32],
+                                          to=TensorProto.FLOAT))
+        else:
+            scale = name + "_scale"
+            inputs += [_retype(vi, TensorProto.INT8),
+                       _retype(vi, TensorProto.FLOAT, 1)]
+            inputs[-1].name = scale
+            nodes += [
+                helper.make_node("Cast", [name], [name + "/f"],
+                                 to=TensorProto.FLOAT),
+                helper.make_node("Mul", [name + "/f", scale], [fp32]),
+            ]
+
+    # Consumers of the past tensors now read the fp32 copies; producers of
+    # the present tensors write fp32 copies that are converted below.
+    presents = {vi.name for vi in graph.output if vi.name.startswith(PRESENT)}
+    for node in graph.node:
+        for i, x in enumerate(node.input):
+            node.input[i] = renamed.get(x, x)
+        for i, y in enumerate(node.output):
+            if y in presents:
+                node.output[i] = y + "/fp32"
+    body = list(graph.node)
+
+    for vi in graph.output:
+        if not vi.name.startswith(PRESENT):
+            outputs.append(vi)
+            continue
+        name, fp32 = vi.name, vi.name + "/fp32"
+        # Declared, or ORT takes GQA's inferred {…, past, …} shape for the
+        # attention output and may hand it a dead past-sized buffer.
+        shape = _retype(vi, TensorProto.FLOAT)
+        shape.name = fp32
+        graph.value_info.append(shape)
+        if kind == "fp16":
+            outputs.append(_retype(vi, TensorProto.FLOAT16))
+            body.append(helper.make_node("Cast", [fp32], [name],
+                                         to=TensorProto.FLOAT16))
+            continue
+        scale = name + "_scale"
+        outputs += [_retype(vi, TensorProto.INT8),
+                    _retype(vi, TensorProto.FLOAT, 1)]
+        outputs[-1].name = scale
+        body += [helper.make_node("Abs", [fp32], [name + "/abs"])]
+        body += _reduce_max_last(model, name + "/abs", name + "/max")
+        body += [
+            helper.make_node("Max", [name + "/max", "kv_variant/tiny"],
+                             [name + "/max1"]),
+            helper.make_node("Div", [name + "/max1", "kv_variant/127"],
+                             [scale]),
+            helper.make_node("Div", [fp32, scale], [name + "/q"]),
+            helper.make_node("Round", [name + "/q"], [name + "/r"]),
+            helper.make_node("Clip", [name + "/r", "kv_variant/-127",
+                                      "kv_variant/127"], [name + "/c"]),
+            helper.make_node("Cast", [name + "/c"], [name],
+                             to=TensorProto.INT8),
+        ]
+
+    consts = []
+    if kind == "int8":
+        consts = [
+            numpy_helper.from_array(np.array(127, np.float32),
+                                    "kv_variant/127"),
+            numpy_helper.from_array(np.array(-127, np.float32),
+                                    "kv_variant/-127"),
+            numpy_helper.from_array(np.array(1e-8, np.float32),
+                                    "kv_variant/tiny"),
+        ]
+        if _opset(model) >= 18:
+            consts.append(numpy_helper.from_array(
+                np.array([-1], np.int64), "kv_variant/last_axis"))
+
+    del graph.node[:]
+    graph.node.extend(nodes + body)
+    del graph.input[:]
+    graph.input.extend(inputs)
+    del graph.output[:]
+    graph.output.extend(outputs)
+    graph.initializer.extend(consts)
+    return model
+
+
+def write_variant(model_dir, kind):
+    """Writes MODEL_DIR/model_kv16.onnx or model_kv8.onnx; returns its path."""
+    src = os.path.join(model_dir, "model.onnx")
+    model = onnx.load(src, load_external_data=False)  # weights stay put
+    out = os.path.join(model_dir, FILES[kind])
+    onnx.save(convert(model, kind), out)
+    return out
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("model_dir")
+    parser.add_argument("--kv", choices=sorted(FILES), required=True)
+    args = parser.parse_args()
+    print(f"wrote {write_variant(args.model_dir, args.kv)}")
+
+
+if __name__ == "__main__":
+    main()
@@ -17,6 +17,7 @@ import '../../../core/theme/app_theme.dart';
 import '../../triage/domain/entities/triage_entities.dart';
 import '../../triage/data/repositories/triage_repository.dart';
 import '../../triage/presentation/triage_screen.dart';
+import '../../triage/presentation/triage_controller.dart';
 import '../../settings/presentation/settings_controller.dart';
 
 class IntakeScreen extends ConsumerStatefulWidget {
@@ -95,6 +96,10 @@ class _IntakeScreenState extends ConsumerState<IntakeScreen> with AutomaticKeepA
   final List<Uint8List> _capturedImages = [];
   final ImagePicker _picker = ImagePicker();
 
+  // The report's prompt is prefilled page by page (see _draft).
+  late final ModelManager _modelManager;
+  List<Assessment> _history = const [];
+
 
   @override
   bool get wantKeepAlive => true;
@@ -102,6 +107,12 @@ class _IntakeScreenState extends ConsumerState<IntakeScreen> with AutomaticKeepA
   @override
   void initState() {
     super.initState();
+    _modelManager = ref.read(modelManagerProvider);
+    if (widget.existingPatient != null) {
+      ref.read(triageRepositoryProvider)
+          .getAssessmentsForPatient(widget.existingPatient!.id)
+          .then((history) => _history = history.take(3).toList());
+    }
     
     // Pre-fill data if existing patient provided
     if (widget.existingPatient != null) {
@@ -158,6 +169,7 @@ class _IntakeScreenState extends ConsumerState<IntakeScreen> with AutomaticKeepA
           setState(() {
             _capturedImages.add(bytes);
           });
+          _draft();
         }
         return;
       }
@@ -174,6 +186,7 @@ class _IntakeScreenState extends ConsumerState<IntakeScreen> with AutomaticKeepA
         setState(() {
           _capturedImages.add(bytes);
         });
+        _draft();
       }
     } catch (e) {
       debugPrint("Error picking image: $e");
@@ -189,10 +202,12 @@ class _IntakeScreenState extends ConsumerState<IntakeScreen> with AutomaticKeepA
     setState(() {
       _capturedImages.removeAt(index);
     });
+    _draft();
   }
 
   @override
   void dispose() {
+    _modelManager.discardIntakeDraft();
     _pageController.dispose();
     _firstNameController.dispose();
     _lastNameController.dispose();
@@ -236,6 +251,19 @@ class _IntakeScreenState extends ConsumerState<IntakeScreen> with AutomaticKeepA
       curve: Curves.easeInOut,
     );
     setState(() => _currentPage++);
+    _draft();
+  }
+
+  /// Lets the engine prefill the report's prompt as far as the pages done so
+  /// far settle it: the patient after the first page, everything up to the
+  /// question once the clinical page is done (the allergies page comes
+  /// before it), then the photo. Only while the model is loaded.
+  void _draft() {
+    final segments = triagePromptSegments(_buildAssessment(), ref.read(aiSettingsProvider),
+        history: _history);
+    final settled = _currentPage >= 3 ? segments.length - 1 : (_currentPage >= 1 ? 1 : 0);
+    _modelManager.draftIntake(segments.sublist(0, settled),
+        image: _currentPage >= 3 && _capturedImages.isNotEmpty ? _capturedImages.first : null);
   }
 
   void _prevPage() {
@@ -275,14 +303,13 @@ class _IntakeScreenState extends ConsumerState<IntakeScreen> with AutomaticKeepA
     return age;
   }
 
-  Future<void> _submit() async {
+  Assessment _buildAssessment() {
     int? age;
     if (_selectedDOB != null) {
       age = _calculateAge(_selectedDOB!);
     }
 
-    // Create Assessment Object
-    final assessment = Assessment(
+    return Assessment(
       id: const Uuid().v4(),
       patientId: widget.existingPatient?.id ?? const Uuid().v4(),
       systolic: int.tryParse(_systolicController.text.trim()),
@@ -302,6 +329,12 @@ class _IntakeScreenState extends ConsumerState<IntakeScreen> with AutomaticKeepA
       allergies: _collectAllergies(),
       timestamp: DateTime.now(),
     );
+  }
+
+  Future<void> _submit() async {
+    // Create Assessment Object
+    final assessment = _buildAssessment();
+    final age = assessment.age;
 
     // Save or Update Patient details
     final patientToSave = Patient(
@@ -2,6 +2,8 @@ import 'dart:typed_data';
 import 'package:flutter/foundation.dart';
 import 'package:flutter_riverpod/flutter_riverpod.dart';
 import '../../../core/ai/model_manager.dart';
+import '../../../core/ai/medgemma_bridge.dart'
+    show InferencePriority, ChatSessionLost, PromptTemplate, SegmentFit;
 import '../../triage/domain/entities/triage_entities.dart';
 import '../../settings/presentation/settings_controller.dart';
 import '../../history/data/providers/history_providers.dart';
@@ -51,13 +53,29 @@ class TriageChatState {
 }
 
 class TriageChatNotifier extends Notifier<TriageChatState> {
+  // The session pins its first prompt, up to half of its 2048-token window.
+  static const int _seedTokens = 1024;
+
   String _historyContext = "";
+  // Follow-ups so far, one user question and answer each.
+  final List<String> _exchanges = [];
   Assessment? _currentAssessment;
+  // Engine session holding the conversation so far; once primed with the
+  // history, each follow-up sends only its own turn.
+  int _session = 0;
+  bool _sessionPrimed = false;
+  // The assessment's saved conversation, resumed after an app restart, and
+  // the save in flight: the session is busy until it completes.
+  String? _snapshotPath;
+  Future<bool>? _saving;
   
   @override
   TriageChatState build() {
+    final modelManager = ref.read(modelManagerProvider);
     ref.onDispose(() {
       _historyContext = "";
+      _exchanges.clear();
+      if (_session != 0) modelManager.closeChatSession(_session);
       // We no longer dispose the model here to prevent crashes and keep it loaded.
       // ref.read(modelManagerProvider).disposeModel(); 
     });
@@ -66,6 +84,9 @@ class TriageChatNotifier extends Notifier<TriageChatState> {
 
   Future<void> initializeChat(Assessment assessment, String initialAiResult) async {
     _currentAssessment = assessment;
+    _closeSession(); // a new conversation
+    _exchanges.clear();
+    _snapshotPath = null;
     state = state.copyWith(
       messages: [
         TriageChatMessage(text: initialAiResult, isUser: false),
@@ -92,14 +113,6 @@ class TriageChatNotifier extends Notifier<TriageChatState> {
       };
       final targetLanguage = languageMap[aiSettings.locale.languageCode] ?? 'English';
       
-      // Calculate a safe context window (approx 40% of max tokens to leave room for user query and response)
-      // 1 token is roughly 4 characters
-      int maxContextChars = (aiSettings.maxTokens * 0.4 * 4).toInt();
-      String contextText = initialAiResult;
-      if (contextText.length > maxContextChars) {
-        contextText = "${contextText.substring(0, maxContextChars)}... [TRUNCATED]";
-      }
-      
       String buildSeedPrompt(String ctxt) => """Context: You just provided this triage assessment: $ctxt. As a health expert, give a short answer in 1-2 sentences maximum in $targetLanguage language only. If it's a confirmation question, start with a short answer like "Yes" or "No".
 
 
@@ -116,12 +129,38 @@ IMPORTANT INSTRUCTIONS for follow-up questions:
 """;
 
       final isBinary = modelManager.currentModelPath?.endsWith('.bin') ?? true;
-      
-      _historyContext = buildSeedPrompt(contextText);
+
+      // The assessment is cut to the token where the seed would outgrow its
+      // share of the session, measured by the engine's tokenizer.
+      final seed = buildSeedPrompt('\u0000').split('\u0000');
+      final plan = modelManager.planContext(
+          [seed[0], initialAiResult, seed[1]],
+          [SegmentFit.keep, SegmentFit.truncate, SegmentFit.keep],
+          maxPromptTokens: _seedTokens);
+      if (plan != null) {
+        _historyContext = plan.segments.join();
+      } else {
+        // Engine not loaded: 1 token is roughly 4 characters.
+        int maxContextChars = (aiSettings.maxTokens * 0.4 * 4).toInt();
+        String contextText = initialAiResult;
+        if (contextText.length > maxContextChars) {
+          contextText = "${contextText.substring(0, maxContextChars)}... [TRUNCATED]";
+        }
+        _historyContext = buildSeedPrompt(contextText);
+      }
     } catch (e) {
       debugPrint("Chat initial context error: $e");
       state = state.copyWith(error: "Follow-up chat initialized with limited context.");
     }
+
+    // Only a snapshot seeded with this very context may be resumed.
+    if (_historyContext.isNotEmpty) {
+      try {
+        _snapshotPath = await modelManager.chatSnapshotPath(assessment.id, _historyContext);
+      } catch (e) {
+        _snapshotPath = null;
+      }
+    }
   }
 
   Future<void> sendMessage(String text) async {
@@ -171,8 +210,8 @@ IMPORTANT INSTRUCTIONS for follow-up questions:
         messages: [...state.messages, TriageChatMessage(text: "", isUser: false)],
       );
 
-      final fullPrompt = "$_historyContext\n${modelManager.formatChatMessage(text, true, false, targetLanguage)}";
-      final stream = modelManager.inferenceStream(fullPrompt);
+      final stream = _ask(modelManager,
+          modelManager.formatChatMessage(text, true, false, targetLanguage));
       
       await for (final partialResponse in stream) {
         fullAiResponse += partialResponse;
@@ -191,7 +230,7 @@ IMPORTANT INSTRUCTIONS for follow-up questions:
       }
 
       // Update history context for next message
-      _historyContext += "\n${modelManager.formatChatMessage(text, true, false, targetLanguage)}\n${modelManager.formatChatMessage(fullAiResponse, false, false, targetLanguage)}\n";
+      _exchanges.add("\n${modelManager.formatChatMessage(text, true, false, targetLanguage)}\n${modelManager.formatChatMessage(fullAiResponse, false, false, targetLanguage)}\n");
       
       // Check for triage category update
       _checkForTriageUpdate(fullAiResponse);
@@ -209,6 +248,54 @@ IMPORTANT INSTRUCTIONS for follow-up questions:
     }
   }
 
+  /// Sends one follow-up. The engine session already holds the history, so
+  /// after the first turn only [turn] goes in; if the session is gone (engine
+  /// reloaded, a cancelled answer) a new one gets the whole history again.
+  Stream<String> _ask(ModelManager modelManager, String turn) async* {
+    await _saving;
+    for (var attempt = 0;; attempt++) {
+      if (_session == 0 && attempt == 0 && _snapshotPath != null) {
+        _session = await modelManager.loadChatSession(_snapshotPath!);
+        _sessionPrimed = _session != 0;
+      }
+      if (_session == 0) {
+        _session = modelManager.openChatSession();
+        _sessionPrimed = false;
+      }
+      final prompt = _sessionPrimed ? PromptTemplate.plain(turn) : _history(modelManager, turn);
+      try {
+        // Follow-ups are short and interactive: let them overtake a report.
+        yield* modelManager.inferenceStream(prompt,
+            priority: InferencePriority.high, session: _session);
+        _sessionPrimed = _session != 0;
+        if (_sessionPrimed && _snapshotPath != null) {
+          // Written in the background while the user reads the answer.
+          _saving = modelManager.saveChatSession(_session, _snapshotPath!);
+        }
+        return;
+      } on ChatSessionLost {
+        _closeSession();
+        if (attempt > 0) rethrow;
+      }
+    }
+  }
+
+  /// The whole conversation for a new session. The oldest exchanges are left
+  /// out if it would not leave the context room for the answer.
+  PromptTemplate _history(ModelManager modelManager, String turn) {
+    final segments = [_historyContext, ..._exchanges, "\n$turn"];
+    final plan = modelManager.planContext(segments,
+        [SegmentFit.keep, for (final _ in _exchanges) SegmentFit.drop, SegmentFit.keep]);
+    if (plan == null) return PromptTemplate.plain(segments.join());
+    return PromptTemplate.pieces(plan.segments.where((s) => s.isNotEmpty).toList());
+  }
+
+  void _closeSession() {
+    if (_session != 0) ref.read(modelManagerProvider).closeChatSession(_session);
+    _session = 0;
+    _sessionPrimed = false;
+  }
+
   void _checkForTriageUpdate(String aiResponse) {
     // Check for triage update tags (flexible regex to catch [TRIAGE_UPDATE:RED] or just [RED] at the start)
     final redMatch = RegExp(r'\[(?:TRIAGE_UPDATE:)?RED\]', caseSensitive: false).hasMatch(aiResponse);
@@ -245,6 +332,9 @@ IMPORTANT INSTRUCTIONS for follow-up questions:
 
   void resetChat() {
     _historyContext = "";
+    _exchanges.clear();
+    _closeSession();
+    _snapshotPath = null;
     _currentAssessment = null; // Release Assessment reference (and its image bytes)
     state = TriageChatState();
   }
@@ -2,6 +2,7 @@ import 'dart:async';
 import 'package:flutter/foundation.dart';
 import 'package:flutter_riverpod/flutter_riverpod.dart';
 import '../../../core/ai/model_manager.dart';
+import '../../../core/ai/medgemma_bridge.dart' show PromptTemplate;
 import '../../triage/data/repositories/triage_repository.dart';
 import '../../triage/domain/entities/triage_entities.dart';
 import '../../settings/presentation/settings_controller.dart';
@@ -10,6 +11,87 @@ import '../../history/data/providers/history_providers.dart';
 import '../../../core/localization/app_localizations.dart';
 
 
+/// The report prompt in the order the intake form settles it, so the engine
+/// can prefill the first pieces while the rest is still being typed (see
+/// ModelManager.draftIntake): patient, vitals, allergies and history, the
+/// instructions, then the question. Joined, they are the whole prompt; the
+/// image goes just before the question. Everything that varies per patient
+/// is a template value, so the localized text is tokenized once per locale.
+List<PromptTemplate> triagePromptSegments(Assessment a, AISettings aiSettings,
+    {List<Assessment>? history}) {
+  final loc = AppLocalizations(aiSettings.locale);
+  final hasImages = a.images != null && a.images!.isNotEmpty;
+
+  String historyContext = "";
+  if (history != null && history.isNotEmpty) {
+    historyContext = "\n${loc.translate('prompt_history_summary')}\n";
+    for (var prev in history) {
+      historyContext += "- ${DateFormat('MMM dd', aiSettings.locale.languageCode).format(prev.timestamp)}: ${prev.urgencyColor}";
+      if (prev.reasoning != null && prev.reasoning!.isNotEmpty) {
+        historyContext += " (${_summarizeReasoning(prev.reasoning)})";
+      }
+      historyContext += "\n";
+    }
+  }
+
+  final maxTokensResult = aiSettings.maxTokens;
+
+  // Build vitals string conditionally
+  String vitalsSummary = "- ${loc.translate('prompt_vitals')} ";
+  List<String> vitalsParts = [];
+  if (a.systolic != null && a.diastolic != null) vitalsParts.add("BP ${a.systolic}/${a.diastolic}");
+  if (a.heartRate != null) vitalsParts.add("HR ${a.heartRate}");
+  if (a.temperature != null) vitalsParts.add("Temp ${a.temperature}°C");
+  if (a.spo2 != null) vitalsParts.add("SpO2 ${a.spo2}%");
+
+  if (vitalsParts.isEmpty) {
+    vitalsSummary = "";
+  } else {
+    vitalsSummary += vitalsParts.join(", ");
+  }
+
+  final unknown = loc.translate('unknown');
+
+  return [
+    PromptTemplate(
+        "${loc.translate('prompt_intro')}\n"
+            "- ${loc.translate('prompt_age')} {{age}}\n"
+            "- ${loc.translate('prompt_gender')} {{gender}}\n",
+        [a.age != null ? "${a.age}y" : unknown, a.gender ?? unknown]),
+    PromptTemplate("- {{vitals}}\n{{glucose}}{{height}}{{weight}}", [
+      vitalsSummary,
+      a.glucose != null ? "- ${loc.translate('prompt_Glucose')}: ${a.glucose} mg/dL\n" : "",
+      a.height != null ? "- ${loc.translate('prompt_Height')}: ${a.height} cm\n" : "",
+      a.weight != null ? "- ${loc.translate('prompt_Weight')}: ${a.weight} kg\n" : "",
+    ]),
+    PromptTemplate("{{allergies}}\n{{history}}\n\n", [
+      a.allergies != null && a.allergies!.isNotEmpty
+          ? "- ${loc.translate('prompt_Allergies')}: ${a.allergies!.join(', ')}\n"
+          : "",
+      historyContext,
+    ]),
+    PromptTemplate("${loc.translate('prompt_structure_triage')}\n\n"
+        "${loc.translate('prompt_begin_immediately')} \n\n\n"),
+    PromptTemplate(
+        "Question: ${loc.translate('prompt_in_less_than')} {{max_tokens}} ${loc.translate('prompt_tokens')}, {{images}} ${loc.translate('prompt_treatment_plan')} {{symptoms}}.\n\n"
+            "End your response with \"---END OF REPORT---\" to indicate that you have completed the analysis.\n",
+        [
+          "$maxTokensResult",
+          hasImages ? loc.translate('prompt_images_analysis') : "",
+          "${a.symptoms}",
+        ]),
+  ];
+}
+
+String _summarizeReasoning(String? reasoning) {
+  if (reasoning == null || reasoning.isEmpty) return "";
+  final sentences = reasoning.split(RegExp(r'(?<=[.!?])\s+'));
+  if (sentences.length <= 2) return reasoning;
+  final summary = sentences.take(2).join(" ");
+  if (summary.length > 200) return "${summary.substring(0, 200)}...";
+  return summary;
+}
+
 final triageControllerProvider = NotifierProvider.autoDispose<TriageController, AsyncValue<Assessment?>>(TriageController.new);
 
 class TriageController extends Notifier<AsyncValue<Assessment?>> {
@@ -49,14 +131,16 @@ class TriageController extends Notifier<AsyncValue<Assessment?>> {
       
       // === UNIFIED PRIORITY DIAGNOSTIC ===
       debugPrint("TriageController: Starting Unified Diagnostic Stream...");
-      final unifiedPrompt = _buildUnifiedPrompt(assessment, history: previousAssessments);
+      final segments = triagePromptSegments(assessment, ref.read(aiSettingsProvider),
+          history: previousAssessments);
+      debugPrint("TriageController: Generated Prompt:\n${PromptTemplate.join(segments).text}");
 
       // Set state to initial data immediately so UI transitions from loading spinner to result layout
       state = AsyncData(currentAssessment);
 
-      // 3. Inference with image support
+      // 3. Inference with image support, continuing the intake draft
       // Fallback to white.jpeg is now handled centrally in ModelManager
-      final stream = modelManager.inferenceStream(unifiedPrompt, images: assessment.images);
+      final stream = modelManager.reportStream(segments, images: assessment.images);
       
       bool colorDetected = false;
       String fullResponse = "";
@@ -146,78 +230,6 @@ class TriageController extends Notifier<AsyncValue<Assessment?>> {
 
   // These methods are no longer needed as we use Stream directly in performTriage
   
-  // --- UNIFIED PROMPT BUILDERS ---
-
-  String _buildUnifiedPrompt(Assessment a, {List<Assessment>? history}) {
-    final aiSettings = ref.read(aiSettingsProvider);
-    final loc = AppLocalizations(aiSettings.locale);
-    final hasImages = a.images != null && a.images!.isNotEmpty;
-    
-    String historyContext = "";
-    if (history != null && history.isNotEmpty) {
-      historyContext = "\n${loc.translate('prompt_history_summary')}\n";
-      for (var prev in history) {
-        historyContext += "- ${DateFormat('MMM dd', aiSettings.locale.languageCode).format(prev.timestamp)}: ${prev.urgencyColor}";
-        if (prev.reasoning != null && prev.reasoning!.isNotEmpty) {
-          historyContext += " (${_summarizeReasoning(prev.reasoning)})";
-        }
-        historyContext += "\n";
-      }
-    }
-    
-    const targetLanguage = 'english';
-    final maxTokensResult = aiSettings.maxTokens;
-    
-    // Build vitals string conditionally
-    String vitalsSummary = "- ${loc.translate('prompt_vitals')} ";
-    List<String> vitalsParts = [];
-    if (a.systolic != null && a.diastolic != null) vitalsParts.add("BP ${a.systolic}/${a.diastolic}");
-    if (a.heartRate != null) vitalsParts.add("HR ${a.heartRate}");
-    if (a.temperature != null) vitalsParts.add("Temp ${a.temperature}°C");
-    if (a.spo2 != null) vitalsParts.add("SpO2 ${a.spo2}%");
-    
-    if (vitalsParts.isEmpty) {
-      vitalsSummary = "";
-    } else {
-      vitalsSummary += vitalsParts.join(", ");
-    }
-
-    final unknown = loc.translate('unknown');
-
-    final prompt = """
-${loc.translate('prompt_intro')}
-- ${loc.translate('prompt_age')} ${a.age != null ? "${a.age}y" : unknown}
-- ${loc.translate('prompt_gender')} ${a.gender ?? unknown}
-- $vitalsSummary
-${a.glucose != null ? "- ${loc.translate('prompt_Glucose')}: ${a.glucose} mg/dL\n" : ""}${a.height != null ? "- ${loc.translate('prompt_Height')}: ${a.height} cm\n" : ""}${a.weight != null ? "- ${loc.translate('prompt_Weight')}: ${a.weight} kg\n" : ""}${a.allergies != null && a.allergies!.isNotEmpty ? "- ${loc.translate('prompt_Allergies')}: ${a.allergies!.join(', ')}\n" : ""}
-$historyContext
-
-${loc.translate('prompt_structure_triage')}
-
-${loc.translate('prompt_begin_immediately')} 
-
-
-Question: ${loc.translate('prompt_in_less_than')} ${maxTokensResult} ${loc.translate('prompt_tokens')}, ${hasImages ? "${loc.translate('prompt_images_analysis')}" : ""} ${loc.translate('prompt_treatment_plan')} ${a.symptoms}.
-
-End your response with "---END OF REPORT---" to indicate that you have completed the analysis.
-""";
-
-    debugPrint("TriageController: Generated Prompt in $targetLanguage:\n$prompt");
-    return prompt;
-  }
-
- 
-
-
-  String _summarizeReasoning(String? reasoning) {
-    if (reasoning == null || reasoning.isEmpty) return "";
-    final sentences = reasoning.split(RegExp(r'(?<=[.!?])\s+'));
-    if (sentences.length <= 2) return reasoning;
-    final summary = sentences.take(2).join(" ");
-    if (summary.length > 200) return "${summary.substring(0, 200)}...";
-    return summary;
-  }
-
   String _extractReasoning(String response) {
     // For the preview card, clean tags and take a snippet
     String cleaned = response.replaceAll(RegExp(r'\[TRIAGE:[A-Z]+\]', caseSensitive: false), "").trim();